@@ -85,3 +85,31 @@ AC_DEFUN([WITH_WBCLIENT],
 
           AM_CONDITIONAL([BUILD_WBCLIENT], [test x"$with_wbclient" = xyes])
          ])
+
+AC_DEFUN([WITH_BUILTIN_CRYPTO],
+         [AC_ARG_WITH([builtin-crypto],
+                      [AC_HELP_STRING([--with-builtin-crypto],
+                                      [Use built-in RC4, MD4 and DES instead of the OpenSSL legacy provider [no]])
+                      ],
+                      [],
+                      with_builtin_crypto=no)
+
+          if test x"$with_builtin_crypto" = xyes; then
+              AC_DEFINE_UNQUOTED(BUILTIN_CRYPTO, 1, [Use built-in legacy crypto primitives])
+          fi
+         ])
+
+AC_DEFUN([WITH_USDT],
+         [AC_ARG_WITH([usdt],
+                      [AC_HELP_STRING([--with-usdt],
+                                      [Build with static tracepoints for SystemTap, perf and bpftrace (needs sys/sdt.h) [no]])
+                      ],
+                      [],
+                      with_usdt=no)
+
+          if test x"$with_usdt" = xyes; then
+              AC_CHECK_HEADER([sys/sdt.h],
+                              [AC_DEFINE_UNQUOTED(HAVE_USDT, 1, [Build with static tracepoints])],
+                              [AC_MSG_ERROR([--with-usdt requires sys/sdt.h (systemtap-sdt-devel)])])
+          fi
+         ])
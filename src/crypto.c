@@ -1,16 +1,38 @@
 /* Copyright 2013 Simo Sorce <simo@samba.org>, see COPYING for license */
 
+#include "config.h"
+
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
+#ifndef BUILTIN_CRYPTO
 #include <openssl/des.h>
 #include <openssl/rc4.h>
+#endif
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 #include <zlib.h>
 
 #include "crypto.h"
+#include "crypto_builtin.h"
+
+/* With --with-builtin-crypto the legacy primitives (RC4, MD4 and DES) do not
+ * come from OpenSSL, which then only needs its default provider */
+#ifdef BUILTIN_CRYPTO
+typedef struct builtin_rc4_key rc4_key_t;
+#define rc4_set_key builtin_rc4_set_key
+#define rc4_crypt builtin_rc4
+#else
+typedef RC4_KEY rc4_key_t;
+#define rc4_set_key RC4_set_key
+#define rc4_crypt RC4
+#endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 HMAC_CTX *HMAC_CTX_new(void)
@@ -38,17 +60,258 @@ void HMAC_CTX_free(HMAC_CTX *ctx)
 
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+/* With OpenSSL 3 every EVP_md4() style reference goes through a provider
+ * lookup, and new contexts cost a few allocations each. Algorithms are
+ * fetched once per process and every thread keeps its own digest and MAC
+ * contexts, which are reinitialized for each operation. Plain and keyed
+ * MD5 use the built-in implementation, which needs neither. */
+
+struct crypto_thread_ctx {
+#ifndef BUILTIN_CRYPTO
+    EVP_MD_CTX *md4;
+#endif
+    EVP_MAC_CTX *hmac_md5;
+};
+
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+static pthread_key_t crypto_thread_key;
+static bool crypto_thread_key_ok;
+#ifndef BUILTIN_CRYPTO
+static EVP_MD *fetched_md4;
+#endif
+static EVP_MAC *fetched_hmac;
+
+static void crypto_thread_ctx_free(void *ptr)
+{
+    struct crypto_thread_ctx *tc = ptr;
+
+#ifndef BUILTIN_CRYPTO
+    EVP_MD_CTX_free(tc->md4);
+#endif
+    EVP_MAC_CTX_free(tc->hmac_md5);
+    free(tc);
+}
+
+static void crypto_init(void)
+{
+    /* failures are reported when the algorithm is used */
+#ifndef BUILTIN_CRYPTO
+    fetched_md4 = EVP_MD_fetch(NULL, "MD4", NULL);
+#endif
+    fetched_hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+
+    crypto_thread_key_ok = (pthread_key_create(&crypto_thread_key,
+                                               crypto_thread_ctx_free) == 0);
+}
+
+/* Runs when the mechglue dlclose()s the module. Once the module is
+ * unmapped, the key destructor must not run for threads that still have
+ * contexts, so the key is deleted and those contexts are leaked. */
+static void __attribute__((destructor)) crypto_thread_unload(void)
+{
+    struct crypto_thread_ctx *tc;
+
+    if (!crypto_thread_key_ok) return;
+    crypto_thread_key_ok = false;
+
+    tc = pthread_getspecific(crypto_thread_key);
+    pthread_setspecific(crypto_thread_key, NULL);
+    if (tc) crypto_thread_ctx_free(tc);
+    pthread_key_delete(crypto_thread_key);
+}
+
+static struct crypto_thread_ctx *crypto_thread_ctx(void)
+{
+    struct crypto_thread_ctx *tc;
+    OSSL_PARAM params[2];
+
+    pthread_once(&crypto_once, crypto_init);
+    if (!crypto_thread_key_ok) return NULL;
+
+    tc = pthread_getspecific(crypto_thread_key);
+    if (tc) return tc;
+
+    tc = calloc(1, sizeof(struct crypto_thread_ctx));
+    if (!tc) return NULL;
+
+#ifndef BUILTIN_CRYPTO
+    tc->md4 = EVP_MD_CTX_new();
+    if (!tc->md4) goto fail;
+#endif
+
+    if (fetched_hmac) {
+        tc->hmac_md5 = EVP_MAC_CTX_new(fetched_hmac);
+        if (!tc->hmac_md5) goto fail;
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                     discard_const("MD5"), 0);
+        params[1] = OSSL_PARAM_construct_end();
+        if (!EVP_MAC_CTX_set_params(tc->hmac_md5, params)) goto fail;
+    }
+
+    if (pthread_setspecific(crypto_thread_key, tc) != 0) goto fail;
+    return tc;
+
+fail:
+    crypto_thread_ctx_free(tc);
+    return NULL;
+}
+
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+/* Challenges, nonces and random session keys are only 8 or 16 bytes, so
+ * rather than calling into the shared OpenSSL RNG for each of them every
+ * thread draws RAND_POOL_SIZE bytes at a time and hands out slices, which
+ * are wiped from the pool as soon as they are copied out. A forked child
+ * must never reuse bytes its parent already buffered, so pools filled
+ * before a fork are discarded in the child. */
+#define RAND_POOL_SIZE 512
+#define RAND_POOL_MAX_DRAW 64
+
+struct rand_pool {
+    unsigned int fork_gen;
+    size_t pos;
+    uint8_t data[RAND_POOL_SIZE];
+};
+
+static pthread_once_t rand_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rand_pool_key;
+static bool rand_pool_key_ok;
+/* only ever changed in a child right after fork, when it is single
+ * threaded */
+static unsigned int rand_fork_gen;
+
+static void rand_pool_free(void *ptr)
+{
+    safezero(ptr, sizeof(struct rand_pool));
+    free(ptr);
+}
+
+static void rand_pool_atfork_child(void)
+{
+    rand_fork_gen++;
+}
+
+static void rand_pool_init(void)
+{
+    if (pthread_key_create(&rand_pool_key, rand_pool_free) != 0) return;
+    if (pthread_atfork(NULL, NULL, rand_pool_atfork_child) != 0) return;
+    rand_pool_key_ok = true;
+}
+
+/* Buffered bytes of the unloading thread are wiped; pools of other threads
+ * can not be reached any more and must not be freed by a destructor that
+ * dlclose() is about to unmap, so only the key is deleted for them. */
+static void __attribute__((destructor)) rand_pool_unload(void)
+{
+    struct rand_pool *pool;
+
+    if (!rand_pool_key_ok) return;
+    rand_pool_key_ok = false;
+
+    pool = pthread_getspecific(rand_pool_key);
+    pthread_setspecific(rand_pool_key, NULL);
+    if (pool) rand_pool_free(pool);
+    pthread_key_delete(rand_pool_key);
+}
+
+static struct rand_pool *rand_pool_get(void)
+{
+    struct rand_pool *pool;
+
+    pthread_once(&rand_pool_once, rand_pool_init);
+    if (!rand_pool_key_ok) return NULL;
+
+    pool = pthread_getspecific(rand_pool_key);
+    if (pool) return pool;
+
+    pool = malloc(sizeof(struct rand_pool));
+    if (!pool) return NULL;
+    pool->fork_gen = rand_fork_gen;
+    pool->pos = RAND_POOL_SIZE;
+
+    if (pthread_setspecific(rand_pool_key, pool) != 0) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
 int RAND_BUFFER(struct ntlm_buffer *random)
 {
+    struct rand_pool *pool = NULL;
     int ret;
 
-    ret = RAND_bytes(random->data, random->length);
-    if (ret != 1) {
-        return ERR_CRYPTO;
+    if (random->length <= RAND_POOL_MAX_DRAW) {
+        pool = rand_pool_get();
     }
+    if (!pool) {
+        ret = RAND_bytes(random->data, random->length);
+        if (ret != 1) {
+            return ERR_CRYPTO;
+        }
+        return 0;
+    }
+
+    if (pool->fork_gen != rand_fork_gen) {
+        safezero(pool->data, RAND_POOL_SIZE);
+        pool->pos = RAND_POOL_SIZE;
+        pool->fork_gen = rand_fork_gen;
+    }
+
+    if (RAND_POOL_SIZE - pool->pos < random->length) {
+        ret = RAND_bytes(pool->data, RAND_POOL_SIZE);
+        if (ret != 1) {
+            safezero(pool->data, RAND_POOL_SIZE);
+            pool->pos = RAND_POOL_SIZE;
+            return ERR_CRYPTO;
+        }
+        pool->pos = 0;
+    }
+
+    memcpy(random->data, &pool->data[pool->pos], random->length);
+    safezero(&pool->data[pool->pos], random->length);
+    pool->pos += random->length;
     return 0;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int HMAC_MD5_IOV(struct ntlm_buffer *key,
+                 struct ntlm_iov *iov,
+                 struct ntlm_buffer *result)
+{
+    static const uint8_t empty_key[1];
+    struct crypto_thread_ctx *tc;
+    const uint8_t *kdata;
+    size_t len;
+    size_t i;
+
+    if (result->length != 16) return EINVAL;
+
+    tc = crypto_thread_ctx();
+    if (!tc) return ENOMEM;
+    if (!tc->hmac_md5) return ERR_CRYPTO;
+
+    /* a NULL key would mean "reuse the previous one", which on a shared
+     * context may belong to another caller */
+    kdata = key->data ? key->data : empty_key;
+
+    if (!EVP_MAC_init(tc->hmac_md5, kdata, key->length, NULL)) {
+        return ERR_CRYPTO;
+    }
+    for (i = 0; i < iov->num; i++) {
+        if (!EVP_MAC_update(tc->hmac_md5, iov->data[i]->data,
+                            iov->data[i]->length)) {
+            return ERR_CRYPTO;
+        }
+    }
+    if (!EVP_MAC_final(tc->hmac_md5, result->data, &len, 16)) {
+        return ERR_CRYPTO;
+    }
+    return 0;
+}
+#else
 int HMAC_MD5_IOV(struct ntlm_buffer *key,
                  struct ntlm_iov *iov,
                  struct ntlm_buffer *result)
@@ -92,6 +355,7 @@ done:
     HMAC_CTX_free(hmac_ctx);
     return ret;
 }
+#endif
 
 int HMAC_MD5(struct ntlm_buffer *key,
              struct ntlm_buffer *payload,
@@ -104,8 +368,110 @@ int HMAC_MD5(struct ntlm_buffer *key,
     return HMAC_MD5_IOV(key, &iov, result);
 }
 
-static int mdx_hash(const EVP_MD *type,
-                    struct ntlm_buffer *payload,
+/* The HMAC-MD5 handle caches the MD5 state after absorbing the inner and
+ * outer padded keys. The built-in MD5 state is a plain structure, so each
+ * MAC only copies it on the stack and never touches the heap or the
+ * OpenSSL allocator. */
+#define HMAC_MD5_BLOCK 64
+
+struct ntlm_hmac_handle {
+    struct builtin_md5_ctx inner;
+    struct builtin_md5_ctx outer;
+};
+
+int HMAC_MD5_INIT(struct ntlm_buffer *key, struct ntlm_hmac_handle **out)
+{
+    struct ntlm_hmac_handle *handle;
+    struct builtin_md5_ctx ctx;
+    uint8_t pad[HMAC_MD5_BLOCK];
+    uint8_t hkey[16];
+    uint8_t *kdata = key->data;
+    size_t klen = key->length;
+    size_t i;
+
+    if (klen > HMAC_MD5_BLOCK) {
+        builtin_md5_init(&ctx);
+        builtin_md5_update(&ctx, key->data, key->length);
+        builtin_md5_final(&ctx, hkey);
+        safezero((uint8_t *)&ctx, sizeof(ctx));
+        kdata = hkey;
+        klen = sizeof(hkey);
+    }
+
+    handle = malloc(sizeof(struct ntlm_hmac_handle));
+    if (!handle) return ENOMEM;
+
+    memset(pad, 0x36, HMAC_MD5_BLOCK);
+    for (i = 0; i < klen; i++) pad[i] ^= kdata[i];
+    builtin_md5_init(&handle->inner);
+    builtin_md5_update(&handle->inner, pad, HMAC_MD5_BLOCK);
+
+    memset(pad, 0x5c, HMAC_MD5_BLOCK);
+    for (i = 0; i < klen; i++) pad[i] ^= kdata[i];
+    builtin_md5_init(&handle->outer);
+    builtin_md5_update(&handle->outer, pad, HMAC_MD5_BLOCK);
+
+    safezero(pad, HMAC_MD5_BLOCK);
+    safezero(hkey, sizeof(hkey));
+
+    *out = handle;
+    return 0;
+}
+
+int HMAC_MD5_KEYED_IOV(struct ntlm_hmac_handle *handle,
+                       struct ntlm_iov *iov,
+                       struct ntlm_buffer *result)
+{
+    struct builtin_md5_ctx ctx;
+    uint8_t ihash[16];
+    size_t i;
+
+    if (result->length != 16) return EINVAL;
+
+    ctx = handle->inner;
+    for (i = 0; i < iov->num; i++) {
+        builtin_md5_update(&ctx, iov->data[i]->data, iov->data[i]->length);
+    }
+    builtin_md5_final(&ctx, ihash);
+
+    ctx = handle->outer;
+    builtin_md5_update(&ctx, ihash, sizeof(ihash));
+    builtin_md5_final(&ctx, result->data);
+
+    safezero(ihash, sizeof(ihash));
+    safezero((uint8_t *)&ctx, sizeof(ctx));
+    return 0;
+}
+
+void HMAC_MD5_FREE(struct ntlm_hmac_handle **handle)
+{
+    if (!handle || !*handle) return;
+    safezero((uint8_t *)(*handle), sizeof(struct ntlm_hmac_handle));
+    safefree(*handle);
+}
+
+#ifndef BUILTIN_CRYPTO
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int md4_hash(struct ntlm_buffer *payload,
+                    struct ntlm_buffer *result)
+{
+    struct crypto_thread_ctx *tc;
+
+    if (result->length != 16) return EINVAL;
+
+    tc = crypto_thread_ctx();
+    if (!tc) return ENOMEM;
+    if (!fetched_md4) return ERR_CRYPTO;
+
+    if (!EVP_DigestInit_ex2(tc->md4, fetched_md4, NULL) ||
+        !EVP_DigestUpdate(tc->md4, payload->data, payload->length) ||
+        !EVP_DigestFinal_ex(tc->md4, result->data, NULL)) {
+        return ERR_CRYPTO;
+    }
+    return 0;
+}
+#else
+static int md4_hash(struct ntlm_buffer *payload,
                     struct ntlm_buffer *result)
 {
     EVP_MD_CTX *ctx;
@@ -121,7 +487,7 @@ static int mdx_hash(const EVP_MD *type,
     }
 
     EVP_MD_CTX_init(ctx);
-    ret = EVP_DigestInit_ex(ctx, type, NULL);
+    ret = EVP_DigestInit_ex(ctx, EVP_md4(), NULL);
     if (ret == 0) {
         ret = ERR_CRYPTO;
         goto done;
@@ -145,21 +511,46 @@ done:
     if (ctx) EVP_MD_CTX_free(ctx);
     return ret;
 }
+#endif
+#endif
 
 int MD4_HASH(struct ntlm_buffer *payload,
              struct ntlm_buffer *result)
 {
-    return mdx_hash(EVP_md4(), payload, result);
+#ifdef BUILTIN_CRYPTO
+    if (result->length != 16) return EINVAL;
+
+    builtin_md4(payload->data, payload->length, result->data);
+    return 0;
+#else
+    return md4_hash(payload, result);
+#endif
 }
 
 int MD5_HASH(struct ntlm_buffer *payload,
              struct ntlm_buffer *result)
 {
-    return mdx_hash(EVP_md5(), payload, result);
+    struct builtin_md5_ctx ctx;
+
+    if (result->length != 16) return EINVAL;
+
+    /* the payload is often key material, do not leave it on the stack */
+    builtin_md5_init(&ctx);
+    builtin_md5_update(&ctx, payload->data, payload->length);
+    builtin_md5_final(&ctx, result->data);
+    safezero((uint8_t *)&ctx, sizeof(ctx));
+    return 0;
 }
 
 struct ntlm_rc4_handle {
-    RC4_KEY key;
+    rc4_key_t key;
+    /* keystream generated ahead of time by RC4_PREFETCH(), the unused
+     * bytes stream[pos..len) come before the position of 'key'. The buffer
+     * is exactly 'len' bytes and only exists while some of it is unused,
+     * so idle handles hold no keystream memory. */
+    uint8_t *stream;
+    size_t pos;
+    size_t len;
 };
 
 int RC4_INIT(struct ntlm_buffer *rc4_key,
@@ -168,63 +559,186 @@ int RC4_INIT(struct ntlm_buffer *rc4_key,
 {
     struct ntlm_rc4_handle *handle;
 
-    handle = malloc(sizeof(struct ntlm_rc4_handle));
+    handle = calloc(1, sizeof(struct ntlm_rc4_handle));
     if (!handle) return ENOMEM;
 
-    RC4_set_key(&handle->key, rc4_key->length, rc4_key->data);
+    rc4_set_key(&handle->key, rc4_key->length, rc4_key->data);
 
     *out = handle;
     return 0;
 }
 
+static void rc4_stream_free(struct ntlm_rc4_handle *handle)
+{
+    if (!handle->stream) return;
+    /* this runs on the wrap path once the keystream is used up, where a
+     * byte at a time would cost as much as generating it */
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero(handle->stream, handle->len);
+#else
+    safezero(handle->stream, handle->len);
+#endif
+    safefree(handle->stream);
+    handle->pos = 0;
+    handle->len = 0;
+}
+
+void RC4_REKEY(struct ntlm_rc4_handle *handle, struct ntlm_buffer *rc4_key)
+{
+    /* keystream of the old key is useless */
+    rc4_stream_free(handle);
+    rc4_set_key(&handle->key, rc4_key->length, rc4_key->data);
+}
+
+/* XORs with buffered keystream, returns how many bytes were processed */
+static size_t rc4_stream_xor(struct ntlm_rc4_handle *handle,
+                             const uint8_t *in, uint8_t *out, size_t len)
+{
+    const uint8_t *ks = &handle->stream[handle->pos];
+    uint64_t a, b;
+    size_t n, i;
+
+    n = handle->len - handle->pos;
+    if (n > len) n = len;
+
+    /* word sized operations, simple enough for the compiler to turn into
+     * vector instructions; memcpy() keeps them alignment agnostic */
+    for (i = 0; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        memcpy(&a, &in[i], sizeof(uint64_t));
+        memcpy(&b, &ks[i], sizeof(uint64_t));
+        a ^= b;
+        memcpy(&out[i], &a, sizeof(uint64_t));
+    }
+    for (; i < n; i++) {
+        out[i] = in[i] ^ ks[i];
+    }
+
+    handle->pos += n;
+    if (handle->pos == handle->len) {
+        rc4_stream_free(handle);
+    }
+    return n;
+}
+
 int RC4_UPDATE(struct ntlm_rc4_handle *handle,
                struct ntlm_buffer *in, struct ntlm_buffer *out)
 {
+    size_t done = 0;
+
     if (out->length < in->length) return EINVAL;
 
     if (in->length > 0) {
-        RC4(&handle->key, in->length, in->data, out->data);
+        if (handle->len > 0) {
+            done = rc4_stream_xor(handle, in->data, out->data, in->length);
+        }
+        if (done < in->length) {
+            rc4_crypt(&handle->key, in->length - done,
+                      in->data + done, out->data + done);
+        }
     }
 
     out->length = in->length;
     return 0;
 }
 
+int RC4_PREFETCH(struct ntlm_rc4_handle *handle, size_t length)
+{
+    uint8_t *stream;
+    size_t avail;
+    size_t n;
+
+    if (length > RC4_PREFETCH_MAX) length = RC4_PREFETCH_MAX;
+
+    avail = handle->len - handle->pos;
+    if (avail >= length) return 0;
+
+    /* sized to the request, the unused stream moves to the front */
+    stream = malloc(length);
+    if (!stream) return ENOMEM;
+    if (avail > 0) {
+        memcpy(stream, &handle->stream[handle->pos], avail);
+    }
+    rc4_stream_free(handle);
+    handle->stream = stream;
+
+    /* the keystream is what encrypting zeroes yields */
+    n = length - avail;
+    memset(&stream[avail], 0, n);
+    rc4_crypt(&handle->key, n, &stream[avail], &stream[avail]);
+    handle->len = length;
+    return 0;
+}
+
 void RC4_FREE(struct ntlm_rc4_handle **handle)
 {
     if (!handle || !*handle) return;
-    safezero((uint8_t *)(&((*handle)->key)), sizeof(RC4_KEY));
+    safezero((uint8_t *)(&((*handle)->key)), sizeof(rc4_key_t));
+    rc4_stream_free(*handle);
     safefree(*handle);
 }
 
+/* Steps the RC4 state back, undoing the generation of 'n' keystream bytes.
+ * Each step of the generator swaps two entries and advances both indexes
+ * by known amounts, so it can be run in reverse. */
+static void rc4_rewind(rc4_key_t *key, size_t n)
+{
+    unsigned int x = key->x;
+    unsigned int y = key->y;
+    unsigned int t;
+
+    while (n--) {
+        t = key->data[x];
+        key->data[x] = key->data[y];
+        key->data[y] = t;
+        y = (y - key->data[x]) & 0xff;
+        x = (x - 1) & 0xff;
+    }
+    key->x = x;
+    key->y = y;
+}
+
+/* Both implementations export the same layout: x, y and the 256 entries
+ * of the state, each as a 32 bit integer in host order */
 int RC4_EXPORT(struct ntlm_rc4_handle *handle, struct ntlm_buffer *out)
 {
-    RC4_INT *data = (RC4_INT *)out->data;
-    int len = 258 * sizeof(RC4_INT);
+    uint32_t *data = (uint32_t *)out->data;
+    int len = 258 * sizeof(uint32_t);
+    rc4_key_t key;
+    int i;
 
     if (out->length < len) return EINVAL;
 
-    data[0] = handle->key.x;
-    data[1] = handle->key.y;
-    memcpy(&data[2], handle->key.data, sizeof(RC4_INT) * 256);
+    /* export the state matching what was actually consumed */
+    key = handle->key;
+    rc4_rewind(&key, handle->len - handle->pos);
+
+    data[0] = key.x;
+    data[1] = key.y;
+    for (i = 0; i < 256; i++) data[i + 2] = key.data[i];
     out->length = len;
+
+    safezero((uint8_t *)&key, sizeof(rc4_key_t));
     return 0;
 }
 
 int RC4_IMPORT(struct ntlm_rc4_handle **_handle, struct ntlm_buffer *in)
 {
     struct ntlm_rc4_handle *handle;
-    RC4_INT *data = (RC4_INT *)in->data;
-    int len = 258 * sizeof(RC4_INT);
+    uint32_t *data = (uint32_t *)in->data;
+    int len = 258 * sizeof(uint32_t);
+    int i;
 
     if (in->length != len) return EINVAL;
+    for (i = 0; i < 258; i++) {
+        if (data[i] > 0xff) return EINVAL;
+    }
 
-    handle = malloc(sizeof(struct ntlm_rc4_handle));
+    handle = calloc(1, sizeof(struct ntlm_rc4_handle));
     if (!handle) return ENOMEM;
 
     handle->key.x = data[0];
     handle->key.y = data[1];
-    memcpy(handle->key.data, &data[2], sizeof(RC4_INT) * 256);
+    for (i = 0; i < 256; i++) handle->key.data[i] = data[i + 2];
 
     *_handle = handle;
     return 0;
@@ -235,17 +749,17 @@ int RC4K(struct ntlm_buffer *key,
          struct ntlm_buffer *payload,
          struct ntlm_buffer *result)
 {
-    struct ntlm_rc4_handle *handle;
+    struct ntlm_rc4_handle handle = { 0 };
     int ret;
 
     if (result->length < payload->length) return EINVAL;
 
-    ret = RC4_INIT(key, mode, &handle);
-    if (ret) return ret;
+    /* one shot, the state can live on the stack */
+    rc4_set_key(&handle.key, key->length, key->data);
 
-    ret = RC4_UPDATE(handle, payload, result);
+    ret = RC4_UPDATE(&handle, payload, result);
 
-    RC4_FREE(&handle);
+    safezero((uint8_t *)&handle.key, sizeof(rc4_key_t));
     return ret;
 }
 
@@ -253,8 +767,10 @@ int WEAK_DES(struct ntlm_buffer *key,
              struct ntlm_buffer *payload,
              struct ntlm_buffer *result)
 {
+#ifndef BUILTIN_CRYPTO
     DES_key_schedule schedule;
-    DES_cblock key8;
+#endif
+    uint8_t key8[8];
 
     if ((key->length != 7) ||
         (payload->length != 8) ||
@@ -272,9 +788,15 @@ int WEAK_DES(struct ntlm_buffer *key,
     key8[6] = (key->data[5] << 2) | (key->data[6] >> 6);
     key8[7] = (key->data[6] << 1);
 
+#ifdef BUILTIN_CRYPTO
+    builtin_des_ecb_encrypt(key8, payload->data, result->data);
+#else
     DES_set_key_unchecked(&key8, &schedule);
     DES_ecb_encrypt((DES_cblock *)payload->data,
                     (DES_cblock *)result->data, &schedule, 1);
+    safezero((uint8_t *)&schedule, sizeof(schedule));
+#endif
+    safezero(key8, sizeof(key8));
     return 0;
 }
 
@@ -9,6 +9,10 @@
 /**
  * @brief   Fills the provided preallocated buffer with random data
  *
+ * Requests of up to 64 bytes are served from a per-thread pool refilled
+ * from the OpenSSL RNG in larger blocks, bytes are never handed out twice,
+ * also not across fork().
+ *
  * @param random        A preallocated buffer, length determines the amount of
  *                      random bytes the function will return.
  *
@@ -42,6 +46,43 @@ int HMAC_MD5_IOV(struct ntlm_buffer *key,
                  struct ntlm_iov *iov,
                  struct ntlm_buffer *result);
 
+/**
+ * @brief Creates a pre-keyed HMAC-MD5 handle
+ *
+ * The key schedule (inner and outer padded key) is computed once, so that
+ * HMAC_MD5_KEYED_IOV() can be called any number of times without
+ * allocating memory.
+ *
+ * @param key           The authentication key
+ * @param handle        A new ntlm_hmac_handle on success
+ *
+ * @return 0 on success or ENOMEM
+ */
+int HMAC_MD5_INIT(struct ntlm_buffer *key,
+                  struct ntlm_hmac_handle **handle);
+
+/**
+ * @brief HMAC-MD5 over multiple buffers using a pre-keyed handle
+ *
+ * Performs no heap allocation.
+ *
+ * @param handle        The handle initialized by HMAC_MD5_INIT
+ * @param iov           The IOVec of the payloads to authenticate
+ * @param result        A preallocated 16 byte buffer
+ *
+ * @return 0 on success or EINVAL if the result buffer has the wrong size
+ */
+int HMAC_MD5_KEYED_IOV(struct ntlm_hmac_handle *handle,
+                       struct ntlm_iov *iov,
+                       struct ntlm_buffer *result);
+
+/**
+ * @brief           Release an HMAC-MD5 handle
+ *
+ * @param handle    A pointer to the HMAC-MD5 handle
+ */
+void HMAC_MD5_FREE(struct ntlm_hmac_handle **handle);
+
 /**
  * @brief MD4 Hash Function
  *
@@ -77,6 +118,16 @@ int RC4_INIT(struct ntlm_buffer *rc4_key,
              enum ntlm_cipher_mode mode,
              struct ntlm_rc4_handle **handle);
 
+/**
+ * @brief Reinitializes an existing RC4 handle with a new key
+ *
+ * Same as releasing the handle and creating a new one, without going
+ * through the allocator.
+ *
+ * @param handle    The RC4 handle
+ * @param rc4_key   The new key
+ */
+void RC4_REKEY(struct ntlm_rc4_handle *handle, struct ntlm_buffer *rc4_key);
 
 /**
  * @brief RC4 encrypt/decrypt function
@@ -97,6 +148,24 @@ int RC4_UPDATE(struct ntlm_rc4_handle *handle,
  */
 void RC4_FREE(struct ntlm_rc4_handle **handle);
 
+#define RC4_PREFETCH_MAX (16 * 1024)
+
+/**
+ * @brief Generates keystream ahead of time
+ *
+ * Following RC4_UPDATE() calls XOR their input with the buffered keystream
+ * before falling back to the cipher, so the cost of generating it can be
+ * moved out of the critical path. Exports are not affected. The buffer is
+ * sized to the request and freed once its keystream has been used.
+ *
+ * @param handle    The RC4 handle
+ * @param length    How many bytes of keystream should be ready (at most
+ *                  RC4_PREFETCH_MAX bytes are kept)
+ *
+ * @return 0 on success or ENOMEM
+ */
+int RC4_PREFETCH(struct ntlm_rc4_handle *handle, size_t length);
+
 /**
  * @brief Exports the RC4 state
  *
@@ -0,0 +1,488 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* RC4 (as used by NTLM sealing), MD4 (RFC 1320), MD5 (RFC 1321) and single
+ * block DES (FIPS 46-3) written for clarity rather than speed. All of them
+ * operate on caller provided memory only.
+ *
+ * RC4 indexes its state with secret values by design. DES keys here are
+ * derived from password hashes, so the S-boxes are read in full on every
+ * lookup and the wanted entry is selected with masks. MD4 and MD5 have no
+ * data dependent memory accesses or branches. */
+
+#include <endian.h>
+#include <string.h>
+
+#include "ntlm_common.h"
+#include "crypto_builtin.h"
+
+/* ==== RC4 ==== */
+
+void builtin_rc4_set_key(struct builtin_rc4_key *key,
+                         int len, const uint8_t *data)
+{
+    unsigned int i, j, k;
+    uint32_t t;
+
+    for (i = 0; i < 256; i++) {
+        key->data[i] = i;
+    }
+    for (i = 0, j = 0, k = 0; i < 256; i++) {
+        j = (j + key->data[i] + data[k]) & 0xff;
+        t = key->data[i];
+        key->data[i] = key->data[j];
+        key->data[j] = t;
+        if (++k == (unsigned int)len) k = 0;
+    }
+    key->x = 0;
+    key->y = 0;
+}
+
+#define RC4_STEP(ks, n) do { \
+    x = (x + 1) & 0xff; \
+    tx = d[x]; \
+    y = (y + tx) & 0xff; \
+    ty = d[y]; \
+    d[x] = ty; \
+    d[y] = tx; \
+    ks |= (uint64_t)d[(tx + ty) & 0xff] << ((n) * 8); \
+} while (0)
+
+void builtin_rc4(struct builtin_rc4_key *key, size_t len,
+                 const uint8_t *in, uint8_t *out)
+{
+    uint32_t *d = key->data;
+    uint32_t x = key->x;
+    uint32_t y = key->y;
+    uint32_t tx, ty;
+    uint64_t ks, v;
+    size_t i = 0;
+
+    /* 8 bytes of keystream at a time, XORed in with a single word */
+    for (; i + 8 <= len; i += 8) {
+        ks = 0;
+        RC4_STEP(ks, 0);
+        RC4_STEP(ks, 1);
+        RC4_STEP(ks, 2);
+        RC4_STEP(ks, 3);
+        RC4_STEP(ks, 4);
+        RC4_STEP(ks, 5);
+        RC4_STEP(ks, 6);
+        RC4_STEP(ks, 7);
+        memcpy(&v, &in[i], 8);
+        v ^= htole64(ks);
+        memcpy(&out[i], &v, 8);
+    }
+    for (; i < len; i++) {
+        ks = 0;
+        RC4_STEP(ks, 0);
+        out[i] = in[i] ^ ks;
+    }
+
+    key->x = x;
+    key->y = y;
+}
+
+/* ==== MD4 ==== */
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define MD4_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD4_G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define MD4_R1(a, b, c, d, k, s) \
+    a = ROTL32(a + MD4_F(b, c, d) + X[k], s)
+#define MD4_R2(a, b, c, d, k, s) \
+    a = ROTL32(a + MD4_G(b, c, d) + X[k] + 0x5A827999, s)
+#define MD4_R3(a, b, c, d, k, s) \
+    a = ROTL32(a + MD4_H(b, c, d) + X[k] + 0x6ED9EBA1, s)
+
+static const int md4_r3_order[4] = { 0, 2, 1, 3 };
+
+static void md4_block(uint32_t h[4], const uint8_t *block)
+{
+    uint32_t X[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        X[i] = (uint32_t)block[i * 4] |
+               ((uint32_t)block[i * 4 + 1] << 8) |
+               ((uint32_t)block[i * 4 + 2] << 16) |
+               ((uint32_t)block[i * 4 + 3] << 24);
+    }
+
+    for (i = 0; i < 16; i += 4) {
+        MD4_R1(a, b, c, d, i, 3);
+        MD4_R1(d, a, b, c, i + 1, 7);
+        MD4_R1(c, d, a, b, i + 2, 11);
+        MD4_R1(b, c, d, a, i + 3, 19);
+    }
+    for (i = 0; i < 4; i++) {
+        MD4_R2(a, b, c, d, i, 3);
+        MD4_R2(d, a, b, c, i + 4, 5);
+        MD4_R2(c, d, a, b, i + 8, 9);
+        MD4_R2(b, c, d, a, i + 12, 13);
+    }
+    for (i = 0; i < 4; i++) {
+        MD4_R3(a, b, c, d, md4_r3_order[i], 3);
+        MD4_R3(d, a, b, c, md4_r3_order[i] + 8, 9);
+        MD4_R3(c, d, a, b, md4_r3_order[i] + 4, 11);
+        MD4_R3(b, c, d, a, md4_r3_order[i] + 12, 15);
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+
+    safezero((uint8_t *)X, sizeof(X));
+}
+
+void builtin_md4(const uint8_t *data, size_t len, uint8_t digest[16])
+{
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint8_t tail[128];
+    uint64_t bits = (uint64_t)len * 8;
+    size_t tail_len;
+    size_t rest;
+    int i;
+
+    while (len >= 64) {
+        md4_block(h, data);
+        data += 64;
+        len -= 64;
+    }
+
+    /* 0x80, zeroes and the length in bits fill up one or two blocks */
+    rest = len;
+    tail_len = (rest < 56) ? 64 : 128;
+    memcpy(tail, data, rest);
+    tail[rest] = 0x80;
+    memset(&tail[rest + 1], 0, tail_len - rest - 1);
+    for (i = 0; i < 8; i++) {
+        tail[tail_len - 8 + i] = bits >> (i * 8);
+    }
+    md4_block(h, tail);
+    if (tail_len == 128) md4_block(h, &tail[64]);
+
+    for (i = 0; i < 16; i++) {
+        digest[i] = h[i / 4] >> ((i % 4) * 8);
+    }
+
+    safezero(tail, sizeof(tail));
+    safezero((uint8_t *)h, sizeof(h));
+}
+
+/* ==== MD5 ==== */
+
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+/* message words are read straight from the block rather than copied into
+ * a local array, which would need wiping as the inner block of HMAC holds
+ * the key */
+#define MD5_STEP(f, a, b, c, d, k, s, t) \
+    a = b + ROTL32(a + f(b, c, d) + load_le32(&block[(k) * 4]) + t, s)
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static void md5_block(uint32_t h[4], const uint8_t *block)
+{
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+
+    MD5_STEP(MD5_F, a, b, c, d, 0, 7, 0xd76aa478);
+    MD5_STEP(MD5_F, d, a, b, c, 1, 12, 0xe8c7b756);
+    MD5_STEP(MD5_F, c, d, a, b, 2, 17, 0x242070db);
+    MD5_STEP(MD5_F, b, c, d, a, 3, 22, 0xc1bdceee);
+    MD5_STEP(MD5_F, a, b, c, d, 4, 7, 0xf57c0faf);
+    MD5_STEP(MD5_F, d, a, b, c, 5, 12, 0x4787c62a);
+    MD5_STEP(MD5_F, c, d, a, b, 6, 17, 0xa8304613);
+    MD5_STEP(MD5_F, b, c, d, a, 7, 22, 0xfd469501);
+    MD5_STEP(MD5_F, a, b, c, d, 8, 7, 0x698098d8);
+    MD5_STEP(MD5_F, d, a, b, c, 9, 12, 0x8b44f7af);
+    MD5_STEP(MD5_F, c, d, a, b, 10, 17, 0xffff5bb1);
+    MD5_STEP(MD5_F, b, c, d, a, 11, 22, 0x895cd7be);
+    MD5_STEP(MD5_F, a, b, c, d, 12, 7, 0x6b901122);
+    MD5_STEP(MD5_F, d, a, b, c, 13, 12, 0xfd987193);
+    MD5_STEP(MD5_F, c, d, a, b, 14, 17, 0xa679438e);
+    MD5_STEP(MD5_F, b, c, d, a, 15, 22, 0x49b40821);
+
+    MD5_STEP(MD5_G, a, b, c, d, 1, 5, 0xf61e2562);
+    MD5_STEP(MD5_G, d, a, b, c, 6, 9, 0xc040b340);
+    MD5_STEP(MD5_G, c, d, a, b, 11, 14, 0x265e5a51);
+    MD5_STEP(MD5_G, b, c, d, a, 0, 20, 0xe9b6c7aa);
+    MD5_STEP(MD5_G, a, b, c, d, 5, 5, 0xd62f105d);
+    MD5_STEP(MD5_G, d, a, b, c, 10, 9, 0x02441453);
+    MD5_STEP(MD5_G, c, d, a, b, 15, 14, 0xd8a1e681);
+    MD5_STEP(MD5_G, b, c, d, a, 4, 20, 0xe7d3fbc8);
+    MD5_STEP(MD5_G, a, b, c, d, 9, 5, 0x21e1cde6);
+    MD5_STEP(MD5_G, d, a, b, c, 14, 9, 0xc33707d6);
+    MD5_STEP(MD5_G, c, d, a, b, 3, 14, 0xf4d50d87);
+    MD5_STEP(MD5_G, b, c, d, a, 8, 20, 0x455a14ed);
+    MD5_STEP(MD5_G, a, b, c, d, 13, 5, 0xa9e3e905);
+    MD5_STEP(MD5_G, d, a, b, c, 2, 9, 0xfcefa3f8);
+    MD5_STEP(MD5_G, c, d, a, b, 7, 14, 0x676f02d9);
+    MD5_STEP(MD5_G, b, c, d, a, 12, 20, 0x8d2a4c8a);
+
+    MD5_STEP(MD5_H, a, b, c, d, 5, 4, 0xfffa3942);
+    MD5_STEP(MD5_H, d, a, b, c, 8, 11, 0x8771f681);
+    MD5_STEP(MD5_H, c, d, a, b, 11, 16, 0x6d9d6122);
+    MD5_STEP(MD5_H, b, c, d, a, 14, 23, 0xfde5380c);
+    MD5_STEP(MD5_H, a, b, c, d, 1, 4, 0xa4beea44);
+    MD5_STEP(MD5_H, d, a, b, c, 4, 11, 0x4bdecfa9);
+    MD5_STEP(MD5_H, c, d, a, b, 7, 16, 0xf6bb4b60);
+    MD5_STEP(MD5_H, b, c, d, a, 10, 23, 0xbebfbc70);
+    MD5_STEP(MD5_H, a, b, c, d, 13, 4, 0x289b7ec6);
+    MD5_STEP(MD5_H, d, a, b, c, 0, 11, 0xeaa127fa);
+    MD5_STEP(MD5_H, c, d, a, b, 3, 16, 0xd4ef3085);
+    MD5_STEP(MD5_H, b, c, d, a, 6, 23, 0x04881d05);
+    MD5_STEP(MD5_H, a, b, c, d, 9, 4, 0xd9d4d039);
+    MD5_STEP(MD5_H, d, a, b, c, 12, 11, 0xe6db99e5);
+    MD5_STEP(MD5_H, c, d, a, b, 15, 16, 0x1fa27cf8);
+    MD5_STEP(MD5_H, b, c, d, a, 2, 23, 0xc4ac5665);
+
+    MD5_STEP(MD5_I, a, b, c, d, 0, 6, 0xf4292244);
+    MD5_STEP(MD5_I, d, a, b, c, 7, 10, 0x432aff97);
+    MD5_STEP(MD5_I, c, d, a, b, 14, 15, 0xab9423a7);
+    MD5_STEP(MD5_I, b, c, d, a, 5, 21, 0xfc93a039);
+    MD5_STEP(MD5_I, a, b, c, d, 12, 6, 0x655b59c3);
+    MD5_STEP(MD5_I, d, a, b, c, 3, 10, 0x8f0ccc92);
+    MD5_STEP(MD5_I, c, d, a, b, 10, 15, 0xffeff47d);
+    MD5_STEP(MD5_I, b, c, d, a, 1, 21, 0x85845dd1);
+    MD5_STEP(MD5_I, a, b, c, d, 8, 6, 0x6fa87e4f);
+    MD5_STEP(MD5_I, d, a, b, c, 15, 10, 0xfe2ce6e0);
+    MD5_STEP(MD5_I, c, d, a, b, 6, 15, 0xa3014314);
+    MD5_STEP(MD5_I, b, c, d, a, 13, 21, 0x4e0811a1);
+    MD5_STEP(MD5_I, a, b, c, d, 4, 6, 0xf7537e82);
+    MD5_STEP(MD5_I, d, a, b, c, 11, 10, 0xbd3af235);
+    MD5_STEP(MD5_I, c, d, a, b, 2, 15, 0x2ad7d2bb);
+    MD5_STEP(MD5_I, b, c, d, a, 9, 21, 0xeb86d391);
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+void builtin_md5_init(struct builtin_md5_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->len = 0;
+}
+
+void builtin_md5_update(struct builtin_md5_ctx *ctx,
+                        const uint8_t *data, size_t len)
+{
+    size_t used = ctx->len % 64;
+    size_t n;
+
+    ctx->len += len;
+
+    if (used > 0) {
+        n = 64 - used;
+        if (n > len) n = len;
+        memcpy(&ctx->buf[used], data, n);
+        data += n;
+        len -= n;
+        if (used + n < 64) return;
+        md5_block(ctx->h, ctx->buf);
+    }
+    while (len >= 64) {
+        md5_block(ctx->h, data);
+        data += 64;
+        len -= 64;
+    }
+    if (len > 0) memcpy(ctx->buf, data, len);
+}
+
+void builtin_md5_final(struct builtin_md5_ctx *ctx, uint8_t digest[16])
+{
+    uint64_t bits = ctx->len * 8;
+    size_t used = ctx->len % 64;
+    int i;
+
+    /* 0x80, zeroes and the length in bits fill up one or two blocks */
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(&ctx->buf[used], 0, 64 - used);
+        md5_block(ctx->h, ctx->buf);
+        used = 0;
+    }
+    memset(&ctx->buf[used], 0, 56 - used);
+    for (i = 0; i < 8; i++) {
+        ctx->buf[56 + i] = bits >> (i * 8);
+    }
+    md5_block(ctx->h, ctx->buf);
+
+    for (i = 0; i < 16; i++) {
+        digest[i] = ctx->h[i / 4] >> ((i % 4) * 8);
+    }
+}
+
+/* ==== DES ==== */
+
+/* Bit positions are numbered from 1 (the most significant bit), as in the
+ * standard */
+static const uint8_t des_ip[64] = {
+    58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+    62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+    57, 49, 41, 33, 25, 17, 9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+    61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7
+};
+
+static const uint8_t des_fp[64] = {
+    40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+    38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+    36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+    34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41, 9, 49, 17, 57, 25
+};
+
+static const uint8_t des_p[32] = {
+    16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+    2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25
+};
+
+static const uint8_t des_pc1[56] = {
+    57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+    10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+    63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+    14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4
+};
+
+static const uint8_t des_pc2[48] = {
+    14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+    23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+    41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+    44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+static const uint8_t des_shifts[16] = {
+    1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1
+};
+
+/* S-boxes, one 64 bit word per row with column c in bits 4c..4c+3. Rows
+ * are selected by the outer bits of the 6 bit input and columns by the
+ * inner 4 bits. */
+static const uint64_t des_sbox[8][4] = {
+    { 0x7095c6a38bf21d4eULL, 0x8359bc6a1d2e47f0ULL,
+      0x05a379cfb26d8e14ULL, 0xd60ae3b5719428cfULL },
+    { 0xa50cd27943b6e81fULL, 0x5b96a10ce82f74d3ULL,
+      0xf2396c851d4ab7e0ULL, 0x9e50c76b24f31a8dULL },
+    { 0x824b7cd15f36e90aULL, 0x1fbce582a643907dULL,
+      0x7ea5c21b03f8946dULL, 0xc25b3ef478960da1ULL },
+    { 0xf4cb5821a9603ed7ULL, 0x9ea1c27430f65b8dULL,
+      0x4825e31fd7bc096aULL, 0xe27cb5498d1a60f3ULL },
+    { 0x9e0df3586ba714c2ULL, 0x6893af051d74c2beULL,
+      0xe0365c9f87dab124ULL, 0x354a90f6d2e17c8bULL },
+    { 0xb57e43d08629fa1cULL, 0x83b0ed1659c724faULL,
+      0x6bd1a4073c825fe9ULL, 0xd80671ebaf59c234ULL },
+    { 0x16a579c3d80fe2b4ULL, 0x68f2c53ea1947b0dULL,
+      0x295086fae73cdb41ULL, 0xc32ef0597a418db6ULL },
+    { 0x7c05e39a1bf6482dULL, 0x29e0b65c473a8df1ULL,
+      0x853fda602ec914b7ULL, 0xb65309cfd8a47e12ULL }
+};
+
+static uint64_t des_permute(uint64_t in, int in_bits,
+                            const uint8_t *table, int out_bits)
+{
+    uint64_t out = 0;
+    int i;
+
+    for (i = 0; i < out_bits; i++) {
+        out = (out << 1) | ((in >> (in_bits - table[i])) & 1);
+    }
+    return out;
+}
+
+/* All rows are read and the wanted one is selected with masks, so the
+ * memory access pattern does not depend on the input */
+static uint32_t des_sbox_lookup(const uint64_t *box, uint32_t six)
+{
+    uint32_t row = ((six >> 4) & 0x02) | (six & 0x01);
+    uint32_t col = (six >> 1) & 0x0f;
+    uint32_t value = 0;
+    uint32_t mask;
+    uint32_t r;
+
+    for (r = 0; r < 4; r++) {
+        /* all ones when r == row, zero otherwise */
+        mask = 0 - ((((r ^ row) - 1) >> 8) & 1);
+        value |= (box[r] >> (col * 4)) & mask;
+    }
+    return value & 0x0f;
+}
+
+static uint32_t des_f(uint32_t r, uint64_t subkey)
+{
+    uint32_t out = 0;
+    uint32_t six;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        /* the E expansion gives each S-box 6 consecutive bits of r,
+         * wrapping around at the ends */
+        six = ROTL32(r, (4 * i + 5) % 32) & 0x3f;
+        six ^= (subkey >> (42 - i * 6)) & 0x3f;
+        out = (out << 4) | des_sbox_lookup(des_sbox[i], six);
+    }
+
+    return des_permute(out, 32, des_p, 32);
+}
+
+static uint64_t load_be64(const uint8_t *b)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) v = (v << 8) | b[i];
+    return v;
+}
+
+void builtin_des_ecb_encrypt(const uint8_t key[8], const uint8_t in[8],
+                             uint8_t out[8])
+{
+    uint64_t subkeys[16];
+    uint64_t cd, block;
+    uint32_t c, d, l, r, t;
+    int i;
+
+    cd = des_permute(load_be64(key), 64, des_pc1, 56);
+    c = cd >> 28;
+    d = cd & 0x0fffffff;
+    for (i = 0; i < 16; i++) {
+        c = ((c << des_shifts[i]) | (c >> (28 - des_shifts[i]))) & 0x0fffffff;
+        d = ((d << des_shifts[i]) | (d >> (28 - des_shifts[i]))) & 0x0fffffff;
+        cd = ((uint64_t)c << 28) | d;
+        subkeys[i] = des_permute(cd, 56, des_pc2, 48);
+    }
+
+    block = des_permute(load_be64(in), 64, des_ip, 64);
+    l = block >> 32;
+    r = block & 0xffffffff;
+    for (i = 0; i < 16; i++) {
+        t = r;
+        r = l ^ des_f(r, subkeys[i]);
+        l = t;
+    }
+    /* the halves are not swapped after the last round */
+    block = ((uint64_t)r << 32) | l;
+    block = des_permute(block, 64, des_fp, 64);
+
+    for (i = 0; i < 8; i++) {
+        out[i] = block >> (56 - i * 8);
+    }
+
+    safezero((uint8_t *)subkeys, sizeof(subkeys));
+}
@@ -0,0 +1,100 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+#ifndef _SRC_CRYPTO_BUILTIN_H_
+#define _SRC_CRYPTO_BUILTIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Self contained implementations of the legacy primitives NTLM depends on.
+ * They are used instead of OpenSSL when configured --with-builtin-crypto,
+ * so that the legacy provider is not needed. None of them allocates.
+ * MD5 is always built in: its state is a plain structure that pre-keyed
+ * HMAC handles copy for every message, which OpenSSL 3 only offers through
+ * deprecated functions. */
+
+/* word sized entries like OpenSSL's RC4_KEY, byte loads and stores into
+ * the state are slower on common CPUs */
+struct builtin_rc4_key {
+    uint32_t x;
+    uint32_t y;
+    uint32_t data[256];
+};
+
+/**
+ * @brief Initializes the RC4 state, same semantics as RC4_set_key()
+ *
+ * @param key           The state to initialize
+ * @param len           Length of the key
+ * @param data          The key
+ */
+void builtin_rc4_set_key(struct builtin_rc4_key *key,
+                         int len, const uint8_t *data);
+
+/**
+ * @brief RC4 encryption/decryption, same semantics as RC4()
+ *
+ * @param key           The RC4 state
+ * @param len           Length of the input (and output)
+ * @param in            Input data
+ * @param out           Output buffer, may be the same as in
+ */
+void builtin_rc4(struct builtin_rc4_key *key, size_t len,
+                 const uint8_t *in, uint8_t *out);
+
+/**
+ * @brief MD4 digest
+ *
+ * @param data          The data to hash
+ * @param len           Length of the data
+ * @param digest        A 16 bytes output buffer
+ */
+void builtin_md4(const uint8_t *data, size_t len, uint8_t digest[16]);
+
+struct builtin_md5_ctx {
+    uint32_t h[4];
+    uint64_t len;           /* bytes hashed so far */
+    uint8_t buf[64];        /* partial block, len % 64 bytes */
+};
+
+/**
+ * @brief Starts an MD5 (RFC 1321) computation
+ *
+ * @param ctx           The state to initialize
+ */
+void builtin_md5_init(struct builtin_md5_ctx *ctx);
+
+/**
+ * @brief Hashes more data
+ *
+ * @param ctx           The MD5 state
+ * @param data          The data to hash
+ * @param len           Length of the data
+ */
+void builtin_md5_update(struct builtin_md5_ctx *ctx,
+                        const uint8_t *data, size_t len);
+
+/**
+ * @brief Completes the computation
+ *
+ * The state is left as is, callers hashing secrets wipe it themselves.
+ *
+ * @param ctx           The MD5 state
+ * @param digest        A 16 bytes output buffer
+ */
+void builtin_md5_final(struct builtin_md5_ctx *ctx, uint8_t digest[16]);
+
+/**
+ * @brief Encrypts one block with DES in ECB mode
+ *
+ * Parity bits of the key are ignored. S-box lookups do not depend on the
+ * key or data for their memory access pattern.
+ *
+ * @param key           The 8 bytes DES key
+ * @param in            The 8 bytes plaintext block
+ * @param out           The 8 bytes output block
+ */
+void builtin_des_ecb_encrypt(const uint8_t key[8], const uint8_t in[8],
+                             uint8_t out[8]);
+
+#endif /* _SRC_CRYPTO_BUILTIN_H_ */
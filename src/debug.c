@@ -1,33 +1,350 @@
 /* Copyright (C) 2014 GSS-NTLMSSP contributors, see COPYING for license */
 
+/* Debug log.
+ *
+ * Enabled by setting GSSNTLMSSP_DEBUG to the path of the log file.
+ * GSSNTLMSSP_DEBUG_LEVEL=error only logs failures, the default (all) logs
+ * every status set by the mechanism. GSSNTLMSSP_DEBUG_SAMPLE=N keeps only
+ * one in N of the successful events of each thread, failures are always
+ * logged.
+ *
+ * Callers never block and never do I/O: events go to a bounded lock-free
+ * multi producer queue (Vyukov's), and a background thread formats them
+ * as key=value lines and writes them out every DEBUG_DRAIN_MS. When the
+ * queue is full events are dropped and counted. The queue is also drained
+ * at exit, and by anyone calling gssntlm_debug_flush(). */
+
 #define _GNU_SOURCE
-#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gss_ntlmssp.h"
+
+#define DEBUG_RING_SIZE 4096    /* must be a power of two */
+#define DEBUG_DRAIN_MS 100
 
 bool gssntlm_debug_initialized = false;
 bool gssntlm_debug_enabled = false;
+bool gssntlm_debug_all = true;
+__thread struct gssntlm_debug_scope gssntlm_debug_scope;
+
 static FILE *debug_fd = NULL;
+static unsigned int debug_sample = 1;
+static __thread unsigned int debug_sample_seq;
+static __thread pid_t debug_tid;
 
-void gssntlm_debug_init(void)
+struct debug_event {
+    uint64_t seq;
+    struct timespec ts;
+    const char *function;
+    const char *file;
+    const void *ctx;
+    unsigned int line;
+    unsigned int maj;
+    unsigned int min;
+    int stage;
+    pid_t tid;
+};
+
+static struct debug_event *debug_ring;
+/* next slot to claim, shared by all producers */
+static uint64_t debug_head __attribute__((aligned(64)));
+/* next slot to write out, only touched under debug_drain_mutex */
+static uint64_t debug_tail __attribute__((aligned(64)));
+static uint64_t debug_dropped;
+static uint64_t debug_dropped_logged;
+static pthread_mutex_t debug_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+enum debug_writer_state {
+    WRITER_NONE = 0,    /* not started in this process yet */
+    WRITER_RUNNING,
+    WRITER_FAILED,
+    WRITER_EXITED,
+};
+static enum debug_writer_state debug_writer_state;
+static bool debug_writer_stop;
+static pthread_t debug_writer_thread;
+static pthread_mutex_t debug_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t debug_writer_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t debug_once = PTHREAD_ONCE_INIT;
+
+static const char *debug_stage_name(int stage)
+{
+    switch (stage) {
+    case NTLMSSP_STAGE_INIT:
+        return "init";
+    case NTLMSSP_STAGE_NEGOTIATE:
+        return "negotiate";
+    case NTLMSSP_STAGE_CHALLENGE:
+        return "challenge";
+    case NTLMSSP_STAGE_AUTHENTICATE:
+        return "authenticate";
+    case NTLMSSP_STAGE_DONE:
+        return "done";
+    }
+    return "unknown";
+}
+
+static void debug_ring_reset(void)
+{
+    uint64_t i;
+
+    for (i = 0; i < DEBUG_RING_SIZE; i++) {
+        debug_ring[i].seq = i;
+    }
+    debug_head = 0;
+    debug_tail = 0;
+    debug_dropped = 0;
+    debug_dropped_logged = 0;
+}
+
+static bool debug_ring_pop(struct debug_event *ev)
+{
+    struct debug_event *slot;
+
+    slot = &debug_ring[debug_tail & (DEBUG_RING_SIZE - 1)];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != debug_tail + 1) {
+        /* empty, or the next producer has not finished yet */
+        return false;
+    }
+    *ev = *slot;
+    __atomic_store_n(&slot->seq, debug_tail + DEBUG_RING_SIZE,
+                     __ATOMIC_RELEASE);
+    debug_tail++;
+    return true;
+}
+
+static void debug_write(struct debug_event *ev)
+{
+    const char *err_name = gssntlm_err_name(ev->min);
+
+    fprintf(debug_fd, "ts=%lld.%06ld tid=%d level=%s func=%s file=%s "
+                      "line=%u maj=0x%08x min=%u",
+            (long long)ev->ts.tv_sec, ev->ts.tv_nsec / 1000, (int)ev->tid,
+            GSS_ERROR(ev->maj) ? "error" : "info",
+            ev->function, ev->file, ev->line, ev->maj, ev->min);
+    if (err_name) {
+        fprintf(debug_fd, " err=%s", err_name);
+    }
+    if (ev->ctx) {
+        fprintf(debug_fd, " ctx=%p stage=%s",
+                ev->ctx, debug_stage_name(ev->stage));
+    }
+    fputc('\n', debug_fd);
+}
+
+void gssntlm_debug_flush(void)
+{
+    struct debug_event ev;
+    uint64_t dropped;
+
+    if (!gssntlm_debug_enabled) return;
+
+    pthread_mutex_lock(&debug_drain_mutex);
+    while (debug_ring_pop(&ev)) {
+        debug_write(&ev);
+    }
+    dropped = __atomic_load_n(&debug_dropped, __ATOMIC_RELAXED);
+    if (dropped != debug_dropped_logged) {
+        fprintf(debug_fd, "level=warning msg=dropped count=%" PRIu64 "\n",
+                dropped - debug_dropped_logged);
+        debug_dropped_logged = dropped;
+    }
+    fflush(debug_fd);
+    pthread_mutex_unlock(&debug_drain_mutex);
+}
+
+static void *debug_writer(void *arg)
+{
+    struct timespec deadline;
+    bool stop = false;
+
+    (void)arg;
+
+    while (!stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DEBUG_DRAIN_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&debug_writer_mutex);
+        if (!debug_writer_stop) {
+            pthread_cond_timedwait(&debug_writer_cond, &debug_writer_mutex,
+                                   &deadline);
+        }
+        stop = debug_writer_stop;
+        pthread_mutex_unlock(&debug_writer_mutex);
+
+        gssntlm_debug_flush();
+    }
+    return NULL;
+}
+
+static void debug_writer_start(void)
+{
+    sigset_t all, old;
+    int ret;
+
+    pthread_mutex_lock(&debug_writer_mutex);
+    if (debug_writer_state == WRITER_NONE) {
+        /* leave signal handling to the application's threads */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        debug_writer_stop = false;
+        ret = pthread_create(&debug_writer_thread, NULL, debug_writer, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        /* without a writer events queue up until exit or a flush */
+        __atomic_store_n(&debug_writer_state,
+                         ret ? WRITER_FAILED : WRITER_RUNNING,
+                         __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&debug_writer_mutex);
+}
+
+static void debug_shutdown(void)
+{
+    bool running;
+
+    pthread_mutex_lock(&debug_writer_mutex);
+    running = (debug_writer_state == WRITER_RUNNING);
+    __atomic_store_n(&debug_writer_state, WRITER_EXITED, __ATOMIC_RELAXED);
+    debug_writer_stop = true;
+    pthread_cond_signal(&debug_writer_cond);
+    pthread_mutex_unlock(&debug_writer_mutex);
+
+    if (running) {
+        pthread_join(debug_writer_thread, NULL);
+    }
+    gssntlm_debug_flush();
+}
+
+static void debug_atfork_child(void)
+{
+    /* the writer did not survive the fork, and the events still queued
+     * are the parent's to write */
+    pthread_mutex_init(&debug_drain_mutex, NULL);
+    pthread_mutex_init(&debug_writer_mutex, NULL);
+    pthread_cond_init(&debug_writer_cond, NULL);
+    debug_writer_state = WRITER_NONE;
+    debug_tid = 0;
+    debug_ring_reset();
+}
+
+static void debug_setup(void)
 {
     char *env;
+    long sample;
 
     env = secure_getenv("GSSNTLMSSP_DEBUG");
+    if (!env) return;
+
+    env = secure_getenv("GSSNTLMSSP_DEBUG_LEVEL");
+    if (env && strcasecmp(env, "error") == 0) {
+        gssntlm_debug_all = false;
+    }
+    env = secure_getenv("GSSNTLMSSP_DEBUG_SAMPLE");
     if (env) {
-        debug_fd = fopen(env, "a");
-        if (debug_fd) gssntlm_debug_enabled = true;
+        sample = strtol(env, NULL, 10);
+        if (sample > 1) debug_sample = sample;
     }
-    gssntlm_debug_initialized = true;
+
+    debug_fd = fopen(secure_getenv("GSSNTLMSSP_DEBUG"), "a");
+    if (!debug_fd) return;
+
+    debug_ring = malloc(sizeof(struct debug_event) * DEBUG_RING_SIZE);
+    if (!debug_ring) goto fail;
+    debug_ring_reset();
+
+    if (pthread_atfork(NULL, NULL, debug_atfork_child) != 0) goto fail;
+    /* if this fails events are still written by the writer thread, only
+     * the last ones may be lost */
+    (void)atexit(debug_shutdown);
+
+    /* set before the writer exists, so that creating it publishes the
+     * flag and its setup to it */
+    gssntlm_debug_enabled = true;
+    debug_writer_start();
+    return;
+
+fail:
+    safefree(debug_ring);
+    fclose(debug_fd);
+    debug_fd = NULL;
 }
 
-void gssntlm_debug_printf(const char *fmt, ...)
+static void debug_init_once(void)
 {
-    va_list ap;
+    debug_setup();
+    __atomic_store_n(&gssntlm_debug_initialized, true, __ATOMIC_RELEASE);
+}
 
-    va_start(ap, fmt);
-    vfprintf(debug_fd, fmt, ap);
-    va_end(ap);
-    fflush(debug_fd);
+void gssntlm_debug_init(void)
+{
+    pthread_once(&debug_once, debug_init_once);
+}
+
+void gssntlm_debug_log(const char *function, const char *file,
+                       unsigned int line, unsigned int maj,
+                       unsigned int min)
+{
+    struct debug_event *slot;
+    uint64_t pos;
+    uint64_t seq;
+
+    if (!GSS_ERROR(maj) && debug_sample > 1 &&
+        debug_sample_seq++ % debug_sample != 0) {
+        return;
+    }
+
+    if (unlikely(__atomic_load_n(&debug_writer_state,
+                                 __ATOMIC_RELAXED) == WRITER_NONE)) {
+        /* first event in a forked child */
+        debug_writer_start();
+    }
+    if (unlikely(debug_tid == 0)) {
+        debug_tid = syscall(SYS_gettid);
+    }
+
+    pos = __atomic_load_n(&debug_head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &debug_ring[pos & (DEBUG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&debug_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* pos was reloaded by the failed exchange */
+        } else if ((int64_t)(seq - pos) < 0) {
+            /* the slot still holds an event from the previous lap */
+            __atomic_add_fetch(&debug_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&debug_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->ts);
+    slot->function = function;
+    slot->file = file;
+    slot->ctx = gssntlm_debug_scope.ctx;
+    slot->stage = gssntlm_debug_scope.stage;
+    slot->line = line;
+    slot->maj = maj;
+    slot->min = min;
+    slot->tid = debug_tid;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 }
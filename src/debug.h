@@ -4,13 +4,60 @@
 #define _GSSNTLMSSP_DEBUG_H_
 
 #include <stdbool.h>
-#include <time.h>
 
 extern bool gssntlm_debug_initialized;
 extern bool gssntlm_debug_enabled;
+extern bool gssntlm_debug_all;
 
 void gssntlm_debug_init(void);
-void gssntlm_debug_printf(const char *fmt, ...);
+
+/**
+ * @brief   Queues one event for the log writer, never blocks
+ *
+ * Events that do not fit in the queue are dropped and counted, the count
+ * is logged once there is room again.
+ */
+void gssntlm_debug_log(const char *function, const char *file,
+                       unsigned int line, unsigned int maj,
+                       unsigned int min);
+
+/**
+ * @brief   Writes out all queued events, from the calling thread
+ */
+void gssntlm_debug_flush(void);
+
+/* The context the calling thread is working on, logged with every event.
+ * The stage is the one the context had when the scope was entered. */
+struct gssntlm_debug_scope {
+    const void *ctx;
+    int stage;
+};
+extern __thread struct gssntlm_debug_scope gssntlm_debug_scope;
+
+static inline struct gssntlm_debug_scope debug_scope_enter(const void *ctx,
+                                                           int stage)
+{
+    struct gssntlm_debug_scope prev = gssntlm_debug_scope;
+
+    gssntlm_debug_scope.ctx = ctx;
+    gssntlm_debug_scope.stage = stage;
+    return prev;
+}
+
+static inline void debug_scope_leave(struct gssntlm_debug_scope *prev)
+{
+    gssntlm_debug_scope = *prev;
+}
+
+/* Declares a variable that restores the previous scope when it goes out
+ * of scope, so that every return path of the function is covered */
+#define DEBUG_CTX_SCOPE(ctx, stage) \
+    struct gssntlm_debug_scope debug_scope_prev \
+        __attribute__((cleanup(debug_scope_leave))) = \
+            debug_scope_enter((ctx), (stage))
+
+/* Updates the scope set by DEBUG_CTX_SCOPE(), once the context exists */
+#define DEBUG_CTX(ctx, stage) (void)debug_scope_enter((ctx), (stage))
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
@@ -24,10 +71,9 @@ static inline int debug_gss_errors(const char *function,
         gssntlm_debug_init();
     }
     if (unlikely(gssntlm_debug_enabled == true)) {
-        gssntlm_debug_printf("[%ld] %s: %s() @ %s:%u [%u:%u]\n",
-                             (long)time(NULL),
-                             GSS_ERROR(maj) ? "ERROR" : "ALLOK",
-                             function, file, line, maj, min);
+        if (GSS_ERROR(maj) || gssntlm_debug_all) {
+            gssntlm_debug_log(function, file, line, maj, min);
+        }
     }
     return 0;
 }
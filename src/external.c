@@ -53,14 +53,18 @@ uint32_t external_srv_auth(struct gssntlm_ctx *ctx,
 #if HAVE_WBCLIENT
     uint8_t challenge[8];
     uint8_t *chal_ptr;
+    int ret;
+
+    /* the attributes are added to the source name, which may still be
+     * sharing its storage with the name it was copied from */
+    ret = gssntlm_name_unshare(&ctx->source_name);
+    if (ret) return ret;
 
     /* NOTE: in the ntlmv1 extended security case, winbindd wants a
      * pre-digested challenge, this is arguably a bug as it has all
      * the data needed to compute it by itself ... just cope */
     if (is_ntlm_v1(nt_chal_resp) &&
         (ctx->neg_flags & NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY) ) {
-        int ret;
-
         ret = ntlm_compute_ext_sec_challenge(ctx->server_chal,
                                              lm_chal_resp->data,
                                              challenge);
@@ -0,0 +1,238 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Allocation helpers for the objects a busy acceptor churns through.
+ *
+ * Contexts, credentials and names are fixed size and are created and
+ * destroyed for every handshake. Each thread keeps a few freed ones around
+ * and hands them out again, so the allocator is not involved at all in the
+ * steady state. Objects are zeroed when they are put in the cache, cached
+ * objects are still plain malloc() blocks and may be released with free().
+ *
+ * The arena collects the data a context keeps while the handshake is in
+ * progress (message copies, workstation name), which all goes away with the
+ * context. Small allocations are carved out of larger chunks; buffers that
+ * were allocated elsewhere (eg. by the message encoders) can be adopted by
+ * the arena so that there is a single owner to release. Everything is
+ * zeroed before being returned to the system. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gss_ntlmssp.h"
+
+#define OBJ_CACHE_DEPTH 16
+
+static const size_t obj_sizes[GSSNTLM_OBJ_TYPES] = {
+    [GSSNTLM_OBJ_CTX] = sizeof(struct gssntlm_ctx),
+    [GSSNTLM_OBJ_CRED] = sizeof(struct gssntlm_cred),
+    [GSSNTLM_OBJ_NAME] = sizeof(struct gssntlm_name),
+};
+
+struct obj_cache {
+    void *objs[GSSNTLM_OBJ_TYPES][OBJ_CACHE_DEPTH];
+    unsigned int count[GSSNTLM_OBJ_TYPES];
+};
+
+static pthread_once_t obj_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t obj_cache_key;
+static bool obj_cache_ok;
+
+static void obj_cache_destroy(void *ptr)
+{
+    struct obj_cache *cache = ptr;
+    unsigned int i, j;
+
+    for (i = 0; i < GSSNTLM_OBJ_TYPES; i++) {
+        for (j = 0; j < cache->count[i]; j++) {
+            free(cache->objs[i][j]);
+        }
+    }
+    free(cache);
+}
+
+static void obj_cache_init(void)
+{
+    obj_cache_ok = (pthread_key_create(&obj_cache_key,
+                                       obj_cache_destroy) == 0);
+}
+
+/* The mechglue may dlclose() this module while other threads still hold
+ * caches: their key destructor would then point into unmapped code. The
+ * key is deleted when the module is unloaded, which leaks those caches but
+ * keeps thread exit safe. */
+static void __attribute__((destructor)) obj_cache_unload(void)
+{
+    struct obj_cache *cache;
+
+    if (!obj_cache_ok) return;
+    obj_cache_ok = false;
+
+    cache = pthread_getspecific(obj_cache_key);
+    pthread_setspecific(obj_cache_key, NULL);
+    if (cache) obj_cache_destroy(cache);
+    pthread_key_delete(obj_cache_key);
+}
+
+static struct obj_cache *obj_cache_get(void)
+{
+    struct obj_cache *cache;
+
+    pthread_once(&obj_cache_once, obj_cache_init);
+    if (!obj_cache_ok) return NULL;
+
+    cache = pthread_getspecific(obj_cache_key);
+    if (!cache) {
+        cache = calloc(1, sizeof(struct obj_cache));
+        if (!cache) return NULL;
+        if (pthread_setspecific(obj_cache_key, cache) != 0) {
+            free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+void *gssntlm_obj_alloc(enum gssntlm_obj_type type)
+{
+    struct obj_cache *cache;
+
+    cache = obj_cache_get();
+    if (cache && cache->count[type] > 0) {
+        /* already zeroed by gssntlm_obj_free() */
+        return cache->objs[type][--cache->count[type]];
+    }
+    return calloc(1, obj_sizes[type]);
+}
+
+void gssntlm_obj_free(enum gssntlm_obj_type type, void *obj)
+{
+    struct obj_cache *cache;
+
+    if (!obj) return;
+
+    safezero((uint8_t *)obj, obj_sizes[type]);
+
+    cache = obj_cache_get();
+    if (cache && cache->count[type] < OBJ_CACHE_DEPTH) {
+        cache->objs[type][cache->count[type]++] = obj;
+        return;
+    }
+    free(obj);
+}
+
+/* ==== Arena ==== */
+
+#define ARENA_CHUNK_SIZE 1024
+#define ARENA_ALIGN 16
+
+struct arena_adopted {
+    struct arena_adopted *next;
+    void *data;
+    size_t size;
+};
+
+/* The arena pointer always refers to the chunk currently being filled,
+ * which links to the older ones and carries the list of adopted buffers */
+struct gssntlm_arena {
+    struct gssntlm_arena *prev;
+    struct arena_adopted *adopted;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+};
+
+void *gssntlm_arena_alloc(struct gssntlm_arena **arena, size_t size)
+{
+    struct gssntlm_arena *cur = *arena;
+    struct gssntlm_arena *chunk;
+    size_t chunk_size;
+    size_t offset;
+
+    if (size == 0) size = 1;
+
+    if (cur) {
+        offset = (cur->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset <= cur->size && size <= cur->size - offset) {
+            cur->used = offset + size;
+            return &cur->data[offset];
+        }
+    }
+
+    chunk_size = ARENA_CHUNK_SIZE;
+    if (size > chunk_size) chunk_size = size;
+
+    chunk = malloc(sizeof(struct gssntlm_arena) + chunk_size);
+    if (!chunk) return NULL;
+    chunk->prev = cur;
+    chunk->adopted = cur ? cur->adopted : NULL;
+    if (cur) cur->adopted = NULL;
+    chunk->size = chunk_size;
+    chunk->used = size;
+    *arena = chunk;
+
+    return chunk->data;
+}
+
+char *gssntlm_arena_strdup(struct gssntlm_arena **arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy;
+
+    copy = gssntlm_arena_alloc(arena, len);
+    if (copy) memcpy(copy, str, len);
+    return copy;
+}
+
+int gssntlm_arena_copy(struct gssntlm_arena **arena,
+                       const void *data, size_t length,
+                       struct ntlm_buffer *buf)
+{
+    buf->data = gssntlm_arena_alloc(arena, length);
+    if (!buf->data) {
+        buf->length = 0;
+        return ENOMEM;
+    }
+    memcpy(buf->data, data, length);
+    buf->length = length;
+    return 0;
+}
+
+int gssntlm_arena_adopt(struct gssntlm_arena **arena, struct ntlm_buffer *buf)
+{
+    struct arena_adopted *a;
+
+    if (!buf->data) return 0;
+
+    a = gssntlm_arena_alloc(arena, sizeof(struct arena_adopted));
+    if (!a) {
+        safezero(buf->data, buf->length);
+        ntlm_free_buffer_data(buf);
+        return ENOMEM;
+    }
+    a->data = buf->data;
+    a->size = buf->length;
+    a->next = (*arena)->adopted;
+    (*arena)->adopted = a;
+    return 0;
+}
+
+void gssntlm_arena_free(struct gssntlm_arena **arena)
+{
+    struct gssntlm_arena *chunk;
+    struct arena_adopted *a;
+
+    if (!arena || !*arena) return;
+
+    for (a = (*arena)->adopted; a; a = a->next) {
+        safezero(a->data, a->size);
+        free(a->data);
+    }
+
+    while ((chunk = *arena)) {
+        *arena = chunk->prev;
+        safezero(chunk->data, chunk->used);
+        free(chunk);
+    }
+}
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <string.h>
 #include "gss_ntlmssp.h"
+#include "probes.h"
 
 
 uint32_t gssntlm_cli_auth(uint32_t *minor_status,
@@ -110,10 +111,11 @@ uint32_t gssntlm_cli_auth(uint32_t *minor_status,
             }
 
             /* NTLMv2 Key */
-            retmin = NTOWFv2(ctx->ntlm, &cred->cred.user.nt_hash,
-                             cred->cred.user.user.data.user.name,
-                             cred->cred.user.user.data.user.domain,
-                             &ntlmv2_key);
+            retmin = gssntlm_keycache_ntowfv2(ctx->ntlm,
+                                    &cred->cred.user.nt_hash,
+                                    cred->cred.user.user.data.user.name,
+                                    cred->cred.user.user.data.user.domain,
+                                    false, &ntlmv2_key);
             if (retmin) {
                 set_GSSERR(retmin);
                 goto done;
@@ -244,20 +246,32 @@ uint32_t gssntlm_cli_auth(uint32_t *minor_status,
         enc_sess_key.data = encrypted_random_session_key.data;
         enc_sess_key.length = encrypted_random_session_key.length;
 
-        retmin = ntlm_encode_auth_msg(ctx->ntlm, ctx->neg_flags,
-                                      &lm_chal_resp,  &nt_chal_resp,
-                                      cred->cred.user.user.data.user.domain,
-                                      cred->cred.user.user.data.user.name,
-                                      ctx->workstation, &enc_sess_key,
-                                      add_mic ? &auth_mic : NULL,
-                                      &ctx->auth_msg);
-        if (retmin) {
-            set_GSSERR(retmin);
-            goto done;
+        /* size the message first, then write it in place in the arena */
+        ctx->auth_msg.data = NULL;
+        for (;;) {
+            retmin = ntlm_write_auth_msg(ctx->ntlm, ctx->neg_flags,
+                                    &lm_chal_resp,  &nt_chal_resp,
+                                    cred->cred.user.user.data.user.domain,
+                                    cred->cred.user.user.data.user.name,
+                                    ctx->workstation, &enc_sess_key,
+                                    add_mic ? &auth_mic : NULL,
+                                    &ctx->auth_msg);
+            if (retmin) {
+                set_GSSERR(retmin);
+                goto done;
+            }
+            if (ctx->auth_msg.data) break;
+
+            ctx->auth_msg.data = gssntlm_arena_alloc(&ctx->arena,
+                                                     ctx->auth_msg.length);
+            if (!ctx->auth_msg.data) {
+                set_GSSERR(ENOMEM);
+                goto done;
+            }
         }
 
         /* Now we need to calculate the MIC, because the MIC is part of the
-         * message it protects, ntlm_encode_auth_msg() always add a zeroeth
+         * message it protects, ntlm_write_auth_msg() always add a zeroeth
          * buffer, however it returns in data_mic the pointer to the actual
          * area in the auth_msg that points at the mic, so we can backfill */
         if (add_mic) {
@@ -283,6 +297,11 @@ uint32_t gssntlm_cli_auth(uint32_t *minor_status,
             set_GSSERR(retmin);
             goto done;
         }
+        retmin = gssntlm_arena_adopt(&ctx->arena, &ctx->auth_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
+        }
         set_GSSERRS(0, GSS_S_COMPLETE);
         break;
 
@@ -310,13 +329,16 @@ uint32_t gssntlm_srv_auth(uint32_t *minor_status,
                           struct gssntlm_cred *cred,
                           struct ntlm_buffer *nt_chal_resp,
                           struct ntlm_buffer *lm_chal_resp,
+                          bool check_replay,
                           struct ntlm_key *key_exchange_key)
 {
     struct ntlm_key session_base_key = { .length = 16 };
     struct ntlm_key ntlmv2_key = { .length = 16 };
     struct ntlm_buffer nt_proof = { 0 };
     uint32_t retmaj, retmin;
+    const char *username;
     const char *domstr;
+    bool no_domain;
     bool ntlm_v1;
     bool ext_sec;
     int retries;
@@ -354,34 +376,52 @@ uint32_t gssntlm_srv_auth(uint32_t *minor_status,
                                                  client_chal);
             }
 
-        } else for (retries = 2; retries > 0; retries--) {
-
-            if (retries == 2) {
-                domstr = cred->cred.user.user.data.user.domain;
-            } else {
-                domstr = NULL;
+        } else {
+            username = cred->cred.user.user.data.user.name;
+            domstr = cred->cred.user.user.data.user.domain;
+
+            /* Start with the key variant that verified last time for this
+             * user. Without a domain both variants are the same key. */
+            no_domain = false;
+            retries = 1;
+            if (domstr) {
+                no_domain = gssntlm_keycache_no_domain(
+                                &cred->cred.user.nt_hash, username, domstr);
+                retries = 2;
             }
 
-            /* NTLMv2 Key */
-            retmin = NTOWFv2(ctx->ntlm, &cred->cred.user.nt_hash,
-                             cred->cred.user.user.data.user.name,
-                             domstr, &ntlmv2_key);
-            if (retmin) {
-                set_GSSERR(retmin);
-                goto done;
-            }
+            for (; retries > 0; retries--) {
 
-            /* NTLMv2 Response */
-            retmin = ntlmv2_verify_nt_response(nt_chal_resp,
-                                               &ntlmv2_key,
-                                               ctx->server_chal);
-            if (retmin && gssntlm_sec_lm_ok(ctx)) {
-                /* LMv2 Response */
-                retmin = ntlmv2_verify_lm_response(lm_chal_resp,
+                /* NTLMv2 Key */
+                retmin = gssntlm_keycache_ntowfv2(ctx->ntlm,
+                                                  &cred->cred.user.nt_hash,
+                                                  username, domstr,
+                                                  no_domain, &ntlmv2_key);
+                if (retmin) {
+                    set_GSSERR(retmin);
+                    goto done;
+                }
+
+                /* NTLMv2 Response */
+                retmin = ntlmv2_verify_nt_response(nt_chal_resp,
                                                    &ntlmv2_key,
                                                    ctx->server_chal);
+                if (retmin && gssntlm_sec_lm_ok(ctx)) {
+                    /* LMv2 Response */
+                    retmin = ntlmv2_verify_lm_response(lm_chal_resp,
+                                                       &ntlmv2_key,
+                                                       ctx->server_chal);
+                }
+                if (retmin == 0) break;
+
+                no_domain = !no_domain;
+            }
+
+            /* the second variant verified, try it first next time */
+            if (retmin == 0 && retries == 1 && domstr) {
+                gssntlm_keycache_verified(&cred->cred.user.nt_hash,
+                                          username, domstr, no_domain);
             }
-            if (retmin == 0) break;
         }
 
         if (retmin) {
@@ -414,8 +454,11 @@ uint32_t gssntlm_srv_auth(uint32_t *minor_status,
         break;
 
     case GSSNTLM_CRED_EXTERNAL:
+        GSSNTLM_PROBE(ext_auth_start, ctx,
+                      nt_chal_resp->length, lm_chal_resp->length);
         retmin = external_srv_auth(ctx, cred, nt_chal_resp, lm_chal_resp,
                                    &session_base_key);
+        GSSNTLM_PROBE(ext_auth_done, ctx, retmin);
         if (retmin) {
             set_GSSERR(retmin);
             goto done;
@@ -427,6 +470,17 @@ uint32_t gssntlm_srv_auth(uint32_t *minor_status,
         goto done;
     }
 
+    /* only responses that verified are recorded, others could be used to
+     * fill the cache with the responses of legitimate clients */
+    if (check_replay) {
+        retmin = gssntlm_replay_check(ctx->server_chal,
+                                      nt_chal_resp, lm_chal_resp);
+        if (retmin) {
+            set_GSSERRS(retmin, GSS_S_DUPLICATE_TOKEN);
+            goto done;
+        }
+    }
+
     if (ntlm_v1) {
         retmin = KXKEY(ctx->ntlm, ext_sec,
                        (ctx->neg_flags & NTLMSSP_NEGOTIATE_LM_KEY),
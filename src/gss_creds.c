@@ -10,7 +10,7 @@
 
 #include "gss_ntlmssp.h"
 
-static int hex_to_key(const char *hex, struct ntlm_key *key)
+int gssntlm_hex_to_key(const char *hex, struct ntlm_key *key)
 {
     size_t len = strlen(hex);
     if (len != 32) return ERR_KEYLEN;
@@ -51,16 +51,12 @@ static int get_user_file_creds(const char *filename,
                                struct gssntlm_cred *cred)
 {
     struct gssntlm_ctx *ctx;
+    struct gssntlm_userfile_ref ref = { 0 };
+    struct gssntlm_user_entry *entry;
     int lm_compat_lvl = -1;
-    char line[1024];
-    char *field1, *field2, *field3, *field4;
-    char *dom, *usr, *pwd, *lm, *nt;
-    char *p;
-    bool found = false;
-    FILE *f;
     int ret = 0;
 
-    ctx = calloc(1, sizeof(struct gssntlm_ctx));
+    ctx = gssntlm_obj_alloc(GSSNTLM_OBJ_CTX);
     if (!ctx) return ENOMEM;
 
     lm_compat_lvl = gssntlm_get_lm_compatibility_level();
@@ -90,123 +86,75 @@ static int get_user_file_creds(const char *filename,
      * recommended.
      */
 
-    f = fopen(filename, "r");
-    if (!f) {
-        ret = errno;
-        goto done;
-    }
-
-    while(fgets(line, 1024, f)) {
-        p = line;
-        if (*p == '#') continue;
-        field1 = p;
-        p = strchr(field1, ':');
-        if (!p) continue;
-        *p++ = '\0';
-        field2 = p;
-        p = strchr(field2, ':');
-        if (!p) continue;
-        *p++ = '\0';
-        field3 = p;
-        p = strchr(field3, ':');
-        if (!p) {
-            /* Assume Heimdal file format */
-            p = field3;
-            strsep(&p, "\r\n");
-
-            dom = field1;
-            usr = field2;
-            pwd = field3;
-            lm = NULL;
-            nt = NULL;
-        } else {
-            *p++ = '\0';
-            field4 = p;
-            p = strchr(field4, ':');
-            if (!p) continue;
-            *p++ = '\0';
-            /* Assume smbpasswd file format */
-            dom = NULL;
-            usr = field1;
-            pwd = NULL;
-            lm = field3;
-            nt = field4;
-
-            /* check if username is domain qualified */
-            p = strchr(usr, '\\');
-            if (p) {
-                dom = usr;
-                *p++ = '\0';
-                usr = p;
-            }
-        }
-
-        /* if no name is specified use the first found */
-        if (name == NULL) {
-            found = true;
-            break;
-        }
+    /* **OR** */
 
-        if (name->data.user.domain && dom) {
-            if (!ntlm_casecmp(dom, name->data.user.domain)) continue;
-        }
-        if (name->data.user.name) {
-            if (!ntlm_casecmp(usr, name->data.user.name)) continue;
-        }
-        /* all matched (NULLs in name are wildcards) */
-        found = true;
-        break;
-    }
+    /* A binary database compiled from one of the above with ntlmssp-mkdb,
+     * which carries the keys directly.
+     */
 
-    fclose(f);
+    /* The file is parsed and indexed once per process and re-read only
+     * when it changes, see gss_userfile.c */
+    ret = gssntlm_userfile_find(filename, name, &ref);
+    if (ret) goto done;
+    entry = &ref.entry;
 
-    if (!found) {
-        ret = ENOENT;
-        goto done;
-    }
+    /* the name may be a copy of the one asked for */
+    ret = gssntlm_name_unshare(&cred->cred.user.user);
+    if (ret) goto done;
 
     cred->type = GSSNTLM_CRED_USER;
     cred->cred.user.user.type = GSSNTLM_NAME_USER;
-    if (dom) {
+    if (entry->domain) {
         free(cred->cred.user.user.data.user.domain);
-        cred->cred.user.user.data.user.domain = strdup(dom);
+        cred->cred.user.user.data.user.domain = strdup(entry->domain);
         if (!cred->cred.user.user.data.user.domain) {
             ret = ENOMEM;
             goto done;
         }
     }
     free(cred->cred.user.user.data.user.name);
-    cred->cred.user.user.data.user.name = strdup(usr);
+    cred->cred.user.user.data.user.name = strdup(entry->user);
     if (!cred->cred.user.user.data.user.name) {
         ret = ENOMEM;
         goto done;
     }
 
-    if (pwd) {
+    if (entry->password) {
         cred->cred.user.nt_hash.length = 16;
 
-        ret = NTOWFv1(pwd, &cred->cred.user.nt_hash);
+        ret = NTOWFv1(entry->password, &cred->cred.user.nt_hash);
         if (ret) goto done;
 
         if (gssntlm_sec_lm_ok(ctx)) {
             cred->cred.user.lm_hash.length = 16;
-            ret = LMOWFv1(pwd, &cred->cred.user.lm_hash);
+            ret = LMOWFv1(entry->password, &cred->cred.user.lm_hash);
             if (ret) goto done;
         }
     }
 
-    if (lm && nt) {
-        ret = hex_to_key(nt, &cred->cred.user.nt_hash);
+    if (entry->nt_key) {
+        memcpy(cred->cred.user.nt_hash.data, entry->nt_key, 16);
+        cred->cred.user.nt_hash.length = 16;
+
+        if (entry->lm_key && gssntlm_sec_lm_ok(ctx)) {
+            memcpy(cred->cred.user.lm_hash.data, entry->lm_key, 16);
+            cred->cred.user.lm_hash.length = 16;
+        }
+    }
+
+    if (entry->lm_hash && entry->nt_hash) {
+        ret = gssntlm_hex_to_key(entry->nt_hash, &cred->cred.user.nt_hash);
         if (ret) goto done;
 
         if (gssntlm_sec_lm_ok(ctx)) {
-            ret = hex_to_key(lm, &cred->cred.user.lm_hash);
+            ret = gssntlm_hex_to_key(entry->lm_hash, &cred->cred.user.lm_hash);
             if (ret) goto done;
         }
     }
 
 done:
-    free(ctx);
+    gssntlm_userfile_release(&ref);
+    gssntlm_obj_free(GSSNTLM_OBJ_CTX, ctx);
     return ret;
 }
 
@@ -245,6 +193,20 @@ static int get_server_creds(struct gssntlm_name *name,
 #define KRB5_CS_CLI_KEYTAB_URN "client_keytab"
 #define KRB5_CS_KEYTAB_URN "keytab"
 
+static int cs_get_uint32(const char *str, uint32_t *value)
+{
+    unsigned long val;
+    char *end;
+
+    errno = 0;
+    val = strtoul(str, &end, 10);
+    if (errno || end == str || *end != '\0' || val > UINT32_MAX) {
+        return ERR_BADARG;
+    }
+    *value = val;
+    return 0;
+}
+
 static int get_creds_from_store(struct gssntlm_name *name,
                                 struct gssntlm_cred *cred,
                                 gss_const_key_value_set_t cred_store)
@@ -256,6 +218,8 @@ static int get_creds_from_store(struct gssntlm_name *name,
         /* special case to let server creds carry a keyfile */
         if (name->type == GSSNTLM_NAME_SERVER) {
             const char *keyfile = NULL;
+            uint32_t replay_entries = 0;
+            uint32_t replay_lifetime = MAX_CHALRESP_LIFETIME;
             cred->type = GSSNTLM_CRED_SERVER;
             ret = gssntlm_copy_name(name, &cred->cred.server.name);
             if (ret) return ret;
@@ -264,6 +228,18 @@ static int get_creds_from_store(struct gssntlm_name *name,
                             GSS_NTLMSSP_CS_KEYFILE) == 0) {
                     keyfile = cred_store->elements[i].value;
                 }
+                if (strcmp(cred_store->elements[i].key,
+                            GSS_NTLMSSP_CS_REPLAY_CACHE) == 0) {
+                    ret = cs_get_uint32(cred_store->elements[i].value,
+                                        &replay_entries);
+                    if (ret) return ret;
+                }
+                if (strcmp(cred_store->elements[i].key,
+                            GSS_NTLMSSP_CS_REPLAY_LIFETIME) == 0) {
+                    ret = cs_get_uint32(cred_store->elements[i].value,
+                                        &replay_lifetime);
+                    if (ret) return ret;
+                }
             }
             if (keyfile) {
                 cred->cred.server.keyfile = strdup(keyfile);
@@ -271,6 +247,12 @@ static int get_creds_from_store(struct gssntlm_name *name,
                     return errno;
                 }
             }
+            if (replay_entries > 0) {
+                ret = gssntlm_replay_cache_enable(replay_entries,
+                                                  replay_lifetime);
+                if (ret) return ret;
+                cred->cred.server.replay_check = true;
+            }
             return 0;
         }
 
@@ -285,13 +267,15 @@ static int get_creds_from_store(struct gssntlm_name *name,
 
     for (i = 0; i < cred_store->count; i++) {
         if (strcmp(cred_store->elements[i].key, GSS_NTLMSSP_CS_DOMAIN) == 0) {
+            ret = gssntlm_name_unshare(&cred->cred.user.user);
+            if (ret) return ret;
             free(cred->cred.user.user.data.user.domain);
             cred->cred.user.user.data.user.domain =
                                     strdup(cred_store->elements[i].value);
             if (!cred->cred.user.user.data.user.domain) return ENOMEM;
         }
         if (strcmp(cred_store->elements[i].key, GSS_NTLMSSP_CS_NTHASH) == 0) {
-            ret = hex_to_key(cred_store->elements[i].value,
+            ret = gssntlm_hex_to_key(cred_store->elements[i].value,
                              &cred->cred.user.nt_hash);
             if (ret) return ret;
         }
@@ -323,54 +307,13 @@ static int get_creds_from_store(struct gssntlm_name *name,
     return 0;
 }
 
-static void gssntlm_copy_key(struct ntlm_key *dest, struct ntlm_key *src)
-{
-    memcpy(dest->data, src->data, src->length);
-    dest->length = src->length;
-}
-
-int gssntlm_copy_creds(struct gssntlm_cred *in, struct gssntlm_cred *out)
+struct gssntlm_cred *gssntlm_cred_ref(struct gssntlm_cred *cred)
 {
-    char *dom = NULL, *usr = NULL, *srv = NULL;
-    int ret = 0;
-
-    out->type = GSSNTLM_CRED_NONE;
-
-    switch (in->type) {
-    case GSSNTLM_CRED_NONE:
-        break;
-    case GSSNTLM_CRED_ANON:
-        out->cred.anon.dummy = 1;
-        break;
-    case GSSNTLM_CRED_USER:
-        ret = gssntlm_copy_name(&in->cred.user.user,
-                                &out->cred.user.user);
-        if (ret) goto done;
-        gssntlm_copy_key(&out->cred.user.nt_hash,
-                         &in->cred.user.nt_hash);
-        gssntlm_copy_key(&out->cred.user.lm_hash,
-                         &in->cred.user.lm_hash);
-        break;
-    case GSSNTLM_CRED_SERVER:
-        ret = gssntlm_copy_name(&in->cred.server.name,
-                                &out->cred.server.name);
-        if (ret) goto done;
-        break;
-    case GSSNTLM_CRED_EXTERNAL:
-        ret = gssntlm_copy_name(&in->cred.external.user,
-                                &out->cred.external.user);
-        if (ret) goto done;
-        break;
-    }
-    out->type = in->type;
+    if (!cred) return NULL;
 
-done:
-    if (ret) {
-        safefree(dom);
-        safefree(usr);
-        safefree(srv);
-    }
-    return ret;
+    /* nothing in a credential changes after it has been acquired */
+    __atomic_add_fetch(&cred->refs, 1, __ATOMIC_RELAXED);
+    return cred;
 }
 
 void gssntlm_int_release_cred(struct gssntlm_cred *cred)
@@ -393,6 +336,7 @@ void gssntlm_int_release_cred(struct gssntlm_cred *cred)
     case GSSNTLM_CRED_SERVER:
         gssntlm_int_release_name(&cred->cred.server.name);
         safefree(cred->cred.server.keyfile);
+        gssntlm_identity_release(&cred->cred.server.identity);
         break;
     case GSSNTLM_CRED_EXTERNAL:
         gssntlm_int_release_name(&cred->cred.external.user);
@@ -417,10 +361,11 @@ uint32_t gssntlm_acquire_cred_from(uint32_t *minor_status,
 
     name = (struct gssntlm_name *)desired_name;
 
-    cred = calloc(1, sizeof(struct gssntlm_cred));
+    cred = gssntlm_obj_alloc(GSSNTLM_OBJ_CRED);
     if (!cred) {
-        return GSSERRS(errno, GSS_S_FAILURE);
+        return GSSERRS(ENOMEM, GSS_S_FAILURE);
     }
+    cred->refs = 1;
 
     /* FIXME: should we split the cred union and allow GSS_C_BOTH ?
      * It may be possible to specify get server name from env and/or
@@ -484,10 +429,10 @@ uint32_t gssntlm_acquire_cred_from(uint32_t *minor_status,
             retmin = get_creds_from_store(name, cred, cred_store);
         } else {
             retmin = get_server_creds(name, cred);
-            if (retmin) {
-                set_GSSERR(retmin);
-                goto done;
-            }
+        }
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
         }
     } else if (cred_usage == GSS_C_BOTH) {
         set_GSSERRS(ERR_NOTSUPPORTED, GSS_S_CRED_UNAVAIL);
@@ -534,12 +479,21 @@ uint32_t gssntlm_acquire_cred(uint32_t *minor_status,
 uint32_t gssntlm_release_cred(uint32_t *minor_status,
                               gss_cred_id_t *cred_handle)
 {
+    struct gssntlm_cred *cred;
+
     *minor_status = 0;
 
     if (!cred_handle) return GSS_S_COMPLETE;
 
-    gssntlm_int_release_cred((struct gssntlm_cred *)*cred_handle);
-    safefree(*cred_handle);
+    cred = (struct gssntlm_cred *)*cred_handle;
+    *cred_handle = NULL;
+    if (!cred) return GSS_S_COMPLETE;
+    if (__atomic_sub_fetch(&cred->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return GSS_S_COMPLETE;
+    }
+
+    gssntlm_int_release_cred(cred);
+    gssntlm_obj_free(GSSNTLM_OBJ_CRED, cred);
 
     return GSS_S_COMPLETE;
 }
@@ -715,3 +669,53 @@ uint32_t gssntlm_inquire_cred_by_mech(uint32_t *minor_status,
     if (cred_usage) *cred_usage = usage;
     return GSSERRS(0, GSS_S_COMPLETE);
 }
+
+gss_OID_desc invalidate_identity_oid = {
+    GSS_NTLMSSP_INVALIDATE_IDENTITY_OID_LENGTH,
+    discard_const(GSS_NTLMSSP_INVALIDATE_IDENTITY_OID_STRING)
+};
+
+uint32_t gssntlm_set_cred_option(uint32_t *minor_status,
+                                 gss_cred_id_t *cred_handle,
+                                 const gss_OID desired_object,
+                                 const gss_buffer_t value)
+{
+    uint32_t retmin;
+    uint32_t retmaj;
+
+    if (desired_object == GSS_C_NO_OID) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
+    }
+
+    /* the identity cache is process wide, so no credential is needed */
+    if (gss_oid_equal(desired_object, &invalidate_identity_oid)) {
+        gssntlm_identity_invalidate();
+        return GSSERRS(0, GSS_S_COMPLETE);
+    }
+
+    return GSSERRS(ERR_BADARG, GSS_S_UNAVAILABLE);
+}
+
+uint32_t gssntlm_inquire_cred_by_oid(uint32_t *minor_status,
+                                     const gss_cred_id_t cred_handle,
+                                     const gss_OID desired_object,
+                                     gss_buffer_set_t *data_set)
+{
+    uint32_t retmin;
+    uint32_t retmaj;
+
+    if (desired_object == GSS_C_NO_OID) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
+    }
+    if (!data_set) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_WRITE);
+    }
+    *data_set = GSS_C_NO_BUFFER_SET;
+
+    /* process wide as well, any credential will do */
+    if (gss_oid_equal(desired_object, &metrics_oid)) {
+        return gssntlm_metrics_inquire(minor_status, data_set);
+    }
+
+    return GSSERRS(ERR_NOTSUPPORTED, GSS_S_UNAVAILABLE);
+}
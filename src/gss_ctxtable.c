@@ -0,0 +1,674 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Shared context table.
+ *
+ * In pre-forked servers the process that completes a handshake is often
+ * not the one that serves the next request on the connection. Instead of
+ * moving the whole context around with export/import every time, an
+ * established context can be put in a table in shared memory: a memfd
+ * mapped by every process of the pool, inherited across fork().
+ *
+ * Entries are found by ID: the index of the entry and the generation it
+ * had when the context was stored, so that an old ID never finds a reused
+ * entry. Finding an entry takes no table-wide lock, and a free entry is
+ * claimed with a compare and swap.
+ *
+ * An entry holds the context in the compact export format, which is what
+ * processes import their own copy from, and its per-message state: the
+ * sequence numbers and RC4 states of both directions. That state is owned
+ * by the entry. Every per-message call on a shared context locks the
+ * entry (a robust, process shared mutex), reloads the state if another
+ * copy used it in the meantime, and publishes it back if the call changed
+ * it.
+ *
+ * An entry counts the copies attached to it per process, in a few owner
+ * slots holding a PID and a count, so that the references of a process
+ * that died without detaching can be told apart and are ignored. It also
+ * counts the reference tokens exported and not imported yet: an entry
+ * with pending tokens is kept until they are imported or it expires, even
+ * if no copy is attached in the meantime. Otherwise, once the last copy is
+ * gone the entry stays valid, for the next import, until the table runs
+ * out of free entries and it is the least recently used one. Expired
+ * entries are reused first, attached or not. */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gss_ntlmssp.h"
+
+#define TABLE_MAGIC 0x4e544354 /* "NTCT" */
+#define TABLE_LAYOUT 2
+#define TABLE_MAX_ENTRIES (1 << 20)
+#define TABLE_TOKEN_MAX 2048
+#define TABLE_REUSE_TRIES 4
+/* processes that can be attached to the same entry at the same time */
+#define TABLE_OWNERS 8
+
+enum entry_state {
+    ENTRY_FREE = 0,
+    ENTRY_CLAIMED,  /* being filled in */
+    ENTRY_LIVE,
+};
+
+struct table_dir {
+    uint32_t seq_num;
+    uint8_t has_rc4_state;
+    uint8_t rc4_state[258];
+};
+
+struct table_owner {
+    int32_t pid;
+    uint32_t refs;
+};
+
+struct table_entry {
+    pthread_mutex_t lock;
+    /* read without the lock to find or pick entries, only changed under
+     * it (except for claiming a free entry) */
+    uint32_t gen;
+    uint32_t state;
+    uint32_t pending;       /* exported reference tokens not imported yet */
+    int64_t expiration;
+    int64_t last_used;
+    struct table_owner owners[TABLE_OWNERS];
+
+    /* only accessed under the lock */
+    uint64_t version;       /* bumped every time dir[] is published */
+    struct table_dir dir[2];    /* send, recv */
+    uint32_t token_len;
+    uint8_t token[TABLE_TOKEN_MAX];
+} __attribute__((aligned(64)));
+
+struct table_hdr {
+    uint32_t magic;
+    uint32_t layout;
+    uint32_t entries;
+    uint32_t entry_size;
+    uint32_t next_free;     /* where the search for a free entry starts */
+    struct table_entry entry[];
+};
+
+gss_OID_desc ctx_table_oid = {
+    GSS_NTLMSSP_CTX_TABLE_OID_LENGTH,
+    discard_const(GSS_NTLMSSP_CTX_TABLE_OID_STRING)
+};
+
+static struct table_hdr *ctx_table;
+static pthread_mutex_t ctx_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct table_hdr *table_get(void)
+{
+    return __atomic_load_n(&ctx_table, __ATOMIC_ACQUIRE);
+}
+
+static size_t table_size(uint32_t entries)
+{
+    return sizeof(struct table_hdr) +
+           (size_t)entries * sizeof(struct table_entry);
+}
+
+static uint64_t entry_id(struct table_hdr *t, struct table_entry *e)
+{
+    return ((uint64_t)e->gen << 32) | (uint64_t)(e - t->entry);
+}
+
+static void entry_reset_owners(struct table_entry *e)
+{
+    int i;
+
+    __atomic_store_n(&e->pending, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < TABLE_OWNERS; i++) {
+        __atomic_store_n(&e->owners[i].refs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->owners[i].pid, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static bool owner_alive(pid_t pid)
+{
+    /* EPERM means the process exists, it just belongs to someone else */
+    return pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* must be called with the entry locked */
+static int owner_add(struct table_entry *e, pid_t pid)
+{
+    struct table_owner *slot = NULL;
+    struct table_owner *o;
+    int i;
+
+    for (i = 0; i < TABLE_OWNERS; i++) {
+        o = &e->owners[i];
+        if (o->refs > 0 && o->pid == pid) {
+            __atomic_store_n(&o->refs, o->refs + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (!slot && (o->refs == 0 || !owner_alive(o->pid))) slot = o;
+    }
+    if (!slot) return EBUSY;
+
+    __atomic_store_n(&slot->pid, pid, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->refs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* must be called with the entry locked */
+static void owner_del(struct table_entry *e, pid_t pid)
+{
+    struct table_owner *o;
+    int i;
+
+    /* a forked child releasing copies it inherited has no slot */
+    for (i = 0; i < TABLE_OWNERS; i++) {
+        o = &e->owners[i];
+        if (o->refs > 0 && o->pid == pid) {
+            __atomic_store_n(&o->refs, o->refs - 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+/* true if a live process is attached, may be called without the lock */
+static bool entry_attached(struct table_entry *e)
+{
+    int i;
+
+    for (i = 0; i < TABLE_OWNERS; i++) {
+        if (__atomic_load_n(&e->owners[i].refs, __ATOMIC_RELAXED) > 0 &&
+            owner_alive(__atomic_load_n(&e->owners[i].pid,
+                                        __ATOMIC_RELAXED))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void entry_drop(struct table_entry *e)
+{
+    __atomic_add_fetch(&e->gen, 1, __ATOMIC_RELEASE);
+    entry_reset_owners(e);
+    __atomic_store_n(&e->state, ENTRY_FREE, __ATOMIC_RELEASE);
+    safezero((uint8_t *)e->dir, sizeof(e->dir));
+    safezero(e->token, e->token_len);
+    e->token_len = 0;
+}
+
+static int entry_lock(struct table_entry *e)
+{
+    int ret;
+
+    ret = pthread_mutex_lock(&e->lock);
+    if (ret == EOWNERDEAD) {
+        /* the owner died with the entry locked, maybe half way through
+         * publishing the state, so nobody can use it anymore */
+        entry_drop(e);
+        pthread_mutex_consistent(&e->lock);
+        pthread_mutex_unlock(&e->lock);
+        return ENOENT;
+    }
+    return ret;
+}
+
+/* Locks the entry an ID refers to, as long as it still does */
+static int entry_lock_id(uint64_t id, struct table_entry **entry)
+{
+    struct table_hdr *t = table_get();
+    uint32_t index = id & 0xffffffff;
+    uint32_t gen = id >> 32;
+    struct table_entry *e;
+    int ret;
+
+    if (!t || index >= t->entries) return ENOENT;
+    e = &t->entry[index];
+    if (__atomic_load_n(&e->gen, __ATOMIC_ACQUIRE) != gen) return ENOENT;
+
+    ret = entry_lock(e);
+    if (ret) return ret;
+    if (e->gen != gen || e->state != ENTRY_LIVE) {
+        pthread_mutex_unlock(&e->lock);
+        return ENOENT;
+    }
+    *entry = e;
+    return 0;
+}
+
+static bool entry_reusable(struct table_entry *e, int64_t now)
+{
+    int64_t expiration = __atomic_load_n(&e->expiration, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&e->state, __ATOMIC_RELAXED) != ENTRY_LIVE) {
+        return false;
+    }
+    if (expiration < now) return true;
+    if (__atomic_load_n(&e->pending, __ATOMIC_RELAXED) > 0) return false;
+    return !entry_attached(e);
+}
+
+/* Returns a locked entry in the ENTRY_CLAIMED state with a new generation,
+ * or NULL if all entries are in use */
+static struct table_entry *entry_claim(struct table_hdr *t, int64_t now)
+{
+    struct table_entry *victim;
+    struct table_entry *e;
+    uint32_t expected;
+    uint32_t start;
+    uint32_t i;
+    int tries;
+
+    start = __atomic_fetch_add(&t->next_free, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < t->entries; i++) {
+        e = &t->entry[(start + i) % t->entries];
+        expected = ENTRY_FREE;
+        if (__atomic_load_n(&e->state, __ATOMIC_RELAXED) != ENTRY_FREE ||
+            !__atomic_compare_exchange_n(&e->state, &expected,
+                                         ENTRY_CLAIMED, false,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (entry_lock(e) != 0) continue;
+        goto claimed;
+    }
+
+    /* no free entry, take the least recently used one no live process is
+     * attached to and no token refers to, or any expired one */
+    for (tries = 0; tries < TABLE_REUSE_TRIES; tries++) {
+        victim = NULL;
+        for (i = 0; i < t->entries; i++) {
+            e = &t->entry[i];
+            if (!entry_reusable(e, now)) continue;
+            if (__atomic_load_n(&e->expiration, __ATOMIC_RELAXED) < now) {
+                victim = e;
+                break;
+            }
+            if (!victim ||
+                __atomic_load_n(&e->last_used, __ATOMIC_RELAXED) <
+                    __atomic_load_n(&victim->last_used, __ATOMIC_RELAXED)) {
+                victim = e;
+            }
+        }
+        if (!victim) return NULL;
+
+        if (entry_lock(victim) != 0) continue;
+        if (entry_reusable(victim, now)) {
+            e = victim;
+            __atomic_store_n(&e->state, ENTRY_CLAIMED, __ATOMIC_RELAXED);
+            goto claimed;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return NULL;
+
+claimed:
+    /* old IDs stop matching from here on */
+    if (__atomic_add_fetch(&e->gen, 1, __ATOMIC_RELEASE) == 0) {
+        __atomic_add_fetch(&e->gen, 1, __ATOMIC_RELEASE);
+    }
+    return e;
+}
+
+static int dir_save(struct ntlm_signseal_handle *h, struct table_dir *dir)
+{
+    int ret;
+
+    dir->seq_num = h->seq_num;
+    if (h->seal_handle) {
+        ret = gssntlm_rc4_pack(h->seal_handle, dir->rc4_state);
+        if (ret) return ret;
+        dir->has_rc4_state = 1;
+    } else {
+        dir->has_rc4_state = 0;
+    }
+    return 0;
+}
+
+static int dir_load(struct table_dir *dir, struct ntlm_signseal_handle *h)
+{
+    h->seq_num = dir->seq_num;
+    RC4_FREE(&h->seal_handle);
+    if (dir->has_rc4_state) {
+        return gssntlm_rc4_unpack(dir->rc4_state, &h->seal_handle);
+    }
+    return 0;
+}
+
+static int table_init_locks(struct table_hdr *t)
+{
+    pthread_mutexattr_t attr;
+    uint32_t i;
+    int ret;
+
+    ret = pthread_mutexattr_init(&attr);
+    if (ret) return ret;
+    ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (ret == 0) {
+        ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    for (i = 0; ret == 0 && i < t->entries; i++) {
+        ret = pthread_mutex_init(&t->entry[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+uint32_t gssntlm_ctx_table_create(uint32_t *minor_status,
+                                  uint32_t entries, int *fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    struct table_hdr *t = MAP_FAILED;
+    size_t size;
+    int mfd = -1;
+    uint32_t retmaj;
+    uint32_t retmin;
+    int ret;
+
+    if (entries == 0 || entries > TABLE_MAX_ENTRIES) {
+        return GSSERRS(ERR_BADARG, GSS_S_FAILURE);
+    }
+    size = table_size(entries);
+
+    pthread_mutex_lock(&ctx_table_mutex);
+    if (ctx_table) {
+        set_GSSERRS(EEXIST, GSS_S_FAILURE);
+        goto done;
+    }
+
+    /* the memory of a new memfd reads as zeroes: all entries are free */
+    mfd = memfd_create("gssntlmssp-ctx-table", MFD_CLOEXEC);
+    if (mfd == -1 || ftruncate(mfd, size) != 0) {
+        set_GSSERR(errno);
+        goto done;
+    }
+    t = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (t == MAP_FAILED) {
+        set_GSSERR(errno);
+        goto done;
+    }
+
+    t->entries = entries;
+    t->entry_size = sizeof(struct table_entry);
+    ret = table_init_locks(t);
+    if (ret) {
+        set_GSSERR(ret);
+        goto done;
+    }
+    t->layout = TABLE_LAYOUT;
+    t->magic = TABLE_MAGIC;
+
+    __atomic_store_n(&ctx_table, t, __ATOMIC_RELEASE);
+    set_GSSERRS(0, GSS_S_COMPLETE);
+
+done:
+    pthread_mutex_unlock(&ctx_table_mutex);
+    if (retmaj) {
+        if (t != MAP_FAILED) munmap(t, size);
+        if (mfd != -1) close(mfd);
+    } else if (fd) {
+        *fd = mfd;
+    } else {
+        close(mfd);
+    }
+    return GSSERR();
+#else
+    return GSSERRS(ERR_NOTAVAIL, GSS_S_UNAVAILABLE);
+#endif
+}
+
+uint32_t gssntlm_ctx_table_map(uint32_t *minor_status, int fd)
+{
+    struct table_hdr *t = MAP_FAILED;
+    struct stat st;
+    uint32_t retmaj;
+    uint32_t retmin;
+
+    pthread_mutex_lock(&ctx_table_mutex);
+    if (ctx_table) {
+        set_GSSERRS(EEXIST, GSS_S_FAILURE);
+        goto done;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        set_GSSERR(errno);
+        goto done;
+    }
+    if (st.st_size < (off_t)sizeof(struct table_hdr)) {
+        set_GSSERRS(ERR_BADARG, GSS_S_FAILURE);
+        goto done;
+    }
+    t = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (t == MAP_FAILED) {
+        set_GSSERR(errno);
+        goto done;
+    }
+    if (t->magic != TABLE_MAGIC || t->layout != TABLE_LAYOUT ||
+        t->entry_size != sizeof(struct table_entry) ||
+        t->entries == 0 || t->entries > TABLE_MAX_ENTRIES ||
+        (size_t)st.st_size < table_size(t->entries)) {
+        set_GSSERRS(ERR_BADARG, GSS_S_FAILURE);
+        goto done;
+    }
+
+    __atomic_store_n(&ctx_table, t, __ATOMIC_RELEASE);
+    set_GSSERRS(0, GSS_S_COMPLETE);
+
+done:
+    pthread_mutex_unlock(&ctx_table_mutex);
+    if (retmaj && t != MAP_FAILED) munmap(t, st.st_size);
+    return GSSERR();
+}
+
+uint32_t gssntlm_ctx_table_share(uint32_t *minor_status,
+                                 struct gssntlm_ctx *ctx)
+{
+    struct table_hdr *t = table_get();
+    struct ntlm_buffer token = { 0 };
+    struct table_entry *e;
+    int64_t now = time(NULL);
+    uint32_t retmaj;
+    uint32_t retmin;
+    int ret;
+
+    if (!t) {
+        return GSSERRS(ERR_NOTAVAIL, GSS_S_UNAVAILABLE);
+    }
+    retmaj = gssntlm_context_is_valid(ctx, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(ERR_BADCTX, retmaj);
+    }
+    if (ctx->int_flags & NTLMSSP_CTX_FLAG_SHARED) {
+        return GSSERRS(0, GSS_S_COMPLETE);
+    }
+
+    ret = gssntlm_ctx_pack(ctx, &token);
+    if (ret) {
+        return GSSERRS(ret, GSS_S_FAILURE);
+    }
+    if (token.length > TABLE_TOKEN_MAX) {
+        set_GSSERRS(E2BIG, GSS_S_FAILURE);
+        goto done;
+    }
+
+    e = entry_claim(t, now);
+    if (!e) {
+        set_GSSERRS(ENOSPC, GSS_S_FAILURE);
+        goto done;
+    }
+
+    ret = dir_save(&ctx->crypto_state.send, &e->dir[0]);
+    if (ret == 0) {
+        ret = dir_save(&ctx->crypto_state.recv, &e->dir[1]);
+    }
+    if (ret) {
+        entry_drop(e);
+        pthread_mutex_unlock(&e->lock);
+        set_GSSERR(ret);
+        goto done;
+    }
+    memcpy(e->token, token.data, token.length);
+    e->token_len = token.length;
+    e->version = 1;
+    entry_reset_owners(e);
+    (void)owner_add(e, getpid());
+    __atomic_store_n(&e->expiration, ctx->expiration_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->last_used, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->state, ENTRY_LIVE, __ATOMIC_RELEASE);
+
+    ctx->table_id = entry_id(t, e);
+    ctx->table_version = e->version;
+    ctx->int_flags |= NTLMSSP_CTX_FLAG_SHARED;
+    pthread_mutex_unlock(&e->lock);
+
+    set_GSSERRS(0, GSS_S_COMPLETE);
+
+done:
+    safezero(token.data, token.length);
+    free(token.data);
+    return GSSERR();
+}
+
+uint32_t gssntlm_ctx_table_inquire(uint32_t *minor_status,
+                                   struct gssntlm_ctx *ctx,
+                                   gss_buffer_set_t *data_set)
+{
+    gss_buffer_desc id_buf;
+    uint32_t retmin;
+    uint32_t retmaj;
+    uint32_t tmpmin;
+
+    if (!(ctx->int_flags & NTLMSSP_CTX_FLAG_SHARED)) {
+        return GSSERRS(ERR_NOTAVAIL, GSS_S_UNAVAILABLE);
+    }
+
+    id_buf.value = &ctx->table_id;
+    id_buf.length = sizeof(ctx->table_id);
+
+    retmaj = gss_add_buffer_set_member(&retmin, &id_buf, data_set);
+    if (retmaj != GSS_S_COMPLETE) {
+        (void)gss_release_buffer_set(&tmpmin, data_set);
+    }
+    return GSSERRS(retmin, retmaj);
+}
+
+int gssntlm_ctx_table_attach(uint64_t id, struct ntlm_buffer *token)
+{
+    struct table_entry *e;
+    int ret;
+
+    ret = entry_lock_id(id, &e);
+    if (ret) return ret;
+
+    ret = owner_add(e, getpid());
+    if (ret) {
+        pthread_mutex_unlock(&e->lock);
+        return ret;
+    }
+
+    token->data = malloc(e->token_len);
+    if (!token->data) {
+        owner_del(e, getpid());
+        pthread_mutex_unlock(&e->lock);
+        return ENOMEM;
+    }
+    memcpy(token->data, e->token, e->token_len);
+    token->length = e->token_len;
+
+    if (e->pending > 0) {
+        __atomic_store_n(&e->pending, e->pending - 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&e->last_used, time(NULL), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+void gssntlm_ctx_table_detach(uint64_t id)
+{
+    struct table_entry *e;
+
+    if (entry_lock_id(id, &e) != 0) return;
+    owner_del(e, getpid());
+    pthread_mutex_unlock(&e->lock);
+}
+
+int gssntlm_ctx_table_exported(uint64_t id)
+{
+    struct table_entry *e;
+    int ret;
+
+    ret = entry_lock_id(id, &e);
+    if (ret) return ret;
+    if (e->pending < UINT32_MAX) {
+        __atomic_store_n(&e->pending, e->pending + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+int gssntlm_ctx_table_lock_entry(struct gssntlm_ctx *ctx,
+                                 struct gssntlm_table_lock *tl)
+{
+    struct table_entry *e;
+    int ret;
+
+    ret = entry_lock_id(ctx->table_id, &e);
+    if (ret) return ret;
+
+    if (e->version != ctx->table_version) {
+        ret = dir_load(&e->dir[0], &ctx->crypto_state.send);
+        if (ret == 0) {
+            ret = dir_load(&e->dir[1], &ctx->crypto_state.recv);
+        }
+        if (ret) {
+            /* table_version is left alone, the next call retries */
+            pthread_mutex_unlock(&e->lock);
+            return ret;
+        }
+        ctx->table_version = e->version;
+    }
+
+    tl->ctx = ctx;
+    tl->entry = e;
+    tl->seq_num[0] = ctx->crypto_state.send.seq_num;
+    tl->seq_num[1] = ctx->crypto_state.recv.seq_num;
+    tl->dirty = false;
+    return 0;
+}
+
+void gssntlm_ctx_table_unlock_entry(struct gssntlm_table_lock *tl)
+{
+    struct ntlm_signseal_state *state = &tl->ctx->crypto_state;
+    struct table_entry *e = tl->entry;
+    bool send, recv;
+    int ret = 0;
+
+    send = tl->dirty || state->send.seq_num != tl->seq_num[0];
+    recv = tl->dirty || state->recv.seq_num != tl->seq_num[1];
+    if (!state->ext_sec && (send || recv)) {
+        /* a single RC4 state serves both ways */
+        send = recv = true;
+    }
+
+    if (send || recv) {
+        if (send) ret = dir_save(&state->send, &e->dir[0]);
+        if (recv && ret == 0) ret = dir_save(&state->recv, &e->dir[1]);
+        if (ret) {
+            /* the entry may now be half updated */
+            entry_drop(e);
+        } else {
+            e->version++;
+            tl->ctx->table_version = e->version;
+        }
+    }
+    __atomic_store_n(&e->last_used, time(NULL), __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&e->lock);
+    tl->entry = NULL;
+}
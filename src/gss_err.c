@@ -51,10 +51,54 @@ static const char *err_strs[] = {
     /* ERR_KEYLEN */       N_("Invalid key length"),
     /* ERR_NONTLMV1 */     N_("NTLM version 1 not allowed"),
     /* ERR_NOUSRFOUND */   N_("User not found"),
+    /* ERR_REPLAY */       N_("Authentication was already used"),
 };
 
 #define UNKNOWN_ERROR err_strs[0]
 
+/* same order as err_strs, never translated */
+static const char *err_names[] = {
+    NULL,
+    "ERR_DECODE",
+    "ERR_ENCODE",
+    "ERR_CRYPTO",
+    "ERR_NOARG",
+    "ERR_BADARG",
+    "ERR_NONAME",
+    "ERR_NOSRVNAME",
+    "ERR_NOUSRNAME",
+    "ERR_BADLMLVL",
+    "ERR_IMPOSSIBLE",
+    "ERR_BADCTX",
+    "ERR_WRONGCTX",
+    "ERR_WRONGMSG",
+    "ERR_REQNEGFLAG",
+    "ERR_FAILNEGFLAGS",
+    "ERR_BADNEGFLAGS",
+    "ERR_NOSRVCRED",
+    "ERR_NOUSRCRED",
+    "ERR_BADCRED",
+    "ERR_NOTOKEN",
+    "ERR_NOTSUPPORTED",
+    "ERR_NOTAVAIL",
+    "ERR_NAMETOOLONG",
+    "ERR_NOBINDINGS",
+    "ERR_TIMESKEW",
+    "ERR_EXPIRED",
+    "ERR_KEYLEN",
+    "ERR_NONTLMV1",
+    "ERR_NOUSRFOUND",
+    "ERR_REPLAY",
+};
+
+const char *gssntlm_err_name(uint32_t err)
+{
+    if (err > ERR_BASE && err < ERR_LAST) {
+        return err_names[err - ERR_BASE];
+    }
+    return NULL;
+}
+
 uint32_t gssntlm_display_status(uint32_t *minor_status,
                                 uint32_t status_value,
                                 int status_type,
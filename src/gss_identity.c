@@ -0,0 +1,377 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Process-wide cache of the names this host presents in NTLM messages.
+ *
+ * Resolving them may require reading the environment, a winbind round trip
+ * and several allocations, yet they change very rarely. Entries are kept
+ * for IDENTITY_CACHE_TTL seconds, and can be dropped at any time with the
+ * GSS_NTLMSSP_INVALIDATE_IDENTITY OID. The NETBIOS_* environment overrides
+ * are read when an entry is built, so changes to them are picked up at the
+ * next expiry or invalidation.
+ *
+ * Lookups only take the lock for reading, so concurrent accepts do not
+ * wait on each other; it is taken for writing when entries are replaced.
+ * Reference counts are atomic, releasing an identity needs no lock.
+ *
+ * Each identity also owns the pre-encoded CHALLENGE_MESSAGE templates built
+ * from its names, so they go away together with it. */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gss_ntlmssp.h"
+#include "unicode.h"
+
+#define IDENTITY_CACHE_TTL 300
+
+/* protects the list, the slots identities are bound to, and the cached
+ * host name */
+static pthread_rwlock_t identity_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct gssntlm_identity *identity_list;
+/* bumped by gssntlm_identity_invalidate() */
+static unsigned int identity_generation;
+
+static char *cached_hostname;
+static time_t hostname_expires;
+
+static bool identity_is_valid(struct gssntlm_identity *id,
+                              const char *computer_name, time_t now)
+{
+    return id->generation == __atomic_load_n(&identity_generation,
+                                             __ATOMIC_ACQUIRE) &&
+           now < id->expires &&
+           strcmp(id->computer_name, computer_name) == 0;
+}
+
+static void identity_free(struct gssntlm_identity *id)
+{
+    int i;
+
+    for (i = 0; i < GSSNTLM_CHAL_TEMPLATES; i++) {
+        if (id->chal_templates[i]) {
+            ntlm_free_buffer_data(&id->chal_templates[i]->message);
+            free(id->chal_templates[i]);
+        }
+    }
+    safefree(id->computer_name);
+    safefree(id->nb_computer_name);
+    safefree(id->nb_domain_name);
+    ntlm_free_buffer_data(&id->u16_computer_name);
+    ntlm_free_buffer_data(&id->u16_nb_computer_name);
+    ntlm_free_buffer_data(&id->u16_nb_domain_name);
+    free(id);
+}
+
+static void identity_unref(struct gssntlm_identity *id)
+{
+    if (__atomic_sub_fetch(&id->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        identity_free(id);
+    }
+}
+
+static void identity_addref(struct gssntlm_identity *id)
+{
+    __atomic_add_fetch(&id->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static int encode_u16(const char *str, struct ntlm_buffer *out)
+{
+    size_t len = strlen(str);
+    int ret;
+
+    out->data = malloc(len * 2 + 1);
+    if (!out->data) return ENOMEM;
+
+    ret = ntlm_utf8_to_utf16le((const uint8_t *)str, len,
+                               out->data, len * 2, &out->length);
+    if (ret) ntlm_free_buffer_data(out);
+    return ret;
+}
+
+static int identity_create(const char *computer_name,
+                           struct gssntlm_identity **identity)
+{
+    struct gssntlm_identity *id;
+    int ret;
+
+    id = calloc(1, sizeof(struct gssntlm_identity));
+    if (!id) return ENOMEM;
+
+    id->computer_name = strdup(computer_name);
+    if (!id->computer_name) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    ret = netbios_get_names(id->computer_name,
+                            &id->nb_computer_name, &id->nb_domain_name);
+    if (ret) goto done;
+
+    ret = encode_u16(id->computer_name, &id->u16_computer_name);
+    if (ret) goto done;
+    ret = encode_u16(id->nb_computer_name, &id->u16_nb_computer_name);
+    if (ret) goto done;
+    ret = encode_u16(id->nb_domain_name, &id->u16_nb_domain_name);
+    if (ret) goto done;
+
+    id->expires = time(NULL) + IDENTITY_CACHE_TTL;
+
+done:
+    if (ret) {
+        identity_free(id);
+    } else {
+        *identity = id;
+    }
+    return ret;
+}
+
+/* must be called with the lock held for writing, updates the bound slot if
+ * any */
+static struct gssntlm_identity *identity_hit(struct gssntlm_identity *id,
+                                             struct gssntlm_identity **bound)
+{
+    if (bound && *bound != id) {
+        if (*bound) identity_unref(*bound);
+        identity_addref(id);
+        *bound = id;
+    }
+    identity_addref(id);
+    return id;
+}
+
+int gssntlm_identity_get(const char *computer_name,
+                         struct gssntlm_identity **bound,
+                         struct gssntlm_identity **identity)
+{
+    struct gssntlm_identity *id = NULL;
+    struct gssntlm_identity **prev;
+    struct gssntlm_identity *cur;
+    unsigned int generation;
+    time_t now;
+    int ret;
+
+    if (!computer_name) return EINVAL;
+
+    now = time(NULL);
+
+    /* the common case: the slot already holds a current identity; the
+     * slot's reference keeps it alive while the read lock is held */
+    if (bound) {
+        pthread_rwlock_rdlock(&identity_lock);
+        id = *bound;
+        if (id && identity_is_valid(id, computer_name, now)) {
+            identity_addref(id);
+        } else {
+            id = NULL;
+        }
+        pthread_rwlock_unlock(&identity_lock);
+
+        if (id) {
+            *identity = id;
+            return 0;
+        }
+    }
+
+    pthread_rwlock_wrlock(&identity_lock);
+    for (cur = identity_list; cur; cur = cur->next) {
+        if (identity_is_valid(cur, computer_name, now)) {
+            id = identity_hit(cur, bound);
+            break;
+        }
+    }
+    generation = identity_generation;
+    pthread_rwlock_unlock(&identity_lock);
+
+    if (id) {
+        *identity = id;
+        return 0;
+    }
+
+    /* resolve without holding the lock, it may involve IPC */
+    ret = identity_create(computer_name, &id);
+    if (ret) return ret;
+
+    pthread_rwlock_wrlock(&identity_lock);
+    id->generation = generation;
+    /* drop stale entries, including older ones for this computer name */
+    prev = &identity_list;
+    while ((cur = *prev)) {
+        if (cur->generation != identity_generation || now >= cur->expires ||
+            strcmp(cur->computer_name, computer_name) == 0) {
+            *prev = cur->next;
+            identity_unref(cur);
+        } else {
+            prev = &cur->next;
+        }
+    }
+    /* one reference for the list, unless an invalidation raced us */
+    if (generation == identity_generation) {
+        id->refcount = 1;
+        id->next = identity_list;
+        identity_list = id;
+    }
+    *identity = identity_hit(id, bound);
+    pthread_rwlock_unlock(&identity_lock);
+
+    return 0;
+}
+
+static int chal_template_slot(uint32_t flags)
+{
+    int slot = 0;
+
+    if (flags & NTLMSSP_NEGOTIATE_UNICODE) slot |= 0x01;
+    if (flags & NTLMSSP_TARGET_TYPE_DOMAIN) slot |= 0x02;
+    if (flags & NTLMSSP_TARGET_TYPE_SERVER) slot |= 0x04;
+    if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) slot |= 0x08;
+    if (flags & NTLMSSP_NEGOTIATE_VERSION) slot |= 0x10;
+    return slot;
+}
+
+static int chal_template_create(struct gssntlm_identity *id, uint32_t flags,
+                                struct ntlm_chal_template **tmpl)
+{
+    struct ntlm_chal_template *t;
+    struct ntlm_buffer target_name;
+    int ret;
+
+    if (flags & NTLMSSP_TARGET_TYPE_DOMAIN) {
+        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
+            target_name = id->u16_nb_domain_name;
+        } else {
+            target_name.data = (uint8_t *)id->nb_domain_name;
+            target_name.length = strlen(id->nb_domain_name);
+        }
+    } else {
+        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
+            target_name = id->u16_nb_computer_name;
+        } else {
+            target_name.data = (uint8_t *)id->nb_computer_name;
+            target_name.length = strlen(id->nb_computer_name);
+        }
+    }
+
+    t = calloc(1, sizeof(struct ntlm_chal_template));
+    if (!t) return ENOMEM;
+
+    ret = ntlm_encode_chal_template(flags, &target_name,
+                                    &id->u16_nb_computer_name,
+                                    &id->u16_nb_domain_name,
+                                    &id->u16_computer_name, t);
+    if (ret) {
+        free(t);
+        return ret;
+    }
+
+    *tmpl = t;
+    return 0;
+}
+
+int gssntlm_identity_chal_msg(struct gssntlm_identity *identity,
+                              uint32_t flags,
+                              struct ntlm_buffer *challenge,
+                              uint64_t timestamp,
+                              struct gssntlm_arena **arena,
+                              struct ntlm_buffer *message)
+{
+    struct ntlm_chal_template *tmpl;
+    struct ntlm_chal_template *new_tmpl;
+    int slot;
+    int ret;
+
+    slot = chal_template_slot(flags);
+
+    tmpl = __atomic_load_n(&identity->chal_templates[slot], __ATOMIC_ACQUIRE);
+    if (!tmpl) {
+        ret = chal_template_create(identity, flags, &new_tmpl);
+        if (ret) return ret;
+
+        if (__atomic_compare_exchange_n(&identity->chal_templates[slot],
+                                        &tmpl, new_tmpl, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            tmpl = new_tmpl;
+        } else {
+            /* somebody else got there first, tmpl now holds theirs */
+            ntlm_free_buffer_data(&new_tmpl->message);
+            free(new_tmpl);
+        }
+    }
+
+    /* templates are never modified once published, and the caller's
+     * reference keeps the identity alive */
+    message->data = gssntlm_arena_alloc(arena, tmpl->message.length);
+    if (!message->data) return ENOMEM;
+    message->length = tmpl->message.length;
+
+    return ntlm_chal_template_write(tmpl, flags, challenge,
+                                    timestamp, message);
+}
+
+struct gssntlm_identity *gssntlm_identity_ref(struct gssntlm_identity *id)
+{
+    if (!id) return NULL;
+
+    identity_addref(id);
+    return id;
+}
+
+void gssntlm_identity_release(struct gssntlm_identity **identity)
+{
+    if (!identity || !*identity) return;
+
+    identity_unref(*identity);
+    *identity = NULL;
+}
+
+void gssntlm_identity_invalidate(void)
+{
+    struct gssntlm_identity *cur;
+
+    pthread_rwlock_wrlock(&identity_lock);
+    __atomic_add_fetch(&identity_generation, 1, __ATOMIC_RELEASE);
+    while ((cur = identity_list)) {
+        identity_list = cur->next;
+        identity_unref(cur);
+    }
+    safefree(cached_hostname);
+    pthread_rwlock_unlock(&identity_lock);
+}
+
+int gssntlm_identity_hostname(char **hostname)
+{
+    char buf[HOST_NAME_MAX + 1];
+    char *name;
+    time_t now;
+
+    now = time(NULL);
+
+    pthread_rwlock_rdlock(&identity_lock);
+    if (cached_hostname && now < hostname_expires) {
+        name = strdup(cached_hostname);
+        pthread_rwlock_unlock(&identity_lock);
+        if (!name) return ENOMEM;
+        *hostname = name;
+        return 0;
+    }
+    pthread_rwlock_unlock(&identity_lock);
+
+    if (gethostname(buf, HOST_NAME_MAX) != 0) return errno;
+    buf[HOST_NAME_MAX] = '\0';
+
+    name = strdup(buf);
+    if (!name) return ENOMEM;
+
+    pthread_rwlock_wrlock(&identity_lock);
+    free(cached_hostname);
+    cached_hostname = strdup(buf);
+    hostname_expires = now + IDENTITY_CACHE_TTL;
+    pthread_rwlock_unlock(&identity_lock);
+
+    *hostname = name;
+    return 0;
+}
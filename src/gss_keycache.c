@@ -0,0 +1,283 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Process-wide cache of NTLMv2 response keys.
+ *
+ * NTOWFv2 upcases the user name, converts it to UTF-16LE together with the
+ * domain and runs HMAC-MD5 over the result. Services see the same principals
+ * over and over, so the derived keys are kept in a bounded LRU cache, split
+ * in independently locked shards to keep threads from contending.
+ *
+ * Entries are keyed by a tag: an HMAC-MD5, with a random per-process key, of
+ * the NT hash, user and domain. The NT hash is password equivalent, so no
+ * copy of it is kept, and tags are compared in constant time. Each entry
+ * holds the key derived with the domain and the one derived without it, and
+ * remembers which of the two last verified a response, so that the acceptor
+ * tries that one first. Key material is zeroed when entries are evicted or
+ * flushed. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gss_ntlmssp.h"
+
+#define KEYCACHE_SHARDS 16
+#define KEYCACHE_SHARD_ENTRIES 64
+#define KEYCACHE_TAG_SIZE 16
+
+struct keycache_entry {
+    struct keycache_entry *prev;
+    struct keycache_entry *next;
+    uint8_t tag[KEYCACHE_TAG_SIZE];
+    uint8_t keys[2][16];
+    uint8_t valid;          /* bit N set when keys[N] is filled in */
+    bool no_domain;         /* the variant that last verified */
+};
+
+struct keycache_shard {
+    pthread_mutex_t mutex;
+    struct keycache_entry *head;    /* most recently used */
+    struct keycache_entry *tail;
+    unsigned int count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+#define SHARD_INIT { .mutex = PTHREAD_MUTEX_INITIALIZER }
+#define SHARD_INIT4 SHARD_INIT, SHARD_INIT, SHARD_INIT, SHARD_INIT
+
+static struct keycache_shard keycache[KEYCACHE_SHARDS] = {
+    SHARD_INIT4, SHARD_INIT4, SHARD_INIT4, SHARD_INIT4
+};
+
+static pthread_once_t keycache_once = PTHREAD_ONCE_INIT;
+/* NULL if no random key could be made, then nothing is cached */
+static struct ntlm_hmac_handle *keycache_tag_key;
+
+static void keycache_init(void)
+{
+    uint8_t secret[16];
+    struct ntlm_buffer key = { secret, sizeof(secret) };
+
+    if (RAND_BUFFER(&key) == 0) {
+        (void)HMAC_MD5_INIT(&key, &keycache_tag_key);
+    }
+    safezero(secret, sizeof(secret));
+}
+
+static int keycache_tag(struct ntlm_key *nt_hash,
+                        const char *user, const char *domain,
+                        uint8_t tag[KEYCACHE_TAG_SIZE])
+{
+    /* include the terminators so that "ab"+"c" differs from "a"+"bc" */
+    struct ntlm_buffer hash = { nt_hash->data, 16 };
+    struct ntlm_buffer ubuf = { (uint8_t *)discard_const(user),
+                                strlen(user) + 1 };
+    struct ntlm_buffer dbuf = { (uint8_t *)discard_const(domain),
+                                domain ? strlen(domain) + 1 : 0 };
+    struct ntlm_buffer *bufs[] = { &hash, &ubuf, &dbuf };
+    struct ntlm_iov iov = { bufs, domain ? 3 : 2 };
+    struct ntlm_buffer result = { tag, KEYCACHE_TAG_SIZE };
+
+    pthread_once(&keycache_once, keycache_init);
+    if (!keycache_tag_key) return ENOMEM;
+
+    return HMAC_MD5_KEYED_IOV(keycache_tag_key, &iov, &result);
+}
+
+static struct keycache_shard *keycache_shard(const uint8_t *tag)
+{
+    /* the tag is a keyed digest, any byte spreads entries evenly */
+    return &keycache[tag[0] % KEYCACHE_SHARDS];
+}
+
+static bool entry_matches(struct keycache_entry *e, const uint8_t *tag)
+{
+    uint8_t diff = 0;
+    int i;
+
+    for (i = 0; i < KEYCACHE_TAG_SIZE; i++) {
+        diff |= e->tag[i] ^ tag[i];
+    }
+    return diff == 0;
+}
+
+static void entry_free(struct keycache_entry *e)
+{
+    safezero((uint8_t *)e->keys, sizeof(e->keys));
+    free(e);
+}
+
+/* must be called with the shard lock held */
+static void shard_unlink(struct keycache_shard *s, struct keycache_entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else s->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else s->tail = e->prev;
+    e->prev = e->next = NULL;
+    s->count--;
+}
+
+/* must be called with the shard lock held */
+static void shard_push(struct keycache_shard *s, struct keycache_entry *e)
+{
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head) s->head->prev = e;
+    s->head = e;
+    if (!s->tail) s->tail = e;
+    s->count++;
+}
+
+/* must be called with the shard lock held, moves the entry to the front */
+static struct keycache_entry *shard_find(struct keycache_shard *s,
+                                         const uint8_t *tag)
+{
+    struct keycache_entry *e;
+
+    for (e = s->head; e; e = e->next) {
+        if (entry_matches(e, tag)) {
+            if (e != s->head) {
+                shard_unlink(s, e);
+                shard_push(s, e);
+            }
+            return e;
+        }
+    }
+    return NULL;
+}
+
+int gssntlm_keycache_ntowfv2(struct ntlm_ctx *ctx, struct ntlm_key *nt_hash,
+                             const char *user, const char *domain,
+                             bool no_domain, struct ntlm_key *result)
+{
+    struct keycache_entry *new_entry = NULL;
+    struct keycache_entry *e;
+    struct keycache_shard *s;
+    uint8_t tag[KEYCACHE_TAG_SIZE];
+    uint8_t bit = no_domain ? 0x02 : 0x01;
+    int ret;
+
+    /* only the canonical 16 byte hash and key sizes are cached */
+    if (!user || nt_hash->length != 16 || result->length != 16 ||
+        keycache_tag(nt_hash, user, domain, tag) != 0) {
+        return NTOWFv2(ctx, nt_hash, user, no_domain ? NULL : domain, result);
+    }
+    s = keycache_shard(tag);
+
+    pthread_mutex_lock(&s->mutex);
+    e = shard_find(s, tag);
+    if (e && (e->valid & bit)) {
+        memcpy(result->data, e->keys[no_domain], 16);
+        s->hits++;
+        pthread_mutex_unlock(&s->mutex);
+        return 0;
+    }
+    s->misses++;
+    pthread_mutex_unlock(&s->mutex);
+
+    ret = NTOWFv2(ctx, nt_hash, user, no_domain ? NULL : domain, result);
+    if (ret) return ret;
+
+    /* failing to cache is not an error, the key has been computed */
+    new_entry = calloc(1, sizeof(struct keycache_entry));
+    if (!new_entry) return 0;
+    memcpy(new_entry->tag, tag, KEYCACHE_TAG_SIZE);
+
+    pthread_mutex_lock(&s->mutex);
+    e = shard_find(s, tag);
+    if (!e) {
+        if (s->count >= KEYCACHE_SHARD_ENTRIES) {
+            e = s->tail;
+            shard_unlink(s, e);
+            entry_free(e);
+            s->evictions++;
+        }
+        e = new_entry;
+        e->no_domain = no_domain;
+        shard_push(s, e);
+        new_entry = NULL;
+    }
+    memcpy(e->keys[no_domain], result->data, 16);
+    e->valid |= bit;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (new_entry) entry_free(new_entry);
+    return 0;
+}
+
+bool gssntlm_keycache_no_domain(struct ntlm_key *nt_hash,
+                                const char *user, const char *domain)
+{
+    struct keycache_entry *e;
+    struct keycache_shard *s;
+    uint8_t tag[KEYCACHE_TAG_SIZE];
+    bool no_domain = false;
+
+    if (!user || nt_hash->length != 16) return false;
+    if (keycache_tag(nt_hash, user, domain, tag) != 0) return false;
+    s = keycache_shard(tag);
+
+    pthread_mutex_lock(&s->mutex);
+    e = shard_find(s, tag);
+    if (e) no_domain = e->no_domain;
+    pthread_mutex_unlock(&s->mutex);
+
+    return no_domain;
+}
+
+void gssntlm_keycache_verified(struct ntlm_key *nt_hash,
+                               const char *user, const char *domain,
+                               bool no_domain)
+{
+    struct keycache_entry *e;
+    struct keycache_shard *s;
+    uint8_t tag[KEYCACHE_TAG_SIZE];
+
+    if (!user || nt_hash->length != 16) return;
+    if (keycache_tag(nt_hash, user, domain, tag) != 0) return;
+    s = keycache_shard(tag);
+
+    pthread_mutex_lock(&s->mutex);
+    e = shard_find(s, tag);
+    if (e) e->no_domain = no_domain;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void gssntlm_keycache_stats(struct gssntlm_keycache_stats *stats)
+{
+    struct keycache_shard *s;
+    int i;
+
+    memset(stats, 0, sizeof(struct gssntlm_keycache_stats));
+
+    for (i = 0; i < KEYCACHE_SHARDS; i++) {
+        s = &keycache[i];
+        pthread_mutex_lock(&s->mutex);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->entries += s->count;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+void gssntlm_keycache_flush(void)
+{
+    struct keycache_entry *e;
+    struct keycache_shard *s;
+    int i;
+
+    for (i = 0; i < KEYCACHE_SHARDS; i++) {
+        s = &keycache[i];
+        pthread_mutex_lock(&s->mutex);
+        while ((e = s->head)) {
+            shard_unlink(s, e);
+            entry_free(e);
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
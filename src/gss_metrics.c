@@ -0,0 +1,528 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Process-wide metrics.
+ *
+ * Each thread records into its own block, registered in a global list the
+ * first time the thread records anything. A block is only ever written by
+ * its owner, with plain relaxed atomic loads and stores (no locked
+ * read-modify-write), so recording neither takes a lock nor bounces cache
+ * lines between CPUs. Snapshots walk the list under the registration mutex
+ * and add up all blocks. When a thread exits its block is folded into the
+ * totals of exited threads.
+ *
+ * Latencies go to log-linear histograms: every power of two is split in
+ * HIST_SUB buckets, so a bucket is at most 25% wide at any magnitude.
+ * Reading the clock twice costs as much as a small wrap, so wrap/unwrap
+ * latency is only taken for one message in MESSAGE_SAMPLE per thread;
+ * the message counters are exact. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gss_ntlmssp.h"
+
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36    /* about 68 seconds in ns */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+/* exported bucket bounds, every other power of two nanoseconds between
+ * these: they end internal buckets, so cumulative counts are exact */
+#define HIST_EXPORT_MIN_BITS 8      /* 256ns */
+#define HIST_EXPORT_MAX_BITS 34     /* about 17 seconds */
+
+/* wrap/unwrap size classes, the last one is unbounded */
+static const size_t size_classes[] = { 64, 1024, 16384, 65536, SIZE_MAX };
+#define SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+
+#define MESSAGE_SAMPLE 16
+
+#define HANDSHAKE_LEGS 4
+#define HISTOGRAMS (HANDSHAKE_LEGS + 2 * SIZE_CLASSES)
+
+/* failure slots: 0 when there is no minor code, then one per ERR_* code,
+ * the last one for any other (errno) value */
+#define FAILURE_SLOTS (ERR_LAST - ERR_BASE + 1)
+
+struct metrics_hist {
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct metrics_block {
+    struct metrics_block *prev;
+    struct metrics_block *next;
+    uint64_t message_seq;       /* owner only, not part of the totals */
+    uint64_t counters[2][GSSNTLM_CNT_NUM];
+    uint64_t messages[2][SIZE_CLASSES];
+    uint64_t failures[2][FAILURE_SLOTS];
+    struct metrics_hist hists[HISTOGRAMS];
+};
+
+gss_OID_desc metrics_oid = {
+    GSS_NTLMSSP_METRICS_OID_LENGTH,
+    discard_const(GSS_NTLMSSP_METRICS_OID_STRING)
+};
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_block *metrics_live;
+static struct metrics_block metrics_exited;
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static bool metrics_key_ok;
+
+/* only the owning thread writes, readers may see a value one update old */
+#define METRIC_ADD(field, n) \
+    __atomic_store_n(&(field), \
+                     __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), \
+                     __ATOMIC_RELAXED)
+#define METRIC_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void metrics_fold(struct metrics_block *dst, struct metrics_block *src)
+{
+    uint64_t *d = &dst->counters[0][0];
+    uint64_t *s = &src->counters[0][0];
+    size_t n;
+    size_t i;
+
+    /* everything after the list pointers is an array of uint64_t */
+    n = (sizeof(struct metrics_block) -
+         offsetof(struct metrics_block, counters)) / sizeof(uint64_t);
+    for (i = 0; i < n; i++) {
+        d[i] += METRIC_READ(s[i]);
+    }
+}
+
+static void metrics_block_free(void *ptr)
+{
+    struct metrics_block *b = ptr;
+
+    pthread_mutex_lock(&metrics_mutex);
+    metrics_fold(&metrics_exited, b);
+    if (b->prev) b->prev->next = b->next;
+    else metrics_live = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    free(b);
+}
+
+static void metrics_init(void)
+{
+    metrics_key_ok = (pthread_key_create(&metrics_key,
+                                         metrics_block_free) == 0);
+}
+
+/* A module unloaded by dlclose() must not leave metrics_block_free() as
+ * the key destructor of threads that keep running. Their blocks stay
+ * linked in metrics_live, which nothing reads any more, and are leaked. */
+static void __attribute__((destructor)) metrics_unload(void)
+{
+    struct metrics_block *b;
+
+    if (!metrics_key_ok) return;
+    metrics_key_ok = false;
+
+    b = pthread_getspecific(metrics_key);
+    pthread_setspecific(metrics_key, NULL);
+    if (b) metrics_block_free(b);
+    pthread_key_delete(metrics_key);
+}
+
+static struct metrics_block *metrics_block(void)
+{
+    struct metrics_block *b;
+
+    pthread_once(&metrics_once, metrics_init);
+    if (!metrics_key_ok) return NULL;
+
+    b = pthread_getspecific(metrics_key);
+    if (b) return b;
+
+    b = calloc(1, sizeof(struct metrics_block));
+    if (!b) return NULL;
+    if (pthread_setspecific(metrics_key, b) != 0) {
+        free(b);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&metrics_mutex);
+    b->next = metrics_live;
+    if (metrics_live) metrics_live->prev = b;
+    metrics_live = b;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return b;
+}
+
+static unsigned int hist_bucket(uint64_t v)
+{
+    unsigned int msb;
+
+    if (v < HIST_SUB) return v;
+    if (v >= (UINT64_C(1) << HIST_MAX_BITS)) return HIST_BUCKETS - 1;
+
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the largest value that lands in the bucket */
+static uint64_t hist_bucket_max(unsigned int idx)
+{
+    unsigned int shift;
+
+    if (idx < HIST_SUB) return idx;
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1)) + 1) << shift) - 1;
+}
+
+static void hist_record(struct metrics_hist *h, uint64_t elapsed)
+{
+    METRIC_ADD(h->sum, elapsed);
+    METRIC_ADD(h->buckets[hist_bucket(elapsed)], 1);
+}
+
+uint64_t gssntlm_metrics_start(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void gssntlm_metrics_leg(bool server, bool first, uint32_t retmaj,
+                         uint32_t retmin, uint64_t start)
+{
+    uint64_t elapsed = gssntlm_metrics_start() - start;
+    struct metrics_block *b;
+    unsigned int slot;
+
+    b = metrics_block();
+    if (!b) return;
+
+    if (first) {
+        METRIC_ADD(b->counters[server][GSSNTLM_CNT_STARTED], 1);
+    }
+
+    if (retmaj != GSS_S_COMPLETE && retmaj != GSS_S_CONTINUE_NEEDED) {
+        if (retmin == 0) {
+            slot = 0;
+        } else if (retmin > ERR_BASE && retmin < ERR_LAST) {
+            slot = retmin - ERR_BASE;
+        } else {
+            slot = FAILURE_SLOTS - 1;
+        }
+        METRIC_ADD(b->failures[server][slot], 1);
+        return;
+    }
+
+    hist_record(&b->hists[server * 2 + (first ? 0 : 1)], elapsed);
+}
+
+void gssntlm_metrics_established(bool server, uint32_t events)
+{
+    struct metrics_block *b;
+    unsigned int i;
+
+    b = metrics_block();
+    if (!b) return;
+
+    METRIC_ADD(b->counters[server][GSSNTLM_CNT_COMPLETED], 1);
+    for (i = 0; i < GSSNTLM_CNT_NUM; i++) {
+        if (events & GSSNTLM_EVENT(i)) {
+            METRIC_ADD(b->counters[server][i], 1);
+        }
+    }
+}
+
+uint64_t gssntlm_metrics_message_start(void)
+{
+    struct metrics_block *b;
+
+    b = metrics_block();
+    if (!b) return 0;
+
+    if (b->message_seq++ % MESSAGE_SAMPLE != 0) return 0;
+    return gssntlm_metrics_start();
+}
+
+void gssntlm_metrics_message(bool unwrap, size_t size, uint64_t start)
+{
+    uint64_t elapsed = 0;
+    struct metrics_block *b;
+    unsigned int c;
+
+    if (start) elapsed = gssntlm_metrics_start() - start;
+
+    b = metrics_block();
+    if (!b) return;
+
+    for (c = 0; size > size_classes[c]; c++) /* the last one matches */ ;
+    METRIC_ADD(b->messages[unwrap][c], 1);
+    if (start) {
+        hist_record(&b->hists[HANDSHAKE_LEGS + unwrap * SIZE_CLASSES + c],
+                    elapsed);
+    }
+}
+
+/* ==== snapshot ==== */
+
+struct metrics_text {
+    char *data;
+    size_t len;
+    size_t size;
+    int err;
+};
+
+static void text_printf(struct metrics_text *t, const char *fmt, ...)
+{
+    va_list ap;
+    size_t size;
+    char *data;
+    int n;
+
+    if (t->err) return;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(t->data + t->len, t->size - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            t->err = EINVAL;
+            return;
+        }
+        if ((size_t)n < t->size - t->len) break;
+
+        size = t->size ? t->size * 2 : 4096;
+        while (size - t->len <= (size_t)n) size *= 2;
+        data = realloc(t->data, size);
+        if (!data) {
+            t->err = ENOMEM;
+            return;
+        }
+        t->data = data;
+        t->size = size;
+    }
+    t->len += n;
+}
+
+static const char *role_names[] = { "client", "server" };
+
+static const char *leg_names[HANDSHAKE_LEGS] = {
+    "client_negotiate", "client_authenticate",
+    "server_challenge", "server_authenticate"
+};
+
+static const struct {
+    const char *name;
+    const char *labels;     /* added after the role */
+    enum gssntlm_counter counter;
+} counter_lines[] = {
+    { "handshakes_started_total", "", GSSNTLM_CNT_STARTED },
+    { "handshakes_completed_total", "", GSSNTLM_CNT_COMPLETED },
+    { "logons_total", ",type=\"ntlmv1\"", GSSNTLM_CNT_NTLMV1 },
+    { "logons_total", ",type=\"ntlmv2\"", GSSNTLM_CNT_NTLMV2 },
+    { "logons_total", ",type=\"anonymous\"", GSSNTLM_CNT_ANONYMOUS },
+    { "mic_total", "", GSSNTLM_CNT_MIC },
+    { "channel_bindings_total", "", GSSNTLM_CNT_CBT },
+    { "auth_total", ",source=\"local\"", GSSNTLM_CNT_LOCAL },
+    { "auth_total", ",source=\"external\"", GSSNTLM_CNT_EXTERNAL },
+};
+
+static void text_hist(struct metrics_text *t, const char *metric,
+                      const char *labels, struct metrics_hist *h)
+{
+    uint64_t count = 0;
+    uint64_t bound;
+    unsigned int bits;
+    unsigned int i = 0;
+
+    /* always the same set of buckets, so that every scrape has the same
+     * series; counts are cumulative */
+    for (bits = HIST_EXPORT_MIN_BITS; bits <= HIST_EXPORT_MAX_BITS;
+         bits += 2) {
+        bound = (UINT64_C(1) << bits) - 1;
+        for (; i < HIST_BUCKETS && hist_bucket_max(i) <= bound; i++) {
+            count += h->buckets[i];
+        }
+        text_printf(t, "gssntlmssp_%s_bucket{%s,le=\"%.9f\"} %" PRIu64 "\n",
+                    metric, labels, bound / 1e9, count);
+    }
+    for (; i < HIST_BUCKETS; i++) {
+        count += h->buckets[i];
+    }
+    text_printf(t, "gssntlmssp_%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n",
+                metric, labels, count);
+    text_printf(t, "gssntlmssp_%s_sum{%s} %.9f\n",
+                metric, labels, h->sum / 1e9);
+    text_printf(t, "gssntlmssp_%s_count{%s} %" PRIu64 "\n",
+                metric, labels, count);
+}
+
+static void message_labels(char *labels, size_t size, int unwrap, size_t c)
+{
+    const char *op = unwrap ? "unwrap" : "wrap";
+
+    if (size_classes[c] == SIZE_MAX) {
+        snprintf(labels, size, "op=\"%s\",size_le=\"+Inf\"", op);
+    } else {
+        snprintf(labels, size, "op=\"%s\",size_le=\"%zu\"",
+                 op, size_classes[c]);
+    }
+}
+
+static void metrics_text(struct metrics_text *t, struct metrics_block *m)
+{
+    struct gssntlm_keycache_stats kc;
+    struct gssntlm_replay_stats rs;
+    const char *prev = NULL;
+    const char *reason;
+    char labels[64];
+    size_t i;
+    int r;
+
+    for (i = 0; i < sizeof(counter_lines) / sizeof(counter_lines[0]); i++) {
+        if (!prev || strcmp(prev, counter_lines[i].name) != 0) {
+            prev = counter_lines[i].name;
+            text_printf(t, "# TYPE gssntlmssp_%s counter\n", prev);
+        }
+        for (r = 0; r < 2; r++) {
+            text_printf(t, "gssntlmssp_%s{role=\"%s\"%s} %" PRIu64 "\n",
+                        counter_lines[i].name, role_names[r],
+                        counter_lines[i].labels,
+                        m->counters[r][counter_lines[i].counter]);
+        }
+    }
+
+    text_printf(t, "# TYPE gssntlmssp_handshake_failures_total counter\n");
+    for (r = 0; r < 2; r++) {
+        for (i = 0; i < FAILURE_SLOTS; i++) {
+            if (m->failures[r][i] == 0) continue;
+            if (i == 0) {
+                reason = "none";
+            } else if (i == FAILURE_SLOTS - 1) {
+                reason = "system";
+            } else {
+                reason = gssntlm_err_name(ERR_BASE + i);
+            }
+            text_printf(t, "gssntlmssp_handshake_failures_total"
+                           "{role=\"%s\",reason=\"%s\"} %" PRIu64 "\n",
+                        role_names[r], reason, m->failures[r][i]);
+        }
+    }
+
+    gssntlm_keycache_stats(&kc);
+    text_printf(t, "# TYPE gssntlmssp_keycache_hits_total counter\n"
+                   "gssntlmssp_keycache_hits_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_keycache_misses_total counter\n"
+                   "gssntlmssp_keycache_misses_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_keycache_evictions_total counter\n"
+                   "gssntlmssp_keycache_evictions_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_keycache_entries gauge\n"
+                   "gssntlmssp_keycache_entries %" PRIu64 "\n",
+                kc.hits, kc.misses, kc.evictions, kc.entries);
+
+    /* all zero unless an acceptor credential enabled the cache */
+    gssntlm_replay_stats(&rs);
+    text_printf(t, "# TYPE gssntlmssp_replay_cache_inserts_total counter\n"
+                   "gssntlmssp_replay_cache_inserts_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_replay_cache_replays_total counter\n"
+                   "gssntlmssp_replay_cache_replays_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_replay_cache_evictions_total counter\n"
+                   "gssntlmssp_replay_cache_evictions_total %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_replay_cache_entries gauge\n"
+                   "gssntlmssp_replay_cache_entries %" PRIu64 "\n"
+                   "# TYPE gssntlmssp_replay_cache_capacity gauge\n"
+                   "gssntlmssp_replay_cache_capacity %" PRIu64 "\n",
+                rs.inserts, rs.replays, rs.evictions, rs.entries,
+                rs.capacity);
+
+    text_printf(t, "# TYPE gssntlmssp_handshake_leg_seconds histogram\n");
+    for (i = 0; i < HANDSHAKE_LEGS; i++) {
+        snprintf(labels, sizeof(labels), "leg=\"%s\"", leg_names[i]);
+        text_hist(t, "handshake_leg_seconds", labels, &m->hists[i]);
+    }
+
+    text_printf(t, "# TYPE gssntlmssp_messages_total counter\n");
+    for (r = 0; r < 2; r++) {
+        for (i = 0; i < SIZE_CLASSES; i++) {
+            message_labels(labels, sizeof(labels), r, i);
+            text_printf(t, "gssntlmssp_messages_total{%s} %" PRIu64 "\n",
+                        labels, m->messages[r][i]);
+        }
+    }
+
+    /* sampled, see MESSAGE_SAMPLE */
+    text_printf(t, "# TYPE gssntlmssp_message_seconds histogram\n");
+    for (r = 0; r < 2; r++) {
+        for (i = 0; i < SIZE_CLASSES; i++) {
+            message_labels(labels, sizeof(labels), r, i);
+            text_hist(t, "message_seconds", labels,
+                      &m->hists[HANDSHAKE_LEGS + r * SIZE_CLASSES + i]);
+        }
+    }
+}
+
+uint32_t gssntlm_metrics_snapshot(uint32_t *minor_status,
+                                  gss_buffer_t snapshot)
+{
+    struct metrics_text t = { 0 };
+    struct metrics_block *m;
+    struct metrics_block *b;
+    uint32_t retmin;
+    uint32_t retmaj;
+
+    if (snapshot == GSS_C_NO_BUFFER) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_WRITE);
+    }
+
+    m = calloc(1, sizeof(struct metrics_block));
+    if (!m) return GSSERRS(ENOMEM, GSS_S_FAILURE);
+
+    pthread_mutex_lock(&metrics_mutex);
+    metrics_fold(m, &metrics_exited);
+    for (b = metrics_live; b; b = b->next) {
+        metrics_fold(m, b);
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+
+    metrics_text(&t, m);
+    free(m);
+    if (t.err) {
+        free(t.data);
+        return GSSERRS(t.err, GSS_S_FAILURE);
+    }
+
+    snapshot->value = t.data;
+    snapshot->length = t.len;
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
+uint32_t gssntlm_metrics_inquire(uint32_t *minor_status,
+                                 gss_buffer_set_t *data_set)
+{
+    gss_buffer_desc snapshot = GSS_C_EMPTY_BUFFER;
+    uint32_t retmin;
+    uint32_t retmaj;
+    uint32_t tmpmin;
+
+    retmaj = gssntlm_metrics_snapshot(&retmin, &snapshot);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(retmin, retmaj);
+    }
+
+    retmaj = gss_add_buffer_set_member(&retmin, &snapshot, data_set);
+    if (retmaj != GSS_S_COMPLETE) {
+        (void)gss_release_buffer_set(&tmpmin, data_set);
+    }
+    free(snapshot.value);
+    return GSSERRS(retmin, retmaj);
+}
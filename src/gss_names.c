@@ -4,7 +4,6 @@
 
 #include <ctype.h>
 #include <errno.h>
-#include <limits.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -261,7 +260,6 @@ uint32_t gssntlm_import_name_by_mech(uint32_t *minor_status,
                                      gss_OID input_name_type,
                                      gss_name_t *output_name)
 {
-    char hostname[HOST_NAME_MAX + 1] = { 0 };
     char struid[12] = { 0 };
     uid_t uid;
     struct gssntlm_name *name = NULL;
@@ -273,7 +271,7 @@ uint32_t gssntlm_import_name_by_mech(uint32_t *minor_status,
         return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
     }
 
-    name = calloc(1, sizeof(struct gssntlm_name));
+    name = gssntlm_obj_alloc(GSSNTLM_OBJ_NAME);
     if (!name) {
         set_GSSERR(ENOMEM);
         goto done;
@@ -300,16 +298,11 @@ uint32_t gssntlm_import_name_by_mech(uint32_t *minor_status,
 
         /* no seprator, assume only service is provided and try to source
          * the local host name */
-        retmin = gethostname(hostname, HOST_NAME_MAX);
+        retmin = gssntlm_identity_hostname(&name->data.server.name);
         if (retmin) {
             set_GSSERR(retmin);
             goto done;
         }
-        hostname[HOST_NAME_MAX] = '\0';
-        name->data.server.name = strdup(hostname);
-        if (!name->data.server.name) {
-            set_GSSERR(ENOMEM);
-        }
         set_GSSERRS(0, GSS_S_COMPLETE);
 
     } else if (gss_oid_equal(input_name_type, GSS_C_NT_USER_NAME)) {
@@ -442,12 +435,103 @@ void gssntlm_release_attrs(struct gssntlm_name_attribute **attrs)
 {
     for (size_t i = 0; *attrs && (*attrs)[i].attr_name != NULL; i++) {
         free((*attrs)[i].attr_name);
+        safezero((*attrs)[i].attr_value.value, (*attrs)[i].attr_value.length);
         free((*attrs)[i].attr_value.value);
     }
     safefree(*attrs);
 }
 
+/* Names are copied into every context and credential built from them, and
+ * the acceptor credential's name into every context it accepts. Rather
+ * than duplicating the strings each time, the first copy moves them to a
+ * store that all copies point to. The store is never modified, and is
+ * freed with its last reference. */
+struct gssntlm_name_store {
+    uint32_t refs;
+    /* the name as it was when it was first copied, owns the memory */
+    struct gssntlm_name owner;
+};
+
+static void zerofree_str(char **str)
+{
+    if (!*str) return;
+    safezero((uint8_t *)*str, strlen(*str));
+    safefree(*str);
+}
+
+static void name_free_data(struct gssntlm_name *name)
+{
+    switch (name->type) {
+    case GSSNTLM_NAME_NULL:
+    case GSSNTLM_NAME_ANON:
+        break;
+    case GSSNTLM_NAME_USER:
+        zerofree_str(&name->data.user.domain);
+        zerofree_str(&name->data.user.name);
+        break;
+    case GSSNTLM_NAME_SERVER:
+        zerofree_str(&name->data.server.name);
+        break;
+    }
+    gssntlm_release_attrs(&name->attrs);
+}
+
+/* returns the store of name, creating it if needed, may be called
+ * concurrently for the same name (e.g. a shared acceptor credential) */
+static struct gssntlm_name_store *name_get_store(struct gssntlm_name *name)
+{
+    struct gssntlm_name_store *store;
+    struct gssntlm_name_store *cur = NULL;
+
+    store = __atomic_load_n(&name->store, __ATOMIC_ACQUIRE);
+    if (store) return store;
+
+    store = malloc(sizeof(struct gssntlm_name_store));
+    if (!store) return NULL;
+    store->refs = 1;
+    store->owner.type = name->type;
+    store->owner.data = name->data;
+    store->owner.attrs = name->attrs;
+    store->owner.store = NULL;
+
+    if (!__atomic_compare_exchange_n(&name->store, &cur, store, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* someone else got there first, only the wrapper is ours */
+        free(store);
+        store = cur;
+    }
+    return store;
+}
+
+static void name_store_release(struct gssntlm_name_store *store)
+{
+    if (__atomic_sub_fetch(&store->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    name_free_data(&store->owner);
+    free(store);
+}
+
 int gssntlm_copy_name(struct gssntlm_name *src, struct gssntlm_name *dst)
+{
+    struct gssntlm_name_store *store;
+
+    if (src->type == GSSNTLM_NAME_NULL) {
+        memset(dst, 0, sizeof(struct gssntlm_name));
+        return 0;
+    }
+
+    store = name_get_store(src);
+    if (!store) return ENOMEM;
+    __atomic_add_fetch(&store->refs, 1, __ATOMIC_RELAXED);
+
+    dst->type = store->owner.type;
+    dst->data = store->owner.data;
+    dst->attrs = store->owner.attrs;
+    dst->store = store;
+    return 0;
+}
+
+static int name_deep_copy(struct gssntlm_name *src, struct gssntlm_name *dst)
 {
     char *dom = NULL, *usr = NULL, *srv = NULL;
     int ret;
@@ -489,6 +573,7 @@ int gssntlm_copy_name(struct gssntlm_name *src, struct gssntlm_name *dst)
     ret = gssntlm_copy_attrs(src->attrs, &dst->attrs);
     if (ret) goto done;
 
+    dst->store = NULL;
     ret = 0;
 done:
     if (ret) {
@@ -499,6 +584,21 @@ done:
     return ret;
 }
 
+int gssntlm_name_unshare(struct gssntlm_name *name)
+{
+    struct gssntlm_name copy;
+    int ret;
+
+    if (!name->store) return 0;
+
+    ret = name_deep_copy(name, &copy);
+    if (ret) return ret;
+
+    name_store_release(name->store);
+    *name = copy;
+    return 0;
+}
+
 uint32_t gssntlm_duplicate_name(uint32_t *minor_status,
                                 const gss_name_t input_name,
                                 gss_name_t *dest_name)
@@ -519,7 +619,7 @@ uint32_t gssntlm_duplicate_name(uint32_t *minor_status,
         return GSSERRS(0, GSS_S_COMPLETE);
     }
 
-    out = calloc(1, sizeof(struct gssntlm_name));
+    out = gssntlm_obj_alloc(GSSNTLM_OBJ_NAME);
     if (!out) {
         set_GSSERR(ENOMEM);
         goto done;
@@ -535,7 +635,8 @@ uint32_t gssntlm_duplicate_name(uint32_t *minor_status,
 
 done:
     if (retmaj) {
-        safefree(out);
+        gssntlm_obj_free(GSSNTLM_OBJ_NAME, out);
+        out = NULL;
     }
     *dest_name = (gss_name_t)out;
     return GSSERR();
@@ -544,21 +645,15 @@ done:
 void gssntlm_int_release_name(struct gssntlm_name *name)
 {
     if (!name) return;
+    if (name->type == GSSNTLM_NAME_NULL) return;
 
-    switch (name->type) {
-    case GSSNTLM_NAME_NULL:
+    if (name->store) {
+        name_store_release(name->store);
+        memset(name, 0, sizeof(struct gssntlm_name));
         return;
-    case GSSNTLM_NAME_ANON:
-        break;
-    case GSSNTLM_NAME_USER:
-        safefree(name->data.user.domain);
-        safefree(name->data.user.name);
-        break;
-    case GSSNTLM_NAME_SERVER:
-        safefree(name->data.server.name);
-        break;
     }
-    gssntlm_release_attrs(&name->attrs);
+
+    name_free_data(name);
     name->type = GSSNTLM_NAME_NULL;
 }
 
@@ -574,7 +669,8 @@ uint32_t gssntlm_release_name(uint32_t *minor_status,
 
     gssntlm_int_release_name((struct gssntlm_name *)*input_name);
 
-    safefree(*input_name);
+    gssntlm_obj_free(GSSNTLM_OBJ_NAME, *input_name);
+    *input_name = NULL;
     return GSSERRS(0, GSS_S_COMPLETE);
 }
 
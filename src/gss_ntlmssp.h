@@ -39,6 +39,7 @@
 #define NTLMSSP_CTX_FLAG_ESTABLISHED    0x01 /* context was established */
 #define NTLMSSP_CTX_FLAG_SPNEGO_CAN_MIC 0x02 /* SPNEGO asks for MIC */
 #define NTLMSSP_CTX_FLAG_AUTH_WITH_MIC  0x04 /* Auth MIC was created */
+#define NTLMSSP_CTX_FLAG_SHARED         0x08 /* in the shared ctx table */
 
 struct gssntlm_name_attribute {
     char *attr_name; /* NULL indicates array termination */
@@ -64,6 +65,10 @@ struct gssntlm_name {
     } data;
 
     struct gssntlm_name_attribute *attrs; /* Array of name attributes */
+
+    /* when set the strings and attrs above belong to it, and are shared
+     * read-only with the other copies of the name, see gss_names.c */
+    struct gssntlm_name_store *store;
 };
 
 struct gssntlm_cred {
@@ -87,15 +92,38 @@ struct gssntlm_cred {
         struct {
             struct gssntlm_name name;
             char *keyfile;
+            /* cached names this acceptor presents, see gss_identity.c */
+            struct gssntlm_identity *identity;
+            /* check accepted responses against the replay cache */
+            bool replay_check;
         } server;
         struct {
             struct gssntlm_name user;
             bool creds_in_cache;
         } external;
     } cred;
+
+    /* handles referring to this credential, see gssntlm_cred_ref() */
+    uint32_t refs;
 };
 
 struct gssntlm_ctx {
+    /* Per-message state first: together with the handles and sequence
+     * numbers at the start of crypto_state.send and .recv it all sits in
+     * the first 128 bytes, the keys after them are only used at setup. */
+
+    /* negotiated flags */
+    uint32_t neg_flags;
+
+    /* requested gss fags */
+    uint32_t gss_flags;
+
+    uint32_t int_flags;
+    time_t expiration_time;
+
+    struct ntlm_signseal_state crypto_state;
+
+    /* Handshake and inquiry state */
     enum gssntlm_role {
         GSSNTLM_CLIENT,
         GSSNTLM_SERVER,
@@ -113,6 +141,10 @@ struct gssntlm_ctx {
 
     uint8_t sec_req;
 
+    /* owns workstation and the nego/chal/auth message buffers, all released
+     * once the context is established */
+    struct gssntlm_arena *arena;
+
     char *workstation;
 
     struct ntlm_ctx *ntlm;
@@ -122,22 +154,78 @@ struct gssntlm_ctx {
 
     struct gssntlm_name source_name;
     struct gssntlm_name target_name;
+    /* the names of a context imported in the compact format, still encoded
+     * (held by the arena), see gssntlm_ctx_unpack_names() */
+    struct ntlm_buffer packed_names;
 
     uint8_t server_chal[8];
 
-    /* requested gss fags */
-    uint32_t gss_flags;
-
-    /* negotiated flags */
-    uint32_t neg_flags;
-
     struct ntlm_key exported_session_key;
-    struct ntlm_signseal_state crypto_state;
 
-    uint32_t int_flags;
-    time_t expiration_time;
+    /* the entry of a context in the shared table (NTLMSSP_CTX_FLAG_SHARED),
+     * and the version of the entry crypto_state was last synced with */
+    uint64_t table_id;
+    uint64_t table_version;
 };
 
+enum gssntlm_obj_type {
+    GSSNTLM_OBJ_CTX,
+    GSSNTLM_OBJ_CRED,
+    GSSNTLM_OBJ_NAME,
+    GSSNTLM_OBJ_TYPES
+};
+
+/**
+ * @brief   Allocates a zeroed context, credential or name structure
+ *
+ * Recently freed objects are reused from a small per-thread cache.
+ *
+ * @param type      The kind of object
+ *
+ * @return The object or NULL if out of memory
+ */
+void *gssntlm_obj_alloc(enum gssntlm_obj_type type);
+
+/**
+ * @brief   Zeroes an object from gssntlm_obj_alloc() and releases it
+ */
+void gssntlm_obj_free(enum gssntlm_obj_type type, void *obj);
+
+/**
+ * @brief   Allocates memory that lives until gssntlm_arena_free()
+ *
+ * @param arena     The arena, a NULL pointer is an empty arena
+ * @param size      The number of bytes needed
+ *
+ * @return The memory (not zeroed) or NULL if out of memory
+ */
+void *gssntlm_arena_alloc(struct gssntlm_arena **arena, size_t size);
+char *gssntlm_arena_strdup(struct gssntlm_arena **arena, const char *str);
+
+/**
+ * @brief   Copies data into an arena allocated buffer
+ *
+ * @return 0 on success or ENOMEM
+ */
+int gssntlm_arena_copy(struct gssntlm_arena **arena,
+                       const void *data, size_t length,
+                       struct ntlm_buffer *buf);
+
+/**
+ * @brief   Hands a malloc()ed buffer over to the arena
+ *
+ * The buffer is zeroed and freed together with the arena. On failure it is
+ * released immediately and cleared.
+ *
+ * @return 0 on success or ENOMEM
+ */
+int gssntlm_arena_adopt(struct gssntlm_arena **arena, struct ntlm_buffer *buf);
+
+/**
+ * @brief   Zeroes and frees all the memory and buffers held by the arena
+ */
+void gssntlm_arena_free(struct gssntlm_arena **arena);
+
 #define set_GSSERRS(min, maj) \
     (void)DEBUG_GSS_ERRORS((retmaj = (maj)), (retmin = (min)))
 #define set_GSSERR(min) set_GSSERRS((min), GSS_S_FAILURE)
@@ -186,8 +274,321 @@ struct gssntlm_name_attribute *gssntlm_find_attr(
                                         size_t attr_name_len);
 void gssntlm_release_attrs(struct gssntlm_name_attribute **attrs);
 
+/**
+ * @brief   Makes dst another reference to the name in src
+ *
+ * @param src       The name to copy, it is switched to shared storage
+ *                  the first time it is copied
+ * @param dst       The name to fill in, release it with
+ *                  gssntlm_int_release_name()
+ *
+ * @return 0 or ENOMEM
+ */
 int gssntlm_copy_name(struct gssntlm_name *src, struct gssntlm_name *dst);
-int gssntlm_copy_creds(struct gssntlm_cred *in, struct gssntlm_cred *out);
+
+/**
+ * @brief   Gives a name storage of its own, so it can be modified in place
+ *
+ * @return 0 or ENOMEM, the name is unchanged on error
+ */
+int gssntlm_name_unshare(struct gssntlm_name *name);
+
+/**
+ * @brief   Takes one more reference to a credential, the credential is
+ *          freed by the gssntlm_release_cred() of the last one
+ */
+struct gssntlm_cred *gssntlm_cred_ref(struct gssntlm_cred *cred);
+
+int gssntlm_hex_to_key(const char *hex, struct ntlm_key *key);
+
+/* One line of a user file, either DOMAIN:USER:PASSWORD (Heimdal) or
+ * [DOMAIN\]USER:UID:LM_HASH:NT_HASH:... (smbpasswd), or one record of a
+ * compiled user database, which carries binary keys (nt_key/lm_key) instead
+ * of passwords or hex strings. Fields that are not present are NULL. */
+struct gssntlm_user_entry {
+    const char *domain;
+    const char *user;
+    const char *password;
+    const char *lm_hash;
+    const char *nt_hash;
+    const uint8_t *lm_key;
+    const uint8_t *nt_key;
+    uint64_t hash;
+    size_t next;
+};
+
+/* Keeps the cached copy of a user file alive while an entry is in use */
+struct gssntlm_userfile_ref {
+    struct userfile_table *table;
+    struct gssntlm_user_entry entry;
+};
+
+int gssntlm_userfile_find(const char *filename,
+                          struct gssntlm_name *name,
+                          struct gssntlm_userfile_ref *ref);
+void gssntlm_userfile_release(struct gssntlm_userfile_ref *ref);
+
+/**
+ * @brief   Makes the next lookup in a user file stat() it again
+ *
+ * Lookups only check whether a user file changed on disk about once a
+ * second; callers that just rewrote the file use this to skip the wait.
+ *
+ * @param filename  The user file, as passed to gssntlm_userfile_find()
+ */
+void gssntlm_userfile_recheck(const char *filename);
+
+/**
+ * @brief   Compiles a text user file into the binary user database format
+ *
+ * @param input     A user file in Heimdal or smbpasswd format
+ * @param output    The database file to create or atomically replace
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_userfile_compile(const char *input, const char *output);
+
+/* The names a host presents in NTLM messages, resolved by
+ * netbios_get_names() and cached process-wide by gss_identity.c.
+ * Entries are immutable and refcounted, the UTF-16LE forms are ready to be
+ * copied into messages. */
+/* one slot for each combination of the flags that affect the layout of a
+ * CHALLENGE_MESSAGE, see ntlm_chal_template_layout() */
+#define GSSNTLM_CHAL_TEMPLATES 32
+
+struct gssntlm_identity {
+    char *computer_name;
+    char *nb_computer_name;
+    char *nb_domain_name;
+    struct ntlm_buffer u16_computer_name;
+    struct ntlm_buffer u16_nb_computer_name;
+    struct ntlm_buffer u16_nb_domain_name;
+
+    /* CHALLENGE_MESSAGE templates, one per message layout, built on first
+     * use and immutable afterwards */
+    struct ntlm_chal_template *chal_templates[GSSNTLM_CHAL_TEMPLATES];
+
+    /* cache bookkeeping, set before the identity is published */
+    time_t expires;
+    unsigned int generation;
+    /* atomic */
+    int refcount;
+    /* protected by the cache lock */
+    struct gssntlm_identity *next;
+};
+
+/**
+ * @brief   Returns the cached identity for a computer name
+ *
+ * Names are resolved again when the cached entry is older than the cache
+ * TTL or after gssntlm_identity_invalidate(). The NETBIOS_* environment
+ * overrides are only read when names are resolved.
+ *
+ * @param computer_name     The (DNS) host name of the local machine
+ * @param bound             Optional slot (eg. in an acceptor credential)
+ *                          that keeps a reference to the last identity
+ *                          used, checked before the shared cache
+ * @param identity          A new reference, release it with
+ *                          gssntlm_identity_release()
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_identity_get(const char *computer_name,
+                         struct gssntlm_identity **bound,
+                         struct gssntlm_identity **identity);
+void gssntlm_identity_release(struct gssntlm_identity **identity);
+struct gssntlm_identity *gssntlm_identity_ref(struct gssntlm_identity *id);
+
+/**
+ * @brief   Drops all cached identities and the cached host name
+ */
+void gssntlm_identity_invalidate(void);
+
+/**
+ * @brief   Builds a CHALLENGE_MESSAGE for this identity
+ *
+ * The message is produced from a pre-encoded template, so that only the
+ * flags, challenge and timestamp are written for each handshake. The target
+ * name is the NetBIOS domain or computer name, as selected by the
+ * NTLMSSP_TARGET_TYPE_* flag.
+ *
+ * @param identity      The identity
+ * @param flags         The challenge flags
+ * @param challenge     The 8 bytes server challenge
+ * @param timestamp     The FILETIME timestamp to put in target_info
+ * @param arena         The arena the message is allocated from
+ * @param message       The returned message
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_identity_chal_msg(struct gssntlm_identity *identity,
+                              uint32_t flags,
+                              struct ntlm_buffer *challenge,
+                              uint64_t timestamp,
+                              struct gssntlm_arena **arena,
+                              struct ntlm_buffer *message);
+
+/**
+ * @brief   Returns a copy of the local host name, cached like identities
+ *
+ * @param hostname      The returned host name, to be freed by the caller
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_identity_hostname(char **hostname);
+
+struct gssntlm_keycache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+};
+
+/**
+ * @brief   NTOWFv2() backed by the process-wide key cache in gss_keycache.c
+ *
+ * @param ctx           An ntlm context
+ * @param nt_hash       The NT Hash of the user password
+ * @param user          The user name
+ * @param domain        The user's domain, part of the cache key even when
+ *                      no_domain is set
+ * @param no_domain     Derive the key as if the domain was NULL
+ * @param result        The resulting key (a preallocated 16 bytes buffer)
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_keycache_ntowfv2(struct ntlm_ctx *ctx, struct ntlm_key *nt_hash,
+                             const char *user, const char *domain,
+                             bool no_domain, struct ntlm_key *result);
+
+/**
+ * @brief   Returns the variant that last verified a response for this
+ *          principal, true if that was the key derived without the domain
+ */
+bool gssntlm_keycache_no_domain(struct ntlm_key *nt_hash,
+                                const char *user, const char *domain);
+
+/**
+ * @brief   Records the variant that verified a response for this principal
+ */
+void gssntlm_keycache_verified(struct ntlm_key *nt_hash,
+                               const char *user, const char *domain,
+                               bool no_domain);
+
+void gssntlm_keycache_stats(struct gssntlm_keycache_stats *stats);
+
+/**
+ * @brief   Drops and zeroes all cached keys
+ */
+void gssntlm_keycache_flush(void);
+
+/* Replay cache of accepted authentications, see gss_replay.c */
+struct gssntlm_replay_stats {
+    uint64_t capacity;
+    uint64_t entries;
+    uint64_t inserts;
+    uint64_t replays;
+    uint64_t evictions;
+};
+
+/**
+ * @brief   Creates the process-wide replay cache, if it does not exist yet
+ *
+ * @param entries       How many responses to remember at most, rounded up
+ *                      to a power of two
+ * @param lifetime      How long responses are remembered, in seconds
+ *
+ * @return 0, EINVAL or ENOMEM
+ */
+int gssntlm_replay_cache_enable(uint32_t entries, uint32_t lifetime);
+
+/**
+ * @brief   Records a verified response, unless it was seen already
+ *
+ * @param server_chal   The 8 bytes server challenge it answers
+ * @param nt_chal_resp  The NT response
+ * @param lm_chal_resp  The LM response
+ *
+ * @return 0, also when there is no cache, or ERR_REPLAY
+ */
+int gssntlm_replay_check(const uint8_t *server_chal,
+                         struct ntlm_buffer *nt_chal_resp,
+                         struct ntlm_buffer *lm_chal_resp);
+
+void gssntlm_replay_stats(struct gssntlm_replay_stats *stats);
+
+/* Process-wide metrics, see gss_metrics.c. Counters are kept separately
+ * for the client and the server role. */
+enum gssntlm_counter {
+    GSSNTLM_CNT_STARTED,
+    GSSNTLM_CNT_COMPLETED,
+    GSSNTLM_CNT_NTLMV1,
+    GSSNTLM_CNT_NTLMV2,
+    GSSNTLM_CNT_ANONYMOUS,
+    GSSNTLM_CNT_MIC,
+    GSSNTLM_CNT_CBT,
+    GSSNTLM_CNT_LOCAL,
+    GSSNTLM_CNT_EXTERNAL,
+    GSSNTLM_CNT_NUM
+};
+#define GSSNTLM_EVENT(c) (1U << (c))
+
+/**
+ * @brief   Returns a timestamp to pass to the functions below, in ns
+ */
+uint64_t gssntlm_metrics_start(void);
+
+/**
+ * @brief   Records the outcome of one init/accept_sec_context() call
+ *
+ * @param server        True for the acceptor
+ * @param first         True if the call created the context
+ * @param retmaj        The major status of the call
+ * @param retmin        The minor status, failures are counted per code
+ * @param start         Timestamp taken when the call started, successful
+ *                      legs are added to the latency histograms
+ */
+void gssntlm_metrics_leg(bool server, bool first, uint32_t retmaj,
+                         uint32_t retmin, uint64_t start);
+
+/**
+ * @brief   Counts an established context
+ *
+ * @param server        True for the acceptor
+ * @param events        GSSNTLM_EVENT() flags for the logon type, MIC and
+ *                      channel bindings use and the credential source
+ */
+void gssntlm_metrics_established(bool server, uint32_t events);
+
+/**
+ * @brief   Returns a timestamp for gssntlm_metrics_message(), or 0 when
+ *          this message is not sampled for latency
+ */
+uint64_t gssntlm_metrics_message_start(void);
+
+/**
+ * @brief   Counts a wrap or unwrap in its size class, and records its
+ *          latency if start is not 0
+ */
+void gssntlm_metrics_message(bool unwrap, size_t size, uint64_t start);
+
+/**
+ * @brief   Returns all metrics in the Prometheus text exposition format
+ *
+ * @param minor_status  The minor status
+ * @param snapshot      The returned text, release with gss_release_buffer()
+ *
+ * @return GSS_S_COMPLETE or an error
+ */
+uint32_t gssntlm_metrics_snapshot(uint32_t *minor_status,
+                                  gss_buffer_t snapshot);
+
+/**
+ * @brief   Adds a snapshot as returned by gssntlm_metrics_snapshot() to a
+ *          buffer set, for the inquire by OID functions
+ */
+uint32_t gssntlm_metrics_inquire(uint32_t *minor_status,
+                                 gss_buffer_set_t *data_set);
 
 uint32_t external_netbios_get_names(char **computer, char **domain);
 uint32_t external_get_creds(struct gssntlm_name *name,
@@ -218,9 +619,13 @@ uint32_t gssntlm_srv_auth(uint32_t *minor,
                           struct gssntlm_cred *cred,
                           struct ntlm_buffer *nt_chal_resp,
                           struct ntlm_buffer *lm_chal_resp,
+                          bool check_replay,
                           struct ntlm_key *key_exchange_key);
 
 extern const gss_OID_desc gssntlm_oid;
+extern gss_OID_desc invalidate_identity_oid;
+extern gss_OID_desc metrics_oid;
+extern gss_OID_desc ctx_table_oid;
 
 uint32_t gssntlm_acquire_cred(uint32_t *minor_status,
                               gss_name_t desired_name,
@@ -344,6 +749,39 @@ uint32_t gssntlm_unwrap(uint32_t *minor_status,
                         int *conf_state,
                         gss_qop_t *qop_state);
 
+uint32_t gssntlm_set_cred_option(uint32_t *minor_status,
+                                 gss_cred_id_t *cred_handle,
+                                 const gss_OID desired_object,
+                                 const gss_buffer_t value);
+
+uint32_t gssntlm_inquire_cred_by_oid(uint32_t *minor_status,
+                                     const gss_cred_id_t cred_handle,
+                                     const gss_OID desired_object,
+                                     gss_buffer_set_t *data_set);
+
+uint32_t gssntlm_wrap_iov(uint32_t *minor_status,
+                          gss_ctx_id_t context_handle,
+                          int conf_req_flag,
+                          gss_qop_t qop_req,
+                          int *conf_state,
+                          gss_iov_buffer_desc *iov,
+                          int iov_count);
+
+uint32_t gssntlm_unwrap_iov(uint32_t *minor_status,
+                            gss_ctx_id_t context_handle,
+                            int *conf_state,
+                            gss_qop_t *qop_state,
+                            gss_iov_buffer_desc *iov,
+                            int iov_count);
+
+uint32_t gssntlm_wrap_iov_length(uint32_t *minor_status,
+                                 gss_ctx_id_t context_handle,
+                                 int conf_req_flag,
+                                 gss_qop_t qop_req,
+                                 int *conf_state,
+                                 gss_iov_buffer_desc *iov,
+                                 int iov_count);
+
 uint32_t gssntlm_wrap_size_limit(uint32_t *minor_status,
                                  gss_ctx_id_t context_handle,
                                  int conf_req_flag,
@@ -394,6 +832,145 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
                                     gss_buffer_t interprocess_token,
                                     gss_ctx_id_t *context_handle);
 
+/**
+ * @brief   Decodes the names of a context imported in the compact format
+ *
+ * Contexts exported once established only carry their names in encoded
+ * form, they are decoded the first time they are needed. Does nothing
+ * for any other context.
+ *
+ * @param minor_status  The minor status
+ * @param ctx           The context
+ *
+ * @return GSS_S_COMPLETE or GSS_S_DEFECTIVE_TOKEN if the names are invalid
+ */
+uint32_t gssntlm_ctx_unpack_names(uint32_t *minor_status,
+                                  struct gssntlm_ctx *ctx);
+
+/**
+ * @brief   Serializes an established context in the compact export format,
+ *          without invalidating it
+ *
+ * @param ctx           The context
+ * @param token         The returned token, release with free()
+ *
+ * @return 0 on success or an error
+ */
+int gssntlm_ctx_pack(struct gssntlm_ctx *ctx, struct ntlm_buffer *token);
+
+/**
+ * @brief   Saves an RC4 state in 258 bytes (x, y and the permutation)
+ */
+int gssntlm_rc4_pack(struct ntlm_rc4_handle *handle, uint8_t state[258]);
+
+/**
+ * @brief   Creates an RC4 handle from a state saved by gssntlm_rc4_pack()
+ */
+int gssntlm_rc4_unpack(const uint8_t state[258],
+                       struct ntlm_rc4_handle **handle);
+
+/* Shared context table, see gss_ctxtable.c */
+
+/**
+ * @brief   Creates the shared context table of this process
+ *
+ * @param minor_status  The minor status
+ * @param entries       The number of contexts the table can hold
+ * @param fd            Returns a descriptor of the table for
+ *                      gssntlm_ctx_table_map() in unrelated processes
+ *
+ * @return GSS_S_COMPLETE or an error
+ */
+uint32_t gssntlm_ctx_table_create(uint32_t *minor_status,
+                                  uint32_t entries, int *fd);
+
+/**
+ * @brief   Maps a table created by another process
+ */
+uint32_t gssntlm_ctx_table_map(uint32_t *minor_status, int fd);
+
+/**
+ * @brief   Puts an established context in the table, from now on its
+ *          per-message state is kept there
+ */
+uint32_t gssntlm_ctx_table_share(uint32_t *minor_status,
+                                 struct gssntlm_ctx *ctx);
+
+/**
+ * @brief   Returns the table ID of a shared context in a buffer set
+ */
+uint32_t gssntlm_ctx_table_inquire(uint32_t *minor_status,
+                                   struct gssntlm_ctx *ctx,
+                                   gss_buffer_set_t *data_set);
+
+/**
+ * @brief   Takes a reference to an entry and copies out its context
+ *
+ * Also consumes one of the tokens counted by gssntlm_ctx_table_exported().
+ *
+ * @param id            The table ID
+ * @param token         The context in the compact export format, release
+ *                      with free()
+ *
+ * @return 0, ENOENT if there is no such entry, EBUSY if too many processes
+ *         are attached to it, or an error
+ */
+int gssntlm_ctx_table_attach(uint64_t id, struct ntlm_buffer *token);
+
+/**
+ * @brief   Drops a reference taken by gssntlm_ctx_table_attach() or
+ *          gssntlm_ctx_table_share() in this process
+ */
+void gssntlm_ctx_table_detach(uint64_t id);
+
+/**
+ * @brief   Counts a reference token handed out for an entry, which keeps it
+ *          from being reused until the token is imported or the context
+ *          expires
+ *
+ * @return 0, ENOENT if there is no such entry or an error
+ */
+int gssntlm_ctx_table_exported(uint64_t id);
+
+/* Held around any use of the per-message state of a context */
+struct gssntlm_table_lock {
+    struct gssntlm_ctx *ctx;
+    void *entry;
+    uint32_t seq_num[2];
+    bool dirty;         /* set if the state changed other than by a message */
+};
+
+int gssntlm_ctx_table_lock_entry(struct gssntlm_ctx *ctx,
+                                 struct gssntlm_table_lock *tl);
+void gssntlm_ctx_table_unlock_entry(struct gssntlm_table_lock *tl);
+
+/**
+ * @brief   Locks the entry of a shared context and brings crypto_state up
+ *          to date with it, does nothing for other contexts
+ *
+ * @return 0, ENOENT if the entry is gone or an error
+ */
+static inline int gssntlm_ctx_table_lock(struct gssntlm_ctx *ctx,
+                                         struct gssntlm_table_lock *tl)
+{
+    if (!(ctx->int_flags & NTLMSSP_CTX_FLAG_SHARED)) return 0;
+    return gssntlm_ctx_table_lock_entry(ctx, tl);
+}
+
+/**
+ * @brief   Publishes crypto_state to the entry if it changed and unlocks it
+ */
+static inline void gssntlm_ctx_table_unlock(struct gssntlm_table_lock *tl)
+{
+    if (tl->entry) gssntlm_ctx_table_unlock_entry(tl);
+}
+
+/* Declares a table lock released when it goes out of scope, so that every
+ * return path after gssntlm_ctx_table_lock() is covered */
+#define CTX_TABLE_SCOPE(name) \
+    struct gssntlm_table_lock name \
+        __attribute__((cleanup(gssntlm_ctx_table_unlock))) = { 0 }
+
 uint32_t gssntlm_export_cred(uint32_t *minor_status,
                              gss_cred_id_t cred_handle,
                              gss_buffer_t token);
@@ -410,6 +987,12 @@ uint32_t gssntlm_display_status(uint32_t *minor_status,
 				uint32_t *message_context,
 				gss_buffer_t status_string);
 
+/**
+ * @brief   Returns the symbolic name of an ERR_* code, eg. "ERR_DECODE",
+ *          or NULL if the value is not one
+ */
+const char *gssntlm_err_name(uint32_t err);
+
 uint32_t gssntlm_get_name_attribute(uint32_t *minor_status,
                                     gss_name_t name,
                                     gss_buffer_t attr,
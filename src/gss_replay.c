@@ -0,0 +1,271 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Process-wide replay cache of accepted authentications.
+ *
+ * Once enabled (by an acceptor credential, see the ntlmssp_replay_cache
+ * cred store option) every response the acceptor verifies is recorded by
+ * a fingerprint of the server challenge and the leading 24 bytes of the NT
+ * and LM responses. For NTLMv1 that is the whole response; for NTLMv2 it is
+ * the NTProofStr and the fixed blob header, the proof being an HMAC over
+ * the rest of the blob, client challenge (at offset 32) included. Seeing the same fingerprint again within the lifetime means an
+ * authenticate message was played twice against the same challenge, e.g.
+ * to two copies of an exported context.
+ *
+ * The cache is a fixed array of 64 bit slots, allocated once: a 48 bit
+ * fingerprint and the 16 bit time bucket it was stored in. It is split in
+ * shards, each with its own statistics, and searched with linear probing
+ * over a short window. Slots are claimed with a compare and swap, lookups
+ * and inserts take no lock. Entries older than the lifetime are reused
+ * first; when the whole window is live the oldest entry in it is evicted,
+ * so memory stays bounded and the evictions counter tells when the cache
+ * is too small for the authentication rate. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gss_ntlmssp.h"
+
+#define REPLAY_SHARDS 64
+#define REPLAY_PROBE 16
+#define REPLAY_MIN_ENTRIES (REPLAY_SHARDS * REPLAY_PROBE)
+#define REPLAY_MAX_ENTRIES (1U << 26)
+/* the lifetime is split in this many buckets */
+#define REPLAY_BUCKETS 64
+
+#define SLOT_FP(v) ((v) >> 16)
+#define SLOT_BUCKET(v) ((uint16_t)(v))
+
+struct replay_shard {
+    uint64_t inserts;
+    uint64_t replays;
+    uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct replay_cache {
+    uint64_t secret[2];
+    uint32_t bucket_secs;
+    uint32_t shard_mask;            /* slots per shard - 1 */
+    uint64_t *slots;
+    struct replay_shard shards[REPLAY_SHARDS];
+};
+
+static struct replay_cache *replay_cache;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t mix64(uint64_t h)
+{
+    /* the MurmurHash3 finalizer */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t mix_bytes(uint64_t h, const uint8_t *data, size_t len)
+{
+    uint64_t w;
+
+    h = mix64(h ^ len);
+    while (len > 0) {
+        w = 0;
+        memcpy(&w, data, len < 8 ? len : 8);
+        h = mix64(h ^ w);
+        data += (len < 8 ? len : 8);
+        len -= (len < 8 ? len : 8);
+    }
+    return h;
+}
+
+/* keyed with a random secret, so that clients cannot choose responses
+ * that collide with someone else's */
+static uint64_t replay_fingerprint(struct replay_cache *rc,
+                                   const uint8_t *server_chal,
+                                   struct ntlm_buffer *nt_chal_resp,
+                                   struct ntlm_buffer *lm_chal_resp)
+{
+    uint64_t h;
+
+    h = mix_bytes(rc->secret[0], server_chal, 8);
+    h = mix_bytes(h, nt_chal_resp->data,
+                  nt_chal_resp->length < 24 ? nt_chal_resp->length : 24);
+    h = mix_bytes(h, lm_chal_resp->data,
+                  lm_chal_resp->length < 24 ? lm_chal_resp->length : 24);
+    return mix64(h ^ rc->secret[1]);
+}
+
+static uint16_t replay_bucket(struct replay_cache *rc, time_t now)
+{
+    return (uint16_t)(now / rc->bucket_secs);
+}
+
+static bool slot_expired(uint64_t v, uint16_t bucket)
+{
+    /* one extra bucket, as the current one is only partly elapsed */
+    return (uint16_t)(bucket - SLOT_BUCKET(v)) > REPLAY_BUCKETS;
+}
+
+int gssntlm_replay_cache_enable(uint32_t entries, uint32_t lifetime)
+{
+    struct replay_cache *rc;
+    struct ntlm_buffer secret;
+    uint64_t bucket_secs;
+    uint32_t size;
+    int ret = 0;
+
+    /* in 64 bits, lifetimes close to UINT32_MAX would wrap to 0 */
+    bucket_secs = ((uint64_t)lifetime + REPLAY_BUCKETS - 1) / REPLAY_BUCKETS;
+    if (entries == 0 || bucket_secs == 0) return EINVAL;
+    if (entries > REPLAY_MAX_ENTRIES) entries = REPLAY_MAX_ENTRIES;
+    for (size = REPLAY_MIN_ENTRIES; size < entries; size <<= 1) ;
+
+    pthread_mutex_lock(&replay_mutex);
+    /* the first credential to ask sizes the cache for the process */
+    if (replay_cache) goto done;
+
+    rc = calloc(1, sizeof(struct replay_cache));
+    if (!rc) {
+        ret = ENOMEM;
+        goto done;
+    }
+    rc->slots = calloc(size, sizeof(uint64_t));
+    if (!rc->slots) {
+        free(rc);
+        ret = ENOMEM;
+        goto done;
+    }
+    secret.data = (uint8_t *)rc->secret;
+    secret.length = sizeof(rc->secret);
+    ret = RAND_BUFFER(&secret);
+    if (ret) {
+        free(rc->slots);
+        free(rc);
+        goto done;
+    }
+    rc->bucket_secs = bucket_secs;
+    rc->shard_mask = size / REPLAY_SHARDS - 1;
+
+    __atomic_store_n(&replay_cache, rc, __ATOMIC_RELEASE);
+
+done:
+    pthread_mutex_unlock(&replay_mutex);
+    return ret;
+}
+
+int gssntlm_replay_check(const uint8_t *server_chal,
+                         struct ntlm_buffer *nt_chal_resp,
+                         struct ntlm_buffer *lm_chal_resp)
+{
+    struct replay_cache *rc;
+    struct replay_shard *shard;
+    uint64_t *slots;
+    uint64_t *victim;
+    uint64_t victim_val;
+    uint64_t fp;
+    uint64_t v;
+    uint16_t bucket;
+    uint16_t age, victim_age;
+    bool reuse;
+    uint32_t start, i;
+
+    rc = __atomic_load_n(&replay_cache, __ATOMIC_ACQUIRE);
+    if (!rc) return 0;
+
+    fp = replay_fingerprint(rc, server_chal, nt_chal_resp, lm_chal_resp);
+    bucket = replay_bucket(rc, time(NULL));
+
+    shard = &rc->shards[fp % REPLAY_SHARDS];
+    slots = &rc->slots[(fp % REPLAY_SHARDS) * (rc->shard_mask + 1)];
+    start = (fp / REPLAY_SHARDS) & rc->shard_mask;
+    /* 0 marks a slot that was never used */
+    fp = SLOT_FP(fp) ? SLOT_FP(fp) : 1;
+
+    for (;;) {
+        victim = NULL;
+        victim_val = 0;
+        victim_age = 0;
+        reuse = false;
+
+        for (i = 0; i < REPLAY_PROBE; i++) {
+            uint64_t *slot = &slots[(start + i) & rc->shard_mask];
+
+            v = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            if (v == 0) {
+                /* slots are never emptied, nothing can be further on */
+                if (!reuse) {
+                    victim = slot;
+                    victim_val = 0;
+                    reuse = true;
+                }
+                break;
+            }
+            if (slot_expired(v, bucket)) {
+                if (!reuse) {
+                    victim = slot;
+                    victim_val = v;
+                    reuse = true;
+                }
+                continue;
+            }
+            if (SLOT_FP(v) == fp) {
+                __atomic_add_fetch(&shard->replays, 1, __ATOMIC_RELAXED);
+                return ERR_REPLAY;
+            }
+            age = bucket - SLOT_BUCKET(v);
+            if (!reuse && (!victim || age > victim_age)) {
+                victim = slot;
+                victim_val = v;
+                victim_age = age;
+            }
+        }
+
+        if (__atomic_compare_exchange_n(victim, &victim_val,
+                                        (fp << 16) | bucket, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+        /* someone else stored into the slot meanwhile, it may even be the
+         * same response: look again */
+    }
+
+    __atomic_add_fetch(&shard->inserts, 1, __ATOMIC_RELAXED);
+    if (!reuse) {
+        __atomic_add_fetch(&shard->evictions, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void gssntlm_replay_stats(struct gssntlm_replay_stats *stats)
+{
+    struct replay_cache *rc;
+    uint16_t bucket;
+    uint64_t size;
+    uint64_t v;
+    uint64_t i;
+
+    memset(stats, 0, sizeof(struct gssntlm_replay_stats));
+
+    rc = __atomic_load_n(&replay_cache, __ATOMIC_ACQUIRE);
+    if (!rc) return;
+
+    for (i = 0; i < REPLAY_SHARDS; i++) {
+        stats->inserts += __atomic_load_n(&rc->shards[i].inserts,
+                                          __ATOMIC_RELAXED);
+        stats->replays += __atomic_load_n(&rc->shards[i].replays,
+                                          __ATOMIC_RELAXED);
+        stats->evictions += __atomic_load_n(&rc->shards[i].evictions,
+                                            __ATOMIC_RELAXED);
+    }
+
+    size = (uint64_t)(rc->shard_mask + 1) * REPLAY_SHARDS;
+    bucket = replay_bucket(rc, time(NULL));
+    for (i = 0; i < size; i++) {
+        v = __atomic_load_n(&rc->slots[i], __ATOMIC_RELAXED);
+        if (v != 0 && !slot_expired(v, bucket)) stats->entries++;
+    }
+    stats->capacity = size;
+}
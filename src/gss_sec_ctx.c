@@ -8,6 +8,18 @@
 
 #include "gssapi_ntlmssp.h"
 #include "gss_ntlmssp.h"
+#include "probes.h"
+
+/* The messages and the workstation name are only needed to build or verify
+ * the MIC, an established context can do without them. */
+static void release_handshake_data(struct gssntlm_ctx *ctx)
+{
+    gssntlm_arena_free(&ctx->arena);
+    ctx->workstation = NULL;
+    memset(&ctx->nego_msg, 0, sizeof(struct ntlm_buffer));
+    memset(&ctx->chal_msg, 0, sizeof(struct ntlm_buffer));
+    memset(&ctx->auth_msg, 0, sizeof(struct ntlm_buffer));
+}
 
 uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
                                   gss_cred_id_t claimant_cred_handle,
@@ -26,21 +38,24 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
     struct gssntlm_ctx *ctx;
     struct gssntlm_name *server = NULL;
     struct gssntlm_cred *cred = NULL;
-    char *computer_name = NULL;
-    char *nb_computer_name = NULL;
-    char *nb_domain_name = NULL;
+    struct gssntlm_identity *identity = NULL;
     struct gssntlm_name *client_name = NULL;
     uint32_t in_flags;
     uint32_t msg_type;
-    char *trgt_name = NULL;
-    struct ntlm_buffer challenge = { 0 };
+    struct ntlm_chal_view chal;
     struct ntlm_buffer target_info = { 0 };
     int lm_compat_lvl;
     uint32_t tmpmin;
     uint32_t retmin = 0;
     uint32_t retmaj = 0;
+    uint64_t start = gssntlm_metrics_start();
+    uint32_t events;
+    bool first_leg;
+    DEBUG_CTX_SCOPE(NULL, 0);
 
     ctx = (struct gssntlm_ctx *)(*context_handle);
+    first_leg = (ctx == NULL);
+    if (ctx) DEBUG_CTX(ctx, ctx->stage);
 
     /* reset return values */
     if (actual_mech_type) *actual_mech_type = NULL;
@@ -62,6 +77,9 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
         }
     }
 
+    GSSNTLM_PROBE(init_start, ctx, PROBE_STAGE(ctx), req_flags,
+                  PROBE_LEN(input_token));
+
     if (claimant_cred_handle == GSS_C_NO_CREDENTIAL) {
         if (req_flags & GSS_C_ANON_FLAG) {
             set_GSSERRS(ERR_NOARG, GSS_S_UNAVAILABLE);
@@ -75,7 +93,8 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
             if (retmaj) goto done;
         }
     } else {
-        cred = (struct gssntlm_cred *)claimant_cred_handle;
+        /* held until we return, like one acquired here */
+        cred = gssntlm_cred_ref((struct gssntlm_cred *)claimant_cred_handle);
         if (cred->type != GSSNTLM_CRED_USER &&
             cred->type != GSSNTLM_CRED_EXTERNAL) {
             set_GSSERRS(ERR_NOARG, GSS_S_CRED_UNAVAIL);
@@ -91,11 +110,12 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
     if (ctx == NULL) {
 
         /* first call */
-        ctx = calloc(1, sizeof(struct gssntlm_ctx));
+        ctx = gssntlm_obj_alloc(GSSNTLM_OBJ_CTX);
         if (!ctx) {
             set_GSSERR(ENOMEM);
             goto done;
         }
+        DEBUG_CTX(ctx, ctx->stage);
 
         retmin = gssntlm_copy_name(&cred->cred.user.user,
                                    &ctx->source_name);
@@ -163,26 +183,21 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
             if (retmaj) goto done;
         }
 
-        computer_name = strdup(client_name->data.server.name);
-        if (!computer_name) {
-            set_GSSERR(ENOMEM);
-            goto done;
-        }
-
-        retmin = netbios_get_names(computer_name,
-                                   &nb_computer_name, &nb_domain_name);
+        retmin = gssntlm_identity_get(client_name->data.server.name,
+                                      NULL, &identity);
         if (retmin) {
             set_GSSERR(retmin);
             goto done;
         }
 
-        ctx->workstation = strdup(nb_computer_name);
+        ctx->workstation = gssntlm_arena_strdup(&ctx->arena,
+                                                identity->nb_computer_name);
         if (!ctx->workstation) {
             set_GSSERR(ENOMEM);
             goto done;
         }
 
-        gssntlm_set_role(ctx, GSSNTLM_CLIENT, nb_domain_name);
+        gssntlm_set_role(ctx, GSSNTLM_CLIENT, identity->nb_domain_name);
 
         lm_compat_lvl = gssntlm_get_lm_compatibility_level();
         if (!gssntlm_required_security(lm_compat_lvl, ctx)) {
@@ -227,8 +242,21 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
                 goto done;
             }
 
-            retmin = ntlm_encode_neg_msg(ctx->ntlm, ctx->neg_flags,
-                                         NULL, NULL, &ctx->nego_msg);
+            ctx->nego_msg.data = NULL;
+            retmin = ntlm_write_neg_msg(ctx->ntlm, ctx->neg_flags,
+                                        NULL, NULL, &ctx->nego_msg);
+            if (retmin) {
+                set_GSSERR(retmin);
+                goto done;
+            }
+            ctx->nego_msg.data = gssntlm_arena_alloc(&ctx->arena,
+                                                     ctx->nego_msg.length);
+            if (!ctx->nego_msg.data) {
+                set_GSSERR(ENOMEM);
+                goto done;
+            }
+            retmin = ntlm_write_neg_msg(ctx->ntlm, ctx->neg_flags,
+                                        NULL, NULL, &ctx->nego_msg);
             if (retmin) {
                 set_GSSERR(retmin);
                 goto done;
@@ -264,13 +292,12 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        ctx->chal_msg.data = malloc(input_token->length);
-        if (!ctx->chal_msg.data) {
-            set_GSSERR(ENOMEM);
+        retmin = gssntlm_arena_copy(&ctx->arena, input_token->value,
+                                    input_token->length, &ctx->chal_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
             goto done;
         }
-        memcpy(ctx->chal_msg.data, input_token->value, input_token->length);
-        ctx->chal_msg.length = input_token->length;
 
         retmin = ntlm_decode_msg_type(ctx->ntlm, &ctx->chal_msg, &msg_type);
         if (retmin) {
@@ -284,15 +311,16 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        /* store challenge in ctx */
-        challenge.data = ctx->server_chal;
-        challenge.length = 8;
-        retmin = ntlm_decode_chal_msg(ctx->ntlm, &ctx->chal_msg, &in_flags,
-                                      &trgt_name, &challenge, &target_info);
+        /* target_info points into ctx->chal_msg, which outlives its use */
+        retmin = ntlm_decode_chal_view(ctx->ntlm, &ctx->chal_msg, &chal);
         if (retmin) {
             set_GSSERRS(retmin, GSS_S_DEFECTIVE_TOKEN);
             goto done;
         }
+        in_flags = chal.flags;
+        /* store challenge in ctx */
+        memcpy(ctx->server_chal, chal.challenge.data, 8);
+        target_info = chal.target_info;
 
         /* mask unacceptable flags */
         if (!gssntlm_sec_lm_ok(ctx)) {
@@ -409,14 +437,43 @@ uint32_t gssntlm_init_sec_context(uint32_t *minor_status,
         memcpy(output_token->value, ctx->auth_msg.data, ctx->auth_msg.length);
         output_token->length = ctx->auth_msg.length;
 
+        release_handshake_data(ctx);
+
         /* For now use the same as the challenge/response lifetime (36h) */
         ctx->expiration_time = time(NULL) + MAX_CHALRESP_LIFETIME;
         ctx->int_flags |= NTLMSSP_CTX_FLAG_ESTABLISHED;
 
+        /* same choice of response as in gssntlm_cli_auth(), winbind
+         * does not tell which one it used */
+        if (cred->type == GSSNTLM_CRED_EXTERNAL) {
+            events = GSSNTLM_EVENT(GSSNTLM_CNT_EXTERNAL);
+        } else if (ctx->gss_flags & GSS_C_ANON_FLAG) {
+            events = GSSNTLM_EVENT(GSSNTLM_CNT_LOCAL) |
+                     GSSNTLM_EVENT(GSSNTLM_CNT_ANONYMOUS);
+        } else if (gssntlm_sec_v2_ok(ctx)) {
+            events = GSSNTLM_EVENT(GSSNTLM_CNT_LOCAL) |
+                     GSSNTLM_EVENT(GSSNTLM_CNT_NTLMV2);
+        } else {
+            events = GSSNTLM_EVENT(GSSNTLM_CNT_LOCAL) |
+                     GSSNTLM_EVENT(GSSNTLM_CNT_NTLMV1);
+        }
+        if (input_chan_bindings != GSS_C_NO_CHANNEL_BINDINGS &&
+            !(events & (GSSNTLM_EVENT(GSSNTLM_CNT_ANONYMOUS) |
+                        GSSNTLM_EVENT(GSSNTLM_CNT_NTLMV1)))) {
+            events |= GSSNTLM_EVENT(GSSNTLM_CNT_CBT);
+        }
+        if (ctx->int_flags & NTLMSSP_CTX_FLAG_AUTH_WITH_MIC) {
+            events |= GSSNTLM_EVENT(GSSNTLM_CNT_MIC);
+        }
+        gssntlm_metrics_established(false, events);
+
         set_GSSERRS(0, GSS_S_COMPLETE);
     }
 
 done:
+    gssntlm_metrics_leg(false, first_leg, retmaj, retmin, start);
+    GSSNTLM_PROBE(init_done, ctx, PROBE_STAGE(ctx), retmaj, retmin,
+                  GSS_ERROR(retmaj) ? 0 : output_token->length);
     if ((retmaj != GSS_S_COMPLETE) &&
         (retmaj != GSS_S_CONTINUE_NEEDED)) {
         gssntlm_delete_sec_context(&tmpmin, (gss_ctx_id_t *)&ctx, NULL);
@@ -426,16 +483,9 @@ done:
         if (time_rec) *time_rec = GSS_C_INDEFINITE;
     }
     *context_handle = (gss_ctx_id_t)ctx;
-    if (claimant_cred_handle == GSS_C_NO_CREDENTIAL) {
-        /* do not leak it, if not passed in */
-        gssntlm_release_cred(&tmpmin, (gss_cred_id_t *)&cred);
-    }
+    gssntlm_release_cred(&tmpmin, (gss_cred_id_t *)&cred);
     gssntlm_release_name(&tmpmin, (gss_name_t *)&client_name);
-    safefree(computer_name);
-    safefree(nb_computer_name);
-    safefree(nb_domain_name);
-    safefree(trgt_name);
-    ntlm_free_buffer_data(&target_info);
+    gssntlm_identity_release(&identity);
 
     return GSSERR();
 }
@@ -460,24 +510,21 @@ uint32_t gssntlm_delete_sec_context(uint32_t *minor_status,
 
     ctx = (struct gssntlm_ctx *)*context_handle;
 
-    safefree(ctx->workstation);
+    if (ctx->int_flags & NTLMSSP_CTX_FLAG_SHARED) {
+        gssntlm_ctx_table_detach(ctx->table_id);
+    }
 
     ret = ntlm_free_ctx(&ctx->ntlm);
 
-    safefree(ctx->nego_msg.data);
-    safefree(ctx->chal_msg.data);
-    safefree(ctx->auth_msg.data);
-    ctx->nego_msg.length = 0;
-    ctx->chal_msg.length = 0;
-    ctx->auth_msg.length = 0;
+    release_handshake_data(ctx);
 
     gssntlm_int_release_name(&ctx->source_name);
     gssntlm_int_release_name(&ctx->target_name);
 
     ntlm_release_rc4_state(&ctx->crypto_state);
 
-    safezero((uint8_t *)ctx, sizeof(struct gssntlm_ctx));
-    safefree(*context_handle);
+    gssntlm_obj_free(GSSNTLM_OBJ_CTX, ctx);
+    *context_handle = NULL;
 
     set_GSSERRS(ret, ret ? GSS_S_FAILURE : GSS_S_COMPLETE);
 done:
@@ -523,16 +570,12 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
                                     uint32_t *time_rec,
                                     gss_cred_id_t *delegated_cred_handle)
 {
-    struct gssntlm_ctx *ctx;
+    struct gssntlm_ctx *ctx = NULL;
     struct gssntlm_cred *cred = NULL;
     int lm_compat_lvl = -1;
     struct ntlm_buffer challenge = { 0 };
     struct gssntlm_name *server_name = NULL;
-    char *computer_name = NULL;
-    char *nb_computer_name = NULL;
-    char *nb_domain_name = NULL;
-    char *chal_target_name;
-    uint64_t timestamp;
+    struct gssntlm_identity *identity = NULL;
     struct ntlm_buffer target_info = { 0 };
     struct ntlm_buffer nt_chal_resp = { 0 };
     struct ntlm_buffer lm_chal_resp = { 0 };
@@ -541,9 +584,7 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
     struct ntlm_key key_exchange_key = { .length = 16 };
     uint8_t micbuf[16];
     struct ntlm_buffer mic = { micbuf, 16 };
-    char *dom_name = NULL;
-    char *usr_name = NULL;
-    char *wks_name = NULL;
+    struct ntlm_auth_view auth;
     struct gssntlm_name *gss_usrname = NULL;
     struct gssntlm_cred *usr_cred = NULL;
     uint32_t retmin;
@@ -554,6 +595,10 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
     uint32_t av_flags = 0;
     struct ntlm_buffer unhashed_cb = { 0 };
     struct ntlm_buffer av_cb = { 0 };
+    uint64_t start = gssntlm_metrics_start();
+    uint32_t events = 0;
+    bool first_leg;
+    DEBUG_CTX_SCOPE(NULL, 0);
 
     if (context_handle == NULL) {
         return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
@@ -561,6 +606,10 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
     if (output_token == GSS_C_NO_BUFFER) {
         return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_WRITE);
     }
+    first_leg = (*context_handle == GSS_C_NO_CONTEXT);
+    GSSNTLM_PROBE(accept_start, *context_handle,
+                  PROBE_STAGE((struct gssntlm_ctx *)*context_handle),
+                  PROBE_LEN(input_token));
 
     if (src_name) *src_name = GSS_C_NO_NAME;
     if (mech_type) *mech_type = GSS_C_NO_OID;
@@ -587,11 +636,12 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
     if (*context_handle == GSS_C_NO_CONTEXT) {
 
         /* first call */
-        ctx = calloc(1, sizeof(struct gssntlm_ctx));
+        ctx = gssntlm_obj_alloc(GSSNTLM_OBJ_CTX);
         if (!ctx) {
             set_GSSERR(ENOMEM);
             goto done;
         }
+        DEBUG_CTX(ctx, ctx->stage);
 
         /* acquire our own name */
         if (!server_name) {
@@ -612,26 +662,25 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        computer_name = strdup(server_name->data.server.name);
-        if (!computer_name) {
-            set_GSSERR(ENOMEM);
-            goto done;
-        }
-
-        retmin = netbios_get_names(computer_name,
-                                   &nb_computer_name, &nb_domain_name);
+        /* the acceptor credential keeps the last identity it resolved, so
+         * repeated accepts on the same cred skip the global lookup */
+        retmin = gssntlm_identity_get(server_name->data.server.name,
+                                      cred ? &cred->cred.server.identity
+                                           : NULL,
+                                      &identity);
         if (retmin) {
             set_GSSERR(retmin);
             goto done;
         }
 
-        ctx->workstation = strdup(nb_computer_name);
+        ctx->workstation = gssntlm_arena_strdup(&ctx->arena,
+                                                identity->nb_computer_name);
         if (!ctx->workstation) {
             set_GSSERR(ENOMEM);
             goto done;
         }
 
-        gssntlm_set_role(ctx, GSSNTLM_SERVER, nb_domain_name);
+        gssntlm_set_role(ctx, GSSNTLM_SERVER, identity->nb_domain_name);
 
         lm_compat_lvl = gssntlm_get_lm_compatibility_level();
         if (!gssntlm_required_security(lm_compat_lvl, ctx)) {
@@ -657,13 +706,12 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
         }
 
         if (input_token && input_token->length != 0) {
-            ctx->nego_msg.data = malloc(input_token->length);
-            if (!ctx->nego_msg.data) {
-                set_GSSERR(ENOMEM);
+            retmin = gssntlm_arena_copy(&ctx->arena, input_token->value,
+                                        input_token->length, &ctx->nego_msg);
+            if (retmin) {
+                set_GSSERR(retmin);
                 goto done;
             }
-            memcpy(ctx->nego_msg.data, input_token->value, input_token->length);
-            ctx->nego_msg.length = input_token->length;
 
             retmin = ntlm_decode_msg_type(ctx->ntlm, &ctx->nego_msg, &msg_type);
             if (retmin || (msg_type != NEGOTIATE_MESSAGE)) {
@@ -725,32 +773,15 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        timestamp = ntlm_timestamp_now();
-
-        retmin = ntlm_encode_target_info(ctx->ntlm,
-                                         nb_computer_name,
-                                         nb_domain_name,
-                                         computer_name,
-                                         NULL, NULL,
-                                         NULL, &timestamp,
-                                         NULL, NULL, NULL,
-                                         &target_info);
-        if (retmin) {
-            set_GSSERR(retmin);
-            goto done;
-        }
-
         if (gssntlm_role_is_domain_member(ctx)) {
-            chal_target_name = nb_domain_name;
             ctx->neg_flags |= NTLMSSP_TARGET_TYPE_DOMAIN;
         } else {
-            chal_target_name = nb_computer_name;
             ctx->neg_flags |= NTLMSSP_TARGET_TYPE_SERVER;
         }
 
-        retmin = ntlm_encode_chal_msg(ctx->ntlm, ctx->neg_flags,
-                                      chal_target_name, &challenge,
-                                      &target_info, &ctx->chal_msg);
+        retmin = gssntlm_identity_chal_msg(identity, ctx->neg_flags,
+                                           &challenge, ntlm_timestamp_now(),
+                                           &ctx->arena, &ctx->chal_msg);
         if (retmin) {
             set_GSSERR(retmin);
             goto done;
@@ -770,6 +801,7 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
 
     } else {
         ctx = (struct gssntlm_ctx *)(*context_handle);
+        DEBUG_CTX(ctx, ctx->stage);
 
         if (!gssntlm_role_is_server(ctx)) {
             set_GSSERRS(ERR_WRONGCTX, GSS_S_NO_CONTEXT);
@@ -782,13 +814,12 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        ctx->auth_msg.data = malloc(input_token->length);
-        if (!ctx->auth_msg.data) {
-            set_GSSERR(ENOMEM);
+        retmin = gssntlm_arena_copy(&ctx->arena, input_token->value,
+                                    input_token->length, &ctx->auth_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
             goto done;
         }
-        memcpy(ctx->auth_msg.data, input_token->value, input_token->length);
-        ctx->auth_msg.length = input_token->length;
 
         retmin = ntlm_decode_msg_type(ctx->ntlm, &ctx->auth_msg, &msg_type);
         if (retmin) {
@@ -802,15 +833,25 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        retmin = ntlm_decode_auth_msg(ctx->ntlm, &ctx->auth_msg,
-                                      ctx->neg_flags,
-                                      &lm_chal_resp, &nt_chal_resp,
-                                      &dom_name, &usr_name, &wks_name,
-                                      &enc_sess_key, &target_info, &mic);
+        /* the responses are used in place, from the copy of the message
+         * kept for the MIC check */
+        retmin = ntlm_decode_auth_view(ctx->ntlm, &ctx->auth_msg,
+                                       ctx->neg_flags, &auth);
         if (retmin) {
             set_GSSERRS(retmin, GSS_S_DEFECTIVE_TOKEN);
             goto done;
         }
+        lm_chal_resp = auth.lm_chalresp;
+        nt_chal_resp = auth.nt_chalresp;
+        enc_sess_key = auth.enc_sess_key;
+        target_info = auth.target_info;
+
+        /* ntlm_verify_mic() clears the MIC in the message, keep a copy */
+        if (auth.mic.length != 16) {
+            set_GSSERRS(ERR_DECODE, GSS_S_DEFECTIVE_TOKEN);
+            goto done;
+        }
+        memcpy(micbuf, auth.mic.data, 16);
 
         if (target_info.length > 0) {
             retmin = ntlm_decode_target_info(ctx->ntlm, &target_info,
@@ -829,7 +870,7 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
             goto done;
         }
 
-        if (((usr_name == NULL) || (usr_name[0] == '\0')) &&
+        if ((auth.user_name.data.length == 0) &&
             (nt_chal_resp.length == 0) &&
             (((lm_chal_resp.length == 1) && (lm_chal_resp.data[0] == '\0')) ||
              (lm_chal_resp.length == 0))) {
@@ -841,46 +882,38 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
         } else {
 
             char useratdom[1024];
-            size_t ulen, dlen, uadlen;
+            size_t ulen, dlen;
             gss_buffer_desc usrname;
             gss_const_key_value_set_t cred_store = GSS_C_NO_CRED_STORE;
             gss_key_value_set_desc cs;
             gss_key_value_element_desc cs_el;
 
-            if (!dom_name) {
-                dom_name = strdup("");
-                if (!dom_name) {
-                    set_GSSERR(ENOMEM);
-                    goto done;
-                }
-            }
-
             /* Use domain\username format as that allows to pass in
-             * enterprise names without the need to escape them */
-            ulen = strlen(usr_name);
-            dlen = strlen(dom_name);
-            if (ulen + dlen + 2 > 1024) {
+             * enterprise names without the need to escape them.
+             * The names are converted straight from the message */
+            retmin = ntlm_str_view_to_utf8(&auth.domain_name, useratdom,
+                                           sizeof(useratdom) - 1, &dlen);
+            if (retmin == 0) {
+                /* always add the domain separator, this way if the
+                 * username is an enteprise name (user@email.domain form)
+                 * it will be correctly recognized by
+                 * gssntlm_import_name() as such */
+                useratdom[dlen] = '\\';
+                retmin = ntlm_str_view_to_utf8(&auth.user_name,
+                                               &useratdom[dlen + 1],
+                                               sizeof(useratdom) - dlen - 1,
+                                               &ulen);
+            }
+            if (retmin == E2BIG) {
                 set_GSSERR(ERR_NAMETOOLONG);
                 goto done;
-            }
-            uadlen = dlen;
-            if (dlen) {
-                memcpy(useratdom, dom_name, dlen);
+            } else if (retmin) {
+                set_GSSERR(retmin);
+                goto done;
             }
 
-            /* always add the domain separator, this way if the username
-             * is an enteprise name (user@email.domain form) it will be
-             * correctly recognized by gssntlm_import_name() as such */
-            useratdom[uadlen] = '\\';
-            uadlen++;
-
-            /* finally add usernmae part */
-            memcpy(&useratdom[uadlen], usr_name, ulen);
-            uadlen += ulen;
-            useratdom[uadlen] = '\0';
-
             usrname.value = useratdom;
-            usrname.length = uadlen;
+            usrname.length = dlen + 1 + ulen;
             retmaj = gssntlm_import_name(&retmin, &usrname,
                                          GSS_C_NT_USER_NAME,
                                          (gss_name_t *)&gss_usrname);
@@ -910,19 +943,26 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
                 goto done;
             }
 
-            retmin = gssntlm_copy_name(gss_usrname, &ctx->source_name);
-            if (retmin) {
-                set_GSSERR(retmin);
-                goto done;
-            }
+            /* the name was imported only for this logon, the context can
+             * take it over instead of copying it */
+            ctx->source_name = *gss_usrname;
+            memset(gss_usrname, 0, sizeof(struct gssntlm_name));
 
+            GSSNTLM_PROBE(srv_auth_start, ctx, usr_cred->type,
+                          nt_chal_resp.length, lm_chal_resp.length);
             retmaj = gssntlm_srv_auth(&retmin, ctx, usr_cred,
                                       &nt_chal_resp, &lm_chal_resp,
+                                      cred && cred->cred.server.replay_check,
                                       &key_exchange_key);
+            GSSNTLM_PROBE(srv_auth_done, ctx, retmaj, retmin);
             if (retmaj) goto done;
         }
 
         if (ctx->neg_flags & NTLMSSP_NEGOTIATE_KEY_EXCH) {
+            if (enc_sess_key.length != 16) {
+                set_GSSERRS(ERR_DECODE, GSS_S_DEFECTIVE_TOKEN);
+                goto done;
+            }
             memcpy(encrypted_random_session_key.data, enc_sess_key.data, 16);
             ctx->exported_session_key.length = 16;
 
@@ -939,9 +979,11 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
 
         /* check if MIC was sent */
         if (av_flags & MSVAVFLAGS_MIC_PRESENT) {
+            GSSNTLM_PROBE(auth_mic_start, ctx, ctx->auth_msg.length);
             retmin = ntlm_verify_mic(&ctx->exported_session_key,
                                      &ctx->nego_msg, &ctx->chal_msg,
                                      &ctx->auth_msg, &mic);
+            GSSNTLM_PROBE(auth_mic_done, ctx, retmin);
             if (retmin) {
                 set_GSSERRS(retmin, GSS_S_DEFECTIVE_TOKEN);
                 goto done;
@@ -971,12 +1013,12 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
                 if (retmin) {
                     set_GSSERRS(retmin, GSS_S_DEFECTIVE_TOKEN);
                     goto done;
+                }
+                events |= GSSNTLM_EVENT(GSSNTLM_CNT_CBT);
 /* This flag has been introduced only recently in MIT krb5 */
 #ifdef GSS_C_CHANNEL_BOUND_FLAG
-                } else {
-                    ctx->gss_flags |= GSS_C_CHANNEL_BOUND_FLAG;
+                ctx->gss_flags |= GSS_C_CHANNEL_BOUND_FLAG;
 #endif /* GSS_C_CHANNEL_BOUND_FLAG */
-                }
             }
         }
 
@@ -1001,10 +1043,24 @@ uint32_t gssntlm_accept_sec_context(uint32_t *minor_status,
         ctx->stage = NTLMSSP_STAGE_DONE;
         ctx->expiration_time = time(NULL) + MAX_CHALRESP_LIFETIME;
         ctx->int_flags |= NTLMSSP_CTX_FLAG_ESTABLISHED;
+        release_handshake_data(ctx);
+
+        events |= GSSNTLM_EVENT(is_ntlm_v1(&nt_chal_resp) ?
+                                GSSNTLM_CNT_NTLMV1 : GSSNTLM_CNT_NTLMV2);
+        events |= GSSNTLM_EVENT(usr_cred->type == GSSNTLM_CRED_EXTERNAL ?
+                                GSSNTLM_CNT_EXTERNAL : GSSNTLM_CNT_LOCAL);
+        if (av_flags & MSVAVFLAGS_MIC_PRESENT) {
+            events |= GSSNTLM_EVENT(GSSNTLM_CNT_MIC);
+        }
+        gssntlm_metrics_established(true, events);
+
         set_GSSERRS(0, GSS_S_COMPLETE);
     }
 
 done:
+    gssntlm_metrics_leg(true, first_leg, retmaj, retmin, start);
+    GSSNTLM_PROBE(accept_done, ctx, PROBE_STAGE(ctx), retmaj, retmin,
+                  GSS_ERROR(retmaj) ? 0 : output_token->length);
 
     if ((retmaj != GSS_S_COMPLETE) &&
         (retmaj != GSS_S_CONTINUE_NEEDED)) {
@@ -1018,16 +1074,7 @@ done:
     gssntlm_release_name(&tmpmin, (gss_name_t *)&server_name);
     gssntlm_release_name(&tmpmin, (gss_name_t *)&gss_usrname);
     gssntlm_release_cred(&tmpmin, (gss_cred_id_t *)&usr_cred);
-    safefree(computer_name);
-    safefree(nb_computer_name);
-    safefree(nb_domain_name);
-    safefree(usr_name);
-    safefree(dom_name);
-    safefree(wks_name);
-    ntlm_free_buffer_data(&nt_chal_resp);
-    ntlm_free_buffer_data(&lm_chal_resp);
-    ntlm_free_buffer_data(&enc_sess_key);
-    ntlm_free_buffer_data(&target_info);
+    gssntlm_identity_release(&identity);
 
     return GSSERR();
 }
@@ -1052,6 +1099,11 @@ uint32_t gssntlm_inquire_context(uint32_t *minor_status,
         return GSSERRS(ERR_NOARG, GSS_S_NO_CONTEXT);
     }
 
+    if (src_name || targ_name) {
+        retmaj = gssntlm_ctx_unpack_names(&retmin, ctx);
+        if (retmaj) goto done;
+    }
+
     if (src_name) {
         retmaj = gssntlm_duplicate_name(&retmin,
                                         (gss_name_t)&ctx->source_name,
@@ -1120,11 +1172,16 @@ uint32_t gssntlm_set_seq_num(uint32_t *minor_status,
 {
     uint32_t retmin;
     uint32_t retmaj;
+    CTX_TABLE_SCOPE(table_lock);
 
     if (ctx->gss_flags & GSS_C_DATAGRAM_FLAG) {
         if (value->length != 4) {
             return GSSERRS(ERR_BADARG, GSS_S_FAILURE);
         }
+        retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+        if (retmin) {
+            return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+        }
         memcpy(&ctx->crypto_state.recv.seq_num,
                value->value, value->length);
         ctx->crypto_state.send.seq_num = ctx->crypto_state.recv.seq_num;
@@ -1146,6 +1203,7 @@ uint32_t gssntlm_reset_crypto(uint32_t *minor_status,
 {
     uint32_t retmin;
     uint32_t retmaj;
+    CTX_TABLE_SCOPE(table_lock);
 
     if (value->length != 4) {
         return GSSERRS(ERR_BADARG, GSS_S_FAILURE);
@@ -1156,6 +1214,12 @@ uint32_t gssntlm_reset_crypto(uint32_t *minor_status,
                             NTLMSSP_NEGOTIATE_SEAL)) {
         uint32_t val;
 
+        retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+        if (retmin) {
+            return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+        }
+        table_lock.dirty = true;
+
         memcpy(&val, value->value, value->length);
 
         /* A val of 1 means we want to reset the verifier handle,
@@ -1172,6 +1236,48 @@ uint32_t gssntlm_reset_crypto(uint32_t *minor_status,
     return GSSERRS(0, GSS_S_COMPLETE);
 }
 
+gss_OID_desc prefetch_keystream_oid = {
+    GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_LENGTH,
+    discard_const(GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_STRING)
+};
+
+#define PREFETCH_KEYSTREAM_DEFAULT (4 * 1024)
+
+uint32_t gssntlm_prefetch_keystream(uint32_t *minor_status,
+                                    struct gssntlm_ctx *ctx,
+                                    const gss_buffer_t value)
+{
+    uint32_t length = PREFETCH_KEYSTREAM_DEFAULT;
+    uint32_t retmin;
+    uint32_t retmaj;
+
+    if (value && value->length != 0) {
+        if (value->length != 4) {
+            return GSSERRS(ERR_BADARG, GSS_S_FAILURE);
+        }
+        memcpy(&length, value->value, value->length);
+    }
+
+    retmaj = gssntlm_context_is_valid(ctx, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(ERR_BADCTX, retmaj);
+    }
+    if (ctx->gss_flags & GSS_C_DATAGRAM_FLAG) {
+        return GSSERRS(ERR_WRONGCTX, GSS_S_FAILURE);
+    }
+    if (!(ctx->neg_flags & (NTLMSSP_NEGOTIATE_SIGN |
+                            NTLMSSP_NEGOTIATE_SEAL))) {
+        return GSSERRS(ERR_NOTAVAIL, GSS_S_UNAVAILABLE);
+    }
+
+    retmin = ntlm_signseal_prefetch(&ctx->crypto_state, length);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
 uint32_t gssntlm_set_sec_context_option(uint32_t *minor_status,
                                         gss_ctx_id_t *context_handle,
                                         const gss_OID desired_object,
@@ -1195,6 +1301,13 @@ uint32_t gssntlm_set_sec_context_option(uint32_t *minor_status,
         return gssntlm_set_seq_num(minor_status, ctx, value);
     } else if (gss_oid_equal(desired_object, &reset_crypto_oid)) {
         return gssntlm_reset_crypto(minor_status, ctx, value);
+    } else if (gss_oid_equal(desired_object, &invalidate_identity_oid)) {
+        gssntlm_identity_invalidate();
+        return GSSERRS(0, GSS_S_COMPLETE);
+    } else if (gss_oid_equal(desired_object, &prefetch_keystream_oid)) {
+        return gssntlm_prefetch_keystream(minor_status, ctx, value);
+    } else if (gss_oid_equal(desired_object, &ctx_table_oid)) {
+        return gssntlm_ctx_table_share(minor_status, ctx);
     }
 
     return GSSERRS(ERR_BADARG, GSS_S_UNAVAILABLE);
@@ -1334,6 +1447,10 @@ uint32_t gssntlm_inquire_sec_context_by_oid(uint32_t *minor_status,
         return gssntlm_sasl_ssf(minor_status, ctx, data_set);
     } else if (gss_oid_equal(desired_object, GSS_C_INQ_SSPI_SESSION_KEY)) {
       return gssntlm_sspi_session_key(minor_status, ctx, data_set);
+    } else if (gss_oid_equal(desired_object, &metrics_oid)) {
+        return gssntlm_metrics_inquire(minor_status, data_set);
+    } else if (gss_oid_equal(desired_object, &ctx_table_oid)) {
+        return gssntlm_ctx_table_inquire(minor_status, ctx, data_set);
     }
 
     return GSSERRS(ERR_NOTSUPPORTED, GSS_S_UNAVAILABLE);
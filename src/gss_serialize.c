@@ -84,6 +84,48 @@ struct export_ctx {
 #define EXP_NAME_USER 2
 #define EXP_NAME_SERV 3
 
+/* Established contexts are exported in a fixed layout that only carries
+ * what the per-message calls need. The names come last, encoded as in the
+ * full format with pointers relative to 'data', and they are only decoded
+ * if the importer asks for them. */
+#define EXPORT_CTX_COMPACT_VER 0x0005
+#pragma pack(push, 1)
+struct export_compact_keys {
+    uint32_t seq_num;
+    uint8_t sign_key_len;
+    uint8_t seal_key_len;
+    uint8_t has_rc4_state;
+    uint8_t sign_key[16];
+    uint8_t seal_key[16];
+    /* x, y and the 256 entries of the state, one byte each */
+    uint8_t rc4_state[258];
+};
+
+struct export_ctx_compact {
+    uint16_t version;
+    uint8_t role;
+    uint32_t gss_flags;
+    uint32_t neg_flags;
+    uint32_t int_flags;
+    uint64_t expiration_time;
+    uint8_t exported_session_key_len;
+    uint8_t exported_session_key[16];
+    struct export_compact_keys send;
+    struct export_compact_keys recv;
+
+    struct export_name source;
+    struct export_name target;
+    uint8_t data[];
+};
+
+/* A context in the shared table is exported as a reference to its entry */
+#define EXPORT_CTX_TABLE_VER 0x0006
+struct export_ctx_ref {
+    uint16_t version;
+    uint64_t id;
+};
+#pragma pack(pop)
+
 #define INC_EXP_SIZE 0x001000 /* 4K */
 #define MAX_EXP_SIZE 0x100000 /* 1M */
 
@@ -103,6 +145,42 @@ struct export_state {
 #define RELMEM_ZERO(rm) \
     memset((rm), 0, sizeof(struct relmem))
 
+static uint8_t export_role(enum gssntlm_role role)
+{
+    switch (role) {
+    case GSSNTLM_CLIENT:
+        return EXP_CTX_CLIENT;
+    case GSSNTLM_SERVER:
+        return EXP_CTX_SERVER;
+    case GSSNTLM_DOMAIN_SERVER:
+        return EXP_CTX_DOMSRV;
+    case GSSNTLM_DOMAIN_CONTROLLER:
+        return EXP_CTX_DOMCTR;
+    }
+    return 0;
+}
+
+static int import_role(uint8_t exp_role, enum gssntlm_role *role)
+{
+    switch (exp_role) {
+    case EXP_CTX_CLIENT:
+        *role = GSSNTLM_CLIENT;
+        break;
+    case EXP_CTX_SERVER:
+        *role = GSSNTLM_SERVER;
+        break;
+    case EXP_CTX_DOMSRV:
+        *role = GSSNTLM_DOMAIN_SERVER;
+        break;
+    case EXP_CTX_DOMCTR:
+        *role = GSSNTLM_DOMAIN_CONTROLLER;
+        break;
+    default:
+        return EINVAL;
+    }
+    return 0;
+}
+
 static int export_data_allocate(struct export_state *state,
                                 size_t length, struct relmem *rm)
 {
@@ -242,6 +320,32 @@ static int export_name(struct export_state *state,
     return export_attrs(state, name->attrs, &exp_name->attrs);
 }
 
+/* how much export_name() adds to the data area */
+static size_t export_name_size(struct gssntlm_name *name)
+{
+    size_t size = 0;
+    size_t i;
+
+    switch (name->type) {
+    case GSSNTLM_NAME_USER:
+        if (name->data.user.domain) size += strlen(name->data.user.domain);
+        if (name->data.user.name) size += strlen(name->data.user.name);
+        break;
+    case GSSNTLM_NAME_SERVER:
+        if (name->data.server.name) size += strlen(name->data.server.name);
+        break;
+    default:
+        break;
+    }
+
+    for (i = 0; name->attrs && name->attrs[i].attr_name; i++) {
+        size += 2 * sizeof(struct relmem) +
+                strlen(name->attrs[i].attr_name) +
+                name->attrs[i].attr_value.length;
+    }
+    return size;
+}
+
 static int export_keys(struct export_state *state,
                        struct ntlm_signseal_handle *keys,
                        struct export_keys *exp_keys)
@@ -282,6 +386,134 @@ static int export_keys(struct export_state *state,
     return 0;
 }
 
+int gssntlm_rc4_pack(struct ntlm_rc4_handle *handle, uint8_t state[258])
+{
+    uint32_t rc4_state[258];
+    struct ntlm_buffer out = { (uint8_t *)rc4_state, sizeof(rc4_state) };
+    int ret;
+    int i;
+
+    ret = RC4_EXPORT(handle, &out);
+    if (ret) return ret;
+    /* every entry is a byte */
+    for (i = 0; i < 258; i++) {
+        state[i] = rc4_state[i];
+    }
+    safezero((uint8_t *)rc4_state, sizeof(rc4_state));
+    return 0;
+}
+
+int gssntlm_rc4_unpack(const uint8_t state[258],
+                       struct ntlm_rc4_handle **handle)
+{
+    uint32_t rc4_state[258];
+    struct ntlm_buffer in = { (uint8_t *)rc4_state, sizeof(rc4_state) };
+    int ret;
+    int i;
+
+    for (i = 0; i < 258; i++) {
+        rc4_state[i] = state[i];
+    }
+    ret = RC4_IMPORT(handle, &in);
+    safezero((uint8_t *)rc4_state, sizeof(rc4_state));
+    return ret;
+}
+
+static int export_compact_keys(struct ntlm_signseal_handle *keys,
+                               struct export_compact_keys *exp_keys)
+{
+    int ret;
+
+    exp_keys->seq_num = htole32(keys->seq_num);
+
+    exp_keys->sign_key_len = keys->sign_key.length;
+    memcpy(exp_keys->sign_key, keys->sign_key.data, keys->sign_key.length);
+    exp_keys->seal_key_len = keys->seal_key.length;
+    memcpy(exp_keys->seal_key, keys->seal_key.data, keys->seal_key.length);
+
+    if (keys->seal_handle) {
+        ret = gssntlm_rc4_pack(keys->seal_handle, exp_keys->rc4_state);
+        if (ret) return ret;
+        exp_keys->has_rc4_state = 1;
+    }
+    return 0;
+}
+
+/* a single allocation of the exact size, nothing is ever reallocated */
+static int export_ctx_compact(struct gssntlm_ctx *ctx,
+                              struct export_state *state)
+{
+    struct export_ctx_compact *ectx;
+    struct export_name source;
+    struct export_name target;
+    size_t names_len;
+    int ret;
+
+    if (ctx->packed_names.length > 0) {
+        /* imported and never decoded, they are already in export format */
+        names_len = ctx->packed_names.length;
+    } else {
+        names_len = 2 * sizeof(struct export_name) +
+                    export_name_size(&ctx->source_name) +
+                    export_name_size(&ctx->target_name);
+    }
+
+    state->exp_data = offsetof(struct export_ctx_compact, data);
+    state->exp_size = offsetof(struct export_ctx_compact, source) + names_len;
+    if (state->exp_size > MAX_EXP_SIZE) return E2BIG;
+    state->exp_struct = calloc(1, state->exp_size);
+    if (!state->exp_struct) return ENOMEM;
+    state->exp_len = state->exp_data;
+
+    if (ctx->packed_names.length > 0) {
+        memcpy(state->exp_struct + offsetof(struct export_ctx_compact, source),
+               ctx->packed_names.data, names_len);
+        state->exp_len = state->exp_size;
+    } else {
+        ret = export_name(state, &ctx->source_name, &source);
+        if (ret) return ret;
+        ret = export_name(state, &ctx->target_name, &target);
+        if (ret) return ret;
+    }
+
+    ectx = (struct export_ctx_compact *)state->exp_struct;
+    if (ctx->packed_names.length == 0) {
+        memcpy(&ectx->source, &source, sizeof(struct export_name));
+        memcpy(&ectx->target, &target, sizeof(struct export_name));
+    }
+
+    ectx->version = htole16(EXPORT_CTX_COMPACT_VER);
+    ectx->role = export_role(ctx->role);
+    ectx->gss_flags = htole32(ctx->gss_flags);
+    ectx->neg_flags = htole32(ctx->neg_flags);
+    ectx->int_flags = htole32(ctx->int_flags & ~NTLMSSP_CTX_FLAG_SHARED);
+    ectx->expiration_time = htole64((uint64_t)ctx->expiration_time);
+
+    ectx->exported_session_key_len = ctx->exported_session_key.length;
+    memcpy(ectx->exported_session_key, ctx->exported_session_key.data,
+           ctx->exported_session_key.length);
+
+    ret = export_compact_keys(&ctx->crypto_state.send, &ectx->send);
+    if (ret) return ret;
+    return export_compact_keys(&ctx->crypto_state.recv, &ectx->recv);
+}
+
+int gssntlm_ctx_pack(struct gssntlm_ctx *ctx, struct ntlm_buffer *token)
+{
+    struct export_state state = { 0 };
+    int ret;
+
+    ret = export_ctx_compact(ctx, &state);
+    if (ret) {
+        if (state.exp_struct) safezero(state.exp_struct, state.exp_size);
+        free(state.exp_struct);
+        return ret;
+    }
+    token->data = state.exp_struct;
+    token->length = state.exp_len;
+    return 0;
+}
+
 uint32_t gssntlm_export_sec_context(uint32_t *minor_status,
                                     gss_ctx_id_t *context_handle,
                                     gss_buffer_t interprocess_token)
@@ -309,6 +541,40 @@ uint32_t gssntlm_export_sec_context(uint32_t *minor_status,
         return GSSERRS(ERR_EXPIRED, GSS_S_CONTEXT_EXPIRED);
     }
 
+    if (ctx->int_flags & NTLMSSP_CTX_FLAG_SHARED) {
+        struct export_ctx_ref *ref;
+
+        state.exp_size = sizeof(struct export_ctx_ref);
+        state.exp_struct = malloc(state.exp_size);
+        if (!state.exp_struct) {
+            set_GSSERR(ENOMEM);
+            goto done;
+        }
+        ref = (struct export_ctx_ref *)state.exp_struct;
+        ref->version = htole16(EXPORT_CTX_TABLE_VER);
+        ref->id = htole64(ctx->table_id);
+        state.exp_len = state.exp_size;
+        /* keep the entry until the token is imported */
+        ret = gssntlm_ctx_table_exported(ctx->table_id);
+        if (ret) {
+            set_GSSERRS(ret == ENOENT ? ERR_BADCTX : ret,
+                        ret == ENOENT ? GSS_S_NO_CONTEXT : GSS_S_FAILURE);
+            goto done;
+        }
+        set_GSSERRS(0, GSS_S_COMPLETE);
+        goto done;
+    }
+
+    if (ctx->stage == NTLMSSP_STAGE_DONE) {
+        ret = export_ctx_compact(ctx, &state);
+        if (ret) {
+            set_GSSERR(ret);
+            goto done;
+        }
+        set_GSSERRS(0, GSS_S_COMPLETE);
+        goto done;
+    }
+
     /* we want to leave space to add the basic context structure in the buffer
      * however we want a memory stable structure we can refernce via memory
      * pointers while we run export functions for all the "static" context
@@ -325,20 +591,7 @@ uint32_t gssntlm_export_sec_context(uint32_t *minor_status,
 
     ectx.version = htole16(EXPORT_CTX_VER);
 
-    switch(ctx->role) {
-    case GSSNTLM_CLIENT:
-        ectx.role = EXP_CTX_CLIENT;
-        break;
-    case GSSNTLM_SERVER:
-        ectx.role = EXP_CTX_SERVER;
-        break;
-    case GSSNTLM_DOMAIN_SERVER:
-        ectx.role = EXP_CTX_DOMSRV;
-        break;
-    case GSSNTLM_DOMAIN_CONTROLLER:
-        ectx.role = EXP_CTX_DOMCTR;
-        break;
-    }
+    ectx.role = export_role(ctx->role);
 
     switch(ctx->stage) {
     case NTLMSSP_STAGE_INIT:
@@ -461,6 +714,7 @@ uint32_t gssntlm_export_sec_context(uint32_t *minor_status,
 
 done:
     if (retmaj) {
+        if (state.exp_struct) safezero(state.exp_struct, state.exp_size);
         free(state.exp_struct);
     } else {
         uint32_t min;
@@ -544,6 +798,13 @@ static uint32_t import_attrs(uint32_t *minor_status,
 
     if (attrs->count == 0) goto done;
 
+    if (state->exp_data + attrs->buffers.ptr +
+            (size_t)attrs->count * 2 * sizeof(struct relmem) >
+            state->exp_len) {
+        set_GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+        goto done;
+    }
+
     a = calloc(attrs->count + 1, sizeof(struct gssntlm_name_attribute));
     if (a == NULL) {
         set_GSSERR(ENOMEM);
@@ -660,6 +921,11 @@ static uint32_t import_keys(uint32_t *minor_status,
                                  &dest, &imp_keys->sign_key.length,
                                  false, &keys->sign_key, false);
         if (retmaj != GSS_S_COMPLETE) goto done;
+        ret = ntlm_sign_handle(imp_keys);
+        if (ret) {
+            set_GSSERR(ret);
+            goto done;
+        }
     } else {
         memset(&imp_keys->sign_key, 0, sizeof(struct ntlm_key));
     }
@@ -699,13 +965,182 @@ done:
     return GSSERR();
 }
 
+static int import_compact_keys(struct export_compact_keys *keys,
+                               struct ntlm_signseal_handle *imp_keys)
+{
+    int ret;
+
+    if (keys->sign_key_len > 16 || keys->seal_key_len > 16) return EINVAL;
+
+    imp_keys->sign_key.length = keys->sign_key_len;
+    memcpy(imp_keys->sign_key.data, keys->sign_key, keys->sign_key_len);
+    if (imp_keys->sign_key.length > 0) {
+        ret = ntlm_sign_handle(imp_keys);
+        if (ret) return ret;
+    }
+
+    imp_keys->seal_key.length = keys->seal_key_len;
+    memcpy(imp_keys->seal_key.data, keys->seal_key, keys->seal_key_len);
+
+    if (keys->has_rc4_state) {
+        ret = gssntlm_rc4_unpack(keys->rc4_state, &imp_keys->seal_handle);
+        if (ret) return ret;
+    }
+
+    imp_keys->seq_num = le32toh(keys->seq_num);
+    return 0;
+}
+
+/* only the fixed part is decoded, the names are kept as they are in the
+ * token until gssntlm_ctx_unpack_names() is called */
+static uint32_t import_ctx_compact(uint32_t *minor_status,
+                                   gss_buffer_t interprocess_token,
+                                   struct gssntlm_ctx *ctx)
+{
+    struct export_ctx_compact *ectx;
+    uint32_t retmaj;
+    uint32_t retmin;
+    int ret;
+
+    if (interprocess_token->length < sizeof(struct export_ctx_compact)) {
+        return GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+    }
+    ectx = (struct export_ctx_compact *)interprocess_token->value;
+
+    if (import_role(ectx->role, &ctx->role) != 0) {
+        return GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+    }
+    ctx->stage = NTLMSSP_STAGE_DONE;
+
+    ctx->gss_flags = le32toh(ectx->gss_flags);
+    ctx->neg_flags = le32toh(ectx->neg_flags);
+    ctx->int_flags = le32toh(ectx->int_flags);
+    ctx->expiration_time = le64toh(ectx->expiration_time);
+
+    if (ectx->exported_session_key_len > 16) {
+        return GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+    }
+    ctx->exported_session_key.length = ectx->exported_session_key_len;
+    memcpy(ctx->exported_session_key.data, ectx->exported_session_key,
+           ectx->exported_session_key_len);
+
+    ret = import_compact_keys(&ectx->send, &ctx->crypto_state.send);
+    if (ret == 0) {
+        ret = import_compact_keys(&ectx->recv, &ctx->crypto_state.recv);
+    }
+    if (ret) {
+        return GSSERRS(ret, ret == EINVAL ? GSS_S_DEFECTIVE_TOKEN :
+                                           GSS_S_FAILURE);
+    }
+    ctx->crypto_state.ext_sec =
+        (ctx->neg_flags & NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY);
+    ctx->crypto_state.datagram =
+        (ctx->neg_flags & NTLMSSP_NEGOTIATE_DATAGRAM);
+
+    if (ectx->source.type != EXP_NAME_NONE ||
+        ectx->target.type != EXP_NAME_NONE) {
+        ret = gssntlm_arena_copy(&ctx->arena, &ectx->source,
+                                 interprocess_token->length -
+                                    offsetof(struct export_ctx_compact,
+                                             source),
+                                 &ctx->packed_names);
+        if (ret) {
+            return GSSERRS(ret, GSS_S_FAILURE);
+        }
+    }
+
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
+/* the context is copied out of its table entry, its per-message state is
+ * synced from the entry before the first use */
+static uint32_t import_ctx_ref(uint32_t *minor_status,
+                               gss_buffer_t interprocess_token,
+                               struct gssntlm_ctx *ctx)
+{
+    struct export_ctx_ref ref;
+    struct ntlm_buffer token;
+    gss_buffer_desc buf;
+    uint32_t retmaj;
+    uint32_t retmin;
+    int ret;
+
+    if (interprocess_token->length != sizeof(struct export_ctx_ref)) {
+        return GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+    }
+    memcpy(&ref, interprocess_token->value, sizeof(struct export_ctx_ref));
+
+    ret = gssntlm_ctx_table_attach(le64toh(ref.id), &token);
+    if (ret) {
+        return GSSERRS(ret == ENOENT ? ERR_BADCTX : ret,
+                       ret == ENOENT ? GSS_S_NO_CONTEXT : GSS_S_FAILURE);
+    }
+
+    buf.value = token.data;
+    buf.length = token.length;
+    retmaj = import_ctx_compact(&retmin, &buf, ctx);
+    safezero(token.data, token.length);
+    free(token.data);
+    if (retmaj != GSS_S_COMPLETE) {
+        gssntlm_ctx_table_detach(le64toh(ref.id));
+        return GSSERR();
+    }
+
+    ctx->table_id = le64toh(ref.id);
+    ctx->table_version = 0;
+    ctx->int_flags |= NTLMSSP_CTX_FLAG_SHARED;
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
+uint32_t gssntlm_ctx_unpack_names(uint32_t *minor_status,
+                                  struct gssntlm_ctx *ctx)
+{
+    struct export_state state;
+    struct export_name source;
+    struct export_name target;
+    uint32_t retmaj;
+    uint32_t retmin;
+
+    if (ctx->packed_names.length == 0) {
+        return GSSERRS(0, GSS_S_COMPLETE);
+    }
+
+    state.exp_struct = ctx->packed_names.data;
+    state.exp_len = ctx->packed_names.length;
+    state.exp_data = 2 * sizeof(struct export_name);
+    state.exp_size = state.exp_len;
+
+    memcpy(&source, state.exp_struct, sizeof(struct export_name));
+    memcpy(&target, state.exp_struct + sizeof(struct export_name),
+           sizeof(struct export_name));
+
+    retmaj = import_name(&retmin, &state, &source, &ctx->source_name);
+    if (retmaj != GSS_S_COMPLETE) goto done;
+    retmaj = import_name(&retmin, &state, &target, &ctx->target_name);
+    if (retmaj != GSS_S_COMPLETE) goto done;
+
+    set_GSSERRS(0, GSS_S_COMPLETE);
+
+done:
+    if (retmaj == GSS_S_COMPLETE) {
+        /* the arena still owns the copy, it goes with the context */
+        ctx->packed_names.length = 0;
+    } else {
+        gssntlm_int_release_name(&ctx->source_name);
+        gssntlm_int_release_name(&ctx->target_name);
+    }
+    return GSSERR();
+}
+
 uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
                                     gss_buffer_t interprocess_token,
                                     gss_ctx_id_t *context_handle)
 {
     struct gssntlm_ctx *ctx = NULL;
+    struct ntlm_buffer workstation;
     struct export_state state;
     struct export_ctx *ectx;
+    uint16_t version;
     uint8_t *dest;
     uint64_t time;
     uint32_t retmaj;
@@ -715,7 +1150,7 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
         return GSSERRS(0, GSS_S_CALL_INACCESSIBLE_READ);
     }
 
-    if (interprocess_token->length < sizeof(struct export_ctx)) {
+    if (interprocess_token->length < sizeof(uint16_t)) {
         return GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
     }
 
@@ -723,7 +1158,7 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
         return GSSERRS(0, GSS_S_CALL_INACCESSIBLE_WRITE);
     }
 
-    ctx = calloc(1, sizeof(struct gssntlm_ctx));
+    ctx = gssntlm_obj_alloc(GSSNTLM_OBJ_CTX);
     if (!ctx) {
         set_GSSERR(ENOMEM);
         goto done;
@@ -734,6 +1169,21 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
         goto done;
     }
 
+    memcpy(&version, interprocess_token->value, sizeof(uint16_t));
+    if (le16toh(version) == EXPORT_CTX_COMPACT_VER) {
+        retmaj = import_ctx_compact(&retmin, interprocess_token, ctx);
+        goto done;
+    }
+    if (le16toh(version) == EXPORT_CTX_TABLE_VER) {
+        retmaj = import_ctx_ref(&retmin, interprocess_token, ctx);
+        goto done;
+    }
+
+    if (interprocess_token->length < sizeof(struct export_ctx)) {
+        set_GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
+        goto done;
+    }
+
     state.exp_struct = interprocess_token->value;
     state.exp_len = interprocess_token->length;
     ectx = (struct export_ctx *)state.exp_struct;
@@ -744,20 +1194,7 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
         goto done;
     }
 
-    switch (ectx->role) {
-    case EXP_CTX_CLIENT:
-        ctx->role = GSSNTLM_CLIENT;
-        break;
-    case EXP_CTX_SERVER:
-        ctx->role = GSSNTLM_SERVER;
-        break;
-    case EXP_CTX_DOMSRV:
-        ctx->role = GSSNTLM_DOMAIN_SERVER;
-        break;
-    case EXP_CTX_DOMCTR:
-        ctx->role = GSSNTLM_DOMAIN_CONTROLLER;
-        break;
-    default:
+    if (import_role(ectx->role, &ctx->role) != 0) {
         set_GSSERRS(0, GSS_S_DEFECTIVE_TOKEN);
         goto done;
     }
@@ -790,6 +1227,13 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
         retmaj = import_data_buffer(&retmin, &state, &dest, NULL,
                                  true, &ectx->workstation, true);
         if (retmaj != GSS_S_COMPLETE) goto done;
+        workstation.data = dest;
+        workstation.length = strlen((char *)dest) + 1;
+        retmin = gssntlm_arena_adopt(&ctx->arena, &workstation);
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
+        }
     }
     ctx->workstation = (char *)dest;
 
@@ -798,6 +1242,11 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
                                  &ctx->nego_msg.data, &ctx->nego_msg.length,
                                  true, &ectx->nego_msg, false);
         if (retmaj != GSS_S_COMPLETE) goto done;
+        retmin = gssntlm_arena_adopt(&ctx->arena, &ctx->nego_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
+        }
     } else {
         ctx->nego_msg.data = NULL;
         ctx->nego_msg.length = 0;
@@ -808,6 +1257,11 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
                                  &ctx->chal_msg.data, &ctx->chal_msg.length,
                                  true, &ectx->chal_msg, false);
         if (retmaj != GSS_S_COMPLETE) goto done;
+        retmin = gssntlm_arena_adopt(&ctx->arena, &ctx->chal_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
+        }
     } else {
         ctx->chal_msg.data = NULL;
         ctx->chal_msg.length = 0;
@@ -818,6 +1272,11 @@ uint32_t gssntlm_import_sec_context(uint32_t *minor_status,
                                  &ctx->auth_msg.data, &ctx->auth_msg.length,
                                  true, &ectx->auth_msg, false);
         if (retmaj != GSS_S_COMPLETE) goto done;
+        retmin = gssntlm_arena_adopt(&ctx->arena, &ctx->auth_msg);
+        if (retmin) {
+            set_GSSERR(retmin);
+            goto done;
+        }
     } else {
         ctx->auth_msg.data = NULL;
         ctx->auth_msg.length = 0;
@@ -1041,11 +1500,12 @@ uint32_t gssntlm_import_cred(uint32_t *minor_status,
         return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_WRITE);
     }
 
-    cred = calloc(1, sizeof(struct gssntlm_cred));
+    cred = gssntlm_obj_alloc(GSSNTLM_OBJ_CRED);
     if (!cred) {
         set_GSSERR(ENOMEM);
         goto done;
     }
+    cred->refs = 1;
 
     state.exp_struct = token->value;
     state.exp_len = token->length;
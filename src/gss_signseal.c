@@ -18,12 +18,15 @@ uint32_t gssntlm_get_mic(uint32_t *minor_status,
     struct ntlm_buffer message;
     struct ntlm_buffer signature;
     uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
 
     ctx = (struct gssntlm_ctx *)context_handle;
     retmaj = gssntlm_context_is_valid(ctx, NULL);
     if (retmaj != GSS_S_COMPLETE) {
         return GSSERRS(ERR_BADCTX, retmaj);
     }
+    DEBUG_CTX(ctx, ctx->stage);
     if (qop_req != GSS_C_QOP_DEFAULT) {
         return GSSERRS(ERR_BADARG, GSS_S_BAD_QOP);
     }
@@ -31,6 +34,11 @@ uint32_t gssntlm_get_mic(uint32_t *minor_status,
         return GSSERRS(ERR_BADARG, GSS_S_CALL_INACCESSIBLE_READ);
     }
 
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
     message_token->value = malloc(NTLM_SIGNATURE_SIZE);
     if (!message_token->value) {
         return GSSERRS(ENOMEM, GSS_S_FAILURE);
@@ -63,12 +71,15 @@ uint32_t gssntlm_verify_mic(uint32_t *minor_status,
     uint8_t token[16];
     struct ntlm_buffer signature = { token, NTLM_SIGNATURE_SIZE };
     uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
 
     ctx = (struct gssntlm_ctx *)context_handle;
     retmaj = gssntlm_context_is_valid(ctx, NULL);
     if (retmaj != GSS_S_COMPLETE) {
         return GSSERRS(ERR_BADCTX, retmaj);
     }
+    DEBUG_CTX(ctx, ctx->stage);
     if (!message_buffer->value || message_buffer->length == 0) {
         return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
     }
@@ -76,6 +87,11 @@ uint32_t gssntlm_verify_mic(uint32_t *minor_status,
         *qop_state = GSS_C_QOP_DEFAULT;
     }
 
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
     message.data = message_buffer->value;
     message.length = message_buffer->length;
     retmin = ntlm_sign(ctx->neg_flags, NTLM_RECV,
@@ -105,13 +121,17 @@ uint32_t gssntlm_wrap(uint32_t *minor_status,
     struct ntlm_buffer message;
     struct ntlm_buffer output;
     struct ntlm_buffer signature;
+    uint64_t start = gssntlm_metrics_message_start();
     uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
 
     ctx = (struct gssntlm_ctx *)context_handle;
     retmaj = gssntlm_context_is_valid(ctx, NULL);
     if (retmaj != GSS_S_COMPLETE) {
         return GSSERRS(ERR_BADCTX, retmaj);
     }
+    DEBUG_CTX(ctx, ctx->stage);
     if (qop_req != GSS_C_QOP_DEFAULT) {
         return GSSERRS(ERR_BADARG, GSS_S_BAD_QOP);
     }
@@ -126,6 +146,11 @@ uint32_t gssntlm_wrap(uint32_t *minor_status,
         /* ignore, always seal */
     }
 
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
     output_message_buffer->length =
         input_message_buffer->length + NTLM_SIGNATURE_SIZE;
     output_message_buffer->value = malloc(output_message_buffer->length);
@@ -149,6 +174,7 @@ uint32_t gssntlm_wrap(uint32_t *minor_status,
     if (conf_state) {
         *conf_state = 1;
     }
+    gssntlm_metrics_message(false, message.length, start);
     return GSSERRS(0, GSS_S_COMPLETE);
 }
 
@@ -164,13 +190,17 @@ uint32_t gssntlm_unwrap(uint32_t *minor_status,
     struct ntlm_buffer output;
     uint8_t sig[16];
     struct ntlm_buffer signature = { sig, NTLM_SIGNATURE_SIZE };
+    uint64_t start = gssntlm_metrics_message_start();
     uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
 
     ctx = (struct gssntlm_ctx *)context_handle;
     retmaj = gssntlm_context_is_valid(ctx, NULL);
     if (retmaj != GSS_S_COMPLETE) {
         return GSSERRS(ERR_BADCTX, retmaj);
     }
+    DEBUG_CTX(ctx, ctx->stage);
     if (!input_message_buffer->value || input_message_buffer->length == 0) {
         return GSSERRS(ERR_BADARG, GSS_S_CALL_INACCESSIBLE_READ);
     }
@@ -181,6 +211,11 @@ uint32_t gssntlm_unwrap(uint32_t *minor_status,
         *qop_state = GSS_C_QOP_DEFAULT;
     }
 
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
     output_message_buffer->length =
         input_message_buffer->length - NTLM_SIGNATURE_SIZE;
     output_message_buffer->value = malloc(output_message_buffer->length);
@@ -208,6 +243,7 @@ uint32_t gssntlm_unwrap(uint32_t *minor_status,
     if (conf_state) {
         *conf_state = 1;
     }
+    gssntlm_metrics_message(true, output.length, start);
     return GSSERRS(0, GSS_S_COMPLETE);
 }
 
@@ -220,12 +256,14 @@ uint32_t gssntlm_wrap_size_limit(uint32_t *minor_status,
 {
     struct gssntlm_ctx *ctx;
     uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
 
     ctx = (struct gssntlm_ctx *)context_handle;
     retmaj = gssntlm_context_is_valid(ctx, NULL);
     if (retmaj != GSS_S_COMPLETE) {
         return GSSERRS(ERR_BADCTX, retmaj);
     }
+    DEBUG_CTX(ctx, ctx->stage);
 
     if (qop_req != GSS_C_QOP_DEFAULT) {
         return GSSERRS(ERR_BADARG, GSS_S_BAD_QOP);
@@ -239,3 +277,276 @@ uint32_t gssntlm_wrap_size_limit(uint32_t *minor_status,
 
     return GSSERRS(0, GSS_S_COMPLETE);
 }
+
+/* Maps a GSS IOV array to the HEADER/PADDING/TRAILER descriptors and to
+ * ntlm_iov lists of the data to seal and the data to sign, without copying
+ * any payload. The map lives on the caller's stack, so the number of
+ * buffers is bounded. */
+struct gssntlm_iov {
+    gss_iov_buffer_desc *header;
+    gss_iov_buffer_desc *padding;
+    gss_iov_buffer_desc *trailer;
+    struct ntlm_iov data;
+    struct ntlm_iov sign;
+    struct ntlm_buffer bufs[NTLM_IOV_MAX];
+    struct ntlm_buffer *data_ptrs[NTLM_IOV_MAX];
+    struct ntlm_buffer *sign_ptrs[NTLM_IOV_MAX];
+};
+
+static int gssntlm_iov_map(gss_iov_buffer_desc *iov, int iov_count,
+                           struct gssntlm_iov *map)
+{
+    struct ntlm_buffer *bufs = map->bufs;
+    gss_iov_buffer_desc **slot;
+    int i;
+
+    if (iov_count > NTLM_IOV_MAX) return ERR_BADARG;
+
+    map->header = NULL;
+    map->padding = NULL;
+    map->trailer = NULL;
+    map->data.data = map->data_ptrs;
+    map->data.num = 0;
+    map->sign.data = map->sign_ptrs;
+    map->sign.num = 0;
+
+    for (i = 0; i < iov_count; i++) {
+        slot = NULL;
+        switch (GSS_IOV_BUFFER_TYPE(iov[i].type)) {
+        case GSS_IOV_BUFFER_TYPE_EMPTY:
+            break;
+        case GSS_IOV_BUFFER_TYPE_HEADER:
+            slot = &map->header;
+            break;
+        case GSS_IOV_BUFFER_TYPE_PADDING:
+            slot = &map->padding;
+            break;
+        case GSS_IOV_BUFFER_TYPE_TRAILER:
+            slot = &map->trailer;
+            break;
+        case GSS_IOV_BUFFER_TYPE_DATA:
+            bufs[i].data = iov[i].buffer.value;
+            bufs[i].length = iov[i].buffer.length;
+            map->data.data[map->data.num++] = &bufs[i];
+            map->sign.data[map->sign.num++] = &bufs[i];
+            break;
+        case GSS_IOV_BUFFER_TYPE_SIGN_ONLY:
+            bufs[i].data = iov[i].buffer.value;
+            bufs[i].length = iov[i].buffer.length;
+            map->sign.data[map->sign.num++] = &bufs[i];
+            break;
+        default:
+            return ERR_NOTSUPPORTED;
+        }
+        if (slot) {
+            if (*slot) return ERR_BADARG;
+            *slot = &iov[i];
+        }
+    }
+
+    if (!map->header) return ERR_BADARG;
+
+    return 0;
+}
+
+/* NTLM has no padding and no trailer, the whole token goes in the header */
+static void gssntlm_iov_no_trailer(struct gssntlm_iov *map)
+{
+    if (map->padding) map->padding->buffer.length = 0;
+    if (map->trailer) map->trailer->buffer.length = 0;
+}
+
+static size_t gssntlm_iov_data_length(struct gssntlm_iov *map)
+{
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; i < map->data.num; i++) {
+        len += map->data.data[i]->length;
+    }
+    return len;
+}
+
+uint32_t gssntlm_wrap_iov(uint32_t *minor_status,
+                          gss_ctx_id_t context_handle,
+                          int conf_req_flag,
+                          gss_qop_t qop_req,
+                          int *conf_state,
+                          gss_iov_buffer_desc *iov,
+                          int iov_count)
+{
+    struct gssntlm_ctx *ctx;
+    struct gssntlm_iov map;
+    struct ntlm_buffer signature;
+    gss_iov_buffer_desc *header;
+    uint64_t start = gssntlm_metrics_message_start();
+    uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
+
+    ctx = (struct gssntlm_ctx *)context_handle;
+    retmaj = gssntlm_context_is_valid(ctx, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(ERR_BADCTX, retmaj);
+    }
+    DEBUG_CTX(ctx, ctx->stage);
+    if (qop_req != GSS_C_QOP_DEFAULT) {
+        return GSSERRS(ERR_BADARG, GSS_S_BAD_QOP);
+    }
+    if (!iov || iov_count <= 0) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
+    }
+    if (conf_state) {
+        *conf_state = 0;
+    }
+
+    if (conf_req_flag == 0) {
+        /* ignore, always seal */
+    }
+
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
+    retmin = gssntlm_iov_map(iov, iov_count, &map);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+    header = map.header;
+
+    if (header->type & GSS_IOV_BUFFER_FLAG_ALLOCATE) {
+        header->buffer.value = malloc(NTLM_SIGNATURE_SIZE);
+        if (!header->buffer.value) {
+            return GSSERRS(ENOMEM, GSS_S_FAILURE);
+        }
+        header->type |= GSS_IOV_BUFFER_FLAG_ALLOCATED;
+    } else if (header->buffer.length < NTLM_SIGNATURE_SIZE) {
+        return GSSERRS(ERR_BADARG, GSS_S_FAILURE);
+    }
+    header->buffer.length = NTLM_SIGNATURE_SIZE;
+    gssntlm_iov_no_trailer(&map);
+
+    signature.data = header->buffer.value;
+    signature.length = NTLM_SIGNATURE_SIZE;
+    retmin = ntlm_seal_iov(ctx->neg_flags, &ctx->crypto_state,
+                           &map.data, &map.sign, &signature);
+    if (retmin) {
+        if (header->type & GSS_IOV_BUFFER_FLAG_ALLOCATED) {
+            safefree(header->buffer.value);
+            header->buffer.length = 0;
+            header->type &= ~GSS_IOV_BUFFER_FLAG_ALLOCATED;
+        }
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+
+    if (conf_state) {
+        *conf_state = 1;
+    }
+    gssntlm_metrics_message(false, gssntlm_iov_data_length(&map), start);
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
+uint32_t gssntlm_unwrap_iov(uint32_t *minor_status,
+                            gss_ctx_id_t context_handle,
+                            int *conf_state,
+                            gss_qop_t *qop_state,
+                            gss_iov_buffer_desc *iov,
+                            int iov_count)
+{
+    struct gssntlm_ctx *ctx;
+    struct gssntlm_iov map;
+    uint8_t sig[16];
+    struct ntlm_buffer signature = { sig, NTLM_SIGNATURE_SIZE };
+    uint64_t start = gssntlm_metrics_message_start();
+    uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+    CTX_TABLE_SCOPE(table_lock);
+
+    ctx = (struct gssntlm_ctx *)context_handle;
+    retmaj = gssntlm_context_is_valid(ctx, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(ERR_BADCTX, retmaj);
+    }
+    DEBUG_CTX(ctx, ctx->stage);
+    if (!iov || iov_count <= 0) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
+    }
+    if (conf_state) {
+        *conf_state = 0;
+    }
+    if (qop_state) {
+        *qop_state = GSS_C_QOP_DEFAULT;
+    }
+
+    retmin = gssntlm_ctx_table_lock(ctx, &table_lock);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_NO_CONTEXT);
+    }
+
+    retmin = gssntlm_iov_map(iov, iov_count, &map);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+    if (map.header->buffer.length != NTLM_SIGNATURE_SIZE) {
+        return GSSERRS(ERR_BADARG, GSS_S_DEFECTIVE_TOKEN);
+    }
+    gssntlm_iov_no_trailer(&map);
+
+    retmin = ntlm_unseal_iov(ctx->neg_flags, &ctx->crypto_state,
+                             &map.data, &map.sign, &signature);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+
+    if (memcmp(map.header->buffer.value,
+               signature.data, NTLM_SIGNATURE_SIZE) != 0) {
+        return GSSERRS(0, GSS_S_BAD_SIG);
+    }
+
+    if (conf_state) {
+        *conf_state = 1;
+    }
+    gssntlm_metrics_message(true, gssntlm_iov_data_length(&map), start);
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
+
+uint32_t gssntlm_wrap_iov_length(uint32_t *minor_status,
+                                 gss_ctx_id_t context_handle,
+                                 int conf_req_flag,
+                                 gss_qop_t qop_req,
+                                 int *conf_state,
+                                 gss_iov_buffer_desc *iov,
+                                 int iov_count)
+{
+    struct gssntlm_ctx *ctx;
+    struct gssntlm_iov map;
+    uint32_t retmaj, retmin;
+    DEBUG_CTX_SCOPE(NULL, 0);
+
+    ctx = (struct gssntlm_ctx *)context_handle;
+    retmaj = gssntlm_context_is_valid(ctx, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        return GSSERRS(ERR_BADCTX, retmaj);
+    }
+    DEBUG_CTX(ctx, ctx->stage);
+    if (qop_req != GSS_C_QOP_DEFAULT) {
+        return GSSERRS(ERR_BADARG, GSS_S_BAD_QOP);
+    }
+    if (!iov || iov_count <= 0) {
+        return GSSERRS(ERR_NOARG, GSS_S_CALL_INACCESSIBLE_READ);
+    }
+
+    retmin = gssntlm_iov_map(iov, iov_count, &map);
+    if (retmin) {
+        return GSSERRS(retmin, GSS_S_FAILURE);
+    }
+
+    map.header->buffer.length = NTLM_SIGNATURE_SIZE;
+    gssntlm_iov_no_trailer(&map);
+
+    if (conf_state) {
+        *conf_state = (ctx->neg_flags & NTLMSSP_NEGOTIATE_SEAL) ? 1 : 0;
+    }
+    return GSSERRS(0, GSS_S_COMPLETE);
+}
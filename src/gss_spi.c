@@ -4,6 +4,7 @@
 #include <gssapi/gssapi_ext.h>
 
 #include "gss_ntlmssp.h"
+#include "probes.h"
 
 OM_uint32 gss_init_sec_context(OM_uint32 *minor_status,
                                gss_cred_id_t claimant_cred_handle,
@@ -198,11 +199,19 @@ OM_uint32 gss_get_mic(OM_uint32 *minor_status,
                       gss_buffer_t message_buffer,
                       gss_buffer_t message_token)
 {
-    return gssntlm_get_mic(minor_status,
-                           context_handle,
-                           qop_req,
-                           message_buffer,
-                           message_token);
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(get_mic_start, context_handle,
+                  PROBE_LEN(message_buffer));
+    retmaj = gssntlm_get_mic(minor_status,
+                             context_handle,
+                             qop_req,
+                             message_buffer,
+                             message_token);
+    GSSNTLM_PROBE(get_mic_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status),
+                  PROBE_OUT_LEN(retmaj, message_token));
+    return retmaj;
 }
 
 
@@ -212,11 +221,18 @@ OM_uint32 gss_verify_mic(OM_uint32 *minor_status,
                          gss_buffer_t message_token,
                          gss_qop_t *qop_state)
 {
-    return gssntlm_verify_mic(minor_status,
-                              context_handle,
-                              message_buffer,
-                              message_token,
-                              qop_state);
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(verify_mic_start, context_handle,
+                  PROBE_LEN(message_buffer));
+    retmaj = gssntlm_verify_mic(minor_status,
+                                context_handle,
+                                message_buffer,
+                                message_token,
+                                qop_state);
+    GSSNTLM_PROBE(verify_mic_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status));
+    return retmaj;
 }
 
 OM_uint32 gss_wrap(OM_uint32 *minor_status,
@@ -227,13 +243,21 @@ OM_uint32 gss_wrap(OM_uint32 *minor_status,
                    int *conf_state,
                    gss_buffer_t output_message_buffer)
 {
-    return gssntlm_wrap(minor_status,
-                        context_handle,
-                        conf_req_flag,
-                        qop_req,
-                        input_message_buffer,
-                        conf_state,
-                        output_message_buffer);
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(wrap_start, context_handle,
+                  PROBE_LEN(input_message_buffer));
+    retmaj = gssntlm_wrap(minor_status,
+                          context_handle,
+                          conf_req_flag,
+                          qop_req,
+                          input_message_buffer,
+                          conf_state,
+                          output_message_buffer);
+    GSSNTLM_PROBE(wrap_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status),
+                  PROBE_OUT_LEN(retmaj, output_message_buffer));
+    return retmaj;
 }
 
 OM_uint32 gss_unwrap(OM_uint32 *minor_status,
@@ -243,12 +267,81 @@ OM_uint32 gss_unwrap(OM_uint32 *minor_status,
                      int *conf_state,
                      gss_qop_t *qop_state)
 {
-    return gssntlm_unwrap(minor_status,
-                          context_handle,
-                          input_message_buffer,
-                          output_message_buffer,
-                          conf_state,
-                          qop_state);
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(unwrap_start, context_handle,
+                  PROBE_LEN(input_message_buffer));
+    retmaj = gssntlm_unwrap(minor_status,
+                            context_handle,
+                            input_message_buffer,
+                            output_message_buffer,
+                            conf_state,
+                            qop_state);
+    GSSNTLM_PROBE(unwrap_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status),
+                  PROBE_OUT_LEN(retmaj, output_message_buffer));
+    return retmaj;
+}
+
+OM_uint32 gss_wrap_iov(OM_uint32 *minor_status,
+                       gss_ctx_id_t context_handle,
+                       int conf_req_flag,
+                       gss_qop_t qop_req,
+                       int *conf_state,
+                       gss_iov_buffer_desc *iov,
+                       int iov_count)
+{
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(wrap_iov_start, context_handle, iov_count);
+    retmaj = gssntlm_wrap_iov(minor_status,
+                              context_handle,
+                              conf_req_flag,
+                              qop_req,
+                              conf_state,
+                              iov,
+                              iov_count);
+    GSSNTLM_PROBE(wrap_iov_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status));
+    return retmaj;
+}
+
+OM_uint32 gss_unwrap_iov(OM_uint32 *minor_status,
+                         gss_ctx_id_t context_handle,
+                         int *conf_state,
+                         gss_qop_t *qop_state,
+                         gss_iov_buffer_desc *iov,
+                         int iov_count)
+{
+    OM_uint32 retmaj;
+
+    GSSNTLM_PROBE(unwrap_iov_start, context_handle, iov_count);
+    retmaj = gssntlm_unwrap_iov(minor_status,
+                                context_handle,
+                                conf_state,
+                                qop_state,
+                                iov,
+                                iov_count);
+    GSSNTLM_PROBE(unwrap_iov_done, context_handle, retmaj,
+                  PROBE_MINOR(minor_status));
+    return retmaj;
+}
+
+OM_uint32 gss_wrap_iov_length(OM_uint32 *minor_status,
+                              gss_ctx_id_t context_handle,
+                              int conf_req_flag,
+                              gss_qop_t qop_req,
+                              int *conf_state,
+                              gss_iov_buffer_desc *iov,
+                              int iov_count)
+{
+    return gssntlm_wrap_iov_length(minor_status,
+                                   context_handle,
+                                   conf_req_flag,
+                                   qop_req,
+                                   conf_state,
+                                   iov,
+                                   iov_count);
 }
 
 OM_uint32 gss_wrap_size_limit(OM_uint32 *minor_status,
@@ -320,6 +413,17 @@ OM_uint32 gss_set_sec_context_option(OM_uint32 *minor_status,
                                           value);
 }
 
+OM_uint32 gssspi_set_cred_option(OM_uint32 *minor_status,
+                                 gss_cred_id_t *cred_handle,
+                                 const gss_OID desired_object,
+                                 const gss_buffer_t value)
+{
+    return gssntlm_set_cred_option(minor_status,
+                                   cred_handle,
+                                   desired_object,
+                                   value);
+}
+
 OM_uint32 gss_inquire_sec_context_by_oid(OM_uint32 *minor_status,
 	                                 const gss_ctx_id_t context_handle,
 	                                 const gss_OID desired_object,
@@ -363,6 +467,17 @@ OM_uint32 gss_inquire_cred_by_mech(OM_uint32 *minor_status,
                                         cred_usage);
 }
 
+OM_uint32 gss_inquire_cred_by_oid(OM_uint32 *minor_status,
+                                  const gss_cred_id_t cred_handle,
+                                  const gss_OID desired_object,
+                                  gss_buffer_set_t *data_set)
+{
+    return gssntlm_inquire_cred_by_oid(minor_status,
+                                       cred_handle,
+                                       desired_object,
+                                       data_set);
+}
+
 OM_uint32 gss_export_sec_context(OM_uint32 *minor_status,
                                  gss_ctx_id_t *context_handle,
                                  gss_buffer_t interprocess_token)
@@ -443,3 +558,20 @@ OM_uint32 gss_inquire_attrs_for_mech(OM_uint32 *minor_status,
     return gssntlm_inquire_attrs_for_mech(minor_status, mech_oid, mech_attrs,
                                           known_mech_attrs);
 }
+
+OM_uint32 gss_ntlmssp_metrics_snapshot(OM_uint32 *minor_status,
+                                       gss_buffer_t snapshot)
+{
+    return gssntlm_metrics_snapshot(minor_status, snapshot);
+}
+
+OM_uint32 gss_ntlmssp_ctx_table_create(OM_uint32 *minor_status,
+                                       OM_uint32 entries, int *fd)
+{
+    return gssntlm_ctx_table_create(minor_status, entries, fd);
+}
+
+OM_uint32 gss_ntlmssp_ctx_table_map(OM_uint32 *minor_status, int fd)
+{
+    return gssntlm_ctx_table_map(minor_status, fd);
+}
@@ -0,0 +1,1064 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <unicase.h>
+
+#include "gss_ntlmssp.h"
+#include "unicode.h"
+
+/* Process wide index of user files (NTLM_USER_FILE or the keyfile set in a
+ * cred store). Each file is parsed once into an immutable table, hashed on
+ * the upcased user name, and shared by all threads. The table is
+ * replaced as a whole when the file on disk changes (different inode, size
+ * or modification time); lookups that still hold a reference to the old
+ * table keep using it until they release it.
+ *
+ * The current table of each file is published through an atomic pointer, so
+ * a lookup takes neither the mutex nor a stat() call. The file is stat()ed
+ * again at most every USERFILE_RECHECK_NS, which bounds how long an edited
+ * file can go unnoticed. Replacing a table waits for lookups that may have
+ * read the old pointer but not yet taken their reference (see
+ * userfile_pin_table()) before dropping the reference of the list.
+ *
+ * Besides the two text formats a user file can also be a compiled database
+ * (see gssntlm_userfile_compile() and ntlmssp-mkdb). That is mapped read only
+ * and used in place: no parsing at load time and no hashing at lookup time,
+ * and all processes using it share the same page cache copy. */
+
+#define USERFILE_NO_ENTRY ((size_t)-1)
+#define USERFILE_NAME_BUF 256
+#define USERFILE_RECHECK_NS 1000000000ULL
+
+/* Compiled database layout, all integers are little endian:
+ *
+ *   header
+ *   buckets   num_buckets + 1 uint32_t, records of bucket N are
+ *             records[buckets[N]] up to records[buckets[N + 1]]
+ *   records   num_entries wire_userdb_rec, in file order within a bucket
+ *   strings   NUL terminated UTF-8 names and upcased UTF-16LE keys
+ *
+ * Records are looked up by the FNV-1a hash of the upcased UTF-16LE user
+ * name, the same form NTOWFv2 uses. */
+#define USERDB_MAGIC "NTLMUDB"
+#define USERDB_VERSION 1
+#define USERDB_KEY_BUF 1024
+
+#define USERDB_HAS_NT 0x01
+#define USERDB_HAS_LM 0x02
+#define USERDB_NO_STRING 0xffffffff
+
+#pragma pack(push, 1)
+struct wire_userdb_hdr {
+    uint8_t magic[8];
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t num_buckets;
+    uint32_t reserved;
+    uint64_t buckets_offset;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct wire_userdb_rec {
+    uint32_t hash;
+    uint32_t flags;
+    uint32_t order;     /* line order in the source file */
+    uint32_t user;      /* UTF-8 */
+    uint32_t domain;    /* UTF-8 or USERDB_NO_STRING */
+    uint32_t key;       /* upcased UTF-16LE user name */
+    uint32_t key_len;
+    uint32_t dkey;      /* upcased UTF-16LE domain or USERDB_NO_STRING */
+    uint32_t dkey_len;
+    uint32_t reserved;
+    uint8_t nt_hash[16];
+    uint8_t lm_hash[16];
+};
+#pragma pack(pop)
+
+struct userfile_table {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    char *data;
+    size_t data_len;
+
+    struct gssntlm_user_entry *entries;
+    size_t num_entries;
+
+    size_t *buckets;
+    size_t num_buckets;
+    /* entries whose user name could not be upcased, scanned linearly */
+    size_t unindexed;
+
+    /* compiled database, when set none of the text fields above are used */
+    uint8_t *map;
+    size_t map_len;
+    const struct wire_userdb_hdr *hdr;
+    const uint32_t *db_buckets;
+    const struct wire_userdb_rec *db_recs;
+    const uint8_t *db_strings;
+    size_t db_strings_size;
+
+    /* atomic, so that releasing a reference needs no lock */
+    unsigned int refcount;
+};
+
+/* Never freed once linked, so the list can be walked without the lock.
+ * table, checked_ns, phase and pins are accessed atomically, table is only
+ * replaced with userfile_mutex held. */
+struct userfile {
+    char *filename;
+    struct userfile_table *table;
+    uint64_t checked_ns;    /* last stat() that found table current */
+    unsigned int phase;
+    unsigned int pins[2];   /* lookups between reading table and ref'ing it */
+    struct userfile *next;
+};
+
+static pthread_mutex_t userfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct userfile *userfile_list = NULL;
+
+/* Both the text tables and the compiled database compare names in the form
+ * NTOWFv2 hashes them: the locale independent Unicode uppercase mapping.
+ * Case folding or the process locale (Turkish dotted and dotless i) would
+ * make the two formats, or two processes, disagree on which names are the
+ * same user. Returns buf, or a malloc'ed string when the name does not fit
+ * in *len bytes, or NULL on error. */
+static uint8_t *userfile_upcase(const char *str, uint8_t *buf, size_t *len)
+{
+    return u8_toupper((const uint8_t *)str, strlen(str),
+                      NULL, NULL, buf, len);
+}
+
+static bool userfile_name_hash(const char *str, uint64_t *hash)
+{
+    uint8_t buf[USERFILE_NAME_BUF];
+    uint8_t *up;
+    size_t len = USERFILE_NAME_BUF;
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+    up = userfile_upcase(str, buf, &len);
+    if (!up) return false;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= up[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    if (up != buf) free(up);
+    *hash = h;
+    return true;
+}
+
+static bool userfile_name_eq(const char *s1, const char *s2)
+{
+    uint8_t buf1[USERFILE_NAME_BUF];
+    uint8_t buf2[USERFILE_NAME_BUF];
+    uint8_t *up1, *up2 = NULL;
+    size_t len1 = USERFILE_NAME_BUF;
+    size_t len2 = USERFILE_NAME_BUF;
+    bool ret = false;
+
+    if (s1 == s2) return true;
+    if (!s1 || !s2) return false;
+
+    up1 = userfile_upcase(s1, buf1, &len1);
+    if (!up1) goto done;
+    up2 = userfile_upcase(s2, buf2, &len2);
+    if (!up2) goto done;
+
+    ret = (len1 == len2 && memcmp(up1, up2, len1) == 0);
+
+done:
+    if (up1 && up1 != buf1) free(up1);
+    if (up2 && up2 != buf2) free(up2);
+    return ret;
+}
+
+static void userfile_table_free(struct userfile_table *table)
+{
+    if (!table) return;
+
+    if (table->data) {
+        /* the file may contain clear text passwords */
+        safezero((uint8_t *)table->data, table->data_len);
+        safefree(table->data);
+    }
+    safefree(table->entries);
+    safefree(table->buckets);
+    if (table->map) munmap(table->map, table->map_len);
+    safefree(table);
+}
+
+static uint64_t userdb_hash(const uint8_t *key, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Upcases a name and converts it to UTF-16LE, buf must be USERDB_KEY_BUF
+ * bytes long */
+static int userdb_key(const char *str, uint8_t *buf, size_t *len)
+{
+    uint8_t upbuf[USERDB_KEY_BUF];
+    uint8_t *up;
+    size_t uplen = USERDB_KEY_BUF;
+    int ret;
+
+    up = userfile_upcase(str, upbuf, &uplen);
+    if (!up) return ERR_CRYPTO;
+    if (up != upbuf) {
+        free(up);
+        return ERR_NAMETOOLONG;
+    }
+
+    ret = ntlm_utf8_to_utf16le(up, uplen, buf, USERDB_KEY_BUF, len);
+    if (ret == E2BIG) return ERR_NAMETOOLONG;
+    if (ret) return ERR_CRYPTO;
+
+    return 0;
+}
+
+static int userdb_map(int fd, struct stat *st, struct userfile_table *table)
+{
+    const struct wire_userdb_hdr *hdr;
+    uint64_t num_entries, num_buckets;
+    uint64_t offset, size;
+
+    if ((uint64_t)st->st_size < sizeof(struct wire_userdb_hdr)) {
+        return ERR_DECODE;
+    }
+    table->map_len = st->st_size;
+    table->map = mmap(NULL, table->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (table->map == MAP_FAILED) {
+        table->map = NULL;
+        return errno;
+    }
+
+    hdr = (const struct wire_userdb_hdr *)table->map;
+    if (le32toh(hdr->version) != USERDB_VERSION) return ERR_NOTSUPPORTED;
+
+    num_entries = le32toh(hdr->num_entries);
+    num_buckets = le32toh(hdr->num_buckets);
+    if (num_buckets == 0 || (num_buckets & (num_buckets - 1))) {
+        return ERR_DECODE;
+    }
+
+    offset = le64toh(hdr->buckets_offset);
+    size = (num_buckets + 1) * sizeof(uint32_t);
+    if (offset % sizeof(uint32_t) ||
+        offset > table->map_len || size > table->map_len - offset) {
+        return ERR_DECODE;
+    }
+    table->db_buckets = (const uint32_t *)(table->map + offset);
+
+    offset = le64toh(hdr->records_offset);
+    size = num_entries * sizeof(struct wire_userdb_rec);
+    if (offset > table->map_len || size > table->map_len - offset) {
+        return ERR_DECODE;
+    }
+    table->db_recs = (const struct wire_userdb_rec *)(table->map + offset);
+
+    offset = le64toh(hdr->strings_offset);
+    size = le64toh(hdr->strings_size);
+    if (offset > table->map_len || size > table->map_len - offset) {
+        return ERR_DECODE;
+    }
+    table->db_strings = table->map + offset;
+    table->db_strings_size = size;
+
+    table->num_entries = num_entries;
+    table->num_buckets = num_buckets;
+    table->hdr = hdr;
+    return 0;
+}
+
+static const char *userdb_string(struct userfile_table *table, uint32_t off)
+{
+    off = le32toh(off);
+    if (off == USERDB_NO_STRING || off >= table->db_strings_size) {
+        return NULL;
+    }
+    if (!memchr(table->db_strings + off, '\0', table->db_strings_size - off)) {
+        return NULL;
+    }
+    return (const char *)table->db_strings + off;
+}
+
+static bool userdb_key_match(struct userfile_table *table,
+                             uint32_t off, uint32_t len,
+                             const uint8_t *key, size_t key_len)
+{
+    off = le32toh(off);
+    len = le32toh(len);
+    if (len != key_len) return false;
+    if (off >= table->db_strings_size ||
+        len > table->db_strings_size - off) {
+        return false;
+    }
+    return memcmp(table->db_strings + off, key, len) == 0;
+}
+
+static int userdb_find(struct userfile_table *table,
+                       struct gssntlm_name *name,
+                       struct gssntlm_user_entry *entry)
+{
+    const struct wire_userdb_rec *rec;
+    const struct wire_userdb_rec *found = NULL;
+    uint8_t ukey[USERDB_KEY_BUF];
+    uint8_t dkey[USERDB_KEY_BUF];
+    size_t ukey_len = 0;
+    size_t dkey_len = 0;
+    bool match_user = false;
+    bool match_domain = false;
+    size_t start, end;
+    uint32_t hash = 0;
+    int ret;
+
+    if (name && name->data.user.name) {
+        ret = userdb_key(name->data.user.name, ukey, &ukey_len);
+        if (ret) return ret;
+        hash = userdb_hash(ukey, ukey_len);
+        match_user = true;
+    }
+    if (name && name->data.user.domain) {
+        ret = userdb_key(name->data.user.domain, dkey, &dkey_len);
+        if (ret) return ret;
+        match_domain = true;
+    }
+
+    if (match_user) {
+        start = le32toh(table->db_buckets[hash & (table->num_buckets - 1)]);
+        end = le32toh(table->db_buckets[(hash & (table->num_buckets - 1)) + 1]);
+    } else {
+        /* no key, scan everything and keep the first in file order */
+        start = 0;
+        end = table->num_entries;
+    }
+    if (start > end || end > table->num_entries) return ERR_DECODE;
+
+    for (size_t i = start; i < end; i++) {
+        rec = &table->db_recs[i];
+
+        if (match_user) {
+            if (le32toh(rec->hash) != hash) continue;
+            if (!userdb_key_match(table, rec->key, rec->key_len,
+                                  ukey, ukey_len)) continue;
+        }
+        if (match_domain && le32toh(rec->dkey) != USERDB_NO_STRING) {
+            if (!userdb_key_match(table, rec->dkey, rec->dkey_len,
+                                  dkey, dkey_len)) continue;
+        }
+        if (!found || le32toh(rec->order) < le32toh(found->order)) {
+            found = rec;
+        }
+        /* records within a bucket are already in file order */
+        if (match_user) break;
+    }
+    if (!found) return ENOENT;
+
+    memset(entry, 0, sizeof(struct gssntlm_user_entry));
+    entry->user = userdb_string(table, found->user);
+    if (!entry->user) return ERR_DECODE;
+    if (le32toh(found->domain) != USERDB_NO_STRING) {
+        entry->domain = userdb_string(table, found->domain);
+        if (!entry->domain) return ERR_DECODE;
+    }
+    if (le32toh(found->flags) & USERDB_HAS_NT) {
+        entry->nt_key = found->nt_hash;
+    }
+    if (le32toh(found->flags) & USERDB_HAS_LM) {
+        entry->lm_key = found->lm_hash;
+    }
+    return 0;
+}
+
+static int userfile_read(int fd, struct userfile_table *table, size_t *len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    table->data = malloc(table->size + 1);
+    if (!table->data) return ENOMEM;
+    table->data_len = table->size + 1;
+
+    while (done < (size_t)table->size) {
+        n = read(fd, table->data + done, table->size - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    table->data[done] = '\0';
+    *len = done;
+    return 0;
+}
+
+/* Splits one line (already NUL terminated) in place, following the same
+ * rules get_user_file_creds() always used for the two supported formats.
+ * Returns false if the line is not a valid entry. */
+static bool userfile_parse_line(char *line, struct gssntlm_user_entry *e)
+{
+    char *field1, *field2, *field3, *field4;
+    char *p;
+
+    memset(e, 0, sizeof(struct gssntlm_user_entry));
+
+    p = line;
+    if (*p == '#') return false;
+    field1 = p;
+    p = strchr(field1, ':');
+    if (!p) return false;
+    *p++ = '\0';
+    field2 = p;
+    p = strchr(field2, ':');
+    if (!p) return false;
+    *p++ = '\0';
+    field3 = p;
+    p = strchr(field3, ':');
+    if (!p) {
+        /* Heimdal file format: DOMAIN:USERNAME:PASSWORD */
+        p = field3;
+        strsep(&p, "\r\n");
+
+        e->domain = field1;
+        e->user = field2;
+        e->password = field3;
+    } else {
+        *p++ = '\0';
+        field4 = p;
+        p = strchr(field4, ':');
+        if (!p) return false;
+        *p++ = '\0';
+        /* smbpasswd file format: NAME:UID:LM_HASH:NT_HASH:... */
+        e->user = field1;
+        e->lm_hash = field3;
+        e->nt_hash = field4;
+
+        /* check if username is domain qualified */
+        p = strchr(e->user, '\\');
+        if (p) {
+            e->domain = e->user;
+            *p++ = '\0';
+            e->user = p;
+        }
+    }
+    return true;
+}
+
+static int userfile_load(const char *filename, struct userfile_table **out)
+{
+    struct userfile_table *table;
+    struct stat st;
+    uint8_t magic[8];
+    size_t len = 0;
+    size_t count;
+    char *line, *eol;
+    int fd = -1;
+    int ret;
+
+    table = calloc(1, sizeof(struct userfile_table));
+    if (!table) return ENOMEM;
+    table->unindexed = USERFILE_NO_ENTRY;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ret = errno;
+        goto done;
+    }
+    ret = fstat(fd, &st);
+    if (ret == -1) {
+        ret = errno;
+        goto done;
+    }
+    table->dev = st.st_dev;
+    table->ino = st.st_ino;
+    table->size = st.st_size;
+    table->mtime = st.st_mtim;
+
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, USERDB_MAGIC, sizeof(magic)) == 0) {
+        ret = userdb_map(fd, &st, table);
+        if (ret == 0) table->refcount = 1;
+        goto done;
+    }
+
+    ret = userfile_read(fd, table, &len);
+    if (ret) goto done;
+
+    /* upper bound on the number of entries */
+    count = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (table->data[i] == '\n') count++;
+    }
+    table->entries = calloc(count, sizeof(struct gssntlm_user_entry));
+    if (!table->entries) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    for (line = table->data; line && *line; line = eol) {
+        struct gssntlm_user_entry *e = &table->entries[table->num_entries];
+        eol = strchr(line, '\n');
+        if (eol) *eol++ = '\0';
+        if (userfile_parse_line(line, e)) {
+            table->num_entries++;
+        }
+    }
+
+    for (table->num_buckets = 16;
+         table->num_buckets < table->num_entries;
+         table->num_buckets <<= 1) ;
+    table->buckets = malloc(table->num_buckets * sizeof(size_t));
+    if (!table->buckets) {
+        ret = ENOMEM;
+        goto done;
+    }
+    for (size_t i = 0; i < table->num_buckets; i++) {
+        table->buckets[i] = USERFILE_NO_ENTRY;
+    }
+
+    /* insert backwards so that chains are in file order, the first
+     * matching line in the file must always win */
+    for (size_t i = table->num_entries; i > 0; i--) {
+        struct gssntlm_user_entry *e = &table->entries[i - 1];
+        size_t b;
+
+        if (userfile_name_hash(e->user, &e->hash)) {
+            b = e->hash & (table->num_buckets - 1);
+            e->next = table->buckets[b];
+            table->buckets[b] = i - 1;
+        } else {
+            e->next = table->unindexed;
+            table->unindexed = i - 1;
+        }
+    }
+
+    table->refcount = 1;
+    ret = 0;
+
+done:
+    if (fd != -1) close(fd);
+    if (ret) {
+        userfile_table_free(table);
+    } else {
+        *out = table;
+    }
+    return ret;
+}
+
+static bool userfile_table_is_current(struct userfile_table *table,
+                                      struct stat *st)
+{
+    return table->dev == st->st_dev &&
+           table->ino == st->st_ino &&
+           table->size == st->st_size &&
+           table->mtime.tv_sec == st->st_mtim.tv_sec &&
+           table->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void userfile_table_unref(struct userfile_table *table)
+{
+    if (__atomic_sub_fetch(&table->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        userfile_table_free(table);
+    }
+}
+
+static uint64_t userfile_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct userfile *userfile_find_slot(const char *filename)
+{
+    struct userfile *uf;
+
+    uf = __atomic_load_n(&userfile_list, __ATOMIC_ACQUIRE);
+    for (; uf; uf = uf->next) {
+        if (strcmp(uf->filename, filename) == 0) break;
+    }
+    return uf;
+}
+
+/* Takes a reference to the current table without the lock. The pin keeps a
+ * concurrent userfile_publish() from dropping the table between our load of
+ * the pointer and the increment of its refcount. */
+static struct userfile_table *userfile_pin_table(struct userfile *uf)
+{
+    struct userfile_table *table;
+    unsigned int p;
+
+    p = __atomic_load_n(&uf->phase, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&uf->pins[p], 1, __ATOMIC_SEQ_CST);
+    table = __atomic_load_n(&uf->table, __ATOMIC_SEQ_CST);
+    if (table) __atomic_add_fetch(&table->refcount, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&uf->pins[p], 1, __ATOMIC_RELEASE);
+    return table;
+}
+
+/* Called with userfile_mutex held. Readers that start after the phase flip
+ * count on the other pin and can only see the new table, so the wait ends
+ * once the few that raced with the swap are done. */
+static void userfile_publish(struct userfile *uf,
+                             struct userfile_table *table)
+{
+    struct userfile_table *old;
+    unsigned int p;
+
+    old = __atomic_exchange_n(&uf->table, table, __ATOMIC_SEQ_CST);
+    if (!old) return;
+
+    p = __atomic_load_n(&uf->phase, __ATOMIC_RELAXED) & 1;
+    __atomic_store_n(&uf->phase, p ^ 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&uf->pins[p], __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+    userfile_table_unref(old);
+}
+
+/* Returns a referenced table matching the state of the file as of its last
+ * check, (re)loading it if necessary. */
+static int userfile_get_table(const char *filename,
+                              struct userfile_table **table)
+{
+    struct userfile_table *loaded = NULL;
+    struct userfile *uf;
+    struct stat st;
+    uint64_t now;
+    int ret;
+
+    now = userfile_now_ns();
+    uf = userfile_find_slot(filename);
+    if (uf && now - __atomic_load_n(&uf->checked_ns, __ATOMIC_RELAXED) <
+              USERFILE_RECHECK_NS) {
+        *table = userfile_pin_table(uf);
+        if (*table) return 0;
+    }
+
+    ret = stat(filename, &st);
+    if (ret == -1) return errno;
+
+    pthread_mutex_lock(&userfile_mutex);
+    uf = userfile_find_slot(filename);
+    if (uf && uf->table && userfile_table_is_current(uf->table, &st)) {
+        /* tables are only replaced under the lock, the list reference
+         * keeps this one alive */
+        __atomic_add_fetch(&uf->table->refcount, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&uf->checked_ns, now, __ATOMIC_RELAXED);
+        *table = uf->table;
+        pthread_mutex_unlock(&userfile_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&userfile_mutex);
+
+    /* parse outside of the lock, concurrent loaders may race, the last one
+     * to finish simply replaces the table */
+    ret = userfile_load(filename, &loaded);
+    if (ret) return ret;
+
+    pthread_mutex_lock(&userfile_mutex);
+    uf = userfile_find_slot(filename);
+    if (!uf) {
+        uf = calloc(1, sizeof(struct userfile));
+        if (uf) uf->filename = strdup(filename);
+        if (!uf || !uf->filename) {
+            pthread_mutex_unlock(&userfile_mutex);
+            if (uf) free(uf);
+            userfile_table_free(loaded);
+            return ENOMEM;
+        }
+        uf->next = userfile_list;
+        __atomic_store_n(&userfile_list, uf, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&loaded->refcount, 1, __ATOMIC_RELAXED);
+    userfile_publish(uf, loaded);
+    __atomic_store_n(&uf->checked_ns, now, __ATOMIC_RELAXED);
+    *table = loaded;
+    pthread_mutex_unlock(&userfile_mutex);
+
+    return 0;
+}
+
+void gssntlm_userfile_recheck(const char *filename)
+{
+    struct userfile *uf;
+
+    uf = userfile_find_slot(filename);
+    if (uf) __atomic_store_n(&uf->checked_ns, 0, __ATOMIC_RELAXED);
+}
+
+static bool userfile_entry_match(struct gssntlm_user_entry *e,
+                                 struct gssntlm_name *name)
+{
+    if (name == NULL) return true;
+
+    if (name->data.user.domain && e->domain) {
+        if (!userfile_name_eq(e->domain, name->data.user.domain)) return false;
+    }
+    if (name->data.user.name) {
+        if (!userfile_name_eq(e->user, name->data.user.name)) return false;
+    }
+    /* all matched (NULLs in name are wildcards) */
+    return true;
+}
+
+int gssntlm_userfile_find(const char *filename,
+                          struct gssntlm_name *name,
+                          struct gssntlm_userfile_ref *ref)
+{
+    struct userfile_table *table = NULL;
+    struct gssntlm_user_entry *found = NULL;
+    uint64_t hash;
+    size_t idx;
+    int ret;
+
+    ret = userfile_get_table(filename, &table);
+    if (ret) return ret;
+
+    ref->table = table;
+
+    if (table->map) {
+        ret = userdb_find(table, name, &ref->entry);
+        if (ret) gssntlm_userfile_release(ref);
+        return ret;
+    }
+
+    if (name == NULL || name->data.user.name == NULL ||
+        !userfile_name_hash(name->data.user.name, &hash)) {
+        /* no usable key, fall back to scanning in file order */
+        for (idx = 0; idx < table->num_entries; idx++) {
+            if (userfile_entry_match(&table->entries[idx], name)) {
+                found = &table->entries[idx];
+                break;
+            }
+        }
+    } else {
+        idx = table->buckets[hash & (table->num_buckets - 1)];
+        for (; idx != USERFILE_NO_ENTRY; idx = table->entries[idx].next) {
+            if (table->entries[idx].hash != hash) continue;
+            if (userfile_entry_match(&table->entries[idx], name)) {
+                found = &table->entries[idx];
+                break;
+            }
+        }
+        /* an earlier line that could not be indexed still takes
+         * precedence, as it would have with a sequential scan */
+        for (idx = table->unindexed; idx != USERFILE_NO_ENTRY;
+             idx = table->entries[idx].next) {
+            if (found && &table->entries[idx] > found) break;
+            if (userfile_entry_match(&table->entries[idx], name)) {
+                found = &table->entries[idx];
+                break;
+            }
+        }
+    }
+
+    if (!found) {
+        gssntlm_userfile_release(ref);
+        return ENOENT;
+    }
+
+    ref->entry = *found;
+    return 0;
+}
+
+void gssntlm_userfile_release(struct gssntlm_userfile_ref *ref)
+{
+    if (!ref->table) return;
+
+    userfile_table_unref(ref->table);
+
+    ref->table = NULL;
+    memset(&ref->entry, 0, sizeof(struct gssntlm_user_entry));
+}
+
+struct userdb_strings {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
+};
+
+static int userdb_add_string(struct userdb_strings *strs,
+                             const void *str, size_t len, bool nul,
+                             uint32_t *offset)
+{
+    size_t need = len + (nul ? 1 : 0);
+    uint8_t *tmp;
+
+    if (strs->size + need > USERDB_NO_STRING) return E2BIG;
+
+    if (strs->size + need > strs->alloc) {
+        size_t alloc = strs->alloc ? strs->alloc : 4096;
+        while (alloc < strs->size + need) alloc *= 2;
+        tmp = realloc(strs->data, alloc);
+        if (!tmp) return ENOMEM;
+        strs->data = tmp;
+        strs->alloc = alloc;
+    }
+
+    *offset = htole32(strs->size);
+    memcpy(strs->data + strs->size, str, len);
+    if (nul) strs->data[strs->size + len] = '\0';
+    strs->size += need;
+    return 0;
+}
+
+static int userdb_make_rec(const struct gssntlm_user_entry *e, uint32_t order,
+                           struct userdb_strings *strs,
+                           struct wire_userdb_rec *rec)
+{
+    struct ntlm_key key = { .length = 16 };
+    uint8_t kbuf[USERDB_KEY_BUF];
+    size_t klen;
+    uint32_t flags = 0;
+    int ret;
+
+    rec->order = htole32(order);
+
+    ret = userdb_add_string(strs, e->user, strlen(e->user), true, &rec->user);
+    if (ret) return ret;
+    ret = userdb_key(e->user, kbuf, &klen);
+    if (ret) return ret;
+    rec->hash = htole32((uint32_t)userdb_hash(kbuf, klen));
+    ret = userdb_add_string(strs, kbuf, klen, false, &rec->key);
+    if (ret) return ret;
+    rec->key_len = htole32(klen);
+
+    if (e->domain) {
+        ret = userdb_add_string(strs, e->domain, strlen(e->domain), true,
+                                &rec->domain);
+        if (ret) return ret;
+        ret = userdb_key(e->domain, kbuf, &klen);
+        if (ret) return ret;
+        ret = userdb_add_string(strs, kbuf, klen, false, &rec->dkey);
+        if (ret) return ret;
+        rec->dkey_len = htole32(klen);
+    } else {
+        rec->domain = htole32(USERDB_NO_STRING);
+        rec->dkey = htole32(USERDB_NO_STRING);
+    }
+
+    if (e->password) {
+        ret = NTOWFv1(e->password, &key);
+        if (ret) goto done;
+        memcpy(rec->nt_hash, key.data, 16);
+        flags |= USERDB_HAS_NT;
+
+        /* whether LM may be used is decided at lookup time */
+        ret = LMOWFv1(e->password, &key);
+        if (ret == 0) {
+            memcpy(rec->lm_hash, key.data, 16);
+            flags |= USERDB_HAS_LM;
+        }
+    } else {
+        ret = gssntlm_hex_to_key(e->nt_hash, &key);
+        if (ret) goto done;
+        memcpy(rec->nt_hash, key.data, 16);
+        flags |= USERDB_HAS_NT;
+
+        /* smbpasswd uses XXXX.. for accounts without an LM hash */
+        ret = gssntlm_hex_to_key(e->lm_hash, &key);
+        if (ret == 0) {
+            memcpy(rec->lm_hash, key.data, 16);
+            flags |= USERDB_HAS_LM;
+        }
+    }
+    rec->flags = htole32(flags);
+    ret = 0;
+
+done:
+    safezero(key.data, 16);
+    return ret;
+}
+
+static int userdb_write(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int gssntlm_userfile_compile(const char *input, const char *output)
+{
+    struct userfile_table *table = NULL;
+    struct wire_userdb_rec *recs = NULL;
+    struct wire_userdb_rec *sorted = NULL;
+    struct userdb_strings strs = { 0 };
+    struct wire_userdb_hdr hdr = { { 0 } };
+    uint32_t *buckets = NULL;
+    uint8_t pad[8] = { 0 };
+    size_t num_buckets;
+    size_t num = 0;
+    uint64_t offset;
+    char *tmpname = NULL;
+    char *dirc = NULL;
+    int fd = -1;
+    int ret;
+
+    ret = userfile_load(input, &table);
+    if (ret) goto done;
+    if (table->map) {
+        /* already compiled */
+        ret = EINVAL;
+        goto done;
+    }
+    num = table->num_entries;
+    if (num >= USERDB_NO_STRING) {
+        ret = E2BIG;
+        goto done;
+    }
+
+    for (num_buckets = 16; num_buckets < num; num_buckets <<= 1) ;
+
+    recs = calloc(num ? num : 1, sizeof(struct wire_userdb_rec));
+    sorted = calloc(num ? num : 1, sizeof(struct wire_userdb_rec));
+    buckets = calloc(num_buckets + 1, sizeof(uint32_t));
+    if (!recs || !sorted || !buckets) {
+        ret = ENOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < num; i++) {
+        ret = userdb_make_rec(&table->entries[i], i, &strs, &recs[i]);
+        if (ret) goto done;
+        buckets[(le32toh(recs[i].hash) & (num_buckets - 1)) + 1]++;
+    }
+
+    /* stable counting sort by bucket, keeps file order within buckets */
+    for (size_t b = 0; b < num_buckets; b++) {
+        buckets[b + 1] += buckets[b];
+    }
+    for (size_t i = 0; i < num; i++) {
+        size_t b = le32toh(recs[i].hash) & (num_buckets - 1);
+        sorted[buckets[b]++] = recs[i];
+    }
+    /* the placement pass moved every start to the next bucket's start */
+    for (size_t b = num_buckets; b > 0; b--) {
+        buckets[b] = buckets[b - 1];
+    }
+    buckets[0] = 0;
+    for (size_t b = 0; b <= num_buckets; b++) {
+        buckets[b] = htole32(buckets[b]);
+    }
+
+    memcpy(hdr.magic, USERDB_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(USERDB_VERSION);
+    hdr.num_entries = htole32(num);
+    hdr.num_buckets = htole32(num_buckets);
+    offset = sizeof(struct wire_userdb_hdr);
+    hdr.buckets_offset = htole64(offset);
+    offset += (num_buckets + 1) * sizeof(uint32_t);
+    offset = (offset + 7) & ~7ULL;
+    hdr.records_offset = htole64(offset);
+    offset += num * sizeof(struct wire_userdb_rec);
+    hdr.strings_offset = htole64(offset);
+    hdr.strings_size = htole64(strs.size);
+
+    /* write to a temporary file and rename it in place, so that processes
+     * using the old database see either the old or the new one */
+    dirc = strdup(output);
+    if (!dirc) {
+        ret = ENOMEM;
+        goto done;
+    }
+    ret = asprintf(&tmpname, "%s/.ntlmssp-mkdb.XXXXXX", dirname(dirc));
+    if (ret == -1) {
+        tmpname = NULL;
+        ret = ENOMEM;
+        goto done;
+    }
+    fd = mkstemp(tmpname);
+    if (fd == -1) {
+        ret = errno;
+        goto done;
+    }
+
+    ret = userdb_write(fd, &hdr, sizeof(hdr));
+    if (ret) goto done;
+    ret = userdb_write(fd, buckets, (num_buckets + 1) * sizeof(uint32_t));
+    if (ret) goto done;
+    ret = userdb_write(fd, pad, le64toh(hdr.records_offset) -
+                                sizeof(hdr) -
+                                (num_buckets + 1) * sizeof(uint32_t));
+    if (ret) goto done;
+    ret = userdb_write(fd, sorted, num * sizeof(struct wire_userdb_rec));
+    if (ret) goto done;
+    ret = userdb_write(fd, strs.data, strs.size);
+    if (ret) goto done;
+
+    ret = fsync(fd);
+    if (ret == -1) {
+        ret = errno;
+        goto done;
+    }
+    ret = close(fd);
+    fd = -1;
+    if (ret == -1) {
+        ret = errno;
+        goto done;
+    }
+    ret = rename(tmpname, output);
+    if (ret == -1) {
+        ret = errno;
+        goto done;
+    }
+    /* do not serve a table we know is stale until the next recheck */
+    gssntlm_userfile_recheck(output);
+    ret = 0;
+
+done:
+    if (fd != -1) close(fd);
+    if (ret && tmpname) unlink(tmpname);
+    free(tmpname);
+    free(dirc);
+    if (recs) {
+        safezero((uint8_t *)recs, (num ? num : 1) * sizeof(*recs));
+        safefree(recs);
+    }
+    if (sorted) {
+        safezero((uint8_t *)sorted, (num ? num : 1) * sizeof(*sorted));
+        safefree(sorted);
+    }
+    safefree(buckets);
+    safefree(strs.data);
+    userfile_table_free(table);
+    return ret;
+}
@@ -53,10 +53,87 @@ extern "C" {
 #define GSS_NTLMSSP_RESET_CRYPTO_OID_STRING GSS_NTLMSSP_BASE_OID_STRING "\x03"
 #define GSS_NTLMSSP_RESET_CRYPTO_OID_LENGTH GSS_NTLMSSP_BASE_OID_LENGTH + 1
 
+/* Invalidate Identity OID
+ * OID to be used with gss_set_cred_option() (any credential, including
+ * GSS_C_NO_CREDENTIAL) or gss_set_sec_context_option(). It drops the cached
+ * NetBIOS computer and domain names and host name, so that they are
+ * resolved again on the next context establishment. Changes to the
+ * NETBIOS_COMPUTER_NAME and NETBIOS_DOMAIN_NAME environment variables are
+ * only picked up then, or when the cache expires. The value buffer is
+ * ignored. */
+#define GSS_NTLMSSP_INVALIDATE_IDENTITY_OID_STRING GSS_NTLMSSP_BASE_OID_STRING "\x04"
+#define GSS_NTLMSSP_INVALIDATE_IDENTITY_OID_LENGTH GSS_NTLMSSP_BASE_OID_LENGTH + 1
+
+/* Prefetch Keystream OID
+ * OID to be used with gss_set_sec_context_option() on an established,
+ * connection oriented context. It generates RC4 keystream for both
+ * directions ahead of time, so that the following gss_wrap()/gss_unwrap()
+ * calls only need to XOR it into the data. Applications can use it while
+ * idle (eg. after a message has been sent, before the next arrives).
+ * The value buffer is either empty (a default of 4 KiB is used) or a
+ * uint32_t in host order with the number of bytes, capped at 16 KiB per
+ * direction. The keystream is kept until it has been used up, then its
+ * memory is released. Datagram contexts rekey on each message and fail
+ * with ERR_WRONGCTX. */
+#define GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_STRING GSS_NTLMSSP_BASE_OID_STRING "\x05"
+#define GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_LENGTH GSS_NTLMSSP_BASE_OID_LENGTH + 1
+
+/* Metrics OID
+ * OID to be used with gss_inquire_sec_context_by_oid() or
+ * gss_inquire_cred_by_oid() on any context or credential. It returns a
+ * single buffer with a snapshot of the process-wide counters and latency
+ * histograms of the mechanism, as text in the Prometheus exposition
+ * format. gss_ntlmssp_metrics_snapshot() returns the same snapshot without
+ * the need for a handle. */
+#define GSS_NTLMSSP_METRICS_OID_STRING GSS_NTLMSSP_BASE_OID_STRING "\x06"
+#define GSS_NTLMSSP_METRICS_OID_LENGTH GSS_NTLMSSP_BASE_OID_LENGTH + 1
+
+/* Context Table OID
+ * OID to be used with gss_set_sec_context_option() on an established
+ * context, in a process that has a shared context table (see
+ * gss_ntlmssp_ctx_table_create() below). The value buffer is ignored.
+ * The per-message state of the context (sequence numbers and RC4 state)
+ * moves to the table, and gss_export_sec_context() now returns a small
+ * token that only refers to the table entry. Any process sharing the
+ * table can import that token, any number of times, and all the contexts
+ * imported from it use and advance the same state. An entry is kept while
+ * a live process has a context imported from it, or until a token that
+ * was exported is imported, and in any case until the context expires.
+ * At most 8 processes can have the same entry imported at a time.
+ * With gss_inquire_sec_context_by_oid() it returns the ID of the table
+ * entry of a shared context, a uint64_t in host order. */
+#define GSS_NTLMSSP_CTX_TABLE_OID_STRING GSS_NTLMSSP_BASE_OID_STRING "\x07"
+#define GSS_NTLMSSP_CTX_TABLE_OID_LENGTH GSS_NTLMSSP_BASE_OID_LENGTH + 1
+
 #define GSS_NTLMSSP_CS_DOMAIN "ntlmssp_domain"
 #define GSS_NTLMSSP_CS_NTHASH "ntlmssp_nthash"
 #define GSS_NTLMSSP_CS_PASSWORD "ntlmssp_password"
 #define GSS_NTLMSSP_CS_KEYFILE "ntlmssp_keyfile"
+/* For acceptor credentials: reject authenticate messages that were already
+ * accepted, remembering up to this many of them (a decimal number). The
+ * cache is shared by the whole process and sized by the first credential
+ * that enables it, its statistics are part of the metrics snapshot. */
+#define GSS_NTLMSSP_CS_REPLAY_CACHE "ntlmssp_replay_cache"
+/* How long, in seconds, accepted messages are remembered for, the default
+ * is as long as a challenge response is valid (36 hours) */
+#define GSS_NTLMSSP_CS_REPLAY_LIFETIME "ntlmssp_replay_cache_lifetime"
+
+/* Exported by the mechanism module, look it up with dlsym() as the module
+ * is normally loaded by the GSSAPI mechglue. The snapshot is released with
+ * gss_release_buffer(). */
+OM_uint32 gss_ntlmssp_metrics_snapshot(OM_uint32 *minor_status,
+                                       gss_buffer_t snapshot);
+
+/* Shared context table, for servers with a pool of pre-forked workers.
+ * Create it in the parent before forking, the workers inherit it. Any
+ * other process can map it with the returned descriptor (eg. received
+ * over a unix socket); the parent can close it if that is not needed.
+ * An entry stays valid while contexts use it, and after that until its
+ * context expires or its room is needed for a new one. Both functions are
+ * exported by the mechanism module, like the one above. */
+OM_uint32 gss_ntlmssp_ctx_table_create(OM_uint32 *minor_status,
+                                       OM_uint32 entries, int *fd);
+OM_uint32 gss_ntlmssp_ctx_table_map(OM_uint32 *minor_status, int fd);
 
 #ifdef __cplusplus
 }
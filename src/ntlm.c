@@ -10,7 +10,6 @@
 #include <alloca.h>
 #include <endian.h>
 #include <errno.h>
-#include <iconv.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/time.h>
@@ -18,6 +17,7 @@
 #include <unicase.h>
 
 #include "ntlm.h"
+#include "unicode.h"
 
 #pragma pack(push, 1)
 struct wire_av_pair {
@@ -65,57 +65,30 @@ struct wire_ntlm_cli_chal {
 };
 #pragma pack(pop)
 
+/* The context used to hold the iconv handles; the codec in unicode.c needs
+ * none, so every caller gets the same static instance and nothing is
+ * allocated per security context. The opaque type is kept because all the
+ * message and key functions take it (and reject NULL): per context state
+ * can come back without touching them. C does not allow an empty struct,
+ * hence the unused member. */
 struct ntlm_ctx {
-    iconv_t from_oem;
-    iconv_t to_oem;
+    char unused;
 };
 
+static struct ntlm_ctx ntlm_shared_ctx;
+
 int ntlm_init_ctx(struct ntlm_ctx **ctx)
 {
-    struct ntlm_ctx *_ctx;
-    int ret = 0;
-
-    _ctx = calloc(1, sizeof(struct ntlm_ctx));
-    if (!_ctx) return ENOMEM;
-
-    _ctx->from_oem = iconv_open("UTF16LE", "UTF-8");
-    if (_ctx->from_oem == (iconv_t) -1) {
-        ret = errno;
-    }
-
-    _ctx->to_oem = iconv_open("UTF-8", "UTF16LE");
-    if (_ctx->to_oem == (iconv_t) -1) {
-        iconv_close(_ctx->from_oem);
-        ret = errno;
-    }
-
-    if (ret) {
-        safefree(_ctx);
-    } else {
-        *ctx = _ctx;
-    }
-    return ret;
+    *ctx = &ntlm_shared_ctx;
+    return 0;
 }
 
 int ntlm_free_ctx(struct ntlm_ctx **ctx)
 {
-    int ret;
-
     if (!ctx || !*ctx) return 0;
 
-    if ((*ctx)->from_oem) {
-        ret = iconv_close((*ctx)->from_oem);
-        if (ret) goto done;
-    }
-
-    if ((*ctx)->to_oem) {
-        ret = iconv_close((*ctx)->to_oem);
-    }
-
-done:
-    if (ret) ret = errno;
-    safefree(*ctx);
-    return ret;
+    *ctx = NULL;
+    return 0;
 }
 
 void ntlm_free_buffer_data(struct ntlm_buffer *buf)
@@ -165,47 +138,6 @@ bool ntlm_casecmp(const char *s1, const char *s2)
 }
 
 
-/**
- * @brief  Converts a string using the provided iconv context.
- *         This function is ok only to convert utf8<->utf16le
- *
- * @param cd        The iconv context
- * @param in        Input buffer
- * @param out       Output buffer
- * @param baselen   Input length
- * @param outlen    Returned length of out buffer
- *
- * NOTE: out must be preallocated to a size of baselen * 2
- *
- * @return 0 on success or a standard error value on error.
- */
-static int ntlm_str_convert(iconv_t cd,
-                            const char *in, char *out,
-                            size_t baselen, size_t *outlen)
-{
-    char *_in;
-    size_t inleft, outleft;
-    size_t ret;
-
-    ret = iconv(cd, NULL, NULL, NULL, NULL);
-    if (ret == -1) return errno;
-
-    _in = discard_const(in);
-    inleft = baselen;
-    /* conservative max_size calculation in case lots of octects end up
-     * being multiple bytes in length (in both directions) */
-    outleft = baselen * 2;
-
-    ret = iconv(cd, &_in, &inleft, &out, &outleft);
-    if (ret == -1) return errno;
-
-    if (outlen) {
-        *outlen = baselen * 2 - outleft;
-    }
-    return 0;
-}
-
-
 uint8_t ntlmssp_sig[8] = {'N', 'T', 'L', 'M', 'S', 'S', 'P', 0};
 
 static void ntlm_encode_header(struct wire_msg_hdr *hdr, uint32_t msg_type)
@@ -274,13 +206,17 @@ static int ntlm_encode_u16l_str_hdr(struct ntlm_ctx *ctx,
                                     size_t *data_offs,
                                     const char *str, int str_len)
 {
-    char *out;
     size_t outlen;
     int ret;
 
-    out = (char *)&buffer->data[*data_offs];
+    if (*data_offs > buffer->length) {
+        return ERR_ENCODE;
+    }
 
-    ret = ntlm_str_convert(ctx->from_oem, str, out, str_len, &outlen);
+    ret = ntlm_utf8_to_utf16le((const uint8_t *)str, str_len,
+                               &buffer->data[*data_offs],
+                               buffer->length - *data_offs, &outlen);
+    if (ret == E2BIG) return ERR_ENCODE;
     if (ret) return ret;
 
     hdr->len = htole16(outlen);
@@ -291,43 +227,29 @@ static int ntlm_encode_u16l_str_hdr(struct ntlm_ctx *ctx,
     return 0;
 }
 
-static int ntlm_decode_u16l_str_hdr(struct ntlm_ctx *ctx,
-                                    struct wire_field_hdr *str_hdr,
-                                    struct ntlm_buffer *buffer,
-                                    size_t payload_offs, char **str)
+/* Size of a string in a message payload, in the charset the flags select */
+static int ntlm_str_size(uint32_t flags, const char *str, size_t *size)
 {
-    char *in, *out = NULL;
-    uint16_t str_len;
-    uint32_t str_offs;
-    size_t outlen;
-    int ret = 0;
+    size_t len;
 
-    str_len = le16toh(str_hdr->len);
-    if (str_len == 0) goto done;
-
-    str_offs = le32toh(str_hdr->offset);
-    if ((str_offs < payload_offs) ||
-        (str_offs > buffer->length) ||
-        (str_offs + str_len > buffer->length)) {
-        return ERR_DECODE;
+    len = str ? strlen(str) : 0;
+    if (len && (flags & NTLMSSP_NEGOTIATE_UNICODE)) {
+        return ntlm_utf8_to_utf16le_len((const uint8_t *)str, len, size);
     }
+    *size = len;
+    return 0;
+}
 
-    in = (char *)&buffer->data[str_offs];
-
-    out = malloc(str_len * 2 + 1);
-    if (!out) return ENOMEM;
-
-    ret = ntlm_str_convert(ctx->to_oem, in, out, str_len, &outlen);
-
-    /* make sure to terminate output string */
-    out[outlen] = '\0';
-
-done:
-    if (ret) {
-        safefree(out);
+static int ntlm_encode_str(struct ntlm_ctx *ctx, uint32_t flags,
+                           struct wire_field_hdr *hdr,
+                           struct ntlm_buffer *buffer,
+                           size_t *data_offs, const char *str)
+{
+    if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
+        return ntlm_encode_u16l_str_hdr(ctx, hdr, buffer, data_offs,
+                                        str, strlen(str));
     }
-    *str = out;
-    return ret;
+    return ntlm_encode_oem_str(hdr, buffer, data_offs, str, strlen(str));
 }
 
 struct wire_version ntlmssp_version = {
@@ -379,17 +301,21 @@ static int ntlm_encode_field(struct wire_field_hdr *hdr,
     return 0;
 }
 
-static int ntlm_decode_field(struct wire_field_hdr *hdr,
-                             struct ntlm_buffer *buffer,
-                             size_t payload_offs,
-                             struct ntlm_buffer *field)
+/* bounds checks a field against the message and points the view at it,
+ * nothing is copied */
+static int ntlm_view_field(struct wire_field_hdr *hdr,
+                           struct ntlm_buffer *buffer,
+                           size_t payload_offs,
+                           struct ntlm_buffer *view)
 {
-    struct ntlm_buffer b = { NULL, 0 };
     uint32_t offs;
     uint16_t len;
 
+    view->data = NULL;
+    view->length = 0;
+
     len = le16toh(hdr->len);
-    if (len == 0) goto done;
+    if (len == 0) return 0;
 
     offs = le32toh(hdr->offset);
     if ((offs < payload_offs) ||
@@ -398,17 +324,80 @@ static int ntlm_decode_field(struct wire_field_hdr *hdr,
         return ERR_DECODE;
     }
 
-    b.data = malloc(len);
-    if (!b.data) return ENOMEM;
+    view->data = &buffer->data[offs];
+    view->length = len;
+    return 0;
+}
 
-    b.length = len;
-    memcpy(b.data, &buffer->data[offs], b.length);
+static int ntlm_copy_view(struct ntlm_buffer *view, struct ntlm_buffer *field)
+{
+    struct ntlm_buffer b = { NULL, 0 };
+
+    if (view->length > 0) {
+        b.data = malloc(view->length);
+        if (!b.data) return ENOMEM;
+        memcpy(b.data, view->data, view->length);
+        b.length = view->length;
+    }
 
-done:
     *field = b;
     return 0;
 }
 
+int ntlm_str_view_to_utf8(struct ntlm_str_view *str,
+                          char *out, size_t outmax, size_t *outlen)
+{
+    size_t len;
+    int ret;
+
+    if (outmax == 0) return E2BIG;
+
+    if (str->unicode) {
+        ret = ntlm_utf16le_to_utf8(str->data.data, str->data.length,
+                                   (uint8_t *)out, outmax - 1, &len);
+        if (ret) return ret;
+    } else {
+        if (str->data.length > outmax - 1) return E2BIG;
+        len = str->data.length;
+        if (len) memcpy(out, str->data.data, len);
+    }
+    out[len] = '\0';
+
+    /* like the strings returned by the decoders, stop at an embedded NUL */
+    if (outlen) *outlen = strlen(out);
+    return 0;
+}
+
+int ntlm_str_view_dup(struct ntlm_str_view *str, char **out)
+{
+    size_t outmax;
+    char *s;
+    int ret;
+
+    if (str->data.length == 0) {
+        *out = NULL;
+        return 0;
+    }
+
+    /* each UTF-16 code unit becomes at most 3 bytes of UTF-8 */
+    if (str->unicode) {
+        outmax = str->data.length * 3 / 2 + 1;
+    } else {
+        outmax = str->data.length + 1;
+    }
+    s = malloc(outmax);
+    if (!s) return ENOMEM;
+
+    ret = ntlm_str_view_to_utf8(str, s, outmax, NULL);
+    if (ret) {
+        safefree(s);
+        return ret;
+    }
+
+    *out = s;
+    return 0;
+}
+
 static int ntlm_encode_av_pair_u16l_str(struct ntlm_ctx *ctx,
                                         struct ntlm_buffer *buffer,
                                         size_t *data_offs,
@@ -416,7 +405,6 @@ static int ntlm_encode_av_pair_u16l_str(struct ntlm_ctx *ctx,
                                         const char *str, size_t str_len)
 {
     struct wire_av_pair *av_pair;
-    char *out;
     size_t outlen;
     int ret;
 
@@ -425,9 +413,10 @@ static int ntlm_encode_av_pair_u16l_str(struct ntlm_ctx *ctx,
     }
 
     av_pair = (struct wire_av_pair *)&buffer->data[*data_offs];
-    out = (char *)av_pair->value;
 
-    ret = ntlm_str_convert(ctx->from_oem, str, out, str_len, &outlen);
+    ret = ntlm_utf8_to_utf16le((const uint8_t *)str, str_len, av_pair->value,
+                               buffer->length - *data_offs - 4, &outlen);
+    if (ret == E2BIG) return ERR_ENCODE;
     if (ret) return ret;
 
     av_pair->av_len = htole16(outlen);
@@ -441,15 +430,16 @@ static int ntlm_decode_av_pair_u16l_str(struct ntlm_ctx *ctx,
                                         struct wire_av_pair *av_pair,
                                         char **str)
 {
-    char *in, *out;
+    char *out;
     size_t inlen, outlen;
     int ret;
 
-    in = (char *)av_pair->value;
     inlen = le16toh(av_pair->av_len);
-    out = malloc(inlen * 2 + 1);
+    out = malloc(inlen * 3 / 2 + 1);
+    if (!out) return ENOMEM;
 
-    ret = ntlm_str_convert(ctx->to_oem, in, out, inlen, &outlen);
+    ret = ntlm_utf16le_to_utf8(av_pair->value, inlen,
+                               (uint8_t *)out, inlen * 3 / 2, &outlen);
     if (ret) {
         safefree(out);
         return ret;
@@ -883,37 +873,40 @@ done:
     return ret;
 }
 
-int ntlm_encode_neg_msg(struct ntlm_ctx *ctx, uint32_t flags,
-                        const char *domain, const char *workstation,
-                        struct ntlm_buffer *message)
+int ntlm_write_neg_msg(struct ntlm_ctx *ctx, uint32_t flags,
+                       const char *domain, const char *workstation,
+                       struct ntlm_buffer *message)
 {
     struct wire_neg_msg *msg;
     struct ntlm_buffer buffer;
     size_t data_offs;
     size_t dom_len = 0;
     size_t wks_len = 0;
-    int ret = 0;
+    int ret;
 
     if (!ctx) return EINVAL;
 
-    buffer.length = sizeof(struct wire_neg_msg);
-
     /* Strings MUST use OEM charset in negotiate message */
     if (flags & NTLMSSP_NEGOTIATE_OEM_DOMAIN_SUPPLIED) {
         if (!domain) return EINVAL;
         dom_len = strlen(domain);
-        buffer.length += dom_len;
     }
     if (flags & NTLMSSP_NEGOTIATE_OEM_WORKSTATION_SUPPLIED) {
         if (!workstation) return EINVAL;
         wks_len = strlen(workstation);
-        buffer.length += wks_len;
     }
 
-    buffer.data = calloc(1, buffer.length);
-    if (!buffer.data) return ENOMEM;
+    if (!message->data) {
+        message->length = sizeof(struct wire_neg_msg) + dom_len + wks_len;
+        return 0;
+    }
+
+    /* every field is bounds checked as it is written */
+    buffer = *message;
+    if (buffer.length < sizeof(struct wire_neg_msg)) return ERR_ENCODE;
 
     msg = (struct wire_neg_msg *)buffer.data;
+    memset(msg, 0, sizeof(struct wire_neg_msg));
     data_offs = (char *)msg->payload - (char *)msg;
 
     ntlm_encode_header(&msg->header, NEGOTIATE_MESSAGE);
@@ -923,22 +916,40 @@ int ntlm_encode_neg_msg(struct ntlm_ctx *ctx, uint32_t flags,
     if (dom_len) {
         ret = ntlm_encode_oem_str(&msg->domain_name, &buffer,
                                   &data_offs, domain, dom_len);
-        if (ret) goto done;
+        if (ret) return ret;
     }
 
     if (wks_len) {
         ret = ntlm_encode_oem_str(&msg->workstation_name, &buffer,
                                   &data_offs, workstation, wks_len);
-        if (ret) goto done;
+        if (ret) return ret;
     }
 
-done:
+    message->length = data_offs;
+    return 0;
+}
+
+int ntlm_encode_neg_msg(struct ntlm_ctx *ctx, uint32_t flags,
+                        const char *domain, const char *workstation,
+                        struct ntlm_buffer *message)
+{
+    struct ntlm_buffer buffer = { 0 };
+    int ret;
+
+    ret = ntlm_write_neg_msg(ctx, flags, domain, workstation, &buffer);
+    if (ret) return ret;
+
+    buffer.data = malloc(buffer.length);
+    if (!buffer.data) return ENOMEM;
+
+    ret = ntlm_write_neg_msg(ctx, flags, domain, workstation, &buffer);
     if (ret) {
         safefree(buffer.data);
-    } else {
-        *message = buffer;
+        return ret;
     }
-    return ret;
+
+    *message = buffer;
+    return 0;
 }
 
 int ntlm_decode_neg_msg(struct ntlm_ctx *ctx,
@@ -984,23 +995,136 @@ done:
     return ret;
 }
 
+int ntlm_write_chal_msg(struct ntlm_ctx *ctx,
+                        uint32_t flags,
+                        const char *target_name,
+                        struct ntlm_buffer *challenge,
+                        struct ntlm_buffer *target_info,
+                        struct ntlm_buffer *message)
+{
+    struct wire_chal_msg *msg;
+    struct ntlm_buffer buffer;
+    size_t data_offs;
+    size_t target_len;
+    bool has_target;
+    int ret;
+
+    if (!ctx) return EINVAL;
+
+    if (!challenge || challenge->length != 8) return EINVAL;
+
+    has_target = (flags & NTLMSSP_TARGET_TYPE_SERVER) ||
+                 (flags & NTLMSSP_TARGET_TYPE_DOMAIN);
+    if (has_target && !target_name) return EINVAL;
+    if ((flags & NTLMSSP_NEGOTIATE_TARGET_INFO) && !target_info) {
+        return EINVAL;
+    }
+
+    if (!message->data) {
+        message->length = sizeof(struct wire_chal_msg);
+        if (flags & NTLMSSP_NEGOTIATE_VERSION) {
+            message->length += sizeof(struct wire_version);
+        }
+        if (has_target) {
+            ret = ntlm_str_size(flags, target_name, &target_len);
+            if (ret) return ret;
+            message->length += target_len;
+        }
+        if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
+            message->length += target_info->length;
+        }
+        return 0;
+    }
+
+    /* every field is bounds checked as it is written */
+    buffer = *message;
+    if (buffer.length < sizeof(struct wire_chal_msg)) return ERR_ENCODE;
+
+    msg = (struct wire_chal_msg *)buffer.data;
+    memset(msg, 0, sizeof(struct wire_chal_msg));
+    data_offs = (char *)msg->payload - (char *)msg;
+
+    ntlm_encode_header(&msg->header, CHALLENGE_MESSAGE);
+
+    /* this must be first as it pushes the payload further down */
+    if (flags & NTLMSSP_NEGOTIATE_VERSION) {
+        ret = ntlm_encode_version(ctx, &buffer, &data_offs);
+        if (ret) return ret;
+    }
+
+    if (has_target) {
+        ret = ntlm_encode_str(ctx, flags, &msg->target_name, &buffer,
+                              &data_offs, target_name);
+        if (ret) return ret;
+    }
+
+    msg->neg_flags = htole32(flags);
+    memcpy(msg->server_challenge, challenge->data, 8);
+
+    if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
+        ret = ntlm_encode_field(&msg->target_info, &buffer,
+                                &data_offs, target_info);
+        if (ret) return ret;
+    }
+
+    message->length = data_offs;
+    return 0;
+}
+
 int ntlm_encode_chal_msg(struct ntlm_ctx *ctx,
                          uint32_t flags,
                          const char *target_name,
                          struct ntlm_buffer *challenge,
                          struct ntlm_buffer *target_info,
                          struct ntlm_buffer *message)
+{
+    struct ntlm_buffer buffer = { 0 };
+    int ret;
+
+    ret = ntlm_write_chal_msg(ctx, flags, target_name, challenge,
+                              target_info, &buffer);
+    if (ret) return ret;
+
+    buffer.data = malloc(buffer.length);
+    if (!buffer.data) return ENOMEM;
+
+    ret = ntlm_write_chal_msg(ctx, flags, target_name, challenge,
+                              target_info, &buffer);
+    if (ret) {
+        safefree(buffer.data);
+        return ret;
+    }
+
+    *message = buffer;
+    return 0;
+}
+
+#define CHAL_TEMPLATE_LAYOUT (NTLMSSP_NEGOTIATE_VERSION | \
+                              NTLMSSP_NEGOTIATE_UNICODE | \
+                              NTLMSSP_NEGOTIATE_TARGET_INFO | \
+                              NTLMSSP_TARGET_TYPE_SERVER | \
+                              NTLMSSP_TARGET_TYPE_DOMAIN)
+
+uint32_t ntlm_chal_template_layout(uint32_t flags)
+{
+    return flags & CHAL_TEMPLATE_LAYOUT;
+}
+
+int ntlm_encode_chal_template(uint32_t flags,
+                              struct ntlm_buffer *target_name,
+                              struct ntlm_buffer *u16_nb_computer_name,
+                              struct ntlm_buffer *u16_nb_domain_name,
+                              struct ntlm_buffer *u16_dns_computer_name,
+                              struct ntlm_chal_template *tmpl)
 {
     struct wire_chal_msg *msg;
     struct ntlm_buffer buffer;
+    struct ntlm_buffer value;
     size_t data_offs;
-    size_t target_len = 0;
+    size_t info_offs;
+    uint64_t timestamp = 0;
     int ret = 0;
 
-    if (!ctx) return EINVAL;
-
-    if (!challenge || challenge->length != 8) return EINVAL;
-
     buffer.length = sizeof(struct wire_chal_msg);
 
     if (flags & NTLMSSP_NEGOTIATE_VERSION) {
@@ -1011,18 +1135,21 @@ int ntlm_encode_chal_msg(struct ntlm_ctx *ctx,
         || (flags & NTLMSSP_TARGET_TYPE_DOMAIN)) {
         if (!target_name) return EINVAL;
 
-        target_len = strlen(target_name);
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            buffer.length += target_len * 2;
-        } else {
-            buffer.length += target_len;
-        }
+        buffer.length += target_name->length;
     }
 
     if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
-        if (!target_info) return EINVAL;
+        if (!u16_nb_computer_name || !u16_nb_domain_name ||
+            !u16_dns_computer_name) {
+            return EINVAL;
+        }
 
-        buffer.length += target_info->length;
+        /* same AV_PAIRs, in the same order, that the acceptor has always
+         * sent: three names, the timestamp and the terminator */
+        buffer.length += 4 + u16_nb_computer_name->length +
+                         4 + u16_nb_domain_name->length +
+                         4 + u16_dns_computer_name->length +
+                         4 + 8 + 4;
     }
 
     buffer.data = calloc(1, buffer.length);
@@ -1033,174 +1160,262 @@ int ntlm_encode_chal_msg(struct ntlm_ctx *ctx,
 
     ntlm_encode_header(&msg->header, CHALLENGE_MESSAGE);
 
-    /* this must be first as it pushes the payload further down */
     if (flags & NTLMSSP_NEGOTIATE_VERSION) {
-        ret = ntlm_encode_version(ctx, &buffer, &data_offs);
+        ret = ntlm_encode_version(NULL, &buffer, &data_offs);
         if (ret) goto done;
     }
 
     if ((flags & NTLMSSP_TARGET_TYPE_SERVER)
         || (flags & NTLMSSP_TARGET_TYPE_DOMAIN)) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_encode_u16l_str_hdr(ctx, &msg->target_name, &buffer,
-                                           &data_offs, target_name, target_len);
-        } else {
-            ret = ntlm_encode_oem_str(&msg->target_name, &buffer,
-                                      &data_offs, target_name, target_len);
-        }
+        ret = ntlm_encode_field(&msg->target_name, &buffer,
+                                &data_offs, target_name);
         if (ret) goto done;
     }
 
     msg->neg_flags = htole32(flags);
-    memcpy(msg->server_challenge, challenge->data, 8);
 
+    tmpl->timestamp_offset = 0;
     if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
-        ret = ntlm_encode_field(&msg->target_info, &buffer,
-                                &data_offs, target_info);
+        info_offs = data_offs;
+
+        ret = ntlm_encode_av_pair_value(&buffer, &data_offs,
+                                        MSV_AV_NB_COMPUTER_NAME,
+                                        u16_nb_computer_name);
+        if (ret) goto done;
+        ret = ntlm_encode_av_pair_value(&buffer, &data_offs,
+                                        MSV_AV_NB_DOMAIN_NAME,
+                                        u16_nb_domain_name);
+        if (ret) goto done;
+        ret = ntlm_encode_av_pair_value(&buffer, &data_offs,
+                                        MSV_AV_DNS_COMPUTER_NAME,
+                                        u16_dns_computer_name);
+        if (ret) goto done;
+
+        tmpl->timestamp_offset = data_offs + 4;
+        value.data = (uint8_t *)&timestamp;
+        value.length = 8;
+        ret = ntlm_encode_av_pair_value(&buffer, &data_offs,
+                                        MSV_AV_TIMESTAMP, &value);
         if (ret) goto done;
+
+        value.data = NULL;
+        value.length = 0;
+        ret = ntlm_encode_av_pair_value(&buffer, &data_offs,
+                                        MSV_AV_EOL, &value);
+        if (ret) goto done;
+
+        msg->target_info.len = htole16(data_offs - info_offs);
+        msg->target_info.max_len = msg->target_info.len;
+        msg->target_info.offset = htole32(info_offs);
     }
 
+    tmpl->layout = ntlm_chal_template_layout(flags);
+
 done:
     if (ret) {
         safefree(buffer.data);
     } else {
-        *message = buffer;
+        tmpl->message = buffer;
     }
     return ret;
 }
 
-int ntlm_decode_chal_msg(struct ntlm_ctx *ctx,
-                         struct ntlm_buffer *buffer,
-                         uint32_t *_flags, char **target_name,
-                         struct ntlm_buffer *challenge,
-                         struct ntlm_buffer *target_info)
+int ntlm_chal_template_write(struct ntlm_chal_template *tmpl,
+                             uint32_t flags,
+                             struct ntlm_buffer *challenge,
+                             uint64_t timestamp,
+                             struct ntlm_buffer *message)
+{
+    struct wire_chal_msg *msg;
+    uint64_t le_timestamp;
+    uint8_t *data;
+
+    if (!challenge || challenge->length != 8) return EINVAL;
+    if (ntlm_chal_template_layout(flags) != tmpl->layout) return EINVAL;
+
+    if (!message->data) {
+        message->length = tmpl->message.length;
+        return 0;
+    }
+    if (message->length < tmpl->message.length) return ERR_ENCODE;
+
+    data = message->data;
+    memcpy(data, tmpl->message.data, tmpl->message.length);
+
+    msg = (struct wire_chal_msg *)data;
+    msg->neg_flags = htole32(flags);
+    memcpy(msg->server_challenge, challenge->data, 8);
+    if (flags & NTLMSSP_NEGOTIATE_VERSION) {
+        /* may have been changed since the template was built */
+        memcpy(msg->payload, &ntlmssp_version, sizeof(struct wire_version));
+    }
+    if (tmpl->timestamp_offset) {
+        le_timestamp = htole64(timestamp);
+        memcpy(&data[tmpl->timestamp_offset], &le_timestamp, 8);
+    }
+
+    message->length = tmpl->message.length;
+    return 0;
+}
+
+int ntlm_chal_template_to_msg(struct ntlm_chal_template *tmpl,
+                              uint32_t flags,
+                              struct ntlm_buffer *challenge,
+                              uint64_t timestamp,
+                              struct ntlm_buffer *message)
+{
+    struct ntlm_buffer buffer = { 0 };
+    int ret;
+
+    ret = ntlm_chal_template_write(tmpl, flags, challenge, timestamp,
+                                   &buffer);
+    if (ret) return ret;
+
+    buffer.data = malloc(buffer.length);
+    if (!buffer.data) return ENOMEM;
+
+    ret = ntlm_chal_template_write(tmpl, flags, challenge, timestamp,
+                                   &buffer);
+    if (ret) {
+        safefree(buffer.data);
+        return ret;
+    }
+
+    *message = buffer;
+    return 0;
+}
+
+int ntlm_decode_chal_view(struct ntlm_ctx *ctx,
+                          struct ntlm_buffer *buffer,
+                          struct ntlm_chal_view *view)
 {
     struct wire_chal_msg *msg;
     size_t payload_offs;
-    uint32_t flags;
-    char *trg = NULL;
-    int ret = 0;
+    int ret;
 
     if (!ctx) return EINVAL;
 
-    if (challenge->length < 8) return EINVAL;
+    memset(view, 0, sizeof(struct ntlm_chal_view));
 
     msg = (struct wire_chal_msg *)buffer->data;
     payload_offs = (char *)msg->payload - (char *)msg;
 
-    flags = le32toh(msg->neg_flags);
+    view->flags = le32toh(msg->neg_flags);
+    view->challenge.data = msg->server_challenge;
+    view->challenge.length = 8;
 
-    if ((flags & NTLMSSP_TARGET_TYPE_SERVER)
-        || (flags & NTLMSSP_TARGET_TYPE_DOMAIN)) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_decode_u16l_str_hdr(ctx, &msg->target_name, buffer,
-                                           payload_offs, &trg);
-        } else {
-            ret = ntlm_decode_oem_str(&msg->target_name, buffer,
-                                      payload_offs, &trg);
-        }
-        if (ret) goto done;
+    if ((view->flags & NTLMSSP_TARGET_TYPE_SERVER)
+        || (view->flags & NTLMSSP_TARGET_TYPE_DOMAIN)) {
+        view->target_name.unicode =
+            (view->flags & NTLMSSP_NEGOTIATE_UNICODE) != 0;
+        ret = ntlm_view_field(&msg->target_name, buffer, payload_offs,
+                              &view->target_name.data);
+        if (ret) return ret;
     }
 
-    memcpy(challenge->data, msg->server_challenge, 8);
-    challenge->length = 8;
-
     /* if we allowed a broken short challenge message from an old
      * server we must stop here */
     if (buffer->length < sizeof(struct wire_chal_msg)) {
-        if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
-            ret = ERR_DECODE;
+        if (view->flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
+            return ERR_DECODE;
         }
-        goto done;
+        return 0;
     }
 
-    if (flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
-        ret = ntlm_decode_field(&msg->target_info, buffer,
-                                payload_offs, target_info);
-        if (ret) goto done;
+    if (view->flags & NTLMSSP_NEGOTIATE_TARGET_INFO) {
+        ret = ntlm_view_field(&msg->target_info, buffer, payload_offs,
+                              &view->target_info);
+        if (ret) return ret;
     }
 
-done:
-    if (ret) {
-        safefree(trg);
-    } else {
-        *_flags = flags;
-        *target_name = trg;
+    return 0;
+}
+
+int ntlm_decode_chal_msg(struct ntlm_ctx *ctx,
+                         struct ntlm_buffer *buffer,
+                         uint32_t *_flags, char **target_name,
+                         struct ntlm_buffer *challenge,
+                         struct ntlm_buffer *target_info)
+{
+    struct ntlm_chal_view view;
+    char *trg = NULL;
+    int ret;
+
+    if (challenge->length < 8) return EINVAL;
+
+    ret = ntlm_decode_chal_view(ctx, buffer, &view);
+    if (ret) return ret;
+
+    ret = ntlm_str_view_dup(&view.target_name, &trg);
+    if (ret) return ret;
+
+    if (target_info) {
+        ret = ntlm_copy_view(&view.target_info, target_info);
+        if (ret) {
+            safefree(trg);
+            return ret;
+        }
     }
-    return ret;
+
+    memcpy(challenge->data, view.challenge.data, 8);
+    challenge->length = 8;
+    *_flags = view.flags;
+    *target_name = trg;
+    return 0;
 }
 
-int ntlm_encode_auth_msg(struct ntlm_ctx *ctx,
-                         uint32_t flags,
-                         struct ntlm_buffer *lm_chalresp,
-                         struct ntlm_buffer *nt_chalresp,
-                         char *domain_name, char *user_name,
-                         char *workstation,
-                         struct ntlm_buffer *enc_sess_key,
-                         struct ntlm_buffer *mic,
-                         struct ntlm_buffer *message)
+int ntlm_write_auth_msg(struct ntlm_ctx *ctx,
+                        uint32_t flags,
+                        struct ntlm_buffer *lm_chalresp,
+                        struct ntlm_buffer *nt_chalresp,
+                        char *domain_name, char *user_name,
+                        char *workstation,
+                        struct ntlm_buffer *enc_sess_key,
+                        struct ntlm_buffer *mic,
+                        struct ntlm_buffer *message)
 {
     struct wire_auth_msg *msg;
     struct ntlm_buffer buffer;
     struct ntlm_buffer empty_chalresp = { 0 };
     size_t data_offs;
-    size_t domain_name_len = 0;
-    size_t user_name_len = 0;
-    size_t workstation_len = 0;
-    int ret = 0;
+    size_t len;
+    int ret;
 
     if (!ctx) return EINVAL;
 
-    buffer.length = sizeof(struct wire_auth_msg);
-
-    if (lm_chalresp) {
-        buffer.length += lm_chalresp->length;
-    } else {
-        lm_chalresp = &empty_chalresp;
-    }
-    if (nt_chalresp) {
-        buffer.length += nt_chalresp->length;
-    } else {
-        nt_chalresp = &empty_chalresp;
-    }
-    if (domain_name) {
-        domain_name_len = strlen(domain_name);
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            buffer.length += domain_name_len * 2;
-        } else {
-            buffer.length += domain_name_len;
+    if (!lm_chalresp) lm_chalresp = &empty_chalresp;
+    if (!nt_chalresp) nt_chalresp = &empty_chalresp;
+
+    if (!message->data) {
+        message->length = sizeof(struct wire_auth_msg) +
+                          lm_chalresp->length + nt_chalresp->length;
+        ret = ntlm_str_size(flags, domain_name, &len);
+        if (ret) return ret;
+        message->length += len;
+        ret = ntlm_str_size(flags, user_name, &len);
+        if (ret) return ret;
+        message->length += len;
+        ret = ntlm_str_size(flags, workstation, &len);
+        if (ret) return ret;
+        message->length += len;
+        if (enc_sess_key) {
+            message->length += enc_sess_key->length;
         }
-    }
-    if (user_name) {
-        user_name_len = strlen(user_name);
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            buffer.length += user_name_len * 2;
-        } else {
-            buffer.length += user_name_len;
+        if (flags & NTLMSSP_NEGOTIATE_VERSION) {
+            message->length += sizeof(struct wire_version);
         }
-    }
-    if (workstation) {
-        workstation_len = strlen(workstation);
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            buffer.length += workstation_len * 2;
-        } else {
-            buffer.length += workstation_len;
+        if (mic) {
+            message->length += 16;
         }
-    }
-    if (enc_sess_key) {
-        buffer.length += enc_sess_key->length;
-    }
-    if (flags & NTLMSSP_NEGOTIATE_VERSION) {
-        buffer.length += sizeof(struct wire_version);
-    }
-    if (mic) {
-        buffer.length += 16;
+        return 0;
     }
 
-    buffer.data = calloc(1, buffer.length);
-    if (!buffer.data) return ENOMEM;
+    /* every field is bounds checked as it is written */
+    buffer = *message;
+    if (buffer.length < sizeof(struct wire_auth_msg)) return ERR_ENCODE;
 
     msg = (struct wire_auth_msg *)buffer.data;
+    memset(msg, 0, sizeof(struct wire_auth_msg));
     data_offs = (char *)msg->payload - (char *)msg;
 
     ntlm_encode_header(&msg->header, AUTHENTICATE_MESSAGE);
@@ -1208,102 +1423,103 @@ int ntlm_encode_auth_msg(struct ntlm_ctx *ctx,
     /* this must be first as it pushes the payload further down */
     if (flags & NTLMSSP_NEGOTIATE_VERSION) {
         ret = ntlm_encode_version(ctx, &buffer, &data_offs);
-        if (ret) goto done;
+        if (ret) return ret;
     }
 
     /* this must be second as it pushes the payload further down */
     if (mic) {
-        memset(&buffer.data[data_offs], 0, mic->length);
+        if (data_offs + 16 > buffer.length) return ERR_ENCODE;
+        memset(&buffer.data[data_offs], 0, 16);
         /* return the actual pointer back in the mic, as it will
          * be backfilled later by the caller */
         mic->data = &buffer.data[data_offs];
-        data_offs += mic->length;
+        data_offs += 16;
     }
 
     ret = ntlm_encode_field(&msg->lm_chalresp, &buffer,
                             &data_offs, lm_chalresp);
-    if (ret) goto done;
+    if (ret) return ret;
 
     ret = ntlm_encode_field(&msg->nt_chalresp, &buffer,
                             &data_offs, nt_chalresp);
-    if (ret) goto done;
+    if (ret) return ret;
 
-    if (domain_name_len) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_encode_u16l_str_hdr(ctx, &msg->domain_name,
-                                           &buffer, &data_offs,
-                                           domain_name, domain_name_len);
-        } else {
-            ret = ntlm_encode_oem_str(&msg->domain_name,
-                                      &buffer, &data_offs,
-                                      domain_name, domain_name_len);
-        }
-        if (ret) goto done;
+    if (domain_name && domain_name[0]) {
+        ret = ntlm_encode_str(ctx, flags, &msg->domain_name,
+                              &buffer, &data_offs, domain_name);
+        if (ret) return ret;
     }
-    if (user_name_len) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_encode_u16l_str_hdr(ctx, &msg->user_name,
-                                           &buffer, &data_offs,
-                                           user_name, user_name_len);
-        } else {
-            ret = ntlm_encode_oem_str(&msg->user_name,
-                                      &buffer, &data_offs,
-                                      user_name, user_name_len);
-        }
-        if (ret) goto done;
+    if (user_name && user_name[0]) {
+        ret = ntlm_encode_str(ctx, flags, &msg->user_name,
+                              &buffer, &data_offs, user_name);
+        if (ret) return ret;
     }
-    if (workstation_len) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_encode_u16l_str_hdr(ctx, &msg->workstation,
-                                           &buffer, &data_offs,
-                                           workstation, workstation_len);
-        } else {
-            ret = ntlm_encode_oem_str(&msg->workstation,
-                                      &buffer, &data_offs,
-                                      workstation, workstation_len);
-        }
-        if (ret) goto done;
+    if (workstation && workstation[0]) {
+        ret = ntlm_encode_str(ctx, flags, &msg->workstation,
+                              &buffer, &data_offs, workstation);
+        if (ret) return ret;
     }
     if (enc_sess_key) {
         ret = ntlm_encode_field(&msg->enc_sess_key, &buffer,
                                 &data_offs, enc_sess_key);
-        if (ret) goto done;
+        if (ret) return ret;
     }
 
     msg->neg_flags = htole32(flags);
 
-done:
-    if (ret) {
-        safefree(buffer.data);
-    } else {
-        *message = buffer;
-    }
-    return ret;
+    message->length = data_offs;
+    return 0;
 }
 
-int ntlm_decode_auth_msg(struct ntlm_ctx *ctx,
-                         struct ntlm_buffer *buffer,
+int ntlm_encode_auth_msg(struct ntlm_ctx *ctx,
                          uint32_t flags,
                          struct ntlm_buffer *lm_chalresp,
                          struct ntlm_buffer *nt_chalresp,
-                         char **domain_name, char **user_name,
-                         char **workstation,
+                         char *domain_name, char *user_name,
+                         char *workstation,
                          struct ntlm_buffer *enc_sess_key,
-                         struct ntlm_buffer *target_info,
-                         struct ntlm_buffer *mic)
+                         struct ntlm_buffer *mic,
+                         struct ntlm_buffer *message)
+{
+    struct ntlm_buffer buffer = { 0 };
+    int ret;
+
+    ret = ntlm_write_auth_msg(ctx, flags, lm_chalresp, nt_chalresp,
+                              domain_name, user_name, workstation,
+                              enc_sess_key, mic, &buffer);
+    if (ret) return ret;
+
+    buffer.data = malloc(buffer.length);
+    if (!buffer.data) return ENOMEM;
+
+    ret = ntlm_write_auth_msg(ctx, flags, lm_chalresp, nt_chalresp,
+                              domain_name, user_name, workstation,
+                              enc_sess_key, mic, &buffer);
+    if (ret) {
+        safefree(buffer.data);
+        return ret;
+    }
+
+    *message = buffer;
+    return 0;
+}
+
+int ntlm_decode_auth_view(struct ntlm_ctx *ctx,
+                          struct ntlm_buffer *buffer,
+                          uint32_t flags,
+                          struct ntlm_auth_view *view)
 {
     struct wire_auth_msg *msg;
+    struct wire_ntlmv2_cli_chal *chal;
+    union wire_ntlm_response *resp;
     size_t payload_offs;
-    char *dom = NULL;
-    char *usr = NULL;
-    char *wks = NULL;
-    int ret = 0;
+    size_t ti_offs;
+    bool unicode;
+    int ret;
 
     if (!ctx) return EINVAL;
 
-    if (lm_chalresp) lm_chalresp->data = NULL;
-    if (nt_chalresp) nt_chalresp->data = NULL;
-    if (enc_sess_key) enc_sess_key->data = NULL;
+    memset(view, 0, sizeof(struct ntlm_auth_view));
 
     msg = (struct wire_auth_msg *)buffer->data;
     payload_offs = (char *)msg->payload - (char *)msg;
@@ -1314,101 +1530,135 @@ int ntlm_decode_auth_msg(struct ntlm_ctx *ctx,
         payload_offs += sizeof(struct wire_version);
     }
 
-    /* Unconditionally copy 16 bytes for the MIC, if it was really
-     * added by the client it will be flagged in the AV_PAIR contained
-     * in the NT Response, that will be fully decoded later by the caller
-     * and the MIC checked otherwise these 16 bytes will just be ignored */
+    /* The MIC would be at payload_offs right now. Whether it was really
+     * added by the client is flagged in the AV_PAIRs contained in the NT
+     * Response, otherwise these 16 bytes are just ignored. We do not push
+     * down the payload because we do not know yet. */
+    if (buffer->length >= payload_offs &&
+        buffer->length - payload_offs >= 16) {
+        view->mic.data = &buffer->data[payload_offs];
+        view->mic.length = 16;
+    }
+
+    ret = ntlm_view_field(&msg->lm_chalresp, buffer, payload_offs,
+                          &view->lm_chalresp);
+    if (ret) return ret;
+    ret = ntlm_view_field(&msg->nt_chalresp, buffer, payload_offs,
+                          &view->nt_chalresp);
+    if (ret) return ret;
+
+    /* NTLMv2 responses embed the target_info the client used */
+    resp = (union wire_ntlm_response *)view->nt_chalresp.data;
+    ti_offs = sizeof(resp->v2.resp) +
+              offsetof(struct wire_ntlmv2_cli_chal, target_info);
+    if (view->nt_chalresp.length > ti_offs) {
+        chal = (struct wire_ntlmv2_cli_chal *)resp->v2.cli_chal;
+        view->target_info.data = chal->target_info;
+        view->target_info.length = view->nt_chalresp.length - ti_offs;
+    }
+
+    unicode = (flags & NTLMSSP_NEGOTIATE_UNICODE) != 0;
+    view->domain_name.unicode = unicode;
+    view->user_name.unicode = unicode;
+    view->workstation.unicode = unicode;
+    ret = ntlm_view_field(&msg->domain_name, buffer, payload_offs,
+                          &view->domain_name.data);
+    if (ret) return ret;
+    ret = ntlm_view_field(&msg->user_name, buffer, payload_offs,
+                          &view->user_name.data);
+    if (ret) return ret;
+    ret = ntlm_view_field(&msg->workstation, buffer, payload_offs,
+                          &view->workstation.data);
+    if (ret) return ret;
+
+    ret = ntlm_view_field(&msg->enc_sess_key, buffer, payload_offs,
+                          &view->enc_sess_key);
+    if (ret) return ret;
+
+    /* ignore returned flags, our flags are authoritative
+    flags = le32toh(msg->neg_flags);
+    */
+
+    return 0;
+}
+
+int ntlm_decode_auth_msg(struct ntlm_ctx *ctx,
+                         struct ntlm_buffer *buffer,
+                         uint32_t flags,
+                         struct ntlm_buffer *lm_chalresp,
+                         struct ntlm_buffer *nt_chalresp,
+                         char **domain_name, char **user_name,
+                         char **workstation,
+                         struct ntlm_buffer *enc_sess_key,
+                         struct ntlm_buffer *target_info,
+                         struct ntlm_buffer *mic)
+{
+    struct ntlm_auth_view view;
+    struct ntlm_buffer lm = { NULL, 0 };
+    struct ntlm_buffer nt = { NULL, 0 };
+    struct ntlm_buffer key = { NULL, 0 };
+    struct ntlm_buffer ti = { NULL, 0 };
+    char *dom = NULL;
+    char *usr = NULL;
+    char *wks = NULL;
+    int ret;
+
+    ret = ntlm_decode_auth_view(ctx, buffer, flags, &view);
+    if (ret) return ret;
+
     if (mic) {
-        if (mic->length < 16) return ERR_DECODE;
-        /* mic is at payload_offs right now */
-        if (buffer->length - payload_offs < 16) return ERR_DECODE;
-        memcpy(mic->data, &buffer->data[payload_offs], 16);
-        /* NOTE: we do not push down the payload because we do not know that
-         * the MIC is actually present yet for real */
+        if (mic->length < 16 || view.mic.length != 16) return ERR_DECODE;
+        memcpy(mic->data, view.mic.data, 16);
     }
 
-    if (msg->lm_chalresp.len != 0 && lm_chalresp) {
-        ret = ntlm_decode_field(&msg->lm_chalresp, buffer,
-                                payload_offs, lm_chalresp);
+    if (lm_chalresp) {
+        ret = ntlm_copy_view(&view.lm_chalresp, &lm);
         if (ret) goto done;
     }
-    if (msg->nt_chalresp.len != 0 && nt_chalresp) {
-        ret = ntlm_decode_field(&msg->nt_chalresp, buffer,
-                                payload_offs, nt_chalresp);
+    if (nt_chalresp) {
+        ret = ntlm_copy_view(&view.nt_chalresp, &nt);
         if (ret) goto done;
-
         if (target_info) {
-            union wire_ntlm_response *resp;
-            struct wire_ntlmv2_cli_chal *chal;
-            uint8_t *data;
-            int len;
-            resp = (union wire_ntlm_response *)nt_chalresp->data;
-            chal = (struct wire_ntlmv2_cli_chal *)resp->v2.cli_chal;
-            len = nt_chalresp->length - sizeof(resp->v2.resp)
-                    - offsetof(struct wire_ntlmv2_cli_chal, target_info);
-            if (len > 0) {
-                data = chal->target_info;
-                target_info->data = malloc(len);
-                if (!target_info->data) {
-                    ret = ENOMEM;
-                    goto done;
-                }
-                memcpy(target_info->data, data, len);
-                target_info->length = len;
-            }
+            ret = ntlm_copy_view(&view.target_info, &ti);
+            if (ret) goto done;
         }
     }
-    if (msg->domain_name.len != 0 && domain_name) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_decode_u16l_str_hdr(ctx, &msg->domain_name, buffer,
-                                           payload_offs, &dom);
-        } else {
-            ret = ntlm_decode_oem_str(&msg->domain_name, buffer,
-                                      payload_offs, &dom);
-        }
+    if (domain_name) {
+        ret = ntlm_str_view_dup(&view.domain_name, &dom);
         if (ret) goto done;
     }
-    if (msg->user_name.len != 0 && user_name) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_decode_u16l_str_hdr(ctx, &msg->user_name, buffer,
-                                           payload_offs, &usr);
-        } else {
-            ret = ntlm_decode_oem_str(&msg->user_name, buffer,
-                                      payload_offs, &usr);
-        }
+    if (user_name) {
+        ret = ntlm_str_view_dup(&view.user_name, &usr);
         if (ret) goto done;
     }
-    if (msg->workstation.len != 0 && workstation) {
-        if (flags & NTLMSSP_NEGOTIATE_UNICODE) {
-            ret = ntlm_decode_u16l_str_hdr(ctx, &msg->workstation, buffer,
-                                           payload_offs, &wks);
-        } else {
-            ret = ntlm_decode_oem_str(&msg->workstation, buffer,
-                                      payload_offs, &wks);
-        }
+    if (workstation) {
+        ret = ntlm_str_view_dup(&view.workstation, &wks);
         if (ret) goto done;
     }
-    if (msg->enc_sess_key.len != 0 && enc_sess_key) {
-        ret = ntlm_decode_field(&msg->enc_sess_key, buffer,
-                                payload_offs, enc_sess_key);
+    if (enc_sess_key) {
+        ret = ntlm_copy_view(&view.enc_sess_key, &key);
+        if (ret) goto done;
     }
 
-    /* ignore returned flags, our flags are authoritative
-    flags = le32toh(msg->neg_flags);
-    */
-
 done:
     if (ret) {
-        if (lm_chalresp) safefree(lm_chalresp->data);
-        if (nt_chalresp) safefree(nt_chalresp->data);
-        if (enc_sess_key) safefree(enc_sess_key->data);
+        safefree(lm.data);
+        safefree(nt.data);
+        safefree(ti.data);
+        safefree(key.data);
         safefree(dom);
         safefree(usr);
         safefree(wks);
     } else {
+        if (lm_chalresp) *lm_chalresp = lm;
+        if (nt_chalresp) {
+            *nt_chalresp = nt;
+            if (target_info) *target_info = ti;
+        }
         if (domain_name) *domain_name = dom;
         if (user_name) *user_name = usr;
         if (workstation) *workstation = wks;
+        if (enc_sess_key) *enc_sess_key = key;
     }
     return ret;
 }
@@ -71,21 +71,21 @@
 struct ntlm_ctx;
 
 /**
- * @brief           Create a ntlm_ctx initialized to the initial state
+ * @brief           Returns a ntlm_ctx to pass to the functions below
  *
- * @param ctx       The returned context
+ * @param ctx       The returned context, currently one shared instance
  *
  * @return 0 if successful, an error otherwise
  */
 int ntlm_init_ctx(struct ntlm_ctx **ctx);
 
 /**
- * @brief           Frees a ntlm_ctx
+ * @brief           Releases a ntlm_ctx
  *
- * @param ctx       Pointer to a context to be freed
+ * @param ctx       Pointer to a context to be released
  *
  * @return 0 if successful, an error otherwise
- * NOTE: even if an error is returned the contetx is freed and NULLed
+ * NOTE: even if an error is returned the context is released and NULLed
  */
 int ntlm_free_ctx(struct ntlm_ctx **ctx);
 
@@ -114,18 +114,23 @@ struct ntlm_key {
     size_t length;
 };
 
+/* The fields used for every message come first, the raw keys are only
+ * needed to (re)initialize the handles */
 struct ntlm_signseal_handle {
-    struct ntlm_key sign_key;
-    struct ntlm_key seal_key;
+    /* HMAC-MD5 state pre-keyed with sign_key (extended security only),
+     * message signing with it does not allocate memory */
+    struct ntlm_hmac_handle *sign_handle;
     struct ntlm_rc4_handle *seal_handle;
     uint32_t seq_num;
+    struct ntlm_key sign_key;
+    struct ntlm_key seal_key;
 };
 
 struct ntlm_signseal_state {
-    struct ntlm_signseal_handle send;
-    struct ntlm_signseal_handle recv;
     bool datagram;
     bool ext_sec;
+    struct ntlm_signseal_handle send;
+    struct ntlm_signseal_handle recv;
 };
 
 #define NTLM_SEND 1
@@ -328,6 +333,15 @@ int ntlm_signseal_keys(uint32_t flags, bool client,
                        struct ntlm_key *session_key,
                        struct ntlm_signseal_state *signseal_state);
 
+/**
+ * @brief   (Re)creates the pre-keyed HMAC-MD5 state from h->sign_key
+ *
+ * @param h                     The sign and seal handle
+ *
+ * @return 0 on success or error.
+ */
+int ntlm_sign_handle(struct ntlm_signseal_handle *h);
+
 /**
  * @brief   Resets the RC4 state for the send or receive handle
  *
@@ -343,12 +357,22 @@ int ntlm_reset_rc4_state(uint32_t flags, bool recv,
                          struct ntlm_signseal_state *state);
 
 /**
- * @brief   Release the RC4 state
+ * @brief   Release the RC4 and pre-keyed signing state
  *
  * @param signseal_state        Sign and seal keys and state
  */
 void ntlm_release_rc4_state(struct ntlm_signseal_state *state);
 
+/**
+ * @brief   Generates RC4 keystream ahead of the next seal/unseal calls
+ *
+ * @param signseal_state        Sign and seal keys and state
+ * @param length                Bytes of keystream to have ready per direction
+ *
+ * @return 0 on success, ENOTSUP for datagram contexts, or error.
+ */
+int ntlm_signseal_prefetch(struct ntlm_signseal_state *state, size_t length);
+
 /**
  * @brief   Verifies a NTLM v1 NT Response
  *
@@ -485,6 +509,48 @@ int ntlm_unseal(uint32_t flags,
                 struct ntlm_buffer *output,
                 struct ntlm_buffer *signature);
 
+/* the most buffers a message passed to ntlm_seal_iov() or
+ * ntlm_unseal_iov() may be made of */
+#define NTLM_IOV_MAX 64
+
+/**
+ * @brief   NTLM seal a message made of multiple buffers, in place
+ *
+ * The signature covers all the sign buffers in order, while only the data
+ * buffers are encrypted. The data buffers are expected to also be part of
+ * the sign buffers. Neither list may hold more than NTLM_IOV_MAX buffers.
+ *
+ * @param flags         Negotiated flags
+ * @param state         Sign and seal keys and state
+ * @param data          Buffers to encrypt in place
+ * @param sign          Buffers to compute the signature over
+ * @param signature     Preallocated buffer of 16 bytes for the signature
+ *
+ * @return 0 on success, or an error
+ */
+int ntlm_seal_iov(uint32_t flags,
+                  struct ntlm_signseal_state *state,
+                  struct ntlm_iov *data,
+                  struct ntlm_iov *sign,
+                  struct ntlm_buffer *signature);
+
+/**
+ * @brief   NTLM unseal a message made of multiple buffers, in place
+ *
+ * @param flags         Negotiated flags
+ * @param state         Sign and seal keys and state
+ * @param data          Buffers to decrypt in place
+ * @param sign          Buffers to compute the signature over
+ * @param signature     Preallocated buffer of 16 bytes for the signature
+ *
+ * @return 0 on success, or an error
+ */
+int ntlm_unseal_iov(uint32_t flags,
+                    struct ntlm_signseal_state *state,
+                    struct ntlm_iov *data,
+                    struct ntlm_iov *sign,
+                    struct ntlm_buffer *signature);
+
 /**
  * @brief   Creates a NTLM MIC
  *
@@ -645,6 +711,27 @@ int ntlm_decode_msg_type(struct ntlm_ctx *ctx,
                          struct ntlm_buffer *buffer,
                          uint32_t *type);
 
+/**
+ * @brief This function encodes a NEGOTIATE_MESSAGE into a caller buffer.
+ *
+ * Message writers work in two passes: when message->data is NULL only the
+ * exact size of the message is computed and returned in message->length.
+ * Otherwise message->length is the size of the buffer at message->data,
+ * the message is written there and its length returned.
+ *
+ * @param ctx           A fresh ntlm context
+ * @param flags         Requested flags
+ * @param domain        Optional Domain Name
+ * @param workstation   Optional Workstation Name
+ * @param message       The buffer to write to, or a NULL data pointer
+ *
+ * @return      0 if everyting encodes correctly, ERR_ENCODE if the buffer
+ *              is too small, or another error code
+ */
+int ntlm_write_neg_msg(struct ntlm_ctx *ctx, uint32_t flags,
+                       const char *domain, const char *workstation,
+                       struct ntlm_buffer *message);
+
 /**
  * @brief This function encodes a NEGTIATE_MESSAGE which is the first message
  * a client will send to a server. It also updates the stage in the context.
@@ -679,6 +766,26 @@ int ntlm_decode_neg_msg(struct ntlm_ctx *ctx,
                         struct ntlm_buffer *buffer, uint32_t *flags,
                         char **domain, char **workstation);
 
+/**
+ * @brief This function encodes a CHALLENGE_MESSAGE into a caller buffer,
+ * see ntlm_write_neg_msg() for how the buffer is sized.
+ *
+ * @param ctx           The ntlm context
+ * @param flags         The challenge flags
+ * @param target_name   The target name
+ * @param challenge     A 64 bit value with a challenge
+ * @param target_info   A buffer containing target_info data
+ * @param message       The buffer to write to, or a NULL data pointer
+ *
+ * @return      0 if everyting encodes correctly, or an error code
+ */
+int ntlm_write_chal_msg(struct ntlm_ctx *ctx,
+                        uint32_t flags,
+                        const char *target_name,
+                        struct ntlm_buffer *challenge,
+                        struct ntlm_buffer *target_info,
+                        struct ntlm_buffer *message);
+
 /**
  * @brief This function encodes a CHALLENGE_MESSAGE which is the first message
  * a server will send to a client. It also updates the stage in the context.
@@ -701,6 +808,135 @@ int ntlm_encode_chal_msg(struct ntlm_ctx *ctx,
                          struct ntlm_buffer *target_info,
                          struct ntlm_buffer *message);
 
+/* A pre-encoded CHALLENGE_MESSAGE, only the fields that change with every
+ * handshake are left to be filled in. */
+struct ntlm_chal_template {
+    struct ntlm_buffer message;
+    uint32_t layout;
+    size_t timestamp_offset;
+};
+
+/**
+ * @brief Returns the subset of the challenge flags that determines the
+ * layout of a CHALLENGE_MESSAGE, templates can only be shared among
+ * messages with the same layout.
+ *
+ * @param flags         The challenge flags
+ *
+ * @return      The layout flags
+ */
+uint32_t ntlm_chal_template_layout(uint32_t flags);
+
+/**
+ * @brief This function pre-encodes a CHALLENGE_MESSAGE template. The
+ * target_info (when requested by flags) carries the NetBIOS names, the DNS
+ * computer name and a timestamp, exactly as ntlm_encode_target_info() would
+ * produce them. Names are passed already encoded so nothing is converted.
+ *
+ * @param flags                 The challenge flags
+ * @param target_name           The target name, UTF-16LE if flags include
+ *                              NTLMSSP_NEGOTIATE_UNICODE, OEM otherwise
+ * @param u16_nb_computer_name  The UTF-16LE NetBIOS Computer Name
+ * @param u16_nb_domain_name    The UTF-16LE NetBIOS Domain Name
+ * @param u16_dns_computer_name The UTF-16LE DNS Computer Name
+ * @param tmpl                  The template to fill in
+ *
+ * NOTE: the caller is responsible for free()ing tmpl->message
+ *
+ * @return      0 if everyting encodes correctly, or an error code
+ */
+int ntlm_encode_chal_template(uint32_t flags,
+                              struct ntlm_buffer *target_name,
+                              struct ntlm_buffer *u16_nb_computer_name,
+                              struct ntlm_buffer *u16_nb_domain_name,
+                              struct ntlm_buffer *u16_dns_computer_name,
+                              struct ntlm_chal_template *tmpl);
+
+/**
+ * @brief Like ntlm_chal_template_to_msg() but writes into a caller buffer,
+ * see ntlm_write_neg_msg() for how the buffer is sized.
+ *
+ * @return      0 if everyting encodes correctly, or an error code
+ */
+int ntlm_chal_template_write(struct ntlm_chal_template *tmpl,
+                             uint32_t flags,
+                             struct ntlm_buffer *challenge,
+                             uint64_t timestamp,
+                             struct ntlm_buffer *message);
+
+/**
+ * @brief This function produces a CHALLENGE_MESSAGE from a template, by
+ * copying it and patching the flags, version, challenge and timestamp.
+ *
+ * @param tmpl          The template
+ * @param flags         The challenge flags, must have the template layout
+ * @param challenge     A 64 bit value with a challenge
+ * @param timestamp     A 64 bit FILETIME timestamp for target_info
+ * @param message       A ntlm_buffer containing the encoded message
+ *
+ * NOTE: the caller is responsible for free()ing the message buffer
+ *
+ * @return      0 if everyting encodes correctly, or an error code
+ */
+int ntlm_chal_template_to_msg(struct ntlm_chal_template *tmpl,
+                              uint32_t flags,
+                              struct ntlm_buffer *challenge,
+                              uint64_t timestamp,
+                              struct ntlm_buffer *message);
+
+
+/* A string field of a received message, still in its wire encoding */
+struct ntlm_str_view {
+    struct ntlm_buffer data;
+    bool unicode;
+};
+
+/**
+ * @brief Converts a string view to a NUL terminated UTF-8 string
+ *
+ * @param str           The string view
+ * @param out           The output buffer
+ * @param outmax        The size of the output buffer
+ * @param outlen        Optional, the length of the string without the NUL
+ *
+ * @return      0 on success, E2BIG if the buffer is too small, or an error
+ */
+int ntlm_str_view_to_utf8(struct ntlm_str_view *str,
+                          char *out, size_t outmax, size_t *outlen);
+
+/**
+ * @brief Like ntlm_str_view_to_utf8() into a newly allocated string
+ *
+ * @param str           The string view
+ * @param out           The returned string, NULL for an empty view
+ *
+ * @return      0 on success, or an error
+ */
+int ntlm_str_view_dup(struct ntlm_str_view *str, char **out);
+
+/* Fields of a CHALLENGE_MESSAGE, pointing into the decoded buffer */
+struct ntlm_chal_view {
+    uint32_t flags;
+    struct ntlm_buffer challenge;
+    struct ntlm_str_view target_name;
+    struct ntlm_buffer target_info;
+};
+
+/**
+ * @brief Decodes a NTLMSSP CHALLENGE_MESSAGE without copying anything
+ *
+ * All fields are bounds checked, the views stay valid as long as the
+ * buffer does.
+ *
+ * @param ctx           The ntlm context
+ * @param buffer        A ntlm_buffer containing the raw NTLMSSP packet
+ * @param view          The returned views
+ *
+ * @return      0 if everyting decodes correctly, or an error code
+ */
+int ntlm_decode_chal_view(struct ntlm_ctx *ctx,
+                          struct ntlm_buffer *buffer,
+                          struct ntlm_chal_view *view);
 
 /**
  * @brief This function decodes a NTLMSSP CHALLENGE_MESSAGE.
@@ -723,6 +959,37 @@ int ntlm_decode_chal_msg(struct ntlm_ctx *ctx,
                          struct ntlm_buffer *target_info);
 
 
+/**
+ * @brief This function encodes a AUTHENTICATE_MESSAGE into a caller buffer,
+ * see ntlm_write_neg_msg() for how the buffer is sized.
+ *
+ * Strings are converted straight into the message. When a mic is
+ * requested a zeroed 16 bytes area is reserved for it, and mic->data is
+ * pointed at it for the caller to backfill.
+ *
+ * @param ctx           The ntlm context
+ * @param flags         The flags
+ * @param lm_chalresp   A LM or LMv2 response
+ * @param nt_chalresp   A NTLM or NTLMv2 response
+ * @param domain_name   The Domain name
+ * @param user_name     The User name
+ * @param workstation   The Workstation name
+ * @param enc_sess_key  The session key
+ * @param mic           A MIC of the messages
+ * @param message       The buffer to write to, or a NULL data pointer
+ *
+ * @return      0 if everyting encodes correctly, or an error code
+ */
+int ntlm_write_auth_msg(struct ntlm_ctx *ctx,
+                        uint32_t flags,
+                        struct ntlm_buffer *lm_chalresp,
+                        struct ntlm_buffer *nt_chalresp,
+                        char *domain_name, char *user_name,
+                        char *workstation,
+                        struct ntlm_buffer *enc_sess_key,
+                        struct ntlm_buffer *mic,
+                        struct ntlm_buffer *message);
+
 /**
  * @brief This function encodes a AUTHENTICATE_MESSAGE which is the second
  * message a client will send to a serve.
@@ -751,6 +1018,39 @@ int ntlm_encode_auth_msg(struct ntlm_ctx *ctx,
                          struct ntlm_buffer *mic,
                          struct ntlm_buffer *message);
 
+/* Fields of an AUTHENTICATE_MESSAGE, pointing into the decoded buffer */
+struct ntlm_auth_view {
+    struct ntlm_buffer lm_chalresp;
+    struct ntlm_buffer nt_chalresp;
+    struct ntlm_str_view domain_name;
+    struct ntlm_str_view user_name;
+    struct ntlm_str_view workstation;
+    struct ntlm_buffer enc_sess_key;
+    /* the target_info embedded in a NTLMv2 response */
+    struct ntlm_buffer target_info;
+    /* where the MIC is if the client sent one, empty if the message is
+     * too short to hold one */
+    struct ntlm_buffer mic;
+};
+
+/**
+ * @brief Decodes a NTLMSSP AUTHENTICATE_MESSAGE without copying anything
+ *
+ * All fields are bounds checked, the views stay valid as long as the
+ * buffer does. Note that ntlm_verify_mic() clears the MIC in the buffer.
+ *
+ * @param ctx           The ntlm context
+ * @param buffer        A ntlm_buffer containing the raw NTLMSSP packet
+ * @param flags         The negotiated flags
+ * @param view          The returned views
+ *
+ * @return      0 if everyting decodes correctly, or an error code
+ */
+int ntlm_decode_auth_view(struct ntlm_ctx *ctx,
+                          struct ntlm_buffer *buffer,
+                          uint32_t flags,
+                          struct ntlm_auth_view *view);
+
 /**
  * @brief This function decodes a NTLMSSP AUTHENTICATE_MESSAGE.
  *
@@ -37,6 +37,7 @@ enum ntlm_err_code {
     ERR_KEYLEN,
     ERR_NONTLMV1,
     ERR_NOUSRFOUND,
+    ERR_REPLAY,
     ERR_LAST
 };
 #define NTLM_ERR_MASK 0x4E54FFFF
@@ -62,6 +63,7 @@ struct ntlm_iov {
 };
 
 struct ntlm_rc4_handle;
+struct ntlm_hmac_handle;
 
 enum ntlm_cipher_mode {
     NTLM_CIPHER_IGNORE,
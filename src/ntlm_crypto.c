@@ -12,10 +12,10 @@
 #include <string.h>
 
 #include <unicase.h>
-#include <uniconv.h>
 
 #include "ntlm.h"
 #include "crypto.h"
+#include "unicode.h"
 
 /* signature structure, v1 or v2 */
 #pragma pack(push, 1)
@@ -40,28 +40,42 @@ union wire_msg_signature {
 #define MAX_USER_DOM_LEN 512
 
 
+/* passwords up to this length in bytes are converted on the stack */
+#define NTOWF_STACK_PWD_LEN 256
+
 int NTOWFv1(const char *password, struct ntlm_key *result)
 {
     struct ntlm_buffer payload;
     struct ntlm_buffer hash;
-    char *retstr;
+    uint8_t u16buf[NTOWF_STACK_PWD_LEN * 2];
+    uint8_t *u16 = u16buf;
     size_t out;
     size_t len;
     int ret;
 
     len = strlen(password);
-    retstr = u8_conv_to_encoding("UTF16LE", iconveh_error,
-                                 (const uint8_t *)password, len,
-                                 NULL, NULL, &out);
-    if (!retstr) return ERR_CRYPTO;
+    if (len > NTOWF_STACK_PWD_LEN) {
+        u16 = malloc(len * 2);
+        if (!u16) return ENOMEM;
+    }
 
-    payload.data = (uint8_t *)retstr;
+    ret = ntlm_utf8_to_utf16le((const uint8_t *)password, len,
+                               u16, len * 2, &out);
+    if (ret) {
+        ret = ERR_CRYPTO;
+        goto done;
+    }
+
+    payload.data = u16;
     payload.length = out;
     hash.data = result->data;
     hash.length = result->length;
 
     ret = MD4_HASH(&payload, &hash);
-    free(retstr);
+
+done:
+    safezero(u16, len * 2);
+    if (u16 != u16buf) free(u16);
     return ret;
 }
 
@@ -235,6 +249,7 @@ int NTOWFv2(struct ntlm_ctx *ctx, struct ntlm_key *nt_hash,
     struct ntlm_buffer hmac = { result->data, result->length };
     struct ntlm_buffer payload;
     uint8_t upcased[MAX_USER_DOM_LEN];
+    uint8_t u16[MAX_USER_DOM_LEN * 2];
     uint8_t *retstr;
     size_t offs;
     size_t out;
@@ -246,24 +261,27 @@ int NTOWFv2(struct ntlm_ctx *ctx, struct ntlm_key *nt_hash,
     retstr = u8_toupper((const uint8_t *)user, len,
                         NULL, NULL, upcased, &out);
     if (!retstr) return ERR_CRYPTO;
-    offs = out;
+    if (retstr != upcased) {
+        free(retstr);
+        return ERR_NAMETOOLONG;
+    }
+
+    ret = ntlm_utf8_to_utf16le(upcased, out, u16, sizeof(u16), &offs);
+    if (ret) return ERR_CRYPTO;
 
     if (domain) {
         len = strlen(domain);
-        memcpy(&upcased[offs], domain, len);
-        offs += len;
+        ret = ntlm_utf8_to_utf16le((const uint8_t *)domain, len,
+                                   &u16[offs], sizeof(u16) - offs, &out);
+        if (ret == E2BIG) return ERR_NAMETOOLONG;
+        if (ret) return ERR_CRYPTO;
+        offs += out;
     }
 
-    retstr = (uint8_t *)u8_conv_to_encoding("UTF16LE", iconveh_error,
-                                            upcased, offs, NULL, NULL, &out);
-    if (!retstr) return ERR_CRYPTO;
-
-    payload.data = (uint8_t *)retstr;
-    payload.length = out;
+    payload.data = u16;
+    payload.length = offs;
 
-    ret = HMAC_MD5(&key, &payload, &hmac);
-    free(retstr);
-    return ret;
+    return HMAC_MD5(&key, &payload, &hmac);
 }
 
 int ntlmv2_compute_nt_response(struct ntlm_key *ntlmv2_key,
@@ -489,6 +507,14 @@ static int no_ext_sec_handle(uint32_t flags,
 }
 
 
+int ntlm_sign_handle(struct ntlm_signseal_handle *h)
+{
+    struct ntlm_buffer key = { h->sign_key.data, h->sign_key.length };
+
+    HMAC_MD5_FREE(&h->sign_handle);
+    return HMAC_MD5_INIT(&key, &h->sign_handle);
+}
+
 static int ext_sec_keys(uint32_t flags, bool client,
                         struct ntlm_key *session_key,
                         struct ntlm_signseal_state *state)
@@ -520,6 +546,12 @@ static int ext_sec_keys(uint32_t flags, bool client,
     ret = ntlm_sealkey(flags, mode, session_key, &state->recv.seal_key);
     if (ret) return ret;
 
+    ret = ntlm_sign_handle(&state->send);
+    if (ret) return ret;
+
+    ret = ntlm_sign_handle(&state->recv);
+    if (ret) return ret;
+
     rc4_key.data = state->send.seal_key.data;
     rc4_key.length = state->send.seal_key.length;
     ret = RC4_INIT(&rc4_key, NTLM_CIPHER_ENCRYPT, &state->send.seal_handle);
@@ -579,10 +611,30 @@ int ntlm_reset_rc4_state(uint32_t flags, bool recv,
 
 void ntlm_release_rc4_state(struct ntlm_signseal_state *state)
 {
+    HMAC_MD5_FREE(&state->recv.sign_handle);
+    HMAC_MD5_FREE(&state->send.sign_handle);
     RC4_FREE(&state->recv.seal_handle);
     RC4_FREE(&state->send.seal_handle);
 }
 
+int ntlm_signseal_prefetch(struct ntlm_signseal_state *state, size_t length)
+{
+    int ret;
+
+    /* datagram mode rekeys for every message, nothing to get ahead of */
+    if (state->datagram) return ENOTSUP;
+
+    if (state->send.seal_handle) {
+        ret = RC4_PREFETCH(state->send.seal_handle, length);
+        if (ret) return ret;
+    }
+    if (state->recv.seal_handle) {
+        ret = RC4_PREFETCH(state->recv.seal_handle, length);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
 static int ntlm_seal_regen(struct ntlm_signseal_handle *h)
 {
     struct ntlm_buffer payload;
@@ -592,8 +644,6 @@ static int ntlm_seal_regen(struct ntlm_signseal_handle *h)
     uint32_t le;
     int ret;
 
-    RC4_FREE(&h->seal_handle);
-
     memcpy(inbuf, h->seal_key.data, h->seal_key.length);
     le = htole32(h->seq_num);
     memcpy(&inbuf[h->seal_key.length], &le, 4);
@@ -606,7 +656,13 @@ static int ntlm_seal_regen(struct ntlm_signseal_handle *h)
     ret = MD5_HASH(&payload, &result);
     if (ret) return ret;
 
-    ret = RC4_INIT(&result, NTLM_CIPHER_ENCRYPT, &h->seal_handle);
+    /* datagram mode rekeys for every message, reuse the handle */
+    if (h->seal_handle) {
+        RC4_REKEY(h->seal_handle, &result);
+    } else {
+        ret = RC4_INIT(&result, NTLM_CIPHER_ENCRYPT, &h->seal_handle);
+    }
+    safezero(outbuf, sizeof(outbuf));
     return ret;
 }
 
@@ -715,101 +771,141 @@ int ntlmv2_verify_lm_response(struct ntlm_buffer *lm_response,
     return EINVAL;
 }
 
-static int ntlmv2_sign(struct ntlm_key *sign_key, uint32_t seq_num,
-                       struct ntlm_rc4_handle *handle, bool keyex,
-                       struct ntlm_buffer *message,
-                       struct ntlm_buffer *signature)
+/* Computes the plain (not yet sealed) v2 signature over the message buffers.
+ * When KEY_EXCH is negotiated the checksum must then be sealed with
+ * ntlmv2_seal_checksum() using the RC4 state that follows the sealed data */
+static int ntlmv2_checksum(struct ntlm_hmac_handle *sign_handle,
+                           uint32_t seq_num,
+                           struct ntlm_iov *message,
+                           struct ntlm_buffer *signature)
 {
-    struct ntlm_buffer key = { sign_key->data, sign_key->length };
     union wire_msg_signature *msg_sig;
     uint32_t le_seq;
-    uint8_t le8seq[8];
-    struct ntlm_buffer seq = { le8seq, 4 };
-    struct ntlm_buffer *data[2];
+    struct ntlm_buffer seq = { (uint8_t *)&le_seq, 4 };
+    struct ntlm_buffer *data[NTLM_IOV_MAX + 1];
     struct ntlm_iov iov;
     uint8_t hmac_sig[NTLM_SIGNATURE_SIZE];
     struct ntlm_buffer hmac = { hmac_sig, NTLM_SIGNATURE_SIZE };
-    struct ntlm_buffer rc4buf;
-    struct ntlm_buffer rc4res;
+    size_t i;
     int ret;
 
     msg_sig = (union wire_msg_signature *)signature->data;
-    if (signature->length != NTLM_SIGNATURE_SIZE) {
+    if (signature->length != NTLM_SIGNATURE_SIZE || !sign_handle ||
+        message->num > NTLM_IOV_MAX) {
         return EINVAL;
     }
 
     le_seq = htole32(seq_num);
-    memcpy(seq.data, &le_seq, 4);
     data[0] = &seq;
-    data[1] = message;
+    for (i = 0; i < message->num; i++) {
+        data[i + 1] = message->data[i];
+    }
     iov.data = data;
-    iov.num = 2;
+    iov.num = message->num + 1;
 
-    ret = HMAC_MD5_IOV(&key, &iov, &hmac);
+    ret = HMAC_MD5_KEYED_IOV(sign_handle, &iov, &hmac);
     if (ret) return ret;
 
-    /* put version */
     msg_sig->v2.version = htole32(NTLMSSP_MESSAGE_SIGNATURE_VERSION);
-
-    /* put actual MAC */
-    if (keyex) {
-        /* encrypt truncated hmac */
-        rc4buf.data = hmac.data;
-        rc4buf.length = 8;
-        /* and put it in the middle of the output signature */
-        rc4res.data = (uint8_t *)&msg_sig->v2.checksum;
-        rc4res.length = 8;
-        ret = RC4_UPDATE(handle, &rc4buf, &rc4res);
-        if (ret) return ret;
-    } else {
-        memcpy(&msg_sig->v2.checksum, hmac.data, 8);
-    }
-
-    /* put used seq_num */
+    memcpy(&msg_sig->v2.checksum, hmac.data, 8);
     msg_sig->v2.seq_num = le_seq;
 
     return 0;
 }
 
-static int ntlmv1_sign(struct ntlm_rc4_handle *handle,
-                       uint32_t random_pad, uint32_t seq_num,
-                       struct ntlm_buffer *message,
-                       struct ntlm_buffer *signature)
+static int ntlmv2_seal_checksum(struct ntlm_rc4_handle *handle, bool keyex,
+                                struct ntlm_buffer *signature)
 {
     union wire_msg_signature *msg_sig;
-    uint32_t rc4buf[3];
-    struct ntlm_buffer payload;
-    struct ntlm_buffer result;
+    struct ntlm_buffer rc4buf;
+
+    if (!keyex) return 0;
+
+    /* encrypt truncated hmac in the middle of the output signature */
+    msg_sig = (union wire_msg_signature *)signature->data;
+    rc4buf.data = (uint8_t *)&msg_sig->v2.checksum;
+    rc4buf.length = 8;
+    return RC4_UPDATE(handle, &rc4buf, &rc4buf);
+}
+
+static int ntlmv2_sign(struct ntlm_hmac_handle *sign_handle, uint32_t seq_num,
+                       struct ntlm_rc4_handle *handle, bool keyex,
+                       struct ntlm_iov *message,
+                       struct ntlm_buffer *signature)
+{
     int ret;
 
+    ret = ntlmv2_checksum(sign_handle, seq_num, message, signature);
+    if (ret) return ret;
+
+    return ntlmv2_seal_checksum(handle, keyex, signature);
+}
+
+/* Same split as for v2: the CRC is computed over the plaintext, while the
+ * RC4 encryption of the signature follows the sealed data */
+static int ntlmv1_checksum(uint32_t random_pad, uint32_t seq_num,
+                           struct ntlm_iov *message,
+                           struct ntlm_buffer *signature)
+{
+    union wire_msg_signature *msg_sig;
+    uint32_t crc = 0;
+    size_t i;
+
     msg_sig = (union wire_msg_signature *)signature->data;
     if (signature->length != NTLM_SIGNATURE_SIZE) {
         return EINVAL;
     }
 
-    rc4buf[0] = random_pad;
-    rc4buf[1] = htole32(CRC32(0, message));
-    rc4buf[2] = htole32(seq_num);
+    for (i = 0; i < message->num; i++) {
+        crc = CRC32(crc, message->data[i]);
+    }
+
+    msg_sig->v1.version = htole32(NTLMSSP_MESSAGE_SIGNATURE_VERSION);
+    msg_sig->v1.random_pad = random_pad;
+    msg_sig->v1.checksum = htole32(crc);
+    msg_sig->v1.seq_num = htole32(seq_num);
 
-    payload.data = (uint8_t *)rc4buf;
-    payload.length = 12;
-    result.data = (uint8_t *)&msg_sig->v1.random_pad;
-    result.length = 12;
-    ret = RC4_UPDATE(handle, &payload, &result);
+    return 0;
+}
+
+static int ntlmv1_seal_checksum(struct ntlm_rc4_handle *handle,
+                                struct ntlm_buffer *signature)
+{
+    union wire_msg_signature *msg_sig;
+    struct ntlm_buffer rc4buf;
+    int ret;
+
+    msg_sig = (union wire_msg_signature *)signature->data;
+    rc4buf.data = (uint8_t *)&msg_sig->v1.random_pad;
+    rc4buf.length = 12;
+    ret = RC4_UPDATE(handle, &rc4buf, &rc4buf);
     if (ret) return ret;
 
-    msg_sig->v1.version = htole32(NTLMSSP_MESSAGE_SIGNATURE_VERSION);
     msg_sig->v1.random_pad = 0;
 
     return 0;
 }
 
+static int ntlmv1_sign(struct ntlm_rc4_handle *handle,
+                       uint32_t random_pad, uint32_t seq_num,
+                       struct ntlm_iov *message,
+                       struct ntlm_buffer *signature)
+{
+    int ret;
+
+    ret = ntlmv1_checksum(random_pad, seq_num, message, signature);
+    if (ret) return ret;
+
+    return ntlmv1_seal_checksum(handle, signature);
+}
+
 int ntlm_sign(uint32_t flags, int direction,
               struct ntlm_signseal_state *state,
               struct ntlm_buffer *message,
               struct ntlm_buffer *signature)
 {
     struct ntlm_signseal_handle *h;
+    struct ntlm_iov iov = { &message, 1 };
     int ret;
 
     if (direction == NTLM_SEND || !state->ext_sec) {
@@ -825,12 +921,12 @@ int ntlm_sign(uint32_t flags, int direction,
                 if (ret) return ret;
             }
 
-            ret = ntlmv2_sign(&h->sign_key, h->seq_num, h->seal_handle,
+            ret = ntlmv2_sign(h->sign_handle, h->seq_num, h->seal_handle,
                               (flags & NTLMSSP_NEGOTIATE_KEY_EXCH),
-                              message, signature);
+                              &iov, signature);
         } else {
             ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num,
-                              message, signature);
+                              &iov, signature);
         }
         if (ret) return ret;
 
@@ -856,6 +952,7 @@ int ntlm_seal(uint32_t flags,
               struct ntlm_buffer *signature)
 {
     struct ntlm_signseal_handle *h;
+    struct ntlm_iov iov = { &message, 1 };
     int ret;
 
     h = &state->send;
@@ -873,11 +970,11 @@ int ntlm_seal(uint32_t flags,
             ret = ntlm_seal_regen(h);
             if (ret) return ret;
         }
-        ret = ntlmv2_sign(&h->sign_key, h->seq_num, h->seal_handle,
+        ret = ntlmv2_sign(h->sign_handle, h->seq_num, h->seal_handle,
                           (flags & NTLMSSP_NEGOTIATE_KEY_EXCH),
-                          message, signature);
+                          &iov, signature);
     } else {
-        ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num, message, signature);
+        ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num, &iov, signature);
     }
     if (ret) return ret;
 
@@ -894,6 +991,7 @@ int ntlm_unseal(uint32_t flags,
                 struct ntlm_buffer *signature)
 {
     struct ntlm_signseal_handle *h;
+    struct ntlm_iov iov = { &output, 1 };
     int ret;
 
     if (!state->ext_sec) {
@@ -915,11 +1013,114 @@ int ntlm_unseal(uint32_t flags,
             ret = ntlm_seal_regen(h);
             if (ret) return ret;
         }
-        ret = ntlmv2_sign(&h->sign_key, h->seq_num, h->seal_handle,
+        ret = ntlmv2_sign(h->sign_handle, h->seq_num, h->seal_handle,
+                          (flags & NTLMSSP_NEGOTIATE_KEY_EXCH),
+                          &iov, signature);
+    } else {
+        ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num, &iov, signature);
+    }
+    if (ret) return ret;
+
+    if (!state->datagram) {
+        h->seq_num++;
+    }
+    return 0;
+}
+
+static int ntlm_rc4_iov(struct ntlm_rc4_handle *handle, struct ntlm_iov *data)
+{
+    size_t i;
+    int ret;
+
+    for (i = 0; i < data->num; i++) {
+        ret = RC4_UPDATE(handle, data->data[i], data->data[i]);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+int ntlm_seal_iov(uint32_t flags,
+                  struct ntlm_signseal_state *state,
+                  struct ntlm_iov *data,
+                  struct ntlm_iov *sign,
+                  struct ntlm_buffer *signature)
+{
+    struct ntlm_signseal_handle *h;
+    bool keyex = (flags & NTLMSSP_NEGOTIATE_KEY_EXCH);
+    int ret;
+
+    h = &state->send;
+
+    if (!(flags & NTLMSSP_NEGOTIATE_SEAL) ||
+        (h->seal_handle == NULL)) {
+        return ENOTSUP;
+    }
+
+    /* The checksum covers the plaintext, so it must be computed before the
+     * data is encrypted in place. The RC4 keystream is still consumed in
+     * the same order as ntlm_seal(): data first, then (after the datagram
+     * rekey) the checksum. */
+    if (state->ext_sec) {
+        ret = ntlmv2_checksum(h->sign_handle, h->seq_num, sign, signature);
+    } else {
+        ret = ntlmv1_checksum(0, h->seq_num, sign, signature);
+    }
+    if (ret) return ret;
+
+    ret = ntlm_rc4_iov(h->seal_handle, data);
+    if (ret) return ret;
+
+    if (state->ext_sec && state->datagram) {
+        ret = ntlm_seal_regen(h);
+        if (ret) return ret;
+    }
+
+    if (state->ext_sec) {
+        ret = ntlmv2_seal_checksum(h->seal_handle, keyex, signature);
+    } else {
+        ret = ntlmv1_seal_checksum(h->seal_handle, signature);
+    }
+    if (ret) return ret;
+
+    if (!state->datagram) {
+        h->seq_num++;
+    }
+    return 0;
+}
+
+int ntlm_unseal_iov(uint32_t flags,
+                    struct ntlm_signseal_state *state,
+                    struct ntlm_iov *data,
+                    struct ntlm_iov *sign,
+                    struct ntlm_buffer *signature)
+{
+    struct ntlm_signseal_handle *h;
+    int ret;
+
+    if (!state->ext_sec) {
+        h = &state->send;
+    } else {
+        h = &state->recv;
+    }
+
+    if (!(flags & NTLMSSP_NEGOTIATE_SEAL) ||
+        (h->seal_handle == NULL)) {
+        return ENOTSUP;
+    }
+
+    ret = ntlm_rc4_iov(h->seal_handle, data);
+    if (ret) return ret;
+
+    if (state->ext_sec) {
+        if (state->datagram) {
+            ret = ntlm_seal_regen(h);
+            if (ret) return ret;
+        }
+        ret = ntlmv2_sign(h->sign_handle, h->seq_num, h->seal_handle,
                           (flags & NTLMSSP_NEGOTIATE_KEY_EXCH),
-                          output, signature);
+                          sign, signature);
     } else {
-        ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num, output, signature);
+        ret = ntlmv1_sign(h->seal_handle, 0, h->seq_num, sign, signature);
     }
     if (ret) return ret;
 
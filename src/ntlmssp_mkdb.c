@@ -0,0 +1,49 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Compiles a user file (Heimdal DOMAIN:USER:PASSWORD or smbpasswd format)
+ * into the binary database format that can be used in place of it via
+ * NTLM_USER_FILE or the ntlmssp_keyfile cred store option. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+
+#include "gss_ntlmssp.h"
+
+static void print_error(const char *text, int err)
+{
+    gss_buffer_desc buf = { 0 };
+    uint32_t msgctx = 0;
+    uint32_t retmin;
+
+    if (gssntlm_display_status(&retmin, err, GSS_C_MECH_CODE,
+                               NULL, &msgctx, &buf) == GSS_S_COMPLETE) {
+        fprintf(stderr, "%s: %.*s\n", text,
+                        (int)buf.length, (char *)buf.value);
+        free(buf.value);
+    } else {
+        fprintf(stderr, "%s: error %d\n", text, err);
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    int ret;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <user file> <database file>\n", argv[0]);
+        return 1;
+    }
+
+    ret = gssntlm_userfile_compile(argv[1], argv[2]);
+    if (ret) {
+        print_error("Failed to compile user database", ret);
+        return 1;
+    }
+
+    return 0;
+}
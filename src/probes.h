@@ -0,0 +1,57 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+#ifndef _GSSNTLMSSP_PROBES_H_
+#define _GSSNTLMSSP_PROBES_H_
+
+/* Static tracepoints, built in when configured --with-usdt.
+ *
+ * A probe compiles to a single nop plus a note in the ELF file, so they
+ * cost nothing until a tracer attaches, e.g.:
+ *   bpftrace -e 'usdt:/usr/lib64/gssntlmssp/gssntlmssp.so:gssntlmssp:*
+ *                { @[probe] = count(); }'
+ *
+ * All probes are under the "gssntlmssp" provider. Every *_start probe has
+ * a matching *_done probe fired on the same thread on every return path.
+ *
+ * init_start      ctx, stage, req_flags, input token length
+ * init_done       ctx, stage, major, minor, output token length
+ * accept_start    ctx, stage, input token length
+ * accept_done     ctx, stage, major, minor, output token length
+ *     stage is the NTLMSSP_STAGE_* of the context, ctx is NULL and stage
+ *     -1 while no context exists yet
+ * srv_auth_start  ctx, credential type (GSSNTLM_CRED_*),
+ *                 NT response length, LM response length
+ * srv_auth_done   ctx, major, minor
+ * ext_auth_start  ctx, NT response length, LM response length
+ * ext_auth_done   ctx, error (0 when the user was authenticated)
+ * auth_mic_start  ctx, authenticate message length
+ * auth_mic_done   ctx, error (0 when the MIC matched)
+ * get_mic_start, verify_mic_start, wrap_start, unwrap_start
+ *                 ctx, message length
+ * get_mic_done, wrap_done, unwrap_done
+ *                 ctx, major, minor, output length (0 on failure)
+ * verify_mic_done ctx, major, minor
+ * wrap_iov_start, unwrap_iov_start
+ *                 ctx, number of buffers
+ * wrap_iov_done, unwrap_iov_done
+ *                 ctx, major, minor
+ *     the per-message probes are in the gss_* entry points of gss_spi.c,
+ *     so they only fire for calls made through GSSAPI
+ */
+
+#include "config.h"
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define GSSNTLM_PROBE(name, ...) STAP_PROBEV(gssntlmssp, name, __VA_ARGS__)
+#else
+#define GSSNTLM_PROBE(name, ...) do { } while (0)
+#endif
+
+/* argument helpers, for pointers the caller may pass as NULL */
+#define PROBE_LEN(buf) ((buf) ? (buf)->length : 0)
+#define PROBE_OUT_LEN(maj, buf) ((maj) == GSS_S_COMPLETE ? PROBE_LEN(buf) : 0)
+#define PROBE_MINOR(min) ((min) ? *(min) : 0)
+#define PROBE_STAGE(ctx) ((ctx) ? (int)(ctx)->stage : -1)
+
+#endif /* _GSSNTLMSSP_PROBES_H_ */
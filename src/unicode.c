@@ -0,0 +1,251 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Minimal validating UTF-8 <-> UTF-16LE transcoder.
+ *
+ * NTLM strings are short and almost always plain ASCII, so both directions
+ * first try to move whole blocks of ASCII characters at once, and fall back
+ * to a per code point conversion only where non ASCII text is found. */
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "unicode.h"
+
+/* whether the next 8 bytes are all ASCII */
+static inline int ascii8(const uint8_t *in)
+{
+    uint64_t w;
+
+    memcpy(&w, in, 8);
+    return (w & 0x8080808080808080ULL) == 0;
+}
+
+/* whether the next 8 UTF-16LE code units are all ASCII */
+static inline int ascii8_utf16le(const uint8_t *in)
+{
+    uint64_t w[2];
+
+    memcpy(w, in, 16);
+    return (le64toh(w[0] | w[1]) & 0xFF80FF80FF80FF80ULL) == 0;
+}
+
+static int utf8_decode(const uint8_t *in, size_t len,
+                       uint32_t *code_point, size_t *used)
+{
+    uint32_t cp;
+    uint32_t min;
+    size_t n;
+    size_t i;
+
+    if (in[0] < 0x80) {
+        *code_point = in[0];
+        *used = 1;
+        return 0;
+    } else if (in[0] < 0xC2) {
+        /* stray continuation byte or overlong 2 byte form */
+        return EILSEQ;
+    } else if (in[0] < 0xE0) {
+        n = 2;
+        cp = in[0] & 0x1F;
+        min = 0x80;
+    } else if (in[0] < 0xF0) {
+        n = 3;
+        cp = in[0] & 0x0F;
+        min = 0x800;
+    } else if (in[0] < 0xF5) {
+        n = 4;
+        cp = in[0] & 0x07;
+        min = 0x10000;
+    } else {
+        return EILSEQ;
+    }
+
+    for (i = 1; i < n; i++) {
+        if (i >= len) return EINVAL;
+        if ((in[i] & 0xC0) != 0x80) return EILSEQ;
+        cp = (cp << 6) | (in[i] & 0x3F);
+    }
+
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return EILSEQ;
+    }
+
+    *code_point = cp;
+    *used = n;
+    return 0;
+}
+
+int ntlm_utf8_to_utf16le(const uint8_t *in, size_t inlen,
+                         uint8_t *out, size_t outmax, size_t *outlen)
+{
+    uint32_t cp;
+    size_t used;
+    size_t i = 0;
+    size_t o = 0;
+    int ret;
+
+    while (i < inlen) {
+#ifdef __SSE2__
+        if (inlen - i >= 16 && outmax - o >= 32) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+            if (_mm_movemask_epi8(v) == 0) {
+                __m128i zero = _mm_setzero_si128();
+                _mm_storeu_si128((__m128i *)&out[o],
+                                 _mm_unpacklo_epi8(v, zero));
+                _mm_storeu_si128((__m128i *)&out[o + 16],
+                                 _mm_unpackhi_epi8(v, zero));
+                i += 16;
+                o += 32;
+                continue;
+            }
+        }
+        if (inlen - i >= 8 && outmax - o >= 16 && ascii8(&in[i])) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)&in[i]);
+            _mm_storeu_si128((__m128i *)&out[o],
+                             _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+            i += 8;
+            o += 16;
+            continue;
+        }
+#endif
+        if (in[i] < 0x80) {
+            if (outmax - o < 2) return E2BIG;
+            out[o++] = in[i++];
+            out[o++] = 0;
+            continue;
+        }
+
+        ret = utf8_decode(&in[i], inlen - i, &cp, &used);
+        if (ret) return ret;
+
+        if (cp < 0x10000) {
+            if (outmax - o < 2) return E2BIG;
+            out[o++] = cp & 0xFF;
+            out[o++] = cp >> 8;
+        } else {
+            uint32_t hi, lo;
+
+            if (outmax - o < 4) return E2BIG;
+            cp -= 0x10000;
+            hi = 0xD800 | (cp >> 10);
+            lo = 0xDC00 | (cp & 0x3FF);
+            out[o++] = hi & 0xFF;
+            out[o++] = hi >> 8;
+            out[o++] = lo & 0xFF;
+            out[o++] = lo >> 8;
+        }
+        i += used;
+    }
+
+    *outlen = o;
+    return 0;
+}
+
+int ntlm_utf8_to_utf16le_len(const uint8_t *in, size_t inlen,
+                             size_t *outlen)
+{
+    uint32_t cp;
+    size_t used;
+    size_t i = 0;
+    size_t o = 0;
+    int ret;
+
+    while (i < inlen) {
+        if (inlen - i >= 8 && ascii8(&in[i])) {
+            o += 16;
+            i += 8;
+            continue;
+        }
+        if (in[i] < 0x80) {
+            o += 2;
+            i++;
+            continue;
+        }
+
+        ret = utf8_decode(&in[i], inlen - i, &cp, &used);
+        if (ret) return ret;
+
+        /* code points outside the BMP take a surrogate pair */
+        o += (cp < 0x10000) ? 2 : 4;
+        i += used;
+    }
+
+    *outlen = o;
+    return 0;
+}
+
+int ntlm_utf16le_to_utf8(const uint8_t *in, size_t inlen,
+                         uint8_t *out, size_t outmax, size_t *outlen)
+{
+    uint32_t cp;
+    uint32_t lo;
+    size_t i = 0;
+    size_t o = 0;
+
+    while (i < inlen) {
+#ifdef __SSE2__
+        if (inlen - i >= 32 && outmax - o >= 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)&in[i]);
+            __m128i b = _mm_loadu_si128((const __m128i *)&in[i + 16]);
+            __m128i hi = _mm_and_si128(_mm_or_si128(a, b),
+                                       _mm_set1_epi16((short)0xFF80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi, _mm_setzero_si128()))
+                    == 0xFFFF) {
+                _mm_storeu_si128((__m128i *)&out[o], _mm_packus_epi16(a, b));
+                i += 32;
+                o += 16;
+                continue;
+            }
+        }
+#endif
+        if (inlen - i >= 16 && outmax - o >= 8 && ascii8_utf16le(&in[i])) {
+            for (size_t k = 0; k < 8; k++) {
+                out[o + k] = in[i + 2 * k];
+            }
+            i += 16;
+            o += 8;
+            continue;
+        }
+        if (inlen - i < 2) return EINVAL;
+        cp = in[i] | (in[i + 1] << 8);
+        i += 2;
+
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+            if (inlen - i < 2) return EINVAL;
+            lo = in[i] | (in[i + 1] << 8);
+            if (lo < 0xDC00 || lo > 0xDFFF) return EILSEQ;
+            i += 2;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+            return EILSEQ;
+        }
+
+        if (cp < 0x80) {
+            if (outmax - o < 1) return E2BIG;
+            out[o++] = cp;
+        } else if (cp < 0x800) {
+            if (outmax - o < 2) return E2BIG;
+            out[o++] = 0xC0 | (cp >> 6);
+            out[o++] = 0x80 | (cp & 0x3F);
+        } else if (cp < 0x10000) {
+            if (outmax - o < 3) return E2BIG;
+            out[o++] = 0xE0 | (cp >> 12);
+            out[o++] = 0x80 | ((cp >> 6) & 0x3F);
+            out[o++] = 0x80 | (cp & 0x3F);
+        } else {
+            if (outmax - o < 4) return E2BIG;
+            out[o++] = 0xF0 | (cp >> 18);
+            out[o++] = 0x80 | ((cp >> 12) & 0x3F);
+            out[o++] = 0x80 | ((cp >> 6) & 0x3F);
+            out[o++] = 0x80 | (cp & 0x3F);
+        }
+    }
+
+    *outlen = o;
+    return 0;
+}
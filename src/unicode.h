@@ -0,0 +1,62 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+#ifndef _SRC_UNICODE_H_
+#define _SRC_UNICODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief   Converts a UTF-8 string to UTF-16LE
+ *
+ * The input is fully validated: overlong forms, surrogate code points and
+ * values above U+10FFFF are rejected. The output is never NUL terminated.
+ * In the worst case the output is twice as long as the input.
+ *
+ * @param in        The UTF-8 input
+ * @param inlen     The input length in bytes
+ * @param out       Preallocated output buffer
+ * @param outmax    The size of the output buffer
+ * @param outlen    Returns the number of bytes written to out
+ *
+ * @return 0 on success, EILSEQ on invalid input, EINVAL if the input ends
+ *         with a truncated sequence, E2BIG if the output buffer is too small
+ */
+int ntlm_utf8_to_utf16le(const uint8_t *in, size_t inlen,
+                         uint8_t *out, size_t outmax, size_t *outlen);
+
+/**
+ * @brief   Computes the length of a UTF-8 string once converted to UTF-16LE
+ *
+ * The input is validated exactly as ntlm_utf8_to_utf16le() does.
+ *
+ * @param in        The UTF-8 input
+ * @param inlen     The input length in bytes
+ * @param outlen    Returns the length of the UTF-16LE string in bytes
+ *
+ * @return 0 on success, EILSEQ on invalid input, EINVAL if the input ends
+ *         with a truncated sequence
+ */
+int ntlm_utf8_to_utf16le_len(const uint8_t *in, size_t inlen,
+                             size_t *outlen);
+
+/**
+ * @brief   Converts a UTF-16LE string to UTF-8
+ *
+ * Unpaired surrogates are rejected. The output is never NUL terminated.
+ * In the worst case the output is 3/2 the length of the input.
+ *
+ * @param in        The UTF-16LE input
+ * @param inlen     The input length in bytes
+ * @param out       Preallocated output buffer
+ * @param outmax    The size of the output buffer
+ * @param outlen    Returns the number of bytes written to out
+ *
+ * @return 0 on success, EILSEQ on invalid input, EINVAL if the input ends
+ *         with a truncated code unit or surrogate pair, E2BIG if the output
+ *         buffer is too small
+ */
+int ntlm_utf16le_to_utf8(const uint8_t *in, size_t inlen,
+                         uint8_t *out, size_t outmax, size_t *outlen);
+
+#endif /* _SRC_UNICODE_H_ */
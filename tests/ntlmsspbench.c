@@ -0,0 +1,2363 @@
+/* Copyright (C) 2024 GSS-NTLMSSP contributors, see COPYING for license */
+
+/* Offline micro and macro benchmarks for the NTLMSSP mechanism.
+ *
+ * Each case is run repeatedly until it has accumulated at least the
+ * requested amount of time, then the number of operations, ns/op, ops/s
+ * and, for cases that process a payload, bytes/s are reported as JSON or
+ * CSV. All inputs are deterministic and nothing requires network access,
+ * so results from different builds can be compared directly. */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/rand.h>
+
+#include "config.h"
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+#include "../src/crypto.h"
+#include "../src/gssapi_ntlmssp.h"
+#include "../src/gss_ntlmssp.h"
+#include "../src/unicode.h"
+
+#define TEST_USER_FILE "examples/test_user_file.txt"
+#define TEST_USER_NAME "TESTDOM\\testuser"
+#define TEST_USER_PASSWORD "testpassword"
+#define TEST_SRV_NAME "test@testserver"
+
+/* keep pre-generated input (e.g. tokens to unwrap) under this size */
+#define BENCH_MAX_PREPARED (64 * 1024 * 1024)
+
+struct bench_case {
+    char name[64];
+    size_t size;            /* payload size, reported as bytes/s if set */
+    bool datagram;
+    uint64_t max_batch;     /* max ops per timed run, 0 for no limit */
+    size_t entries;         /* user file cases, entries in the file */
+
+    int (*setup)(struct bench_case *bc);
+    /* called untimed before each timed run of 'ops' operations */
+    int (*prepare)(struct bench_case *bc, uint64_t ops);
+    int (*run)(struct bench_case *bc, uint64_t ops);
+    void (*teardown)(struct bench_case *bc);
+
+    void *priv;
+};
+
+struct bench_result {
+    uint64_t ops;
+    double seconds;
+};
+
+struct bench_list {
+    struct bench_case *cases;
+    size_t num;
+    size_t alloc;
+};
+
+enum bench_format {
+    BENCH_JSON,
+    BENCH_CSV
+};
+
+static const size_t gss_msg_sizes[] = {
+    16, 256, 4096, 65536, 1024 * 1024
+};
+
+/* ==== common helpers ==== */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(i * 31 + seed);
+    }
+}
+
+/* Holds worker threads until the caller has started all of them, or lets
+ * them go home if it could not */
+struct start_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int state;      /* 0 waiting, 1 run, -1 abort */
+};
+
+#define START_GATE_INIT \
+    { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+
+static bool start_gate_wait(struct start_gate *gate)
+{
+    int state;
+
+    pthread_mutex_lock(&gate->lock);
+    while (gate->state == 0) {
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    }
+    state = gate->state;
+    pthread_mutex_unlock(&gate->lock);
+    return state > 0;
+}
+
+static void start_gate_open(struct start_gate *gate, bool run)
+{
+    pthread_mutex_lock(&gate->lock);
+    gate->state = run ? 1 : -1;
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->lock);
+}
+
+static void print_gss_error(const char *text, uint32_t maj, uint32_t min)
+{
+    gss_buffer_desc msg_buf;
+    uint32_t msg_ctx = 0;
+    uint32_t retmin;
+
+    if (gssntlm_display_status(&retmin, min, GSS_C_MECH_CODE,
+                               NULL, &msg_ctx, &msg_buf) == GSS_S_COMPLETE) {
+        fprintf(stderr, "%s: %.*s (%u)\n", text,
+                (int)msg_buf.length, (char *)msg_buf.value, maj);
+        gss_release_buffer(&retmin, &msg_buf);
+    } else {
+        fprintf(stderr, "%s: %u/%u\n", text, maj, min);
+    }
+}
+
+static struct bench_case *bench_add(struct bench_list *list,
+                                    const char *name, size_t size)
+{
+    struct bench_case *bc;
+
+    if (list->num == list->alloc) {
+        size_t alloc = list->alloc ? list->alloc * 2 : 64;
+        bc = realloc(list->cases, alloc * sizeof(struct bench_case));
+        if (!bc) return NULL;
+        list->cases = bc;
+        list->alloc = alloc;
+    }
+
+    bc = &list->cases[list->num++];
+    memset(bc, 0, sizeof(struct bench_case));
+    if (size) {
+        snprintf(bc->name, sizeof(bc->name), "%s/%zu", name, size);
+    } else {
+        snprintf(bc->name, sizeof(bc->name), "%s", name);
+    }
+    bc->size = size;
+    return bc;
+}
+
+/* ==== crypto primitives ==== */
+
+struct crypto_priv {
+    uint8_t key[16];
+    struct ntlm_buffer data;
+    struct ntlm_buffer out;
+    struct ntlm_hmac_handle *hmac;
+    struct ntlm_rc4_handle *rc4;
+    struct ntlm_ctx *ntlm;
+};
+
+static int crypto_setup(struct bench_case *bc)
+{
+    struct crypto_priv *p;
+    struct ntlm_buffer key;
+    int ret;
+
+    p = calloc(1, sizeof(struct crypto_priv));
+    if (!p) return ENOMEM;
+    bc->priv = p;
+
+    fill_pattern(p->key, 16, 1);
+    key.data = p->key;
+    key.length = 16;
+
+    p->data.length = bc->size ? bc->size : 8;
+    p->data.data = malloc(p->data.length);
+    /* large enough for any result, DESL returns 24 bytes */
+    p->out.length = p->data.length > 24 ? p->data.length : 24;
+    p->out.data = malloc(p->out.length);
+    if (!p->data.data || !p->out.data) return ENOMEM;
+    fill_pattern(p->data.data, p->data.length, 7);
+
+    ret = HMAC_MD5_INIT(&key, &p->hmac);
+    if (ret) return ret;
+    ret = RC4_INIT(&key, NTLM_CIPHER_ENCRYPT, &p->rc4);
+    if (ret) return ret;
+    return ntlm_init_ctx(&p->ntlm);
+}
+
+static void crypto_teardown(struct bench_case *bc)
+{
+    struct crypto_priv *p = bc->priv;
+
+    if (!p) return;
+    HMAC_MD5_FREE(&p->hmac);
+    RC4_FREE(&p->rc4);
+    ntlm_free_ctx(&p->ntlm);
+    free(p->data.data);
+    free(p->out.data);
+    safefree(bc->priv);
+}
+
+static int run_hmac_md5(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer key = { p->key, 16 };
+    struct ntlm_buffer result = { p->out.data, 16 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = HMAC_MD5(&key, &p->data, &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_hmac_md5_keyed(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer *data = &p->data;
+    struct ntlm_iov iov = { &data, 1 };
+    struct ntlm_buffer result = { p->out.data, 16 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = HMAC_MD5_KEYED_IOV(p->hmac, &iov, &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_md4(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer result = { p->out.data, 16 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = MD4_HASH(&p->data, &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_rc4(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer out = { p->out.data, p->data.length };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = RC4_UPDATE(p->rc4, &p->data, &out);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/* the keystream is generated untimed, so this measures what is left on the
+ * critical path when the application prefetches while idle */
+static int prepare_rc4_prefetched(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+
+    return RC4_PREFETCH(p->rc4, ops * p->data.length);
+}
+
+static int run_rc4k(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer key = { p->key, 16 };
+    struct ntlm_buffer out = { p->out.data, p->data.length };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = RC4K(&key, NTLM_CIPHER_ENCRYPT, &p->data, &out);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_desl(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_buffer key = { p->key, 16 };
+    struct ntlm_buffer result = { p->out.data, 24 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = DESL(&key, &p->data, &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_crc32(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    volatile uint32_t crc = 0;
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        crc = CRC32(crc, &p->data);
+    }
+    return 0;
+}
+
+static int run_ntowfv1(struct bench_case *bc, uint64_t ops)
+{
+    struct ntlm_key result = { .length = 16 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = NTOWFv1("testpassword", &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_ntowfv2(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_key nt_hash = { .length = 16 };
+    struct ntlm_key result = { .length = 16 };
+    uint64_t i;
+    int ret;
+
+    memcpy(nt_hash.data, p->key, 16);
+    for (i = 0; i < ops; i++) {
+        ret = NTOWFv2(p->ntlm, &nt_hash, "testuser", "TESTDOM", &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_ntowfv2_cached(struct bench_case *bc, uint64_t ops)
+{
+    struct crypto_priv *p = bc->priv;
+    struct ntlm_key nt_hash = { .length = 16 };
+    struct ntlm_key result = { .length = 16 };
+    uint64_t i;
+    int ret;
+
+    memcpy(nt_hash.data, p->key, 16);
+    for (i = 0; i < ops; i++) {
+        ret = gssntlm_keycache_ntowfv2(p->ntlm, &nt_hash, "testuser",
+                                       "TESTDOM", false, &result);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int add_crypto_cases(struct bench_list *list)
+{
+    static const struct {
+        const char *name;
+        size_t size;
+        int (*prepare)(struct bench_case *bc, uint64_t ops);
+        int (*run)(struct bench_case *bc, uint64_t ops);
+    } crypto_cases[] = {
+        { "crypto/hmac_md5", 64, NULL, run_hmac_md5 },
+        { "crypto/hmac_md5", 1024, NULL, run_hmac_md5 },
+        { "crypto/hmac_md5_keyed", 64, NULL, run_hmac_md5_keyed },
+        { "crypto/hmac_md5_keyed", 1024, NULL, run_hmac_md5_keyed },
+        { "crypto/md4", 64, NULL, run_md4 },
+        { "crypto/md4", 1024, NULL, run_md4 },
+        { "crypto/rc4", 16, NULL, run_rc4 },
+        { "crypto/rc4", 1024, NULL, run_rc4 },
+        { "crypto/rc4", 65536, NULL, run_rc4 },
+        { "crypto/rc4_prefetched", 16, prepare_rc4_prefetched, run_rc4 },
+        { "crypto/rc4_prefetched", 1024, prepare_rc4_prefetched, run_rc4 },
+        { "crypto/rc4k", 16, NULL, run_rc4k },
+        { "crypto/desl", 0, NULL, run_desl },
+        { "crypto/crc32", 1024, NULL, run_crc32 },
+        { "crypto/crc32", 65536, NULL, run_crc32 },
+        { "crypto/ntowfv1", 0, NULL, run_ntowfv1 },
+        { "crypto/ntowfv2", 0, NULL, run_ntowfv2 },
+        { "crypto/ntowfv2_cached", 0, NULL, run_ntowfv2_cached },
+    };
+    struct bench_case *bc;
+    size_t i;
+
+    for (i = 0; i < sizeof(crypto_cases) / sizeof(crypto_cases[0]); i++) {
+        bc = bench_add(list, crypto_cases[i].name, crypto_cases[i].size);
+        if (!bc) return ENOMEM;
+        bc->setup = crypto_setup;
+        bc->prepare = crypto_cases[i].prepare;
+        bc->run = crypto_cases[i].run;
+        bc->teardown = crypto_teardown;
+        if (crypto_cases[i].prepare) {
+            bc->max_batch = RC4_PREFETCH_MAX / bc->size;
+        }
+    }
+    return 0;
+}
+
+/* ==== NTLM message encoding and decoding ==== */
+
+#define BENCH_NEG_FLAGS (NTLMSSP_NEGOTIATE_UNICODE | \
+                         NTLMSSP_REQUEST_TARGET | \
+                         NTLMSSP_NEGOTIATE_SIGN | \
+                         NTLMSSP_NEGOTIATE_SEAL | \
+                         NTLMSSP_NEGOTIATE_NTLM | \
+                         NTLMSSP_NEGOTIATE_ALWAYS_SIGN | \
+                         NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY | \
+                         NTLMSSP_NEGOTIATE_TARGET_INFO | \
+                         NTLMSSP_NEGOTIATE_VERSION | \
+                         NTLMSSP_NEGOTIATE_128 | \
+                         NTLMSSP_NEGOTIATE_KEY_EXCH | \
+                         NTLMSSP_NEGOTIATE_56)
+
+struct msg_priv {
+    struct ntlm_ctx *ntlm;
+    uint8_t chal[8];
+    uint64_t timestamp;
+    struct ntlm_buffer target_info;
+    struct ntlm_chal_template tmpl;
+    uint8_t u16_nb_computer[64];
+    uint8_t u16_nb_domain[64];
+    uint8_t u16_dns_computer[64];
+    uint8_t lm_resp[24];
+    uint8_t nt_resp[128];
+    uint8_t sess_key[16];
+    uint8_t mic[16];
+    struct ntlm_buffer neg_msg;
+    struct ntlm_buffer chal_msg;
+    struct ntlm_buffer auth_msg;
+};
+
+static int encode_u16(const char *str, uint8_t *buf, size_t size,
+                      struct ntlm_buffer *out)
+{
+    out->data = buf;
+    return ntlm_utf8_to_utf16le((const uint8_t *)str, strlen(str),
+                                buf, size, &out->length);
+}
+
+static int encode_auth(struct msg_priv *p, struct ntlm_buffer *msg)
+{
+    struct ntlm_buffer lm = { p->lm_resp, sizeof(p->lm_resp) };
+    struct ntlm_buffer nt = { p->nt_resp, sizeof(p->nt_resp) };
+    struct ntlm_buffer key = { p->sess_key, sizeof(p->sess_key) };
+    struct ntlm_buffer mic = { p->mic, sizeof(p->mic) };
+
+    return ntlm_encode_auth_msg(p->ntlm, BENCH_NEG_FLAGS,
+                                &lm, &nt, discard_const("TESTDOM"),
+                                discard_const("testuser"),
+                                discard_const("WORKSTATION"),
+                                &key, &mic, msg);
+}
+
+static int msg_setup(struct bench_case *bc)
+{
+    struct ntlm_buffer u16_nb_computer;
+    struct ntlm_buffer u16_nb_domain;
+    struct ntlm_buffer u16_dns_computer;
+    struct ntlm_buffer challenge;
+    struct msg_priv *p;
+    int ret;
+
+    p = calloc(1, sizeof(struct msg_priv));
+    if (!p) return ENOMEM;
+    bc->priv = p;
+
+    ret = ntlm_init_ctx(&p->ntlm);
+    if (ret) return ret;
+
+    fill_pattern(p->chal, sizeof(p->chal), 3);
+    fill_pattern(p->lm_resp, sizeof(p->lm_resp), 5);
+    fill_pattern(p->nt_resp, sizeof(p->nt_resp), 9);
+    fill_pattern(p->sess_key, sizeof(p->sess_key), 11);
+    fill_pattern(p->mic, sizeof(p->mic), 13);
+    p->timestamp = 0x01D0000012345678ULL;
+    challenge.data = p->chal;
+    challenge.length = sizeof(p->chal);
+
+    ret = ntlm_encode_target_info(p->ntlm, discard_const("TESTSERVER"),
+                                  discard_const("TESTDOM"),
+                                  discard_const("testserver.example.com"),
+                                  NULL, NULL, NULL, &p->timestamp,
+                                  NULL, NULL, NULL, &p->target_info);
+    if (ret) return ret;
+
+    /* the same names in UTF-16LE, for the template encoder */
+    ret = encode_u16("TESTSERVER", p->u16_nb_computer,
+                     sizeof(p->u16_nb_computer), &u16_nb_computer);
+    if (ret) return ret;
+    ret = encode_u16("TESTDOM", p->u16_nb_domain,
+                     sizeof(p->u16_nb_domain), &u16_nb_domain);
+    if (ret) return ret;
+    ret = encode_u16("testserver.example.com", p->u16_dns_computer,
+                     sizeof(p->u16_dns_computer), &u16_dns_computer);
+    if (ret) return ret;
+    ret = ntlm_encode_chal_template(BENCH_NEG_FLAGS |
+                                        NTLMSSP_TARGET_TYPE_SERVER,
+                                    &u16_nb_computer, &u16_nb_computer,
+                                    &u16_nb_domain, &u16_dns_computer,
+                                    &p->tmpl);
+    if (ret) return ret;
+
+    ret = ntlm_encode_neg_msg(p->ntlm, BENCH_NEG_FLAGS, NULL, NULL,
+                              &p->neg_msg);
+    if (ret) return ret;
+    ret = ntlm_encode_chal_msg(p->ntlm,
+                               BENCH_NEG_FLAGS | NTLMSSP_TARGET_TYPE_SERVER,
+                               "TESTSERVER", &challenge, &p->target_info,
+                               &p->chal_msg);
+    if (ret) return ret;
+    return encode_auth(p, &p->auth_msg);
+}
+
+static void msg_teardown(struct bench_case *bc)
+{
+    struct msg_priv *p = bc->priv;
+
+    if (!p) return;
+    ntlm_free_buffer_data(&p->target_info);
+    ntlm_free_buffer_data(&p->tmpl.message);
+    ntlm_free_buffer_data(&p->neg_msg);
+    ntlm_free_buffer_data(&p->chal_msg);
+    ntlm_free_buffer_data(&p->auth_msg);
+    ntlm_free_ctx(&p->ntlm);
+    safefree(bc->priv);
+}
+
+static int run_encode_neg(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer msg;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_encode_neg_msg(p->ntlm, BENCH_NEG_FLAGS, NULL, NULL, &msg);
+        if (ret) return ret;
+        ntlm_free_buffer_data(&msg);
+    }
+    return 0;
+}
+
+static int run_decode_neg(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    uint32_t type;
+    uint32_t flags;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_decode_msg_type(p->ntlm, &p->neg_msg, &type);
+        if (ret) return ret;
+        ret = ntlm_decode_neg_msg(p->ntlm, &p->neg_msg, &flags, NULL, NULL);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_encode_chal(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer challenge = { p->chal, 8 };
+    struct ntlm_buffer target_info;
+    struct ntlm_buffer msg;
+    uint64_t i;
+    int ret;
+
+    /* what the acceptor did for each context before templates */
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_encode_target_info(p->ntlm, discard_const("TESTSERVER"),
+                                      discard_const("TESTDOM"),
+                                      discard_const("testserver.example.com"),
+                                      NULL, NULL, NULL, &p->timestamp,
+                                      NULL, NULL, NULL, &target_info);
+        if (ret) return ret;
+        ret = ntlm_encode_chal_msg(p->ntlm,
+                                   BENCH_NEG_FLAGS |
+                                        NTLMSSP_TARGET_TYPE_SERVER,
+                                   "TESTSERVER", &challenge, &target_info,
+                                   &msg);
+        ntlm_free_buffer_data(&target_info);
+        if (ret) return ret;
+        ntlm_free_buffer_data(&msg);
+    }
+    return 0;
+}
+
+static int run_encode_chal_template(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer challenge = { p->chal, 8 };
+    struct ntlm_buffer msg;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_chal_template_to_msg(&p->tmpl,
+                                        BENCH_NEG_FLAGS |
+                                            NTLMSSP_TARGET_TYPE_SERVER,
+                                        &challenge, p->timestamp, &msg);
+        if (ret) return ret;
+        ntlm_free_buffer_data(&msg);
+    }
+    return 0;
+}
+
+static int run_decode_chal(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    uint8_t chal[8];
+    struct ntlm_buffer challenge = { chal, 8 };
+    struct ntlm_buffer target_info;
+    char *target_name;
+    uint32_t flags;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_decode_chal_msg(p->ntlm, &p->chal_msg, &flags,
+                                   &target_name, &challenge, &target_info);
+        if (ret) return ret;
+        free(target_name);
+        ntlm_free_buffer_data(&target_info);
+    }
+    return 0;
+}
+
+static int run_decode_chal_view(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_chal_view chal;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_decode_chal_view(p->ntlm, &p->chal_msg, &chal);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_encode_auth(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer msg;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = encode_auth(p, &msg);
+        if (ret) return ret;
+        ntlm_free_buffer_data(&msg);
+    }
+    return 0;
+}
+
+/* sized once, then written in place, as init_sec_context does */
+static int run_write_auth(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer lm = { p->lm_resp, sizeof(p->lm_resp) };
+    struct ntlm_buffer nt = { p->nt_resp, sizeof(p->nt_resp) };
+    struct ntlm_buffer key = { p->sess_key, sizeof(p->sess_key) };
+    struct ntlm_buffer mic = { p->mic, sizeof(p->mic) };
+    uint8_t buf[512];
+    struct ntlm_buffer msg;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        msg.data = NULL;
+        ret = ntlm_write_auth_msg(p->ntlm, BENCH_NEG_FLAGS, &lm, &nt,
+                                  discard_const("TESTDOM"),
+                                  discard_const("testuser"),
+                                  discard_const("WORKSTATION"),
+                                  &key, &mic, &msg);
+        if (ret) return ret;
+        if (msg.length > sizeof(buf)) return E2BIG;
+        msg.data = buf;
+        ret = ntlm_write_auth_msg(p->ntlm, BENCH_NEG_FLAGS, &lm, &nt,
+                                  discard_const("TESTDOM"),
+                                  discard_const("testuser"),
+                                  discard_const("WORKSTATION"),
+                                  &key, &mic, &msg);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_decode_auth(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_buffer lm, nt, key, target_info;
+    uint8_t micbuf[16];
+    struct ntlm_buffer mic = { micbuf, 16 };
+    char *dom, *usr, *wks;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_decode_auth_msg(p->ntlm, &p->auth_msg,
+                                   BENCH_NEG_FLAGS, &lm, &nt,
+                                   &dom, &usr, &wks, &key,
+                                   &target_info, &mic);
+        if (ret) return ret;
+        ntlm_free_buffer_data(&lm);
+        ntlm_free_buffer_data(&nt);
+        ntlm_free_buffer_data(&key);
+        ntlm_free_buffer_data(&target_info);
+        free(dom);
+        free(usr);
+        free(wks);
+    }
+    return 0;
+}
+
+/* what the acceptor does: views, and only the names get converted */
+static int run_decode_auth_view(struct bench_case *bc, uint64_t ops)
+{
+    struct msg_priv *p = bc->priv;
+    struct ntlm_auth_view auth;
+    char name[1024];
+    size_t dlen, ulen;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = ntlm_decode_auth_view(p->ntlm, &p->auth_msg,
+                                    BENCH_NEG_FLAGS, &auth);
+        if (ret) return ret;
+        ret = ntlm_str_view_to_utf8(&auth.domain_name, name,
+                                    sizeof(name) - 1, &dlen);
+        if (ret) return ret;
+        name[dlen] = '\\';
+        ret = ntlm_str_view_to_utf8(&auth.user_name, &name[dlen + 1],
+                                    sizeof(name) - dlen - 1, &ulen);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int add_message_cases(struct bench_list *list)
+{
+    static const struct {
+        const char *name;
+        int (*run)(struct bench_case *bc, uint64_t ops);
+    } msg_cases[] = {
+        { "msg/encode_negotiate", run_encode_neg },
+        { "msg/decode_negotiate", run_decode_neg },
+        { "msg/encode_challenge", run_encode_chal },
+        { "msg/encode_challenge_template", run_encode_chal_template },
+        { "msg/decode_challenge", run_decode_chal },
+        { "msg/decode_challenge_view", run_decode_chal_view },
+        { "msg/encode_authenticate", run_encode_auth },
+        { "msg/write_authenticate", run_write_auth },
+        { "msg/decode_authenticate", run_decode_auth },
+        { "msg/decode_authenticate_view", run_decode_auth_view },
+    };
+    struct bench_case *bc;
+    size_t i;
+
+    for (i = 0; i < sizeof(msg_cases) / sizeof(msg_cases[0]); i++) {
+        bc = bench_add(list, msg_cases[i].name, 0);
+        if (!bc) return ENOMEM;
+        bc->setup = msg_setup;
+        bc->run = msg_cases[i].run;
+        bc->teardown = msg_teardown;
+    }
+    return 0;
+}
+
+/* ==== user file lookups ==== */
+
+/* entries in the generated user files, lookups should cost the same for
+ * all of them */
+static const size_t userfile_sizes[] = { 10, 1000, 100000, 1000000 };
+
+#define USERFILE_LOOKUP_NAMES 8
+
+struct userfile_priv {
+    char path[64];
+    char db_path[72];
+    const char *lookup_path;
+    gss_name_t names[USERFILE_LOOKUP_NAMES];
+};
+
+static int userfile_generate(const char *path, size_t entries)
+{
+    FILE *f;
+    size_t i;
+    int ret = 0;
+
+    f = fopen(path, "w");
+    if (!f) return errno;
+    for (i = 0; i < entries; i++) {
+        if (fprintf(f, "BENCHDOM:user%07zu:password%zu\n", i, i) < 0) {
+            ret = EIO;
+            break;
+        }
+    }
+    if (fclose(f) != 0 && ret == 0) ret = errno;
+    return ret;
+}
+
+static void userfile_teardown(struct bench_case *bc)
+{
+    struct userfile_priv *p = bc->priv;
+    uint32_t retmin;
+    int i;
+
+    if (!p) return;
+    for (i = 0; i < USERFILE_LOOKUP_NAMES; i++) {
+        gssntlm_release_name(&retmin, &p->names[i]);
+    }
+    if (p->path[0]) unlink(p->path);
+    if (p->db_path[0]) unlink(p->db_path);
+    free(p);
+    bc->priv = NULL;
+}
+
+static int userfile_setup(struct bench_case *bc)
+{
+    struct userfile_priv *p;
+    gss_buffer_desc nbuf;
+    char name[64];
+    uint32_t retmaj, retmin;
+    size_t entries = bc->entries;
+    bool compiled = (strncmp(bc->name, "userdb/", 7) == 0);
+    const char *tmpdir;
+    int fd;
+    int ret;
+    int i;
+
+    p = calloc(1, sizeof(struct userfile_priv));
+    if (!p) return ENOMEM;
+    bc->priv = p;
+
+    tmpdir = getenv("TMPDIR");
+    if (!tmpdir || strlen(tmpdir) > 32) tmpdir = "/tmp";
+    snprintf(p->path, sizeof(p->path), "%s/ntlmbench-XXXXXX", tmpdir);
+    fd = mkstemp(p->path);
+    if (fd == -1) {
+        ret = errno;
+        p->path[0] = '\0';
+        goto done;
+    }
+    close(fd);
+
+    ret = userfile_generate(p->path, entries);
+    if (ret) goto done;
+    p->lookup_path = p->path;
+
+    if (compiled) {
+        snprintf(p->db_path, sizeof(p->db_path), "%s.db", p->path);
+        ret = gssntlm_userfile_compile(p->path, p->db_path);
+        if (ret) {
+            p->db_path[0] = '\0';
+            goto done;
+        }
+        p->lookup_path = p->db_path;
+    }
+
+    /* spread over the whole file, the last entry included */
+    for (i = 0; i < USERFILE_LOOKUP_NAMES; i++) {
+        snprintf(name, sizeof(name), "BENCHDOM\\user%07zu",
+                 (entries - 1) - (entries - 1) * i / USERFILE_LOOKUP_NAMES);
+        nbuf.value = name;
+        nbuf.length = strlen(name);
+        retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME,
+                                     &p->names[i]);
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("gssntlm_import_name(user) failed",
+                            retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+    }
+
+done:
+    if (ret) userfile_teardown(bc);
+    return ret;
+}
+
+/* the first run loads the file, the timed ones only see it is current */
+static int run_userfile_lookup(struct bench_case *bc, uint64_t ops)
+{
+    struct userfile_priv *p = bc->priv;
+    struct gssntlm_userfile_ref ref = { 0 };
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = gssntlm_userfile_find(p->lookup_path,
+            (struct gssntlm_name *)p->names[i % USERFILE_LOOKUP_NAMES], &ref);
+        if (ret) return ret;
+        gssntlm_userfile_release(&ref);
+    }
+    return 0;
+}
+
+static int add_userfile_cases(struct bench_list *list)
+{
+    static const char *kinds[] = { "userfile/lookup", "userdb/lookup" };
+    struct bench_case *bc;
+    char name[64];
+    size_t i, j;
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        for (j = 0; j < sizeof(userfile_sizes) / sizeof(size_t); j++) {
+            snprintf(name, sizeof(name), "%s/%zu",
+                     kinds[i], userfile_sizes[j]);
+            /* not a payload size, so not passed as one */
+            bc = bench_add(list, name, 0);
+            if (!bc) return ENOMEM;
+            bc->setup = userfile_setup;
+            bc->run = run_userfile_lookup;
+            bc->teardown = userfile_teardown;
+            bc->entries = userfile_sizes[j];
+        }
+    }
+    return 0;
+}
+
+/* ==== GSSAPI handshakes and per-message calls ==== */
+
+static gss_cred_id_t cli_cred = GSS_C_NO_CREDENTIAL;
+static gss_cred_id_t pw_cred = GSS_C_NO_CREDENTIAL;
+static gss_cred_id_t srv_cred = GSS_C_NO_CREDENTIAL;
+static gss_name_t srv_name = GSS_C_NO_NAME;
+
+static int gss_bench_init(void)
+{
+    gss_name_t user_name = GSS_C_NO_NAME;
+    gss_buffer_desc pwbuf;
+    gss_buffer_desc nbuf;
+    uint32_t retmaj, retmin;
+    int ret = EINVAL;
+
+    /* the credentials come from the example user file, never the network */
+    setenv("NTLM_USER_FILE", TEST_USER_FILE, 1);
+
+    nbuf.value = discard_const(TEST_USER_NAME);
+    nbuf.length = strlen(TEST_USER_NAME);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME,
+                                 &user_name);
+    if (retmaj) {
+        print_gss_error("gssntlm_import_name(user) failed", retmaj, retmin);
+        goto done;
+    }
+    retmaj = gssntlm_acquire_cred(&retmin, user_name, GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET, GSS_C_INITIATE,
+                                  &cli_cred, NULL, NULL);
+    if (retmaj) {
+        print_gss_error("gssntlm_acquire_cred(user) failed", retmaj, retmin);
+        goto done;
+    }
+    pwbuf.value = discard_const(TEST_USER_PASSWORD);
+    pwbuf.length = strlen(TEST_USER_PASSWORD);
+    retmaj = gssntlm_acquire_cred_with_password(&retmin, user_name, &pwbuf,
+                                                GSS_C_INDEFINITE,
+                                                GSS_C_NO_OID_SET,
+                                                GSS_C_INITIATE,
+                                                &pw_cred, NULL, NULL);
+    if (retmaj) {
+        print_gss_error("gssntlm_acquire_cred_with_password failed",
+                        retmaj, retmin);
+        goto done;
+    }
+
+    nbuf.value = discard_const(TEST_SRV_NAME);
+    nbuf.length = strlen(TEST_SRV_NAME);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_HOSTBASED_SERVICE,
+                                 &srv_name);
+    if (retmaj) {
+        print_gss_error("gssntlm_import_name(srv) failed", retmaj, retmin);
+        goto done;
+    }
+    retmaj = gssntlm_acquire_cred(&retmin, srv_name, GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET, GSS_C_ACCEPT,
+                                  &srv_cred, NULL, NULL);
+    if (retmaj) {
+        print_gss_error("gssntlm_acquire_cred(srv) failed", retmaj, retmin);
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    gssntlm_release_name(&retmin, &user_name);
+    return ret;
+}
+
+static void gss_bench_free(void)
+{
+    uint32_t retmin;
+
+    gssntlm_release_cred(&retmin, &cli_cred);
+    gssntlm_release_cred(&retmin, &pw_cred);
+    gssntlm_release_cred(&retmin, &srv_cred);
+    gssntlm_release_name(&retmin, &srv_name);
+}
+
+static int handshake_ex(gss_cred_id_t cred, uint32_t req_flags,
+                        gss_channel_bindings_t cbt,
+                        gss_ctx_id_t *cli_ctx, gss_ctx_id_t *srv_ctx)
+{
+    gss_buffer_desc cli_token = { 0 };
+    gss_buffer_desc srv_token = { 0 };
+    uint32_t retmaj, retmin;
+    int ret = EINVAL;
+
+    /* in connectionless mode the acceptor speaks first */
+    if (!(req_flags & GSS_C_DATAGRAM_FLAG)) {
+        retmaj = gssntlm_init_sec_context(&retmin, cred, cli_ctx,
+                                          srv_name, GSS_C_NO_OID,
+                                          req_flags, 0, cbt,
+                                          GSS_C_NO_BUFFER, NULL, &cli_token,
+                                          NULL, NULL);
+        if (retmaj != GSS_S_CONTINUE_NEEDED) {
+            print_gss_error("init_sec_context 1 failed", retmaj, retmin);
+            goto done;
+        }
+    }
+
+    retmaj = gssntlm_accept_sec_context(&retmin, srv_ctx, srv_cred,
+                                        &cli_token, cbt,
+                                        NULL, NULL, &srv_token,
+                                        NULL, NULL, NULL);
+    if (retmaj != GSS_S_CONTINUE_NEEDED) {
+        print_gss_error("accept_sec_context 1 failed", retmaj, retmin);
+        goto done;
+    }
+    gss_release_buffer(&retmin, &cli_token);
+
+    retmaj = gssntlm_init_sec_context(&retmin, cred, cli_ctx,
+                                      srv_name, GSS_C_NO_OID,
+                                      req_flags, 0, cbt,
+                                      &srv_token, NULL, &cli_token,
+                                      NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("init_sec_context 2 failed", retmaj, retmin);
+        goto done;
+    }
+    gss_release_buffer(&retmin, &srv_token);
+
+    retmaj = gssntlm_accept_sec_context(&retmin, srv_ctx, srv_cred,
+                                        &cli_token, cbt,
+                                        NULL, NULL, &srv_token,
+                                        NULL, NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("accept_sec_context 2 failed", retmaj, retmin);
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    gss_release_buffer(&retmin, &cli_token);
+    gss_release_buffer(&retmin, &srv_token);
+    return ret;
+}
+
+static int handshake(bool datagram,
+                     gss_ctx_id_t *cli_ctx, gss_ctx_id_t *srv_ctx)
+{
+    uint32_t req_flags = GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG;
+
+    if (datagram) req_flags |= GSS_C_DATAGRAM_FLAG;
+    return handshake_ex(cli_cred, req_flags, GSS_C_NO_CHANNEL_BINDINGS,
+                        cli_ctx, srv_ctx);
+}
+
+static int run_handshake(struct bench_case *bc, uint64_t ops)
+{
+    gss_ctx_id_t cli_ctx;
+    gss_ctx_id_t srv_ctx;
+    uint32_t retmin;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        cli_ctx = GSS_C_NO_CONTEXT;
+        srv_ctx = GSS_C_NO_CONTEXT;
+        ret = handshake(bc->datagram, &cli_ctx, &srv_ctx);
+        gssntlm_delete_sec_context(&retmin, &cli_ctx, GSS_C_NO_BUFFER);
+        gssntlm_delete_sec_context(&retmin, &srv_ctx, GSS_C_NO_BUFFER);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+struct gss_priv {
+    gss_ctx_id_t cli_ctx;
+    gss_ctx_id_t srv_ctx;
+    gss_buffer_desc message;
+    gss_buffer_desc *tokens;
+    uint64_t num_tokens;
+};
+
+static int gss_setup(struct bench_case *bc)
+{
+    struct gss_priv *p;
+
+    p = calloc(1, sizeof(struct gss_priv));
+    if (!p) return ENOMEM;
+    bc->priv = p;
+
+    p->message.length = bc->size;
+    p->message.value = malloc(bc->size);
+    if (!p->message.value) return ENOMEM;
+    fill_pattern(p->message.value, bc->size, 17);
+
+    return handshake(bc->datagram, &p->cli_ctx, &p->srv_ctx);
+}
+
+static void gss_free_tokens(struct gss_priv *p)
+{
+    uint32_t retmin;
+    uint64_t i;
+
+    for (i = 0; i < p->num_tokens; i++) {
+        gss_release_buffer(&retmin, &p->tokens[i]);
+    }
+    p->num_tokens = 0;
+}
+
+static void gss_teardown(struct bench_case *bc)
+{
+    struct gss_priv *p = bc->priv;
+    uint32_t retmin;
+
+    if (!p) return;
+    gss_free_tokens(p);
+    free(p->tokens);
+    free(p->message.value);
+    gssntlm_delete_sec_context(&retmin, &p->cli_ctx, GSS_C_NO_BUFFER);
+    gssntlm_delete_sec_context(&retmin, &p->srv_ctx, GSS_C_NO_BUFFER);
+    safefree(bc->priv);
+}
+
+static int run_get_mic(struct bench_case *bc, uint64_t ops)
+{
+    struct gss_priv *p = bc->priv;
+    gss_buffer_desc token;
+    uint32_t retmaj, retmin;
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        retmaj = gssntlm_get_mic(&retmin, p->cli_ctx, GSS_C_QOP_DEFAULT,
+                                 &p->message, &token);
+        if (retmaj) {
+            print_gss_error("gssntlm_get_mic failed", retmaj, retmin);
+            return EINVAL;
+        }
+        gss_release_buffer(&retmin, &token);
+    }
+    return 0;
+}
+
+static int run_wrap(struct bench_case *bc, uint64_t ops)
+{
+    struct gss_priv *p = bc->priv;
+    gss_buffer_desc token;
+    uint32_t retmaj, retmin;
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        retmaj = gssntlm_wrap(&retmin, p->cli_ctx, 1, GSS_C_QOP_DEFAULT,
+                              &p->message, NULL, &token);
+        if (retmaj) {
+            print_gss_error("gssntlm_wrap failed", retmaj, retmin);
+            return EINVAL;
+        }
+        gss_release_buffer(&retmin, &token);
+    }
+    return 0;
+}
+
+static int prepare_unwrap(struct bench_case *bc, uint64_t ops)
+{
+    struct gss_priv *p = bc->priv;
+    gss_buffer_desc *tokens;
+    uint32_t retmaj, retmin;
+
+    gss_free_tokens(p);
+    tokens = realloc(p->tokens, ops * sizeof(gss_buffer_desc));
+    if (!tokens) return ENOMEM;
+    p->tokens = tokens;
+
+    /* in stream mode tokens must be unwrapped in the order they were
+     * produced, which is how run_unwrap() consumes them */
+    for (p->num_tokens = 0; p->num_tokens < ops; p->num_tokens++) {
+        retmaj = gssntlm_wrap(&retmin, p->cli_ctx, 1, GSS_C_QOP_DEFAULT,
+                              &p->message, NULL, &tokens[p->num_tokens]);
+        if (retmaj) {
+            print_gss_error("gssntlm_wrap failed", retmaj, retmin);
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int prepare_wrap_prefetched(struct bench_case *bc, uint64_t ops)
+{
+    struct gss_priv *p = bc->priv;
+    gss_OID_desc prefetch_oid = {
+        GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_STRING)
+    };
+    /* the checksum in the signature is sealed with the same keystream */
+    uint32_t length = ops * (p->message.length + 8);
+    gss_buffer_desc value = { sizeof(length), &length };
+    uint32_t retmaj, retmin;
+
+    retmaj = gssntlm_set_sec_context_option(&retmin, &p->cli_ctx,
+                                            &prefetch_oid, &value);
+    if (retmaj) {
+        print_gss_error("gssntlm_set_sec_context_option failed",
+                        retmaj, retmin);
+        return EINVAL;
+    }
+    return 0;
+}
+
+static int run_unwrap(struct bench_case *bc, uint64_t ops)
+{
+    struct gss_priv *p = bc->priv;
+    gss_buffer_desc output;
+    uint32_t retmaj, retmin;
+    uint64_t i;
+
+    for (i = 0; i < ops; i++) {
+        retmaj = gssntlm_unwrap(&retmin, p->srv_ctx, &p->tokens[i],
+                                &output, NULL, NULL);
+        if (retmaj) {
+            print_gss_error("gssntlm_unwrap failed", retmaj, retmin);
+            return EINVAL;
+        }
+        gss_release_buffer(&retmin, &output);
+    }
+    return 0;
+}
+
+/* hands an established acceptor context over and back, as a server that
+ * passes connections between processes would */
+static int export_import(struct gss_priv *p, bool inquire)
+{
+    gss_buffer_desc token;
+    gss_name_t src_name;
+    uint32_t retmaj, retmin;
+
+    retmaj = gssntlm_export_sec_context(&retmin, &p->srv_ctx, &token);
+    if (retmaj) {
+        print_gss_error("gssntlm_export_sec_context failed", retmaj, retmin);
+        return EINVAL;
+    }
+    retmaj = gssntlm_import_sec_context(&retmin, &token, &p->srv_ctx);
+    gss_release_buffer(&retmin, &token);
+    if (retmaj) {
+        print_gss_error("gssntlm_import_sec_context failed", retmaj, retmin);
+        return EINVAL;
+    }
+    if (inquire) {
+        retmaj = gssntlm_inquire_context(&retmin, p->srv_ctx, &src_name,
+                                         NULL, NULL, NULL, NULL, NULL, NULL);
+        if (retmaj) {
+            print_gss_error("gssntlm_inquire_context failed", retmaj, retmin);
+            return EINVAL;
+        }
+        gssntlm_release_name(&retmin, &src_name);
+    }
+    return 0;
+}
+
+static int run_export_import(struct bench_case *bc, uint64_t ops)
+{
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = export_import(bc->priv, false);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int run_export_import_inquire(struct bench_case *bc, uint64_t ops)
+{
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < ops; i++) {
+        ret = export_import(bc->priv, true);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+static int add_gss_cases(struct bench_list *list)
+{
+    static const struct {
+        const char *name;
+        bool datagram;
+    } handshakes[] = {
+        { "gss/handshake", false },
+        { "gss/handshake_datagram", true },
+    };
+    static const struct {
+        const char *name;
+        int (*run)(struct bench_case *bc, uint64_t ops);
+    } transfers[] = {
+        { "gss/export_import", run_export_import },
+        { "gss/export_import_inquire", run_export_import_inquire },
+    };
+    static const struct {
+        const char *name;
+        int (*prepare)(struct bench_case *bc, uint64_t ops);
+        int (*run)(struct bench_case *bc, uint64_t ops);
+    } calls[] = {
+        { "get_mic", NULL, run_get_mic },
+        { "wrap", NULL, run_wrap },
+        { "unwrap", prepare_unwrap, run_unwrap },
+    };
+    struct bench_case *bc;
+    char name[64];
+    size_t i, j, k;
+
+    for (i = 0; i < sizeof(handshakes) / sizeof(handshakes[0]); i++) {
+        bc = bench_add(list, handshakes[i].name, 0);
+        if (!bc) return ENOMEM;
+        bc->datagram = handshakes[i].datagram;
+        bc->run = run_handshake;
+    }
+
+    for (i = 0; i < sizeof(transfers) / sizeof(transfers[0]); i++) {
+        bc = bench_add(list, transfers[i].name, 0);
+        if (!bc) return ENOMEM;
+        bc->setup = gss_setup;
+        bc->run = transfers[i].run;
+        bc->teardown = gss_teardown;
+    }
+
+    /* stream mode only, datagram contexts rekey for every message */
+    for (k = 0; k < sizeof(gss_msg_sizes) / sizeof(size_t); k++) {
+        if (gss_msg_sizes[k] + 8 > RC4_PREFETCH_MAX) continue;
+        bc = bench_add(list, "gss/wrap_prefetched", gss_msg_sizes[k]);
+        if (!bc) return ENOMEM;
+        bc->setup = gss_setup;
+        bc->prepare = prepare_wrap_prefetched;
+        bc->run = run_wrap;
+        bc->teardown = gss_teardown;
+        bc->max_batch = RC4_PREFETCH_MAX / (gss_msg_sizes[k] + 8);
+    }
+
+    for (i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+        for (j = 0; j < 2; j++) {
+            snprintf(name, sizeof(name), "gss/%s%s",
+                     calls[i].name, j ? "_datagram" : "");
+            for (k = 0; k < sizeof(gss_msg_sizes) / sizeof(size_t); k++) {
+                bc = bench_add(list, name, gss_msg_sizes[k]);
+                if (!bc) return ENOMEM;
+                bc->datagram = (j != 0);
+                bc->setup = gss_setup;
+                bc->prepare = calls[i].prepare;
+                bc->run = calls[i].run;
+                bc->teardown = gss_teardown;
+                if (calls[i].prepare) {
+                    bc->max_batch = BENCH_MAX_PREPARED / bc->size;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* ==== runner and output ==== */
+
+static int bench_run(struct bench_case *bc, double min_time,
+                     struct bench_result *res)
+{
+    uint64_t min_ns = min_time * 1000000000.0;
+    uint64_t total_ns = 0;
+    uint64_t total_ops = 0;
+    uint64_t batch = 1;
+    uint64_t start;
+    uint64_t elapsed;
+    int ret = 0;
+
+    if (bc->setup) {
+        ret = bc->setup(bc);
+        if (ret) goto done;
+    }
+
+    /* one untimed run to warm up caches and lazy initializations */
+    if (bc->prepare) {
+        ret = bc->prepare(bc, 1);
+        if (ret) goto done;
+    }
+    ret = bc->run(bc, 1);
+    if (ret) goto done;
+
+    while (total_ns < min_ns) {
+        if (bc->max_batch && batch > bc->max_batch) {
+            batch = bc->max_batch;
+        }
+        if (bc->prepare) {
+            ret = bc->prepare(bc, batch);
+            if (ret) goto done;
+        }
+
+        start = now_ns();
+        ret = bc->run(bc, batch);
+        elapsed = now_ns() - start;
+        if (ret) goto done;
+
+        total_ns += elapsed;
+        total_ops += batch;
+
+        /* aim to finish with the next run, but never grow more than 10x
+         * at a time so that slow cases do not overshoot too much */
+        if (total_ns < min_ns) {
+            uint64_t next;
+            if (elapsed == 0) {
+                next = batch * 10;
+            } else {
+                next = (double)(min_ns - total_ns) * batch / elapsed + 1;
+                if (next > batch * 10) next = batch * 10;
+            }
+            batch = next;
+        }
+    }
+
+    res->ops = total_ops;
+    res->seconds = total_ns / 1000000000.0;
+
+done:
+    if (bc->teardown) bc->teardown(bc);
+    return ret;
+}
+
+static void print_header(FILE *out, enum bench_format format,
+                         double min_time)
+{
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "{\n  \"min_time\": %g,\n  \"results\": [", min_time);
+        break;
+    case BENCH_CSV:
+        fprintf(out, "name,size,ops,seconds,ns_per_op,ops_per_sec,"
+                     "bytes_per_sec\n");
+        break;
+    }
+}
+
+static void print_result(FILE *out, enum bench_format format, bool first,
+                         struct bench_case *bc, struct bench_result *res)
+{
+    double ns_per_op = res->seconds * 1000000000.0 / res->ops;
+    double ops_per_sec = res->ops / res->seconds;
+    double bytes_per_sec = ops_per_sec * bc->size;
+
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "%s\n    { \"name\": \"%s\", \"size\": %zu, "
+                     "\"ops\": %" PRIu64 ", \"seconds\": %.6f, "
+                     "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, "
+                     "\"bytes_per_sec\": %.1f }",
+                first ? "" : ",", bc->name, bc->size, res->ops,
+                res->seconds, ns_per_op, ops_per_sec, bytes_per_sec);
+        break;
+    case BENCH_CSV:
+        fprintf(out, "%s,%zu,%" PRIu64 ",%.6f,%.1f,%.1f,%.1f\n",
+                bc->name, bc->size, res->ops, res->seconds,
+                ns_per_op, ops_per_sec, bytes_per_sec);
+        break;
+    }
+    fflush(out);
+}
+
+static void print_footer(FILE *out, enum bench_format format)
+{
+    if (format == BENCH_JSON) {
+        fprintf(out, "\n  ]\n}\n");
+    }
+}
+
+/* ==== multi-threaded handshake load ==== */
+
+enum load_creds {
+    LOAD_CREDS_FILE,
+    LOAD_CREDS_PASSWORD,
+    LOAD_CREDS_MIX
+};
+
+static const char *load_creds_names[] = { "file", "password", "mix" };
+
+struct load_opts {
+    unsigned int threads[64];
+    size_t num_threads;
+    uint64_t iterations;    /* handshakes per thread */
+    enum load_creds creds;
+    int cbt;                /* 0 off, 1 on, 2 both */
+    int seal;               /* 0 off, 1 on, 2 both */
+};
+
+struct load_config {
+    unsigned int threads;
+    uint64_t iterations;
+    enum load_creds creds;
+    bool cbt;
+    bool seal;
+};
+
+struct load_result {
+    uint64_t handshakes;
+    double seconds;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+};
+
+/* payload sealed and unsealed after each handshake of a seal_on run */
+#define LOAD_SEAL_SIZE 1024
+
+struct load_thread {
+    pthread_t tid;
+    struct start_gate *gate;
+    struct load_config *cfg;
+    unsigned int id;
+    uint64_t *latencies;    /* ns, one per handshake */
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int ret;
+};
+
+static int load_seal_roundtrip(gss_ctx_id_t cli_ctx, gss_ctx_id_t srv_ctx,
+                               gss_buffer_t message)
+{
+    gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc output = GSS_C_EMPTY_BUFFER;
+    uint32_t retmaj, retmin;
+    int conf_state = 0;
+    int ret = 0;
+
+    retmaj = gssntlm_wrap(&retmin, cli_ctx, 1, GSS_C_QOP_DEFAULT,
+                          message, &conf_state, &token);
+    if (retmaj || !conf_state) {
+        print_gss_error("gssntlm_wrap failed", retmaj, retmin);
+        return EINVAL;
+    }
+    conf_state = 0;
+    retmaj = gssntlm_unwrap(&retmin, srv_ctx, &token, &output,
+                            &conf_state, NULL);
+    if (retmaj) {
+        print_gss_error("gssntlm_unwrap failed", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    if (!conf_state || output.length != message->length ||
+        memcmp(output.value, message->value, message->length) != 0) {
+        fprintf(stderr, "Unsealed payload does not match\n");
+        ret = EINVAL;
+    }
+
+done:
+    gss_release_buffer(&retmin, &token);
+    gss_release_buffer(&retmin, &output);
+    return ret;
+}
+
+static void *load_thread_main(void *arg)
+{
+    struct load_thread *t = arg;
+    struct load_config *cfg = t->cfg;
+    struct gss_channel_bindings_struct cbts = { 0 };
+    gss_channel_bindings_t cbt = GSS_C_NO_CHANNEL_BINDINGS;
+    uint8_t cb_data[32];
+    uint8_t payload[LOAD_SEAL_SIZE];
+    gss_buffer_desc message = { sizeof(payload), payload };
+    uint32_t req_flags;
+    gss_ctx_id_t cli_ctx;
+    gss_ctx_id_t srv_ctx;
+    gss_cred_id_t cred;
+    uint32_t retmin;
+    uint64_t start;
+    uint64_t i;
+
+    if (cfg->cbt) {
+        fill_pattern(cb_data, sizeof(cb_data), t->id);
+        cbts.application_data.value = cb_data;
+        cbts.application_data.length = sizeof(cb_data);
+        cbt = &cbts;
+    }
+    req_flags = GSS_C_INTEG_FLAG;
+    if (cfg->seal) req_flags |= GSS_C_CONF_FLAG;
+    fill_pattern(payload, sizeof(payload), t->id);
+
+    if (!start_gate_wait(t->gate)) return NULL;
+    t->start_ns = now_ns();
+
+    for (i = 0; i < cfg->iterations; i++) {
+        switch (cfg->creds) {
+        case LOAD_CREDS_FILE:
+            cred = cli_cred;
+            break;
+        case LOAD_CREDS_PASSWORD:
+            cred = pw_cred;
+            break;
+        default:
+            cred = ((i + t->id) & 1) ? pw_cred : cli_cred;
+            break;
+        }
+
+        cli_ctx = GSS_C_NO_CONTEXT;
+        srv_ctx = GSS_C_NO_CONTEXT;
+        start = now_ns();
+        t->ret = handshake_ex(cred, req_flags, cbt, &cli_ctx, &srv_ctx);
+        if (t->ret == 0 && cfg->seal) {
+            t->ret = load_seal_roundtrip(cli_ctx, srv_ctx, &message);
+        }
+        gssntlm_delete_sec_context(&retmin, &cli_ctx, GSS_C_NO_BUFFER);
+        gssntlm_delete_sec_context(&retmin, &srv_ctx, GSS_C_NO_BUFFER);
+        t->latencies[i] = now_ns() - start;
+        if (t->ret) break;
+    }
+    t->end_ns = now_ns();
+    return NULL;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t n, double p)
+{
+    uint64_t idx = p * n;
+
+    /* nearest rank: ceil(p * n) - 1 */
+    if (idx == p * n && idx > 0) idx--;
+    if (idx >= n) idx = n - 1;
+    return sorted[idx] / 1000.0;
+}
+
+static int load_run(struct load_config *cfg, struct load_result *res)
+{
+    struct load_thread *threads;
+    struct start_gate gate = START_GATE_INIT;
+    uint64_t *latencies;
+    uint64_t total;
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    unsigned int i;
+    unsigned int started = 0;
+    int ret = 0;
+
+    total = cfg->threads * cfg->iterations;
+    threads = calloc(cfg->threads, sizeof(struct load_thread));
+    latencies = calloc(total, sizeof(uint64_t));
+    if (!threads || !latencies) {
+        free(threads);
+        free(latencies);
+        return ENOMEM;
+    }
+
+    for (i = 0; i < cfg->threads; i++) {
+        threads[i].gate = &gate;
+        threads[i].cfg = cfg;
+        threads[i].id = i;
+        threads[i].latencies = &latencies[i * cfg->iterations];
+        ret = pthread_create(&threads[i].tid, NULL,
+                             load_thread_main, &threads[i]);
+        if (ret) break;
+        started++;
+    }
+    if (ret) {
+        /* release the ones already waiting without running them */
+        fprintf(stderr, "Failed to start load threads: %d\n", ret);
+        start_gate_open(&gate, false);
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i].tid, NULL);
+        }
+        goto done;
+    }
+
+    start_gate_open(&gate, true);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].ret) ret = threads[i].ret;
+        if (threads[i].start_ns < start) start = threads[i].start_ns;
+        if (threads[i].end_ns > end) end = threads[i].end_ns;
+    }
+    res->seconds = (end - start) / 1000000000.0;
+
+    if (ret == 0) {
+        qsort(latencies, total, sizeof(uint64_t), cmp_uint64);
+        res->handshakes = total;
+        res->p50_us = percentile_us(latencies, total, 0.50);
+        res->p99_us = percentile_us(latencies, total, 0.99);
+        res->p999_us = percentile_us(latencies, total, 0.999);
+    }
+
+done:
+    free(threads);
+    free(latencies);
+    return ret;
+}
+
+static void print_load_result(FILE *out, enum bench_format format,
+                              bool first, struct load_config *cfg,
+                              struct load_result *res, double scaling)
+{
+    double rate = res->handshakes / res->seconds;
+    char name[64];
+
+    snprintf(name, sizeof(name), "load/%s/cbt_%s/seal_%s/%u",
+             load_creds_names[cfg->creds], cfg->cbt ? "on" : "off",
+             cfg->seal ? "on" : "off", cfg->threads);
+
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "%s\n    { \"name\": \"%s\", \"threads\": %u, "
+                     "\"handshakes\": %" PRIu64 ", \"seconds\": %.6f, "
+                     "\"handshakes_per_sec\": %.1f, \"scaling\": %.3f, "
+                     "\"p50_us\": %.1f, \"p99_us\": %.1f, "
+                     "\"p999_us\": %.1f }",
+                first ? "" : ",", name, cfg->threads, res->handshakes,
+                res->seconds, rate, scaling,
+                res->p50_us, res->p99_us, res->p999_us);
+        break;
+    case BENCH_CSV:
+        fprintf(out, "%s,%u,%" PRIu64 ",%.6f,%.1f,%.3f,%.1f,%.1f,%.1f\n",
+                name, cfg->threads, res->handshakes, res->seconds, rate,
+                scaling, res->p50_us, res->p99_us, res->p999_us);
+        break;
+    }
+    fflush(out);
+}
+
+/* 'scaling' is the per-thread rate relative to the first thread count of
+ * the same configuration, 1.0 means the library scales linearly */
+static int load_mode(FILE *out, enum bench_format format,
+                     struct load_opts *opts)
+{
+    struct load_config cfg;
+    struct load_result res;
+    double base_rate = 0;
+    bool first = true;
+    int cbt, seal;
+    size_t i;
+    int ret;
+
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "{\n  \"iterations\": %" PRIu64 ",\n  \"results\": [",
+                opts->iterations);
+        break;
+    case BENCH_CSV:
+        fprintf(out, "name,threads,handshakes,seconds,handshakes_per_sec,"
+                     "scaling,p50_us,p99_us,p999_us\n");
+        break;
+    }
+
+    for (cbt = 0; cbt < 2; cbt++) {
+        if (opts->cbt != 2 && opts->cbt != cbt) continue;
+        for (seal = 0; seal < 2; seal++) {
+            if (opts->seal != 2 && opts->seal != seal) continue;
+            for (i = 0; i < opts->num_threads; i++) {
+                cfg.threads = opts->threads[i];
+                cfg.iterations = opts->iterations;
+                cfg.creds = opts->creds;
+                cfg.cbt = cbt;
+                cfg.seal = seal;
+
+                ret = load_run(&cfg, &res);
+                if (ret) {
+                    fprintf(stderr, "Load run failed: %d\n", ret);
+                    return ret;
+                }
+                if (i == 0) {
+                    base_rate = res.handshakes / res.seconds / cfg.threads;
+                }
+                print_load_result(out, format, first, &cfg, &res,
+                                  res.handshakes / res.seconds /
+                                      cfg.threads / base_rate);
+                first = false;
+            }
+        }
+    }
+
+    print_footer(out, format);
+    return 0;
+}
+
+static int parse_threads(const char *arg, struct load_opts *opts)
+{
+    const char *p = arg;
+    char *end;
+    long n;
+
+    opts->num_threads = 0;
+    while (*p) {
+        if (opts->num_threads == sizeof(opts->threads) / sizeof(unsigned)) {
+            return EINVAL;
+        }
+        n = strtol(p, &end, 10);
+        if (end == p || n < 1 || n > 4096) return EINVAL;
+        opts->threads[opts->num_threads++] = n;
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return EINVAL;
+    }
+    return opts->num_threads ? 0 : EINVAL;
+}
+
+static void default_threads(struct load_opts *opts)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n;
+
+    if (ncpu < 1) ncpu = 1;
+    opts->num_threads = 0;
+    for (n = 1; n < ncpu && opts->num_threads < 63; n *= 2) {
+        opts->threads[opts->num_threads++] = n;
+    }
+    opts->threads[opts->num_threads++] = ncpu;
+}
+
+static int parse_switch(const char *arg, int *value)
+{
+    if (strcmp(arg, "off") == 0) {
+        *value = 0;
+    } else if (strcmp(arg, "on") == 0) {
+        *value = 1;
+    } else if (strcmp(arg, "both") == 0) {
+        *value = 2;
+    } else {
+        return EINVAL;
+    }
+    return 0;
+}
+
+/* ==== memory held by idle contexts ==== */
+
+#ifdef HAVE_MALLINFO2
+static size_t heap_in_use(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;
+}
+
+/* Establishes 'count' contexts and keeps the client or the server side,
+ * optionally with the default amount of keystream prefetched, returns the
+ * growth of the heap while they are alive */
+static int idle_measure(bool keep_server, bool prefetch, uint64_t count,
+                        size_t *bytes)
+{
+    gss_OID_desc prefetch_oid = {
+        GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_STRING)
+    };
+    gss_ctx_id_t *kept;
+    gss_ctx_id_t cli_ctx;
+    gss_ctx_id_t srv_ctx;
+    uint32_t retmaj;
+    uint32_t retmin;
+    size_t before;
+    size_t after;
+    uint64_t i;
+    int ret = 0;
+
+    kept = calloc(count, sizeof(gss_ctx_id_t));
+    if (!kept) return ENOMEM;
+
+    /* fill the identity, key and object caches first */
+    for (i = 0; i < 32; i++) {
+        cli_ctx = GSS_C_NO_CONTEXT;
+        srv_ctx = GSS_C_NO_CONTEXT;
+        ret = handshake(false, &cli_ctx, &srv_ctx);
+        gssntlm_delete_sec_context(&retmin, &cli_ctx, GSS_C_NO_BUFFER);
+        gssntlm_delete_sec_context(&retmin, &srv_ctx, GSS_C_NO_BUFFER);
+        if (ret) goto done;
+    }
+
+    before = heap_in_use();
+    for (i = 0; i < count; i++) {
+        cli_ctx = GSS_C_NO_CONTEXT;
+        srv_ctx = GSS_C_NO_CONTEXT;
+        ret = handshake(false, &cli_ctx, &srv_ctx);
+        if (keep_server) {
+            kept[i] = srv_ctx;
+            gssntlm_delete_sec_context(&retmin, &cli_ctx, GSS_C_NO_BUFFER);
+        } else {
+            kept[i] = cli_ctx;
+            gssntlm_delete_sec_context(&retmin, &srv_ctx, GSS_C_NO_BUFFER);
+        }
+        if (ret) goto done;
+        if (prefetch) {
+            retmaj = gssntlm_set_sec_context_option(&retmin, &kept[i],
+                                                    &prefetch_oid,
+                                                    GSS_C_NO_BUFFER);
+            if (retmaj) {
+                print_gss_error("gssntlm_set_sec_context_option failed",
+                                retmaj, retmin);
+                ret = EINVAL;
+                goto done;
+            }
+        }
+    }
+    after = heap_in_use();
+    *bytes = after > before ? after - before : 0;
+
+done:
+    for (i = 0; i < count; i++) {
+        gssntlm_delete_sec_context(&retmin, &kept[i], GSS_C_NO_BUFFER);
+    }
+    free(kept);
+    return ret;
+}
+
+static int memory_mode(FILE *out, enum bench_format format, uint64_t count)
+{
+    static const struct {
+        const char *name;
+        bool keep_server;
+        bool prefetch;
+    } sides[] = {
+        { "idle/server", true, false },
+        { "idle/client", false, false },
+        { "idle/server_prefetched", true, true },
+        { "idle/client_prefetched", false, true },
+    };
+    size_t bytes = 0;
+    size_t i;
+    int ret;
+
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "{\n  \"results\": [");
+        break;
+    case BENCH_CSV:
+        fprintf(out, "name,contexts,bytes,bytes_per_context\n");
+        break;
+    }
+
+    for (i = 0; i < sizeof(sides) / sizeof(sides[0]); i++) {
+        ret = idle_measure(sides[i].keep_server, sides[i].prefetch,
+                           count, &bytes);
+        if (ret) {
+            fprintf(stderr, "Memory measurement failed: %d\n", ret);
+            return ret;
+        }
+        switch (format) {
+        case BENCH_JSON:
+            fprintf(out, "%s\n    { \"name\": \"%s\", \"contexts\": %" PRIu64
+                         ", \"bytes\": %zu, \"bytes_per_context\": %.1f }",
+                    i ? "," : "", sides[i].name, count, bytes,
+                    (double)bytes / count);
+            break;
+        case BENCH_CSV:
+            fprintf(out, "%s,%" PRIu64 ",%zu,%.1f\n", sides[i].name, count,
+                    bytes, (double)bytes / count);
+            break;
+        }
+    }
+
+    print_footer(out, format);
+    return 0;
+}
+#else
+static int memory_mode(FILE *out, enum bench_format format, uint64_t count)
+{
+    fprintf(stderr, "Memory measurements need mallinfo2()\n");
+    return ENOTSUP;
+}
+#endif /* HAVE_MALLINFO2 */
+
+/* ==== concurrent random draws ==== */
+
+/* Compares RAND_BUFFER() with calling RAND_bytes() directly for the small
+ * sizes a handshake needs, alternating 8 byte challenges and 16 byte keys */
+
+struct rand_thread {
+    pthread_t tid;
+    struct start_gate *gate;
+    bool direct;
+    uint64_t draws;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int ret;
+};
+
+static void *rand_thread_main(void *arg)
+{
+    struct rand_thread *t = arg;
+    uint8_t data[16];
+    struct ntlm_buffer buf = { data, 0 };
+    uint64_t i;
+
+    if (!start_gate_wait(t->gate)) return NULL;
+    t->start_ns = now_ns();
+    for (i = 0; i < t->draws; i++) {
+        buf.length = (i & 1) ? 16 : 8;
+        if (t->direct) {
+            if (RAND_bytes(buf.data, buf.length) != 1) t->ret = ERR_CRYPTO;
+        } else {
+            t->ret = RAND_BUFFER(&buf);
+        }
+        if (t->ret) break;
+    }
+    t->end_ns = now_ns();
+    return NULL;
+}
+
+static int rand_run(bool direct, unsigned int nthreads, uint64_t draws,
+                    double *seconds)
+{
+    struct rand_thread *threads;
+    struct start_gate gate = START_GATE_INIT;
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    unsigned int i;
+    unsigned int started = 0;
+    int ret = 0;
+
+    threads = calloc(nthreads, sizeof(struct rand_thread));
+    if (!threads) return ENOMEM;
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].gate = &gate;
+        threads[i].direct = direct;
+        threads[i].draws = draws;
+        ret = pthread_create(&threads[i].tid, NULL,
+                             rand_thread_main, &threads[i]);
+        if (ret) break;
+        started++;
+    }
+    if (ret) {
+        fprintf(stderr, "Failed to start threads: %d\n", ret);
+        start_gate_open(&gate, false);
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i].tid, NULL);
+        }
+        goto done;
+    }
+
+    start_gate_open(&gate, true);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].ret) ret = threads[i].ret;
+        if (threads[i].start_ns < start) start = threads[i].start_ns;
+        if (threads[i].end_ns > end) end = threads[i].end_ns;
+    }
+    *seconds = (end - start) / 1000000000.0;
+
+done:
+    free(threads);
+    return ret;
+}
+
+static int rand_mode(FILE *out, enum bench_format format,
+                     struct load_opts *opts, uint64_t draws)
+{
+    static const struct {
+        const char *name;
+        bool direct;
+    } paths[] = {
+        { "rand/RAND_bytes", true },
+        { "rand/RAND_BUFFER", false },
+    };
+    double base_rate = 0;
+    double seconds;
+    double rate;
+    bool first = true;
+    size_t p, i;
+    int ret;
+
+    switch (format) {
+    case BENCH_JSON:
+        fprintf(out, "{\n  \"draws\": %" PRIu64 ",\n  \"results\": [",
+                draws);
+        break;
+    case BENCH_CSV:
+        fprintf(out, "name,threads,draws,seconds,draws_per_sec,scaling\n");
+        break;
+    }
+
+    for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+        for (i = 0; i < opts->num_threads; i++) {
+            ret = rand_run(paths[p].direct, opts->threads[i], draws,
+                           &seconds);
+            if (ret) {
+                fprintf(stderr, "Random draws failed: %d\n", ret);
+                return ret;
+            }
+            rate = draws * opts->threads[i] / seconds;
+            if (i == 0) base_rate = rate / opts->threads[i];
+
+            switch (format) {
+            case BENCH_JSON:
+                fprintf(out, "%s\n    { \"name\": \"%s/%u\", "
+                             "\"threads\": %u, \"draws\": %" PRIu64 ", "
+                             "\"seconds\": %.6f, \"draws_per_sec\": %.1f, "
+                             "\"scaling\": %.3f }",
+                        first ? "" : ",", paths[p].name, opts->threads[i],
+                        opts->threads[i], draws * opts->threads[i], seconds,
+                        rate, rate / opts->threads[i] / base_rate);
+                break;
+            case BENCH_CSV:
+                fprintf(out, "%s/%u,%u,%" PRIu64 ",%.6f,%.1f,%.3f\n",
+                        paths[p].name, opts->threads[i], opts->threads[i],
+                        draws * opts->threads[i], seconds, rate,
+                        rate / opts->threads[i] / base_rate);
+                break;
+            }
+            fflush(out);
+            first = false;
+        }
+    }
+
+    print_footer(out, format);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-f json|csv] [-t seconds] [-o file] [-l] "
+            "[filter ...]\n"
+            "       %s -L [-f json|csv] [-o file] [-T threads] "
+            "[-n iterations]\n"
+            "          [-c file|password|mix] [-C on|off|both] "
+            "[-S on|off|both]\n"
+            "       %s -M [-f json|csv] [-o file] [-n contexts]\n"
+            "       %s -R [-f json|csv] [-o file] [-T threads] [-n draws]\n"
+            "  -f   output format (default json)\n"
+            "  -t   minimum time spent in each case (default 0.5)\n"
+            "  -o   write results to file instead of stdout\n"
+            "  -l   list the available cases and exit\n"
+            "  Only cases whose name contains one of the filters are run.\n"
+            "  -L   run concurrent handshakes and report latency percentiles\n"
+            "  -T   comma separated thread counts (default 1,2,4,... ncpu)\n"
+            "  -n   handshakes per thread (default 1000)\n"
+            "  -c   client credentials to use (default mix)\n"
+            "  -C   channel bindings (default both)\n"
+            "  -S   wrap and unwrap a sealed 1 KiB message per handshake "
+            "(default both)\n"
+            "  -M   report the heap used by established, idle contexts\n"
+            "  -n   with -M, the number of contexts to keep "
+            "(default 1000)\n"
+            "  -R   draw small random buffers concurrently, through "
+            "RAND_BUFFER()\n"
+            "       and directly from RAND_bytes()\n"
+            "  -n   with -R, draws per thread (default 1000000)\n",
+            name, name, name, name);
+}
+
+static bool bench_selected(const char *name, int nfilters, char **filters)
+{
+    int i;
+
+    if (nfilters == 0) return true;
+    for (i = 0; i < nfilters; i++) {
+        if (strstr(name, filters[i])) return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    enum bench_format format = BENCH_JSON;
+    struct load_opts load = { .iterations = 1000, .creds = LOAD_CREDS_MIX,
+                              .cbt = 2, .seal = 2 };
+    struct bench_list list = { 0 };
+    struct bench_result res;
+    const char *outfile = NULL;
+    double min_time = 0.5;
+    bool list_only = false;
+    bool load_only = false;
+    bool memory_only = false;
+    bool rand_only = false;
+    bool iterations_set = false;
+    bool first = true;
+    FILE *out = stdout;
+    int failed = 0;
+    size_t i;
+    int opt;
+    int ret;
+
+    default_threads(&load);
+
+    while ((opt = getopt(argc, argv, "f:t:o:lLMRT:n:c:C:S:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = BENCH_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = BENCH_CSV;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            min_time = strtod(optarg, NULL);
+            if (min_time <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'l':
+            list_only = true;
+            break;
+        case 'L':
+            load_only = true;
+            break;
+        case 'M':
+            memory_only = true;
+            break;
+        case 'R':
+            rand_only = true;
+            break;
+        case 'T':
+            if (parse_threads(optarg, &load)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            load.iterations = strtoull(optarg, NULL, 10);
+            if (load.iterations == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            iterations_set = true;
+            break;
+        case 'c':
+            for (i = 0; i < 3; i++) {
+                if (strcmp(optarg, load_creds_names[i]) == 0) break;
+            }
+            if (i == 3) {
+                usage(argv[0]);
+                return 1;
+            }
+            load.creds = i;
+            break;
+        case 'C':
+            if (parse_switch(optarg, &load.cbt)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'S':
+            if (parse_switch(optarg, &load.seal)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    ret = add_crypto_cases(&list);
+    if (ret == 0) ret = add_message_cases(&list);
+    if (ret == 0) ret = add_gss_cases(&list);
+    if (ret == 0) ret = add_userfile_cases(&list);
+    if (ret) {
+        fprintf(stderr, "Failed to register benchmarks: %d\n", ret);
+        return 1;
+    }
+
+    if (list_only) {
+        for (i = 0; i < list.num; i++) {
+            printf("%s\n", list.cases[i].name);
+        }
+        free(list.cases);
+        return 0;
+    }
+
+    ret = gss_bench_init();
+    if (ret) {
+        fprintf(stderr, "Failed to acquire the benchmark credentials\n");
+        return 1;
+    }
+
+    if (outfile) {
+        out = fopen(outfile, "w");
+        if (!out) {
+            fprintf(stderr, "Failed to open %s: %s\n",
+                    outfile, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (load_only || memory_only || rand_only) {
+        if (load_only) {
+            ret = load_mode(out, format, &load);
+        } else if (memory_only) {
+            ret = memory_mode(out, format, load.iterations);
+        } else {
+            ret = rand_mode(out, format, &load,
+                            iterations_set ? load.iterations : 1000000);
+        }
+        if (outfile) fclose(out);
+        gss_bench_free();
+        free(list.cases);
+        return ret ? 1 : 0;
+    }
+
+    print_header(out, format, min_time);
+    for (i = 0; i < list.num; i++) {
+        struct bench_case *bc = &list.cases[i];
+
+        if (!bench_selected(bc->name, argc - optind, &argv[optind])) {
+            continue;
+        }
+
+        ret = bench_run(bc, min_time, &res);
+        if (ret) {
+            fprintf(stderr, "Benchmark %s failed: %d\n", bc->name, ret);
+            failed++;
+            continue;
+        }
+        print_result(out, format, first, bc, &res);
+        first = false;
+    }
+    print_footer(out, format);
+
+    if (outfile) fclose(out);
+    gss_bench_free();
+    free(list.cases);
+    return failed ? 1 : 0;
+}
@@ -2,15 +2,24 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <openssl/crypto.h>
 
 #include "config.h"
 
 #include "../src/gssapi_ntlmssp.h"
 #include "../src/gss_ntlmssp.h"
+#include "../src/crypto_builtin.h"
+#include "../src/unicode.h"
 
 const char *hex_to_dump(const uint8_t *d, size_t s)
 {
@@ -1338,6 +1347,97 @@ done:
     return ret;
 }
 
+/* counts every allocation made through the OpenSSL allocator, the hooks
+ * are installed at the very start of main() */
+static bool crypto_mem_hooked;
+static size_t crypto_mem_allocs;
+
+static void *count_malloc(size_t num, const char *file, int line)
+{
+    crypto_mem_allocs++;
+    return malloc(num);
+}
+
+static void *count_realloc(void *addr, size_t num, const char *file, int line)
+{
+    crypto_mem_allocs++;
+    return realloc(addr, num);
+}
+
+static void count_free(void *addr, const char *file, int line)
+{
+    free(addr);
+}
+
+int test_sign_no_alloc(struct ntlm_ctx *ctx, struct t_gsswrapex_data *data)
+{
+    struct ntlm_signseal_state state;
+    struct ntlm_hmac_handle *handle = NULL;
+    uint8_t keybuf[100];
+    struct ntlm_buffer key = { keybuf, 0 };
+    uint8_t msgbuf[300];
+    struct ntlm_buffer message = { msgbuf, sizeof(msgbuf) };
+    struct ntlm_buffer *data_iov[1] = { &message };
+    struct ntlm_iov iov = { data_iov, 1 };
+    uint8_t exp_buf[16];
+    struct ntlm_buffer expected = { exp_buf, 16 };
+    uint8_t res_buf[16];
+    struct ntlm_buffer result = { res_buf, 16 };
+    uint8_t outbuf[sizeof(msgbuf)];
+    struct ntlm_buffer output = { outbuf, sizeof(outbuf) };
+    uint8_t signbuf[16];
+    struct ntlm_buffer signature = { signbuf, 16 };
+    size_t allocs;
+    int ret;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+
+    for (i = 0; i < sizeof(msgbuf); i++) msgbuf[i] = i;
+    for (i = 0; i < sizeof(keybuf); i++) keybuf[i] = 0xff - i;
+
+    /* pre-keyed results must match the one shot HMAC, both with a regular
+     * 16 byte key and with a key longer than the MD5 block */
+    for (key.length = 16; key.length <= sizeof(keybuf); key.length += 84) {
+        ret = HMAC_MD5(&key, &message, &expected);
+        if (ret) goto done;
+        ret = HMAC_MD5_INIT(&key, &handle);
+        if (ret) goto done;
+        ret = HMAC_MD5_KEYED_IOV(handle, &iov, &result);
+        HMAC_MD5_FREE(&handle);
+        if (ret) goto done;
+        ret = test_buffers("Pre-keyed HMAC-MD5", &expected, &result);
+        if (ret) goto done;
+    }
+
+    if (!crypto_mem_hooked) {
+        fprintf(stderr, "Failed to hook the OpenSSL allocator\n");
+        ret = EFAULT;
+        goto done;
+    }
+
+    ret = ntlm_signseal_keys(data->flags, true,
+                             &data->KeyExchangeKey, &state);
+    if (ret) goto done;
+
+    allocs = crypto_mem_allocs;
+    for (i = 0; i < 1000; i++) {
+        ret = ntlm_sign(data->flags, NTLM_SEND, &state, &message, &signature);
+        if (ret) goto done;
+        ret = ntlm_seal(data->flags, &state, &message, &output, &signature);
+        if (ret) goto done;
+    }
+    if (crypto_mem_allocs != allocs) {
+        fprintf(stderr, "Signing performed %zu allocations\n",
+                crypto_mem_allocs - allocs);
+        ret = EINVAL;
+    }
+
+done:
+    ntlm_release_rc4_state(&state);
+    return ret;
+}
+
 #define TEST_USER_FILE "examples/test_user_file.txt"
 
 long seed = 0;
@@ -1450,6 +1550,186 @@ static void print_gss_error(const char *text, uint32_t maj, uint32_t min)
     fflush(stderr);
 }
 
+/* Seals with the IOV interface over caller owned buffers, and checks the
+ * result interoperates both with unwrap_iov and with the plain unwrap */
+int test_gssapi_iov(gss_ctx_id_t send_ctx, gss_ctx_id_t recv_ctx,
+                    gss_buffer_t message)
+{
+    uint8_t header[32];
+    uint8_t assoc[] = "associated data";
+    uint8_t data[message->length];
+    size_t half = message->length / 2;
+    gss_iov_buffer_desc iov[6];
+    gss_iov_buffer_desc *many = NULL;
+    gss_buffer_desc token = { 0 };
+    gss_buffer_desc output = { 0 };
+    uint32_t retmaj, retmin;
+    int conf_state;
+    int ret = 0;
+
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[0].buffer.value = header;
+    iov[0].buffer.length = sizeof(header);
+    iov[1].type = GSS_IOV_BUFFER_TYPE_SIGN_ONLY;
+    iov[1].buffer.value = assoc;
+    iov[1].buffer.length = sizeof(assoc);
+    iov[2].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[2].buffer.value = data;
+    iov[2].buffer.length = half;
+    iov[3].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[3].buffer.value = data + half;
+    iov[3].buffer.length = message->length - half;
+    iov[4].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    iov[4].buffer.value = NULL;
+    iov[4].buffer.length = 8;
+    iov[5].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    iov[5].buffer.value = NULL;
+    iov[5].buffer.length = 8;
+
+    retmaj = gssntlm_wrap_iov_length(&retmin, send_ctx, 1, 0,
+                                     &conf_state, iov, 6);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_wrap_iov_length failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    if (iov[0].buffer.length != 16 || iov[4].buffer.length != 0 ||
+        iov[5].buffer.length != 0 || conf_state == 0) {
+        fprintf(stderr, "gssntlm_wrap_iov_length returned bad lengths\n");
+        return EINVAL;
+    }
+
+    /* scatter/gather round trip, sealed in place */
+    memcpy(data, message->value, message->length);
+    retmaj = gssntlm_wrap_iov(&retmin, send_ctx, 1, 0, &conf_state, iov, 6);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_wrap_iov failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    if (conf_state == 0 ||
+        memcmp(data, message->value, message->length) == 0) {
+        fprintf(stderr, "gssntlm_wrap_iov did not seal the data\n");
+        return EINVAL;
+    }
+    retmaj = gssntlm_unwrap_iov(&retmin, recv_ctx, &conf_state, NULL, iov, 6);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_unwrap_iov failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    if (memcmp(data, message->value, message->length) != 0) {
+        fprintf(stderr, "gssntlm_unwrap_iov returned the wrong data\n");
+        return EINVAL;
+    }
+
+    /* IOV sealing must produce the same token as gssntlm_wrap */
+    memcpy(data, message->value, message->length);
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.value = data;
+    iov[1].buffer.length = message->length;
+    retmaj = gssntlm_wrap_iov(&retmin, send_ctx, 1, 0, NULL, iov, 2);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_wrap_iov failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    token.length = 16 + message->length;
+    token.value = malloc(token.length);
+    if (!token.value) return ENOMEM;
+    memcpy(token.value, header, 16);
+    memcpy((uint8_t *)token.value + 16, data, message->length);
+    retmaj = gssntlm_unwrap(&retmin, recv_ctx, &token, &output, NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_unwrap of an IOV token failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    if (output.length != message->length ||
+        memcmp(output.value, message->value, message->length) != 0) {
+        fprintf(stderr, "gssntlm_unwrap of an IOV token gave wrong data\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gss_release_buffer(&retmin, &token);
+    gss_release_buffer(&retmin, &output);
+
+    /* and a gssntlm_wrap token must be accepted by gssntlm_unwrap_iov */
+    retmaj = gssntlm_wrap(&retmin, send_ctx, 1, 0, message, NULL, &token);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_wrap failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    iov[0].buffer.value = token.value;
+    iov[0].buffer.length = 16;
+    iov[1].buffer.value = (uint8_t *)token.value + 16;
+    iov[1].buffer.length = token.length - 16;
+    retmaj = gssntlm_unwrap_iov(&retmin, recv_ctx, NULL, NULL, iov, 2);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_unwrap_iov of a wrap token failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    if (memcmp(iov[1].buffer.value, message->value, message->length) != 0) {
+        fprintf(stderr, "gssntlm_unwrap_iov of a wrap token gave wrong data\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gss_release_buffer(&retmin, &token);
+
+    /* tampering with a sign-only buffer must be detected */
+    memcpy(data, message->value, message->length);
+    iov[0].buffer.value = NULL;
+    iov[0].buffer.length = 0;
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER | GSS_IOV_BUFFER_FLAG_ALLOCATE;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_SIGN_ONLY;
+    iov[1].buffer.value = assoc;
+    iov[1].buffer.length = sizeof(assoc);
+    iov[2].buffer.value = data;
+    iov[2].buffer.length = message->length;
+    retmaj = gssntlm_wrap_iov(&retmin, send_ctx, 1, 0, NULL, iov, 3);
+    if (retmaj != GSS_S_COMPLETE ||
+        !(iov[0].type & GSS_IOV_BUFFER_FLAG_ALLOCATED) ||
+        iov[0].buffer.length != 16) {
+        print_gss_error("gssntlm_wrap_iov (allocate) failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    assoc[0] ^= 0x01;
+    retmaj = gssntlm_unwrap_iov(&retmin, recv_ctx, NULL, NULL, iov, 3);
+    assoc[0] ^= 0x01;
+    if (retmaj != GSS_S_BAD_SIG) {
+        fprintf(stderr, "gssntlm_unwrap_iov did not detect tampering\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* the number of buffers is bounded */
+    many = calloc(NTLM_IOV_MAX + 1, sizeof(gss_iov_buffer_desc));
+    if (!many) {
+        ret = ENOMEM;
+        goto done;
+    }
+    many[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    many[0].buffer.value = header;
+    many[0].buffer.length = sizeof(header);
+    retmaj = gssntlm_wrap_iov(&retmin, send_ctx, 1, 0, NULL,
+                              many, NTLM_IOV_MAX + 1);
+    if (retmaj == GSS_S_COMPLETE) {
+        fprintf(stderr, "gssntlm_wrap_iov accepted too many buffers\n");
+        ret = EINVAL;
+    }
+
+done:
+    free(many);
+    if (iov[0].type & GSS_IOV_BUFFER_FLAG_ALLOCATED) {
+        gss_release_iov_buffer(&retmin, iov, 1);
+    }
+    gss_release_buffer(&retmin, &token);
+    gss_release_buffer(&retmin, &output);
+    return ret;
+}
+
 int test_gssapi_1(bool user_env_file, bool use_cb, bool no_seal, bool use_cs)
 {
     gss_ctx_id_t cli_ctx = GSS_C_NO_CONTEXT;
@@ -1477,6 +1757,11 @@ int test_gssapi_1(bool user_env_file, bool use_cb, bool no_seal, bool use_cs)
     gss_OID_desc sasl_ssf_oid = {
         11, discard_const("\x2a\x86\x48\x86\xf7\x12\x01\x02\x02\x05\x0f")
     };
+    gss_OID_desc prefetch_oid = {
+        GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_PREFETCH_KEYSTREAM_OID_STRING)
+    };
+    gss_buffer_desc prefetch_len = { 0 };
     gss_key_value_element_desc cs_el;
     gss_key_value_set_desc cs;
     gss_const_key_value_set_t cred_store = GSS_C_NO_CRED_STORE;
@@ -1685,6 +1970,35 @@ int test_gssapi_1(bool user_env_file, bool use_cb, bool no_seal, bool use_cs)
     }
     gss_release_buffer(&retmin, &ctx_token);
 
+    /* established contexts use the compact format, and an imported context
+     * re-exports its names without decoding them */
+    retmaj = gssntlm_export_sec_context(&retmin, &srv_ctx, &ctx_token);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ctx_token, &srv_ctx);
+    }
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_export_sec_context(&retmin, &srv_ctx, &srv_token);
+    }
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &srv_token, &srv_ctx);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("compact context export/import failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    if (ctx_token.length < 2 ||
+        memcmp(ctx_token.value, "\x05\x00", 2) != 0 ||
+        ctx_token.length != srv_token.length ||
+        memcmp(ctx_token.value, srv_token.value, ctx_token.length) != 0) {
+        fprintf(stderr, "Unexpected compact context token\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gss_release_buffer(&retmin, &ctx_token);
+    gss_release_buffer(&retmin, &srv_token);
+
     retmaj = gssntlm_get_mic(&retmin, cli_ctx, 0, &message, &cli_token);
     if (retmaj != GSS_S_COMPLETE) {
         print_gss_error("gssntlm_get_mic(cli) failed!",
@@ -1773,6 +2087,21 @@ int test_gssapi_1(bool user_env_file, bool use_cb, bool no_seal, bool use_cs)
         gss_release_buffer(&retmin, &cli_token);
         gss_release_buffer(&retmin, &srv_token);
 
+        /* the reverse direction runs on prefetched keystream */
+        retmaj = gssntlm_set_sec_context_option(&retmin, &srv_ctx,
+                                                &prefetch_oid, &prefetch_len);
+        if (retmaj == GSS_S_COMPLETE) {
+            retmaj = gssntlm_set_sec_context_option(&retmin, &cli_ctx,
+                                                    &prefetch_oid,
+                                                    &prefetch_len);
+        }
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("gssntlm_set_sec_context_option(prefetch) failed!",
+                            retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+
         retmaj = gssntlm_wrap(&retmin, srv_ctx, 1, 0, &message, &conf_state,
                               &srv_token);
         if (retmaj != GSS_S_COMPLETE) {
@@ -1813,6 +2142,12 @@ int test_gssapi_1(bool user_env_file, bool use_cb, bool no_seal, bool use_cs)
 
         gss_release_buffer(&retmin, &cli_token);
         gss_release_buffer(&retmin, &srv_token);
+
+        ret = test_gssapi_iov(cli_ctx, srv_ctx, &message);
+        if (ret) goto done;
+
+        ret = test_gssapi_iov(srv_ctx, cli_ctx, &message);
+        if (ret) goto done;
     }
 
     gssntlm_release_name(&retmin, &gss_username);
@@ -2094,6 +2429,13 @@ int test_gssapi_cl(void)
     gss_release_buffer(&retmin, &cli_token);
     gss_release_buffer(&retmin, &srv_token);
 
+    /* datagram contexts rekey for every message, IOV and flat tokens must
+     * still interoperate */
+    ret = test_gssapi_iov(cli_ctx, srv_ctx, &message);
+    if (ret) goto done;
+    ret = test_gssapi_iov(srv_ctx, cli_ctx, &message);
+    if (ret) goto done;
+
     gssntlm_release_name(&retmin, &gss_username);
     gssntlm_release_name(&retmin, &gss_srvname);
 
@@ -2304,15 +2646,24 @@ static void generate_random_binary_blob(char *dst, size_t bytes_count)
 static int gssntlm_append_attr(const char *name, void *value,
                                size_t length, struct gssntlm_name *dst)
 {
-    size_t prev_attrs_count = gssntlm_get_attrs_count(dst->attrs);
-    /* 1 for new attribute +1 for terminator entry */
-    size_t new_attrs_count = prev_attrs_count + 2;
+    size_t prev_attrs_count;
+    size_t new_attrs_count;
     struct gssntlm_name_attribute *attrs;
+    int ret;
 
     if (!name || !value || !length || !dst) {
         return ERR_NOARG;
     }
 
+    /* the name may share its storage with the one it was duplicated
+     * from, like external_srv_auth() take a private copy first */
+    ret = gssntlm_name_unshare(dst);
+    if (ret) return ret;
+
+    prev_attrs_count = gssntlm_get_attrs_count(dst->attrs);
+    /* 1 for new attribute +1 for terminator entry */
+    new_attrs_count = prev_attrs_count + 2;
+
     /* Increase buffer - if there was no any attributes before,
      * realloc is identical to malloc */
     attrs = realloc(dst->attrs,
@@ -2651,6 +3002,114 @@ int test_ZERO_LMKEY(struct ntlm_ctx *ctx)
     return test_keys("results", &MS_SessionKey, &result);
 }
 
+int test_UTF16_codec(void)
+{
+    struct {
+        const char *utf8;
+        size_t u8len;
+        const char *utf16;
+        size_t u16len;
+    } valid[] = {
+        { "", 0, "", 0 },
+        { "Administrator@EXAMPLE.COM-long-ascii-name", 41,
+          "A\0d\0m\0i\0n\0i\0s\0t\0r\0a\0t\0o\0r\0@\0E\0X\0A\0M\0P\0L\0E\0"
+          ".\0C\0O\0M\0-\0l\0o\0n\0g\0-\0a\0s\0c\0i\0i\0-\0n\0a\0m\0e\0", 82 },
+        { "ascii-prefix-of-16\xC3\xA9t\xC3\xA9", 23,
+          "a\0s\0c\0i\0i\0-\0p\0r\0e\0f\0i\0x\0-\0o\0f\0-\0001\0006\0"
+          "\xE9\0t\0\xE9\0", 42 },
+        { "\xE2\x82\xAC\xF0\x9D\x84\x9E", 7, "\xAC\x20\x34\xD8\x1E\xDD", 6 },
+        { "8-ascii!\xC3\xA9", 10,
+          "8\0-\0a\0s\0c\0i\0i\0!\0\xE9\0", 18 },
+    };
+    struct {
+        const char *in;
+        size_t len;
+        int err;
+    } bad_utf8[] = {
+        { "\xC0\x80", 2, EILSEQ },          /* overlong NUL */
+        { "\xE0\x80\xAF", 3, EILSEQ },      /* overlong '/' */
+        { "\xED\xA0\x80", 3, EILSEQ },      /* encoded surrogate */
+        { "\xF4\x90\x80\x80", 4, EILSEQ },  /* above U+10FFFF */
+        { "\x80", 1, EILSEQ },              /* stray continuation */
+        { "abc\xE2\x82", 5, EINVAL },       /* truncated */
+    }, bad_utf16[] = {
+        { "\x00\xD8" "a\0", 4, EILSEQ },    /* unpaired high surrogate */
+        { "\x00\xDC", 2, EILSEQ },          /* lone low surrogate */
+        { "a\0\x00\xD8", 4, EINVAL },       /* truncated pair */
+        { "a\0b", 3, EINVAL },              /* odd length */
+    };
+    uint8_t buf[128];
+    size_t len;
+    int ret;
+    size_t i;
+
+    for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        ret = ntlm_utf8_to_utf16le((const uint8_t *)valid[i].utf8,
+                                   valid[i].u8len, buf, sizeof(buf), &len);
+        if (ret || len != valid[i].u16len ||
+            memcmp(buf, valid[i].utf16, len) != 0) {
+            fprintf(stderr, "UTF-8 to UTF-16 conversion %zu failed\n", i);
+            return EINVAL;
+        }
+        ret = ntlm_utf16le_to_utf8((const uint8_t *)valid[i].utf16,
+                                   valid[i].u16len, buf, sizeof(buf), &len);
+        if (ret || len != valid[i].u8len ||
+            memcmp(buf, valid[i].utf8, len) != 0) {
+            fprintf(stderr, "UTF-16 to UTF-8 conversion %zu failed\n", i);
+            return EINVAL;
+        }
+        ret = ntlm_utf8_to_utf16le_len((const uint8_t *)valid[i].utf8,
+                                       valid[i].u8len, &len);
+        if (ret || len != valid[i].u16len) {
+            fprintf(stderr, "UTF-16 length %zu is wrong\n", i);
+            return EINVAL;
+        }
+    }
+
+    for (i = 0; i < sizeof(bad_utf8) / sizeof(bad_utf8[0]); i++) {
+        ret = ntlm_utf8_to_utf16le((const uint8_t *)bad_utf8[i].in,
+                                   bad_utf8[i].len, buf, sizeof(buf), &len);
+        if (ret != bad_utf8[i].err) {
+            fprintf(stderr, "Invalid UTF-8 %zu returned %d\n", i, ret);
+            return EINVAL;
+        }
+        ret = ntlm_utf8_to_utf16le_len((const uint8_t *)bad_utf8[i].in,
+                                       bad_utf8[i].len, &len);
+        if (ret != bad_utf8[i].err) {
+            fprintf(stderr, "Invalid UTF-8 %zu sized with %d\n", i, ret);
+            return EINVAL;
+        }
+    }
+
+    for (i = 0; i < sizeof(bad_utf16) / sizeof(bad_utf16[0]); i++) {
+        ret = ntlm_utf16le_to_utf8((const uint8_t *)bad_utf16[i].in,
+                                   bad_utf16[i].len, buf, sizeof(buf), &len);
+        if (ret != bad_utf16[i].err) {
+            fprintf(stderr, "Invalid UTF-16 %zu returned %d\n", i, ret);
+            return EINVAL;
+        }
+    }
+
+    /* output buffers are never overrun */
+    ret = ntlm_utf8_to_utf16le((const uint8_t *)valid[1].utf8,
+                               valid[1].u8len, buf, valid[1].u16len - 1, &len);
+    if (ret != E2BIG) {
+        fprintf(stderr, "Short UTF-16 output buffer not detected\n");
+        return EINVAL;
+    }
+    for (i = 1; i < 4; i += 2) {
+        ret = ntlm_utf16le_to_utf8((const uint8_t *)valid[i].utf16,
+                                   valid[i].u16len, buf, valid[i].u8len - 1,
+                                   &len);
+        if (ret != E2BIG) {
+            fprintf(stderr, "Short UTF-8 output buffer not detected\n");
+            return EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 int test_NTOWF_UTF16(struct ntlm_ctx *ctx)
 {
     const char *passwd = "Pass\xF0\x9D\x84\x9E";
@@ -2788,77 +3247,2049 @@ int test_import_name(void)
     return ret;
 }
 
-int main(int argc, const char *argv[])
+static int write_user_file(const char *filename, size_t entries,
+                           const char *extra)
 {
-    struct ntlm_ctx *ctx;
-    int gret = 0;
-    int ret;
-
-    /* enable trace debugging by dfault in tests */
-    setenv("GSSNTLMSSP_DEBUG", "tests-trace.log", 0);
-
-    fprintf(stderr, "Test errors\n");
-    ret = test_Errors();
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    FILE *f;
 
-    ret = ntlm_init_ctx(&ctx);
-    if (ret) goto done;
+    f = fopen(filename, "w");
+    if (!f) return errno;
 
-    fprintf(stderr, "Test LMOWFv1\n");
-    ret = test_LMOWFv1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    fprintf(f, "# generated by ntlmssptest\n");
+    fprintf(f, "%s", extra);
+    for (size_t i = 0; i < entries; i++) {
+        fprintf(f, "DOM%zu:user%zu:password%zu\n", i % 7, i, i);
+    }
+    fclose(f);
+    return 0;
+}
 
-    fprintf(stderr, "Test NTOWFv1\n");
-    ret = test_NTOWFv1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+static int check_user_file_entry(const char *filename,
+                                 const char *domain, const char *user,
+                                 int expected_ret, const char *expected_dom,
+                                 const char *expected_pwd)
+{
+    struct gssntlm_name name = { .type = GSSNTLM_NAME_USER };
+    struct gssntlm_userfile_ref ref = { 0 };
+    int ret;
 
-    fprintf(stderr, "Test LMResponse v1\n");
-    ret = test_LMResponseV1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    name.data.user.domain = discard_const(domain);
+    name.data.user.name = discard_const(user);
 
-    fprintf(stderr, "Test NTResponse v1\n");
-    ret = test_NTResponseV1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    ret = gssntlm_userfile_find(filename, &name, &ref);
+    if (ret != expected_ret) {
+        fprintf(stderr, "Lookup of [%s]\\[%s] returned %d, expected %d\n",
+                        domain, user, ret, expected_ret);
+        ret = EINVAL;
+        goto done;
+    }
+    ret = 0;
+    if (expected_ret != 0) goto done;
+
+    if ((expected_dom && (!ref.entry.domain ||
+                          strcmp(ref.entry.domain, expected_dom) != 0)) ||
+        (expected_pwd && (!ref.entry.password ||
+                          strcmp(ref.entry.password, expected_pwd) != 0))) {
+        fprintf(stderr, "Lookup of [%s]\\[%s] found [%s]\\[%s]:[%s]\n",
+                        domain, user, ref.entry.domain, ref.entry.user,
+                        ref.entry.password);
+        ret = EINVAL;
+    }
 
-    fprintf(stderr, "Test SessionBaseKey v1\n");
-    ret = test_SessionBaseKeyV1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+done:
+    gssntlm_userfile_release(&ref);
+    return ret;
+}
 
-    fprintf(stderr, "Test LM KeyExchangeKey\n");
-    ret = test_LM_KeyExchangeKey(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+int test_user_file_index(void)
+{
+    char filename[] = "ntlmssptest-userfile-XXXXXX";
+    const char *dups = "DUPA:dupuser:first\n"
+                       "DUPB:DupUser:second\n"
+                       "HASHDOM\\hashuser:1000:"
+                       "3ae6ccce2a2a253f76fde78389be2ce2:"
+                       "d32a2901011176349b41d406dcc95a90:[U ]:LCT-0\n";
+    int fd;
+    int ret;
 
-    fprintf(stderr, "Test EncryptedSessionKey v1 (1)\n");
-    ret = test_EncryptedSessionKey1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    fd = mkstemp(filename);
+    if (fd == -1) return errno;
+    close(fd);
 
-    fprintf(stderr, "Test EncryptedSessionKey v1 (2)\n");
-    ret = test_EncryptedSessionKey2(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    ret = write_user_file(filename, 5000, dups);
+    if (ret) goto done;
 
-    fprintf(stderr, "Test EncryptedSessionKey v1 (3)\n");
-    ret = test_EncryptedSessionKey3(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+    ret = check_user_file_entry(filename, NULL, "user4999", 0,
+                                "DOM1", "password4999");
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, "dom0", "USER7", 0,
+                                "DOM0", "password7");
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, "DOM1", "user7", ENOENT,
+                                NULL, NULL);
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, NULL, "nosuchuser", ENOENT,
+                                NULL, NULL);
+    if (ret) goto done;
+    /* with no domain the first line in the file wins */
+    ret = check_user_file_entry(filename, NULL, "DUPUSER", 0,
+                                "DUPA", "first");
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, "dupb", "dupuser", 0,
+                                "DUPB", "second");
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, "hashdom", "HashUser", 0,
+                                "HASHDOM", NULL);
+    if (ret) goto done;
 
-    /* override internal version for V1 test vector */
-    ntlm_internal_set_version(6, 0, 6000, 15);
+    /* the file must be reloaded once it changes, lookups only notice that
+     * on their next periodic check unless told about it */
+    ret = write_user_file(filename, 10, "DUPB:dupuser:third\n");
+    if (ret) goto done;
+    gssntlm_userfile_recheck(filename);
+    ret = check_user_file_entry(filename, NULL, "dupuser", 0,
+                                "DUPB", "third");
+    if (ret) goto done;
+    ret = check_user_file_entry(filename, NULL, "user4999", ENOENT,
+                                NULL, NULL);
 
-    fprintf(stderr, "Test decoding ChallengeMessage v1\n");
-    ret = test_DecodeChallengeMessageV1(ctx);
-    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
-    if (ret) gret++;
+done:
+    unlink(filename);
+    return ret;
+}
 
-    fprintf(stderr, "Test encoding ChallengeMessage v1\n");
+static int acquire_user_file_cred(const char *filename, const char *username,
+                                  struct gssntlm_cred **cred)
+{
+    gss_key_value_element_desc cred_file = {
+        .key = GSS_NTLMSSP_CS_KEYFILE,
+        .value = filename
+    };
+    gss_key_value_set_desc cred_store = {
+        .elements = &cred_file,
+        .count = 1
+    };
+    gss_buffer_desc nbuf;
+    gss_name_t name = GSS_C_NO_NAME;
+    uint32_t retmin, retmaj;
+
+    nbuf.value = discard_const(username);
+    nbuf.length = strlen(username);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME, &name);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name() failed!", retmaj, retmin);
+        return EINVAL;
+    }
+
+    retmaj = gssntlm_acquire_cred_from(&retmin, name,
+                                       GSS_C_INDEFINITE, GSS_C_NO_OID_SET,
+                                       GSS_C_INITIATE, &cred_store,
+                                       (gss_cred_id_t *)cred, NULL, NULL);
+    gssntlm_release_name(&retmin, &name);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_acquire_cred_from() failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    return 0;
+}
+
+int test_user_db(void)
+{
+    char textfile[] = "ntlmssptest-userfile-XXXXXX";
+    char dbfile[] = "ntlmssptest-userdb-XXXXXX";
+    const char *extra = "DUPA:dupuser:first\n"
+                        "DUPB:DupUser:second\n"
+                        "HASHDOM\\hashuser:1000:"
+                        "3ae6ccce2a2a253f76fde78389be2ce2:"
+                        "d32a2901011176349b41d406dcc95a90:[U ]:LCT-0\n"
+                        /* Turkish dotless i and dotted capital I */
+                        "TRDOM:\xc4\xb1smail:dotless\n"
+                        "TRDOM:\xc4\xb0pek:dotted\n";
+    const char *names[] = {
+        "user4999", "dom0\\USER7", "DUPUSER", "dupb\\dupuser",
+        "hashdom\\HashUser", "HashUser", "ISMAIL", "trdom\\\xc4\xb1SMAIL",
+        "\xc4\xb0PEK", NULL
+    };
+    const char *files[] = { textfile, dbfile };
+    struct gssntlm_name noname = { .type = GSSNTLM_NAME_USER };
+    struct gssntlm_userfile_ref ref = { 0 };
+    const char *old_env;
+    char *saved_env = NULL;
+    uint32_t retmin;
+    int fd;
+    int ret;
+
+    fd = mkstemp(textfile);
+    if (fd == -1) return errno;
+    close(fd);
+    fd = mkstemp(dbfile);
+    if (fd == -1) {
+        ret = errno;
+        goto done;
+    }
+    close(fd);
+
+    ret = write_user_file(textfile, 5000, extra);
+    if (ret) goto done;
+
+    ret = gssntlm_userfile_compile(textfile, dbfile);
+    if (ret) {
+        fprintf(stderr, "gssntlm_userfile_compile() failed: %d\n", ret);
+        goto done;
+    }
+
+    /* the compiled database must yield the very same credentials */
+    for (int i = 0; names[i] != NULL; i++) {
+        struct gssntlm_cred *text_cred = NULL;
+        struct gssntlm_cred *db_cred = NULL;
+
+        ret = acquire_user_file_cred(textfile, names[i], &text_cred);
+        if (ret == 0) {
+            ret = acquire_user_file_cred(dbfile, names[i], &db_cred);
+        }
+        if (ret == 0) {
+            ret = test_keys("NT hash", &text_cred->cred.user.nt_hash,
+                            &db_cred->cred.user.nt_hash);
+        }
+        if (ret == 0) {
+            ret = test_keys("LM hash", &text_cred->cred.user.lm_hash,
+                            &db_cred->cred.user.lm_hash);
+        }
+        if (ret == 0) {
+            ret = test_difference("domain",
+                    text_cred->cred.user.user.data.user.domain, 0,
+                    db_cred->cred.user.user.data.user.domain, 0);
+        }
+        gssntlm_release_cred(&retmin, (gss_cred_id_t *)&text_cred);
+        gssntlm_release_cred(&retmin, (gss_cred_id_t *)&db_cred);
+        if (ret) {
+            fprintf(stderr, "Credentials for [%s] differ\n", names[i]);
+            goto done;
+        }
+    }
+
+    /* both formats upcase names without regard to the locale: dotless i
+     * upcases to I, while dotted capital I has no lowercase partner */
+    for (int i = 0; i < 2; i++) {
+        ret = check_user_file_entry(files[i], NULL, "ismail", 0,
+                                    "TRDOM", NULL);
+        if (ret) goto done;
+        ret = check_user_file_entry(files[i], "trdom", "\xc4\xb0PEK", 0,
+                                    "TRDOM", NULL);
+        if (ret) goto done;
+        ret = check_user_file_entry(files[i], NULL, "ipek", ENOENT,
+                                    NULL, NULL);
+        if (ret) goto done;
+    }
+
+    noname.data.user.name = discard_const("nosuchuser");
+    ret = gssntlm_userfile_find(dbfile, &noname, &ref);
+    gssntlm_userfile_release(&ref);
+    if (ret != ENOENT) {
+        fprintf(stderr, "Lookup of unknown user returned %d\n", ret);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* and must be usable to run a full exchange */
+    old_env = getenv("NTLM_USER_FILE");
+    if (old_env) {
+        saved_env = strdup(old_env);
+        if (!saved_env) {
+            ret = ENOMEM;
+            goto done;
+        }
+    }
+    ret = gssntlm_userfile_compile(saved_env ? saved_env : TEST_USER_FILE,
+                                   dbfile);
+    if (ret) {
+        fprintf(stderr, "gssntlm_userfile_compile() failed: %d\n", ret);
+        goto done;
+    }
+    setenv("NTLM_USER_FILE", dbfile, 1);
+    ret = test_gssapi_1(true, false, false, false);
+    if (saved_env) {
+        setenv("NTLM_USER_FILE", saved_env, 1);
+    } else {
+        unsetenv("NTLM_USER_FILE");
+    }
+
+done:
+    free(saved_env);
+    unlink(textfile);
+    unlink(dbfile);
+    return ret;
+}
+
+static void restore_env(const char *name, char *saved)
+{
+    if (saved) {
+        setenv(name, saved, 1);
+    } else {
+        unsetenv(name);
+    }
+    free(saved);
+}
+
+static char *save_env(const char *name)
+{
+    char *env = getenv(name);
+    return env ? strdup(env) : NULL;
+}
+
+int test_identity_cache(void)
+{
+    /* "IDHOST" in UTF-16LE */
+    uint8_t u16_idhost[] = { 'I', 0, 'D', 0, 'H', 0, 'O', 0, 'S', 0, 'T', 0 };
+    struct gssntlm_identity *bound = NULL;
+    struct gssntlm_identity *first = NULL;
+    struct gssntlm_identity *id = NULL;
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    char *saved_host;
+    char *saved_domain;
+    uint32_t retmaj;
+    uint32_t retmin;
+    int ret;
+
+    saved_host = save_env("NETBIOS_COMPUTER_NAME");
+    saved_domain = save_env("NETBIOS_DOMAIN_NAME");
+    setenv("NETBIOS_COMPUTER_NAME", "IDHOST", 1);
+    setenv("NETBIOS_DOMAIN_NAME", "IDDOMAIN", 1);
+
+    ret = gssntlm_identity_get("idhost.example.com", NULL, &first);
+    if (ret) {
+        fprintf(stderr, "gssntlm_identity_get() failed: %d\n", ret);
+        goto done;
+    }
+    if (strcmp(first->computer_name, "idhost.example.com") != 0 ||
+        strcmp(first->nb_computer_name, "IDHOST") != 0 ||
+        strcmp(first->nb_domain_name, "IDDOMAIN") != 0) {
+        fprintf(stderr, "Unexpected names [%s] [%s] [%s]\n",
+                first->computer_name, first->nb_computer_name,
+                first->nb_domain_name);
+        ret = EINVAL;
+        goto done;
+    }
+    if (first->u16_nb_computer_name.length != sizeof(u16_idhost) ||
+        memcmp(first->u16_nb_computer_name.data, u16_idhost,
+               sizeof(u16_idhost)) != 0 ||
+        first->u16_nb_domain_name.length != 16 ||
+        first->u16_computer_name.length != 36) {
+        fprintf(stderr, "Unexpected UTF-16 names\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* a second lookup is served from the cache and binds the slot */
+    ret = gssntlm_identity_get("idhost.example.com", &bound, &id);
+    if (ret) goto done;
+    if (id != first || bound != first) {
+        fprintf(stderr, "Identity was not cached\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gssntlm_identity_release(&id);
+
+    /* the overrides are only read when names are resolved */
+    setenv("NETBIOS_COMPUTER_NAME", "IDHOST2", 1);
+    ret = gssntlm_identity_get("idhost.example.com", &bound, &id);
+    if (ret) goto done;
+    if (id != first || bound != first) {
+        fprintf(stderr, "Identity resolved again without invalidation\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gssntlm_identity_release(&id);
+
+    /* explicit invalidation, no credential needed */
+    retmaj = gssntlm_set_cred_option(&retmin, &cred,
+                                     &invalidate_identity_oid,
+                                     GSS_C_NO_BUFFER);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_set_cred_option(invalidate) failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    ret = gssntlm_identity_get("idhost.example.com", &bound, &id);
+    if (ret) goto done;
+    if (id == first || bound != id ||
+        strcmp(id->nb_computer_name, "IDHOST2") != 0) {
+        fprintf(stderr, "Stale identity returned after invalidation\n");
+        ret = EINVAL;
+        goto done;
+    }
+    /* references taken before invalidation stay usable */
+    if (strcmp(first->nb_computer_name, "IDHOST") != 0 ||
+        strcmp(first->nb_domain_name, "IDDOMAIN") != 0) {
+        ret = EINVAL;
+        goto done;
+    }
+
+done:
+    gssntlm_identity_release(&id);
+    gssntlm_identity_release(&first);
+    gssntlm_identity_release(&bound);
+    restore_env("NETBIOS_COMPUTER_NAME", saved_host);
+    restore_env("NETBIOS_DOMAIN_NAME", saved_domain);
+    return ret;
+}
+
+int test_chal_template(struct ntlm_ctx *ctx)
+{
+    uint32_t base = NTLMSSP_NEGOTIATE_SIGN | NTLMSSP_NEGOTIATE_SEAL |
+                    NTLMSSP_NEGOTIATE_NTLM | NTLMSSP_NEGOTIATE_KEY_EXCH;
+    uint32_t variants[] = {
+        NTLMSSP_NEGOTIATE_UNICODE | NTLMSSP_TARGET_TYPE_SERVER |
+            NTLMSSP_NEGOTIATE_TARGET_INFO | NTLMSSP_NEGOTIATE_VERSION,
+        NTLMSSP_NEGOTIATE_UNICODE | NTLMSSP_TARGET_TYPE_DOMAIN |
+            NTLMSSP_NEGOTIATE_TARGET_INFO,
+        NTLMSSP_NEGOTIATE_OEM | NTLMSSP_TARGET_TYPE_SERVER,
+        NTLMSSP_NEGOTIATE_OEM | NTLMSSP_TARGET_TYPE_DOMAIN |
+            NTLMSSP_NEGOTIATE_TARGET_INFO | NTLMSSP_NEGOTIATE_VERSION,
+    };
+    uint8_t chal[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    struct ntlm_buffer challenge = { chal, 8 };
+    struct gssntlm_identity *id = NULL;
+    struct ntlm_chal_template *tmpl;
+    struct gssntlm_arena *arena = NULL;
+    struct ntlm_buffer target_info = { 0 };
+    struct ntlm_buffer expected = { 0 };
+    struct ntlm_buffer msg = { 0 };
+    char *saved_host;
+    char *saved_domain;
+    uint64_t timestamp = 0x01D0000012345678ULL;
+    uint32_t flags;
+    size_t i, n;
+    int ret;
+
+    saved_host = save_env("NETBIOS_COMPUTER_NAME");
+    saved_domain = save_env("NETBIOS_DOMAIN_NAME");
+    setenv("NETBIOS_COMPUTER_NAME", "TMPLHOST", 1);
+    setenv("NETBIOS_DOMAIN_NAME", "TMPLDOM", 1);
+
+    ret = gssntlm_identity_get("tmplhost.example.com", NULL, &id);
+    if (ret) goto done;
+
+    for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        flags = base | variants[i];
+
+        /* the template must produce exactly what the generic encoders do */
+        ret = ntlm_encode_target_info(ctx, id->nb_computer_name,
+                                      id->nb_domain_name, id->computer_name,
+                                      NULL, NULL, NULL, &timestamp,
+                                      NULL, NULL, NULL, &target_info);
+        if (ret) goto done;
+        ret = ntlm_encode_chal_msg(ctx, flags,
+                                   (flags & NTLMSSP_TARGET_TYPE_DOMAIN) ?
+                                        id->nb_domain_name :
+                                        id->nb_computer_name,
+                                   &challenge, &target_info, &expected);
+        if (ret) goto done;
+
+        ret = gssntlm_identity_chal_msg(id, flags, &challenge,
+                                        timestamp, &arena, &msg);
+        if (ret) goto done;
+        ret = test_difference("challenge message", (char *)expected.data,
+                              expected.length, (char *)msg.data, msg.length);
+        if (ret) {
+            fprintf(stderr, "Template mismatch for flags 0x%08x\n", flags);
+            goto done;
+        }
+
+        /* a second message only differs in the patched fields */
+        chal[0]++;
+        ret = gssntlm_identity_chal_msg(id, flags, &challenge,
+                                        timestamp, &arena, &msg);
+        if (ret) goto done;
+        if (msg.length != expected.length ||
+            memcmp(((struct wire_chal_msg *)msg.data)->server_challenge,
+                   chal, 8) != 0) {
+            fprintf(stderr, "Challenge not patched in template\n");
+            ret = EINVAL;
+            goto done;
+        }
+
+        ntlm_free_buffer_data(&expected);
+        ntlm_free_buffer_data(&target_info);
+    }
+
+    /* one template per layout, reused by the second round of messages */
+    for (i = 0, n = 0; i < GSSNTLM_CHAL_TEMPLATES; i++) {
+        tmpl = id->chal_templates[i];
+        if (!tmpl) continue;
+        n++;
+        /* messages with a different layout must never use a template */
+        ret = ntlm_chal_template_to_msg(tmpl, tmpl->layout ^
+                                        NTLMSSP_NEGOTIATE_TARGET_INFO,
+                                        &challenge, timestamp, &msg);
+        if (ret != EINVAL) {
+            fprintf(stderr, "Template used with a different layout\n");
+            ret = EINVAL;
+            goto done;
+        }
+    }
+    if (n != sizeof(variants) / sizeof(variants[0])) {
+        fprintf(stderr, "Expected %zu templates, found %zu\n",
+                sizeof(variants) / sizeof(variants[0]), n);
+        ret = EINVAL;
+        goto done;
+    }
+    ret = 0;
+
+done:
+    gssntlm_arena_free(&arena);
+    ntlm_free_buffer_data(&expected);
+    ntlm_free_buffer_data(&target_info);
+    gssntlm_identity_release(&id);
+    restore_env("NETBIOS_COMPUTER_NAME", saved_host);
+    restore_env("NETBIOS_DOMAIN_NAME", saved_domain);
+    return ret;
+}
+
+int test_arena(void)
+{
+    struct gssntlm_arena *arena = NULL;
+    struct ntlm_buffer buf;
+    struct gssntlm_name *name;
+    uint8_t *ptrs[64];
+    char *str;
+    int ret;
+    int i;
+
+    /* allocations must not overlap, even across chunks */
+    for (i = 0; i < 64; i++) {
+        ptrs[i] = gssntlm_arena_alloc(&arena, 100 + i);
+        if (!ptrs[i]) return ENOMEM;
+        if (((uintptr_t)ptrs[i] & 0x0f) != 0) {
+            fprintf(stderr, "Unaligned arena allocation\n");
+            ret = EINVAL;
+            goto done;
+        }
+        memset(ptrs[i], i, 100 + i);
+    }
+    for (i = 0; i < 64; i++) {
+        if (ptrs[i][0] != i || ptrs[i][99 + i] != i) {
+            fprintf(stderr, "Arena allocation %d was overwritten\n", i);
+            ret = EINVAL;
+            goto done;
+        }
+    }
+
+    /* larger than a chunk */
+    if (!gssntlm_arena_alloc(&arena, 10000)) return ENOMEM;
+
+    str = gssntlm_arena_strdup(&arena, "WORKSTATION");
+    if (!str || strcmp(str, "WORKSTATION") != 0) {
+        fprintf(stderr, "Arena strdup failed\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    ret = gssntlm_arena_copy(&arena, "NTLMSSP", 8, &buf);
+    if (ret) goto done;
+    if (buf.length != 8 || memcmp(buf.data, "NTLMSSP", 8) != 0) {
+        fprintf(stderr, "Arena copy failed\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* adopted buffers are released with the arena */
+    buf.data = malloc(32);
+    if (!buf.data) {
+        ret = ENOMEM;
+        goto done;
+    }
+    buf.length = 32;
+    ret = gssntlm_arena_adopt(&arena, &buf);
+    if (ret) goto done;
+
+    /* recycled objects must come back zeroed */
+    name = gssntlm_obj_alloc(GSSNTLM_OBJ_NAME);
+    if (!name) {
+        ret = ENOMEM;
+        goto done;
+    }
+    memset(name, 0xaa, sizeof(struct gssntlm_name));
+    gssntlm_obj_free(GSSNTLM_OBJ_NAME, name);
+    name = gssntlm_obj_alloc(GSSNTLM_OBJ_NAME);
+    if (!name) {
+        ret = ENOMEM;
+        goto done;
+    }
+    for (i = 0; i < (int)sizeof(struct gssntlm_name); i++) {
+        if (((uint8_t *)name)[i] != 0) {
+            fprintf(stderr, "Recycled object was not zeroed\n");
+            ret = EINVAL;
+            break;
+        }
+    }
+    gssntlm_obj_free(GSSNTLM_OBJ_NAME, name);
+
+done:
+    gssntlm_arena_free(&arena);
+    if (arena != NULL) {
+        fprintf(stderr, "Arena pointer not cleared\n");
+        ret = EINVAL;
+    }
+    return ret;
+}
+
+int test_builtin_crypto(void)
+{
+    /* RFC 1320 */
+    static const struct {
+        const char *msg;
+        const char *digest;
+    } md4_vectors[] = {
+        { "", "\x31\xd6\xcf\xe0\xd1\x6a\xe9\x31"
+              "\xb7\x3c\x59\xd7\xe0\xc0\x89\xc0" },
+        { "abc", "\xa4\x48\x01\x7a\xaf\x21\xd8\x52"
+                 "\x5f\xc1\x0a\xe8\x7a\xa6\x72\x9d" },
+        { "12345678901234567890123456789012345678901234567890123456789012"
+          "345678901234567890", "\xe3\x3b\x4d\xdc\x9c\x38\xf2\x19"
+                                "\x9c\x3e\x7b\x16\x4f\xcc\x05\x36" },
+    };
+    /* RFC 1321 */
+    static const struct {
+        const char *msg;
+        const char *digest;
+    } md5_vectors[] = {
+        { "", "\xd4\x1d\x8c\xd9\x8f\x00\xb2\x04"
+              "\xe9\x80\x09\x98\xec\xf8\x42\x7e" },
+        { "abc", "\x90\x01\x50\x98\x3c\xd2\x4f\xb0"
+                 "\xd6\x96\x3f\x7d\x28\xe1\x7f\x72" },
+        { "12345678901234567890123456789012345678901234567890123456789012"
+          "345678901234567890", "\x57\xed\xf4\xa2\x2b\xe3\xc9\x55"
+                                "\xac\x49\xda\x2e\x21\x07\xb6\x7a" },
+    };
+    static const struct {
+        const char *key;
+        const char *plain;
+        const char *cipher;
+    } rc4_vectors[] = {
+        { "Key", "Plaintext", "\xbb\xf3\x16\xe8\xd9\x40\xaf\x0a\xd3" },
+        { "Secret", "Attack at dawn",
+          "\x45\xa0\x1f\x64\x5f\xc3\x5b\x38\x35\x52\x54\x4b\x9b\xf5" },
+    };
+    /* the classic worked example of the DES specification */
+    uint8_t des_key[8] = { 0x13, 0x34, 0x57, 0x79, 0x9b, 0xbc, 0xdf, 0xf1 };
+    uint8_t des_in[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef };
+    uint8_t des_out[8] = { 0x85, 0xe8, 0x13, 0x54, 0x0f, 0x0a, 0xb4, 0x05 };
+    struct builtin_rc4_key rc4;
+    struct builtin_md5_ctx md5;
+    uint8_t out[32];
+    size_t len, n, pos;
+    size_t i;
+
+    for (i = 0; i < sizeof(md4_vectors) / sizeof(md4_vectors[0]); i++) {
+        builtin_md4((const uint8_t *)md4_vectors[i].msg,
+                    strlen(md4_vectors[i].msg), out);
+        if (memcmp(out, md4_vectors[i].digest, 16) != 0) {
+            fprintf(stderr, "MD4 vector %zu failed\n", i);
+            return EINVAL;
+        }
+    }
+
+    for (i = 0; i < sizeof(md5_vectors) / sizeof(md5_vectors[0]); i++) {
+        builtin_md5_init(&md5);
+        builtin_md5_update(&md5, (const uint8_t *)md5_vectors[i].msg,
+                           strlen(md5_vectors[i].msg));
+        builtin_md5_final(&md5, out);
+        if (memcmp(out, md5_vectors[i].digest, 16) != 0) {
+            fprintf(stderr, "MD5 vector %zu failed\n", i);
+            return EINVAL;
+        }
+    }
+    /* the same digest when fed in uneven pieces across block boundaries */
+    len = strlen(md5_vectors[2].msg);
+    builtin_md5_init(&md5);
+    for (pos = 0, n = 1; pos < len; pos += n, n += 7) {
+        if (n > len - pos) n = len - pos;
+        builtin_md5_update(&md5, (const uint8_t *)&md5_vectors[2].msg[pos], n);
+    }
+    builtin_md5_final(&md5, out);
+    if (memcmp(out, md5_vectors[2].digest, 16) != 0) {
+        fprintf(stderr, "Incremental MD5 failed\n");
+        return EINVAL;
+    }
+
+    for (i = 0; i < sizeof(rc4_vectors) / sizeof(rc4_vectors[0]); i++) {
+        len = strlen(rc4_vectors[i].plain);
+        builtin_rc4_set_key(&rc4, strlen(rc4_vectors[i].key),
+                            (const uint8_t *)rc4_vectors[i].key);
+        builtin_rc4(&rc4, len, (const uint8_t *)rc4_vectors[i].plain, out);
+        if (memcmp(out, rc4_vectors[i].cipher, len) != 0) {
+            fprintf(stderr, "RC4 vector %zu failed\n", i);
+            return EINVAL;
+        }
+    }
+
+    builtin_des_ecb_encrypt(des_key, des_in, out);
+    if (memcmp(out, des_out, 8) != 0) {
+        fprintf(stderr, "DES vector failed\n");
+        return EINVAL;
+    }
+    /* parity bits must not matter */
+    for (i = 0; i < 8; i++) des_key[i] ^= 0x01;
+    builtin_des_ecb_encrypt(des_key, des_in, out);
+    if (memcmp(out, des_out, 8) != 0) {
+        fprintf(stderr, "DES key parity bits were not ignored\n");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+int test_digest_reuse(void)
+{
+    /* RFC 2202, run twice in alternation so that each call must fully
+     * rekey the per-thread contexts left behind by the previous one */
+    static const struct {
+        const char *key;
+        const char *data;
+        const char *mac;
+    } hmac_vectors[] = {
+        { "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b"
+          "\x0b\x0b\x0b\x0b\x0b\x0b\x0b\x0b",
+          "Hi There",
+          "\x92\x94\x72\x7a\x36\x38\xbb\x1c"
+          "\x13\xf4\x8e\xf8\x15\x8b\xfc\x9d" },
+        { "Jefe",
+          "what do ya want for nothing?",
+          "\x75\x0c\x78\x3e\x6a\xb0\xb5\x03"
+          "\xea\xa8\x6e\x31\x0a\x5d\xb7\x38" },
+    };
+    static const char md4_abc[] = "\xa4\x48\x01\x7a\xaf\x21\xd8\x52"
+                                  "\x5f\xc1\x0a\xe8\x7a\xa6\x72\x9d";
+    uint8_t out[16];
+    struct ntlm_buffer key;
+    struct ntlm_buffer data;
+    struct ntlm_buffer result = { out, 16 };
+    size_t i;
+    int ret;
+
+    for (i = 0; i < 2 * sizeof(hmac_vectors) / sizeof(hmac_vectors[0]); i++) {
+        size_t v = i % (sizeof(hmac_vectors) / sizeof(hmac_vectors[0]));
+
+        key.data = discard_const(hmac_vectors[v].key);
+        key.length = strlen(hmac_vectors[v].key);
+        data.data = discard_const(hmac_vectors[v].data);
+        data.length = strlen(hmac_vectors[v].data);
+        ret = HMAC_MD5(&key, &data, &result);
+        if (ret) return ret;
+        if (memcmp(out, hmac_vectors[v].mac, 16) != 0) {
+            fprintf(stderr, "HMAC-MD5 vector %zu failed on pass %zu\n",
+                    v, i / 2);
+            return EINVAL;
+        }
+
+        data.data = discard_const("abc");
+        data.length = 3;
+        ret = MD4_HASH(&data, &result);
+        if (ret) return ret;
+        if (memcmp(out, md4_abc, 16) != 0) {
+            fprintf(stderr, "MD4 failed on pass %zu\n", i / 2);
+            return EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+int test_rand_pool(void)
+{
+    uint8_t a[16], b[16], c[16];
+    struct ntlm_buffer ba = { a, 16 };
+    struct ntlm_buffer bb = { b, 16 };
+    struct ntlm_buffer bc = { c, 16 };
+    int fds[2];
+    pid_t pid;
+    int status;
+    int ret;
+
+    ret = RAND_BUFFER(&ba);
+    if (ret) return ret;
+    ret = RAND_BUFFER(&bb);
+    if (ret) return ret;
+    if (memcmp(a, b, 16) == 0) {
+        fprintf(stderr, "Consecutive draws returned the same bytes\n");
+        return EINVAL;
+    }
+
+    /* the pool now holds buffered bytes, the child must not get the same
+     * ones the parent draws next */
+    if (pipe(fds) != 0) return errno;
+    pid = fork();
+    if (pid == -1) return errno;
+    if (pid == 0) {
+        close(fds[0]);
+        ret = RAND_BUFFER(&bc);
+        if (ret == 0 && write(fds[1], c, 16) != 16) ret = EIO;
+        _exit(ret ? 1 : 0);
+    }
+    close(fds[1]);
+    ret = RAND_BUFFER(&ba);
+    if (ret == 0 && read(fds[0], c, 16) != 16) ret = EIO;
+    close(fds[0]);
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (ret == 0) ret = EIO;
+    }
+    if (ret) return ret;
+
+    if (memcmp(a, c, 16) == 0) {
+        fprintf(stderr, "Parent and child drew the same random bytes\n");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+static int metrics_get(gss_buffer_set_t *data_set)
+{
+    gss_OID_desc oid = {
+        GSS_NTLMSSP_METRICS_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_METRICS_OID_STRING)
+    };
+    uint32_t retmin, retmaj;
+
+    retmaj = gssntlm_inquire_cred_by_oid(&retmin, GSS_C_NO_CREDENTIAL,
+                                         &oid, data_set);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_inquire_cred_by_oid(metrics) failed!",
+                        retmaj, retmin);
+        return EINVAL;
+    }
+    if ((*data_set)->count != 1) {
+        fprintf(stderr, "Expected one metrics buffer, got %zu\n",
+                (*data_set)->count);
+        return EINVAL;
+    }
+    return 0;
+}
+
+/* returns the value of the sample named exactly 'name', or 0 if missing */
+static uint64_t metrics_value(gss_buffer_set_t data_set, const char *name)
+{
+    const char *text = data_set->elements[0].value;
+    const char *end = text + data_set->elements[0].length;
+    size_t len = strlen(name);
+    const char *p;
+
+    for (p = text; p && p < end; p = memchr(p, '\n', end - p)) {
+        if (*p == '\n') p++;
+        if ((size_t)(end - p) > len + 1 &&
+            strncmp(p, name, len) == 0 && p[len] == ' ') {
+            return strtoull(p + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+/* counts the samples whose line starts with 'prefix' */
+static size_t metrics_count(gss_buffer_set_t data_set, const char *prefix)
+{
+    const char *text = data_set->elements[0].value;
+    const char *end = text + data_set->elements[0].length;
+    size_t len = strlen(prefix);
+    size_t count = 0;
+    const char *p;
+
+    for (p = text; p && p < end; p = memchr(p, '\n', end - p)) {
+        if (*p == '\n') p++;
+        if ((size_t)(end - p) > len && strncmp(p, prefix, len) == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int test_metrics(void)
+{
+    static const char *names[] = {
+        "gssntlmssp_handshakes_started_total{role=\"client\"}",
+        "gssntlmssp_handshakes_completed_total{role=\"client\"}",
+        "gssntlmssp_handshakes_started_total{role=\"server\"}",
+        "gssntlmssp_handshakes_completed_total{role=\"server\"}",
+        "gssntlmssp_logons_total{role=\"server\",type=\"ntlmv2\"}",
+        "gssntlmssp_channel_bindings_total{role=\"client\"}",
+        "gssntlmssp_channel_bindings_total{role=\"server\"}",
+        "gssntlmssp_auth_total{role=\"server\",source=\"local\"}",
+        "gssntlmssp_handshake_leg_seconds_count"
+            "{leg=\"server_authenticate\"}",
+        "gssntlmssp_handshake_failures_total"
+            "{role=\"server\",reason=\"ERR_DECODE\"}",
+    };
+    /* expected increments: one handshake with channel bindings, plus one
+     * broken negotiate message sent to a new acceptor context */
+    static const uint64_t delta[] = { 1, 1, 2, 1, 1, 1, 1, 1, 1, 1 };
+    /* a histogram nothing was recorded in yet, and one that is in use:
+     * both expose the same 14 bounds and +Inf on every scrape */
+    static const char *hists[] = {
+        "gssntlmssp_message_seconds_bucket{op=\"unwrap\",size_le=\"+Inf\",",
+        "gssntlmssp_handshake_leg_seconds_bucket"
+            "{leg=\"server_authenticate\",",
+    };
+    uint64_t before[sizeof(names) / sizeof(names[0])];
+    gss_buffer_set_t data_set = GSS_C_NO_BUFFER_SET;
+    gss_ctx_id_t srv_ctx = GSS_C_NO_CONTEXT;
+    gss_buffer_desc token = { 4, discard_const("junk") };
+    gss_buffer_desc out = { 0 };
+    uint32_t retmin, retmaj;
+    size_t i;
+    int ret;
+
+    ret = metrics_get(&data_set);
+    if (ret) return ret;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        before[i] = metrics_value(data_set, names[i]);
+    }
+    gss_release_buffer_set(&retmin, &data_set);
+
+    ret = test_gssapi_1(true, true, false, false);
+    if (ret) return ret;
+
+    retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx, NULL, &token,
+                                        GSS_C_NO_CHANNEL_BINDINGS, NULL, NULL,
+                                        &out, NULL, NULL, NULL);
+    gss_release_buffer(&retmin, &out);
+    if (retmaj == GSS_S_COMPLETE || retmaj == GSS_S_CONTINUE_NEEDED) {
+        fprintf(stderr, "A broken token was accepted\n");
+        return EINVAL;
+    }
+
+    ret = metrics_get(&data_set);
+    if (ret) return ret;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (metrics_value(data_set, names[i]) != before[i] + delta[i]) {
+            fprintf(stderr, "%s: expected %" PRIu64 ", got %" PRIu64 "\n",
+                    names[i], before[i] + delta[i],
+                    metrics_value(data_set, names[i]));
+            ret = EINVAL;
+        }
+    }
+    for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+        if (metrics_count(data_set, hists[i]) != 15) {
+            fprintf(stderr, "%s: %zu buckets\n",
+                    hists[i], metrics_count(data_set, hists[i]));
+            ret = EINVAL;
+        }
+    }
+    gss_release_buffer_set(&retmin, &data_set);
+
+    return ret;
+}
+
+#define DEBUG_TEST_THREADS 4
+#define DEBUG_TEST_EVENTS 2000
+
+static void *debug_log_thread(void *arg)
+{
+    int i;
+
+    (void)arg;
+    for (i = 0; i < DEBUG_TEST_EVENTS; i++) {
+        gssntlm_debug_log("debug_log_thread", __FILE__, __LINE__,
+                          GSS_S_FAILURE, i);
+    }
+    return NULL;
+}
+
+int test_debug_log(void)
+{
+    pthread_t threads[DEBUG_TEST_THREADS];
+    const char *path = getenv("GSSNTLMSSP_DEBUG");
+    gss_buffer_desc msg = { 4, discard_const("test") };
+    gss_buffer_desc out = { 0 };
+    uint32_t retmin;
+    struct stat st;
+    char line[1024];
+    unsigned long events = 0;
+    unsigned long dropped = 0;
+    bool badctx = false;
+    char *p;
+    FILE *f;
+    int i;
+
+    if (!path || !gssntlm_debug_enabled) {
+        fprintf(stderr, "Debug log not enabled, skipping\n");
+        return 0;
+    }
+
+    gssntlm_debug_flush();
+    if (stat(path, &st) != 0) return errno;
+
+    (void)gssntlm_wrap(&retmin, GSS_C_NO_CONTEXT, 1, GSS_C_QOP_DEFAULT,
+                       &msg, NULL, &out);
+    for (i = 0; i < DEBUG_TEST_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, debug_log_thread, NULL)) {
+            return EFAULT;
+        }
+    }
+    for (i = 0; i < DEBUG_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    gssntlm_debug_flush();
+
+    f = fopen(path, "r");
+    if (!f) return errno;
+    fseeko(f, st.st_size, SEEK_SET);
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, " func=debug_log_thread ")) {
+            events++;
+        } else if (strstr(line, " func=gssntlm_wrap ") &&
+                   strstr(line, " level=error ") &&
+                   strstr(line, " err=ERR_BADCTX")) {
+            badctx = true;
+        } else if ((p = strstr(line, "msg=dropped count="))) {
+            dropped += strtoul(p + 18, NULL, 10);
+        }
+    }
+    fclose(f);
+
+    if (!badctx) {
+        fprintf(stderr, "The failed gssntlm_wrap() was not logged\n");
+        return EINVAL;
+    }
+    /* every event is either written once or counted as dropped */
+    if (events + dropped != DEBUG_TEST_THREADS * DEBUG_TEST_EVENTS) {
+        fprintf(stderr, "Expected %d events, %lu written, %lu dropped\n",
+                DEBUG_TEST_THREADS * DEBUG_TEST_EVENTS, events, dropped);
+        return EINVAL;
+    }
+    return 0;
+}
+
+int test_encode_exact_size(struct ntlm_ctx *ctx)
+{
+    uint32_t flags = NTLMSSP_NEGOTIATE_UNICODE | NTLMSSP_NEGOTIATE_VERSION;
+    uint8_t lm[24] = { 0 };
+    uint8_t nt[24] = { 0 };
+    struct ntlm_buffer lm_resp = { lm, 24 };
+    struct ntlm_buffer nt_resp = { nt, 24 };
+    /* 2 byte and 4 byte UTF-8 sequences, sized 2 and 4 in UTF-16 */
+    char domain[] = "D\xC3\xA9MO";
+    char user[] = "\xF0\x9F\x98\x80user";
+    char workstation[] = "WKS";
+    struct ntlm_buffer msg = { 0 };
+    struct ntlm_buffer small = { 0 };
+    struct ntlm_auth_view auth;
+    char name[64];
+    size_t expected;
+    size_t len;
+    int ret;
+
+    ret = ntlm_encode_auth_msg(ctx, flags, &lm_resp, &nt_resp,
+                               domain, user, workstation,
+                               NULL, NULL, &msg);
+    if (ret) goto done;
+
+    expected = sizeof(struct wire_auth_msg) + sizeof(struct wire_version) +
+               24 + 24 + 8 + 12 + 6;
+    if (msg.length != expected) {
+        fprintf(stderr, "Message is %zu bytes, expected %zu\n",
+                msg.length, expected);
+        ret = EINVAL;
+        goto done;
+    }
+
+    ret = ntlm_decode_auth_view(ctx, &msg, flags, &auth);
+    if (ret) goto done;
+    ret = ntlm_str_view_to_utf8(&auth.user_name, name, sizeof(name), &len);
+    if (ret) goto done;
+    if (strcmp(name, user) != 0) {
+        fprintf(stderr, "User name did not round trip\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* writing into a buffer that is too small fails cleanly */
+    small.length = msg.length - 1;
+    small.data = malloc(small.length);
+    if (!small.data) {
+        ret = ENOMEM;
+        goto done;
+    }
+    ret = ntlm_write_auth_msg(ctx, flags, &lm_resp, &nt_resp,
+                              domain, user, workstation,
+                              NULL, NULL, &small);
+    if (ret != ERR_ENCODE) {
+        fprintf(stderr, "Short message buffer not detected\n");
+        ret = EINVAL;
+        goto done;
+    }
+    ret = 0;
+
+done:
+    ntlm_free_buffer_data(&small);
+    ntlm_free_buffer_data(&msg);
+    return ret;
+}
+
+/* unwraps 'in' and checks it decrypts to 'msg' */
+static int unwrap_check(gss_ctx_id_t ctx, gss_buffer_t in, const char *msg)
+{
+    gss_buffer_desc out = { 0 };
+    uint32_t retmin, retmaj;
+    int ret = 0;
+
+    retmaj = gssntlm_unwrap(&retmin, ctx, in, &out, NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_unwrap failed!", retmaj, retmin);
+        return EINVAL;
+    }
+    if (out.length != strlen(msg) || memcmp(out.value, msg, out.length)) {
+        fprintf(stderr, "Unwrapped message does not match\n");
+        ret = EINVAL;
+    }
+    gss_release_buffer(&retmin, &out);
+    return ret;
+}
+
+/* Fills the 8 entries of the table with copies of an established context
+ * and checks which entries can be taken over once it is full */
+static int ctx_table_reuse(gss_buffer_t copy_token)
+{
+    gss_OID_desc table_oid = {
+        GSS_NTLMSSP_CTX_TABLE_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_CTX_TABLE_OID_STRING)
+    };
+    gss_ctx_id_t ctxs[10] = { GSS_C_NO_CONTEXT };
+    gss_buffer_desc ref_token = { 0 };
+    uint32_t retmin, retmaj;
+    pid_t pid;
+    int status;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        retmaj = gssntlm_import_sec_context(&retmin, copy_token, &ctxs[i]);
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("gssntlm_import_sec_context failed!",
+                            retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        retmaj = gssntlm_set_sec_context_option(&retmin, &ctxs[i],
+                                                &table_oid, GSS_C_NO_BUFFER);
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("Sharing the context failed!", retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+    }
+    retmaj = gssntlm_set_sec_context_option(&retmin, &ctxs[8], &table_oid,
+                                            GSS_C_NO_BUFFER);
+    if (retmaj == GSS_S_COMPLETE) {
+        fprintf(stderr, "An attached entry was taken over\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* a worker that dies holding the only reference does not pin it */
+    retmaj = gssntlm_export_sec_context(&retmin, &ctxs[0], &ref_token);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_export_sec_context failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    pid = fork();
+    if (pid == -1) {
+        ret = errno;
+        goto done;
+    }
+    if (pid == 0) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &ctxs[0]);
+        _exit(retmaj == GSS_S_COMPLETE ? 0 : 1);
+    }
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Child failed to attach to the shared context\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gss_release_buffer(&retmin, &ref_token);
+    retmaj = gssntlm_set_sec_context_option(&retmin, &ctxs[8], &table_oid,
+                                            GSS_C_NO_BUFFER);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("The entry of a dead worker was not reused!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* an exported entry waits for its import, even with nobody attached */
+    retmaj = gssntlm_export_sec_context(&retmin, &ctxs[1], &ref_token);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_export_sec_context failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    retmaj = gssntlm_set_sec_context_option(&retmin, &ctxs[9], &table_oid,
+                                            GSS_C_NO_BUFFER);
+    if (retmaj == GSS_S_COMPLETE) {
+        fprintf(stderr, "An exported entry was taken over\n");
+        ret = EINVAL;
+        goto done;
+    }
+    retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &ctxs[1]);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("The exported entry was lost!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+done:
+    gss_release_buffer(&retmin, &ref_token);
+    for (i = 0; i < 10; i++) {
+        gssntlm_delete_sec_context(&retmin, &ctxs[i], NULL);
+    }
+    return ret;
+}
+
+int test_ctx_table(void)
+{
+    gss_OID_desc table_oid = {
+        GSS_NTLMSSP_CTX_TABLE_OID_LENGTH,
+        discard_const(GSS_NTLMSSP_CTX_TABLE_OID_STRING)
+    };
+    const char *msgs[] = { "first request", "second request",
+                           "first reply", "second reply" };
+    gss_ctx_id_t cli_ctx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t srv_ctx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t srv_ctx2 = GSS_C_NO_CONTEXT;
+    gss_cred_id_t cli_cred = GSS_C_NO_CREDENTIAL;
+    gss_cred_id_t srv_cred = GSS_C_NO_CREDENTIAL;
+    gss_name_t gss_username = NULL;
+    gss_name_t gss_srvname = NULL;
+    gss_buffer_desc nbuf;
+    gss_buffer_desc cli_token = { 0 };
+    gss_buffer_desc srv_token = { 0 };
+    gss_buffer_desc ref_token = { 0 };
+    gss_buffer_desc copy_token = { 0 };
+    gss_buffer_desc msg;
+    gss_buffer_desc tok[4] = { { 0 } };
+    gss_buffer_set_t data_set = GSS_C_NO_BUFFER_SET;
+    uint32_t retmin, retmaj;
+    uint64_t id;
+    pid_t pid;
+    int status;
+    int ret;
+    int i;
+
+    setenv("NTLM_USER_FILE", TEST_USER_FILE, 0);
+
+    nbuf.value = discard_const("TESTDOM\\testuser");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME,
+                                 &gss_username);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name(username) failed!",
+                        retmaj, retmin);
+        return EINVAL;
+    }
+    nbuf.value = discard_const("test@testserver");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_HOSTBASED_SERVICE,
+                                 &gss_srvname);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name(srvname) failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    retmaj = gssntlm_acquire_cred(&retmin, gss_username, GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET, GSS_C_INITIATE,
+                                  &cli_cred, NULL, NULL);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_acquire_cred(&retmin, gss_srvname, GSS_C_INDEFINITE,
+                                      GSS_C_NO_OID_SET, GSS_C_ACCEPT,
+                                      &srv_cred, NULL, NULL);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_acquire_cred failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    retmaj = gssntlm_init_sec_context(&retmin, cli_cred, &cli_ctx,
+                                      gss_srvname, GSS_C_NO_OID,
+                                      GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG, 0,
+                                      GSS_C_NO_CHANNEL_BINDINGS,
+                                      GSS_C_NO_BUFFER, NULL, &cli_token,
+                                      NULL, NULL);
+    if (retmaj == GSS_S_CONTINUE_NEEDED) {
+        retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx, srv_cred,
+                                            &cli_token,
+                                            GSS_C_NO_CHANNEL_BINDINGS,
+                                            NULL, NULL, &srv_token,
+                                            NULL, NULL, NULL);
+        gss_release_buffer(&retmin, &cli_token);
+    }
+    if (retmaj == GSS_S_CONTINUE_NEEDED) {
+        retmaj = gssntlm_init_sec_context(&retmin, cli_cred, &cli_ctx,
+                                          gss_srvname, GSS_C_NO_OID,
+                                          GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG,
+                                          0, GSS_C_NO_CHANNEL_BINDINGS,
+                                          &srv_token, NULL, &cli_token,
+                                          NULL, NULL);
+        gss_release_buffer(&retmin, &srv_token);
+    }
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx, srv_cred,
+                                            &cli_token,
+                                            GSS_C_NO_CHANNEL_BINDINGS,
+                                            NULL, NULL, &srv_token,
+                                            NULL, NULL, NULL);
+        gss_release_buffer(&retmin, &cli_token);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Handshake failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* kept to make more copies of the context later */
+    retmaj = gssntlm_export_sec_context(&retmin, &srv_ctx, &copy_token);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &copy_token, &srv_ctx);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Copying the context failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* sharing needs a table */
+    retmaj = gssntlm_set_sec_context_option(&retmin, &srv_ctx, &table_oid,
+                                            GSS_C_NO_BUFFER);
+    if (retmaj != GSS_S_UNAVAILABLE) {
+        fprintf(stderr, "Context shared without a table\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    retmaj = gssntlm_ctx_table_create(&retmin, 8, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_ctx_table_create failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    retmaj = gssntlm_set_sec_context_option(&retmin, &srv_ctx, &table_oid,
+                                            GSS_C_NO_BUFFER);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Sharing the context failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    retmaj = gssntlm_inquire_sec_context_by_oid(&retmin, srv_ctx, &table_oid,
+                                                &data_set);
+    if (retmaj != GSS_S_COMPLETE || data_set->count != 1 ||
+        data_set->elements[0].length != sizeof(id)) {
+        print_gss_error("Inquiring the table ID failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    memcpy(&id, data_set->elements[0].value, sizeof(id));
+    if (id == 0) {
+        fprintf(stderr, "Got a zero table ID\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* a shared context exports as a reference to its entry */
+    retmaj = gssntlm_export_sec_context(&retmin, &srv_ctx, &ref_token);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_export_sec_context failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    if (ref_token.length != 10) {
+        fprintf(stderr, "Expected a 10 byte reference token, got %zu\n",
+                ref_token.length);
+        ret = EINVAL;
+        goto done;
+    }
+
+    for (i = 0; i < 2; i++) {
+        msg.value = discard_const(msgs[i]);
+        msg.length = strlen(msgs[i]);
+        retmaj = gssntlm_wrap(&retmin, cli_ctx, 1, 0, &msg, NULL, &tok[i]);
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("gssntlm_wrap failed!", retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+    }
+
+    /* the first request is served by another process of the pool ... */
+    pid = fork();
+    if (pid == -1) {
+        ret = errno;
+        goto done;
+    }
+    if (pid == 0) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &srv_ctx);
+        if (retmaj != GSS_S_COMPLETE) _exit(1);
+        ret = unwrap_check(srv_ctx, &tok[0], msgs[0]);
+        gssntlm_delete_sec_context(&retmin, &srv_ctx, NULL);
+        _exit(ret ? 1 : 0);
+    }
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Child failed to use the shared context\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* ... and the second one here, which needs the state it left behind */
+    retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &srv_ctx);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &srv_ctx2);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_sec_context failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    ret = unwrap_check(srv_ctx, &tok[1], msgs[1]);
+    if (ret) goto done;
+
+    /* two copies in the same process stay in step too */
+    for (i = 2; i < 4; i++) {
+        msg.value = discard_const(msgs[i]);
+        msg.length = strlen(msgs[i]);
+        retmaj = gssntlm_wrap(&retmin, i == 2 ? srv_ctx2 : srv_ctx, 1, 0,
+                              &msg, NULL, &tok[i]);
+        if (retmaj != GSS_S_COMPLETE) {
+            print_gss_error("gssntlm_wrap failed!", retmaj, retmin);
+            ret = EINVAL;
+            goto done;
+        }
+        ret = unwrap_check(cli_ctx, &tok[i], msgs[i]);
+        if (ret) goto done;
+    }
+
+    /* a stale ID is refused */
+    gss_release_buffer_set(&retmin, &data_set);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx, NULL);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx2, NULL);
+    ((uint8_t *)ref_token.value)[6] ^= 0x01;
+    retmaj = gssntlm_import_sec_context(&retmin, &ref_token, &srv_ctx);
+    if (retmaj != GSS_S_NO_CONTEXT) {
+        fprintf(stderr, "A reference with a wrong generation was accepted\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    ret = ctx_table_reuse(&copy_token);
+
+done:
+    for (i = 0; i < 4; i++) {
+        gss_release_buffer(&retmin, &tok[i]);
+    }
+    gss_release_buffer(&retmin, &ref_token);
+    gss_release_buffer(&retmin, &copy_token);
+    gss_release_buffer(&retmin, &cli_token);
+    gss_release_buffer(&retmin, &srv_token);
+    gss_release_buffer_set(&retmin, &data_set);
+    gssntlm_delete_sec_context(&retmin, &cli_ctx, NULL);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx, NULL);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx2, NULL);
+    gssntlm_release_cred(&retmin, &cli_cred);
+    gssntlm_release_cred(&retmin, &srv_cred);
+    gssntlm_release_name(&retmin, &gss_username);
+    gssntlm_release_name(&retmin, &gss_srvname);
+    return ret;
+}
+
+#define NAME_TEST_THREADS 4
+
+static void *copy_name_thread(void *arg)
+{
+    struct gssntlm_name *name = arg;
+    struct gssntlm_name copy;
+    intptr_t ret = 0;
+    int i;
+
+    for (i = 0; i < 1000 && ret == 0; i++) {
+        ret = gssntlm_copy_name(name, &copy);
+        if (ret) break;
+        if (strcmp(copy.data.server.name, name->data.server.name) != 0) {
+            ret = EINVAL;
+        }
+        gssntlm_int_release_name(&copy);
+    }
+    return (void *)ret;
+}
+
+int test_shared_names(void)
+{
+    gss_buffer_desc nbuf;
+    gss_name_t orig = GSS_C_NO_NAME;
+    gss_name_t dup = GSS_C_NO_NAME;
+    gss_name_t srv = GSS_C_NO_NAME;
+    struct gssntlm_name *in, *out;
+    struct gssntlm_name copy = { 0 };
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    gss_cred_id_t cred2;
+    pthread_t threads[NAME_TEST_THREADS];
+    uint32_t retmin, retmaj;
+    void *tret;
+    int ret = 0;
+    int i;
+
+    nbuf.value = discard_const("TESTDOM\\testuser");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME, &orig);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_duplicate_name(&retmin, orig, &dup);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Importing and duplicating a name failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    in = (struct gssntlm_name *)orig;
+    out = (struct gssntlm_name *)dup;
+
+    /* a copy refers to the same strings, and outlives the original */
+    if (out->data.user.name != in->data.user.name ||
+        out->data.user.domain != in->data.user.domain) {
+        fprintf(stderr, "The duplicate does not share the name's storage\n");
+        ret = EINVAL;
+        goto done;
+    }
+    gssntlm_release_name(&retmin, &orig);
+    if (strcmp(out->data.user.name, "testuser") != 0 ||
+        strcmp(out->data.user.domain, "TESTDOM") != 0) {
+        fprintf(stderr, "The duplicate did not survive the original\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* unsharing gives the same name in storage of its own */
+    ret = gssntlm_copy_name(out, &copy);
+    if (ret) goto done;
+    ret = gssntlm_name_unshare(&copy);
+    if (ret) goto done;
+    if (copy.data.user.name == out->data.user.name ||
+        strcmp(copy.data.user.name, out->data.user.name) != 0 ||
+        strcmp(copy.data.user.domain, out->data.user.domain) != 0) {
+        fprintf(stderr, "Unsharing a name did not copy it\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* many threads making the first copies of a name at the same time */
+    nbuf.value = discard_const("test@testserver");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_HOSTBASED_SERVICE,
+                                 &srv);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name(srvname) failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    for (i = 0; i < NAME_TEST_THREADS; i++) {
+        ret = pthread_create(&threads[i], NULL, copy_name_thread, srv);
+        if (ret) break;
+    }
+    while (--i >= 0) {
+        pthread_join(threads[i], &tret);
+        if (tret) ret = (intptr_t)tret;
+    }
+    if (ret) goto done;
+
+    /* a credential lives until its last reference is released */
+    retmaj = gssntlm_acquire_cred(&retmin, srv, GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET, GSS_C_ACCEPT,
+                                  &cred, NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_acquire_cred failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    cred2 = (gss_cred_id_t)gssntlm_cred_ref((struct gssntlm_cred *)cred);
+    gssntlm_release_cred(&retmin, &cred2);
+    if (((struct gssntlm_cred *)cred)->type != GSSNTLM_CRED_SERVER) {
+        fprintf(stderr, "Credential freed while still referenced\n");
+        ret = EINVAL;
+    }
+
+done:
+    gssntlm_int_release_name(&copy);
+    gssntlm_release_name(&retmin, &orig);
+    gssntlm_release_name(&retmin, &dup);
+    gssntlm_release_name(&retmin, &srv);
+    gssntlm_release_cred(&retmin, &cred);
+    return ret;
+}
+
+int test_replay_cache(void)
+{
+    /* the largest lifetime, whose time buckets used to come out as 0 */
+    gss_key_value_element_desc cs_els[] = {
+        { GSS_NTLMSSP_CS_REPLAY_CACHE, "4096" },
+        { GSS_NTLMSSP_CS_REPLAY_LIFETIME, "4294967295" },
+    };
+    gss_key_value_element_desc *cs_el = &cs_els[0];
+    gss_key_value_set_desc cred_store = {
+        .elements = cs_els,
+        .count = 2
+    };
+    struct gssntlm_replay_stats stats;
+    gss_ctx_id_t cli_ctx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t srv_ctx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t srv_ctx2 = GSS_C_NO_CONTEXT;
+    gss_cred_id_t cli_cred = GSS_C_NO_CREDENTIAL;
+    gss_cred_id_t srv_cred = GSS_C_NO_CREDENTIAL;
+    gss_name_t gss_username = NULL;
+    gss_name_t gss_srvname = NULL;
+    gss_buffer_desc nbuf;
+    gss_buffer_desc cli_token = { 0 };
+    gss_buffer_desc srv_token = { 0 };
+    gss_buffer_desc ctx_token = { 0 };
+    uint32_t retmin, retmaj;
+    int ret;
+
+    setenv("NTLM_USER_FILE", TEST_USER_FILE, 0);
+
+    nbuf.value = discard_const("TESTDOM\\testuser");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_USER_NAME,
+                                 &gss_username);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name(username) failed!",
+                        retmaj, retmin);
+        return EINVAL;
+    }
+    nbuf.value = discard_const("test@testserver");
+    nbuf.length = strlen(nbuf.value);
+    retmaj = gssntlm_import_name(&retmin, &nbuf, GSS_C_NT_HOSTBASED_SERVICE,
+                                 &gss_srvname);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_import_name(srvname) failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* lifetimes that leave no time buckets are refused */
+    if (gssntlm_replay_cache_enable(4096, 0) != EINVAL) {
+        fprintf(stderr, "A zero replay cache lifetime was accepted\n");
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* malformed sizes are refused */
+    cs_el->value = "4k";
+    retmaj = gssntlm_acquire_cred_from(&retmin, gss_srvname,
+                                       GSS_C_INDEFINITE, GSS_C_NO_OID_SET,
+                                       GSS_C_ACCEPT, &cred_store,
+                                       &srv_cred, NULL, NULL);
+    if (retmaj == GSS_S_COMPLETE) {
+        fprintf(stderr, "A bad replay cache size was accepted\n");
+        ret = EINVAL;
+        goto done;
+    }
+    cs_el->value = "4096";
+
+    retmaj = gssntlm_acquire_cred(&retmin, gss_username, GSS_C_INDEFINITE,
+                                  GSS_C_NO_OID_SET, GSS_C_INITIATE,
+                                  &cli_cred, NULL, NULL);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_acquire_cred_from(&retmin, gss_srvname,
+                                           GSS_C_INDEFINITE,
+                                           GSS_C_NO_OID_SET, GSS_C_ACCEPT,
+                                           &cred_store, &srv_cred,
+                                           NULL, NULL);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("gssntlm_acquire_cred failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    retmaj = gssntlm_init_sec_context(&retmin, cli_cred, &cli_ctx,
+                                      gss_srvname, GSS_C_NO_OID,
+                                      GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG, 0,
+                                      GSS_C_NO_CHANNEL_BINDINGS,
+                                      GSS_C_NO_BUFFER, NULL, &cli_token,
+                                      NULL, NULL);
+    if (retmaj == GSS_S_CONTINUE_NEEDED) {
+        retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx, srv_cred,
+                                            &cli_token,
+                                            GSS_C_NO_CHANNEL_BINDINGS,
+                                            NULL, NULL, &srv_token,
+                                            NULL, NULL, NULL);
+        gss_release_buffer(&retmin, &cli_token);
+    }
+    if (retmaj == GSS_S_CONTINUE_NEEDED) {
+        retmaj = gssntlm_init_sec_context(&retmin, cli_cred, &cli_ctx,
+                                          gss_srvname, GSS_C_NO_OID,
+                                          GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG,
+                                          0, GSS_C_NO_CHANNEL_BINDINGS,
+                                          &srv_token, NULL, &cli_token,
+                                          NULL, NULL);
+        gss_release_buffer(&retmin, &srv_token);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Handshake failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    /* two copies of the acceptor waiting for the same authenticate
+     * message, as when the challenge state is handed to other workers */
+    retmaj = gssntlm_export_sec_context(&retmin, &srv_ctx, &ctx_token);
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ctx_token, &srv_ctx);
+    }
+    if (retmaj == GSS_S_COMPLETE) {
+        retmaj = gssntlm_import_sec_context(&retmin, &ctx_token, &srv_ctx2);
+    }
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("Copying the acceptor context failed!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx, srv_cred,
+                                        &cli_token, GSS_C_NO_CHANNEL_BINDINGS,
+                                        NULL, NULL, &srv_token,
+                                        NULL, NULL, NULL);
+    if (retmaj != GSS_S_COMPLETE) {
+        print_gss_error("The first authentication failed!", retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+    gss_release_buffer(&retmin, &srv_token);
+
+    retmaj = gssntlm_accept_sec_context(&retmin, &srv_ctx2, srv_cred,
+                                        &cli_token, GSS_C_NO_CHANNEL_BINDINGS,
+                                        NULL, NULL, &srv_token,
+                                        NULL, NULL, NULL);
+    if (retmaj != GSS_S_DUPLICATE_TOKEN || retmin != ERR_REPLAY) {
+        print_gss_error("The replayed authentication was not detected!",
+                        retmaj, retmin);
+        ret = EINVAL;
+        goto done;
+    }
+
+    gssntlm_replay_stats(&stats);
+    if (stats.capacity < 4096 || stats.entries < 1 ||
+        stats.inserts < 1 || stats.replays < 1) {
+        fprintf(stderr, "Unexpected replay cache stats: capacity %llu "
+                "entries %llu inserts %llu replays %llu\n",
+                (unsigned long long)stats.capacity,
+                (unsigned long long)stats.entries,
+                (unsigned long long)stats.inserts,
+                (unsigned long long)stats.replays);
+        ret = EINVAL;
+        goto done;
+    }
+
+    ret = 0;
+
+done:
+    gss_release_buffer(&retmin, &ctx_token);
+    gss_release_buffer(&retmin, &cli_token);
+    gss_release_buffer(&retmin, &srv_token);
+    gssntlm_delete_sec_context(&retmin, &cli_ctx, NULL);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx, NULL);
+    gssntlm_delete_sec_context(&retmin, &srv_ctx2, NULL);
+    gssntlm_release_cred(&retmin, &cli_cred);
+    gssntlm_release_cred(&retmin, &srv_cred);
+    gssntlm_release_name(&retmin, &gss_username);
+    gssntlm_release_name(&retmin, &gss_srvname);
+    return ret;
+}
+
+int test_rc4_prefetch(void)
+{
+    /* chunk sizes and how much keystream to prefetch before each one, so
+     * that chunks end inside, at the end of and past the buffered stream */
+    static const size_t chunks[][2] = {
+        { 13, 0 }, { 100, 64 }, { 7, 1000 }, { 500, 300 }, { 493, 0 },
+        { 2000, 16 }, { 1, 0 }, { 3000, 4096 }, { 96, 0 },
+    };
+    uint8_t key_data[16] = "0123456789abcdef";
+    struct ntlm_buffer key = { key_data, 16 };
+    struct ntlm_rc4_handle *plain = NULL;
+    struct ntlm_rc4_handle *pref = NULL;
+    struct ntlm_rc4_handle *imported = NULL;
+    uint8_t exp_data[258 * sizeof(uint64_t)];
+    struct ntlm_buffer exp = { exp_data, sizeof(exp_data) };
+    uint8_t msg[4096];
+    uint8_t out1[4096];
+    uint8_t out2[4096];
+    uint8_t out3[4096];
+    struct ntlm_buffer in, o1, o2, o3;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < sizeof(msg); i++) msg[i] = i * 7;
+
+    ret = RC4_INIT(&key, NTLM_CIPHER_ENCRYPT, &plain);
+    if (ret) goto done;
+    ret = RC4_INIT(&key, NTLM_CIPHER_ENCRYPT, &pref);
+    if (ret) goto done;
+
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        in.data = msg;
+        in.length = chunks[i][0];
+        o1.data = out1;
+        o1.length = sizeof(out1);
+        o2.data = out2;
+        o2.length = sizeof(out2);
+
+        if (chunks[i][1]) {
+            ret = RC4_PREFETCH(pref, chunks[i][1]);
+            if (ret) goto done;
+        }
+
+        ret = RC4_UPDATE(plain, &in, &o1);
+        if (ret) goto done;
+        ret = RC4_UPDATE(pref, &in, &o2);
+        if (ret) goto done;
+        if (o1.length != o2.length ||
+            memcmp(out1, out2, o1.length) != 0) {
+            fprintf(stderr, "Prefetched output differs at chunk %zu\n", i);
+            ret = EINVAL;
+            goto done;
+        }
+
+        if (imported) {
+            o3.data = out3;
+            o3.length = sizeof(out3);
+            ret = RC4_UPDATE(imported, &in, &o3);
+            if (ret) goto done;
+            if (memcmp(out1, out3, o1.length) != 0) {
+                fprintf(stderr, "Imported state out of sync at chunk %zu\n",
+                                i);
+                ret = EINVAL;
+                goto done;
+            }
+        } else if (i == 2) {
+            /* most of the prefetched stream is still unused here, the
+             * exported state must not include it */
+            ret = RC4_EXPORT(pref, &exp);
+            if (ret) goto done;
+            ret = RC4_IMPORT(&imported, &exp);
+            if (ret) goto done;
+        }
+    }
+
+    /* in place operation, as used by gss_wrap_iov() */
+    ret = RC4_PREFETCH(pref, 100);
+    if (ret) goto done;
+    memcpy(out2, msg, 200);
+    in.data = msg;
+    in.length = 200;
+    o1.data = out1;
+    o1.length = sizeof(out1);
+    o2.data = out2;
+    o2.length = 200;
+    ret = RC4_UPDATE(plain, &in, &o1);
+    if (ret) goto done;
+    ret = RC4_UPDATE(pref, &o2, &o2);
+    if (ret) goto done;
+    if (memcmp(out1, out2, 200) != 0) {
+        fprintf(stderr, "In place prefetched output differs\n");
+        ret = EINVAL;
+    }
+
+done:
+    RC4_FREE(&plain);
+    RC4_FREE(&pref);
+    RC4_FREE(&imported);
+    return ret;
+}
+
+int test_keycache(struct ntlm_ctx *ctx)
+{
+    struct gssntlm_keycache_stats before;
+    struct gssntlm_keycache_stats stats;
+    struct ntlm_key nt_hash = { .length = 16 };
+    struct ntlm_key expected = { .length = 16 };
+    struct ntlm_key result = { .length = 16 };
+    char user[32];
+    int i;
+    int ret;
+
+    /* counters are cumulative, flushing only drops the entries */
+    gssntlm_keycache_flush();
+    gssntlm_keycache_stats(&before);
+    if (before.entries != 0) {
+        fprintf(stderr, "Cache not empty after flush\n");
+        return EINVAL;
+    }
+
+    ret = NTOWFv1(T_Passwd, &nt_hash);
+    if (ret) return ret;
+
+    /* first lookup computes, second one is served from the cache */
+    for (i = 0; i < 2; i++) {
+        memset(result.data, 0, 16);
+        ret = gssntlm_keycache_ntowfv2(ctx, &nt_hash, T_User, T_UserDom,
+                                       false, &result);
+        if (ret) return ret;
+        ret = test_keys("results", &T_NTLMv2.ResponseKeyNT, &result);
+        if (ret) return ret;
+    }
+
+    /* the variant without domain is a different key in the same entry */
+    ret = NTOWFv2(ctx, &nt_hash, T_User, NULL, &expected);
+    if (ret) return ret;
+    ret = gssntlm_keycache_ntowfv2(ctx, &nt_hash, T_User, T_UserDom,
+                                   true, &result);
+    if (ret) return ret;
+    ret = test_keys("no domain", &expected, &result);
+    if (ret) return ret;
+
+    gssntlm_keycache_stats(&stats);
+    if (stats.hits - before.hits != 1 || stats.misses - before.misses != 2 ||
+        stats.entries != 1) {
+        fprintf(stderr, "Unexpected stats: %lu hits, %lu misses, "
+                        "%lu entries\n",
+                        (unsigned long)(stats.hits - before.hits),
+                        (unsigned long)(stats.misses - before.misses),
+                        (unsigned long)stats.entries);
+        return EINVAL;
+    }
+
+    if (gssntlm_keycache_no_domain(&nt_hash, T_User, T_UserDom)) {
+        fprintf(stderr, "The domain variant should be preferred\n");
+        return EINVAL;
+    }
+    gssntlm_keycache_verified(&nt_hash, T_User, T_UserDom, true);
+    if (!gssntlm_keycache_no_domain(&nt_hash, T_User, T_UserDom)) {
+        fprintf(stderr, "Verified variant was not recorded\n");
+        return EINVAL;
+    }
+
+    /* a different NT hash must not hit */
+    nt_hash.data[0] ^= 0xff;
+    ret = gssntlm_keycache_ntowfv2(ctx, &nt_hash, T_User, T_UserDom,
+                                   false, &result);
+    if (ret) return ret;
+    if (memcmp(result.data, T_NTLMv2.ResponseKeyNT.data, 16) == 0) {
+        fprintf(stderr, "Got the key of a different NT hash\n");
+        return EINVAL;
+    }
+    nt_hash.data[0] ^= 0xff;
+
+    /* the cache is bounded */
+    for (i = 0; i < 4096; i++) {
+        snprintf(user, sizeof(user), "user%d", i);
+        ret = gssntlm_keycache_ntowfv2(ctx, &nt_hash, user, NULL,
+                                       false, &result);
+        if (ret) return ret;
+    }
+    gssntlm_keycache_stats(&stats);
+    if (stats.evictions == before.evictions || stats.entries >= 4096) {
+        fprintf(stderr, "Cache is not bounded: %lu entries\n",
+                        (unsigned long)stats.entries);
+        return EINVAL;
+    }
+
+    gssntlm_keycache_flush();
+    gssntlm_keycache_stats(&stats);
+    if (stats.entries != 0) {
+        fprintf(stderr, "Cache not empty after flush\n");
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    struct ntlm_ctx *ctx;
+    int gret = 0;
+    int ret;
+
+    /* must happen before anything allocates through OpenSSL */
+    crypto_mem_hooked = CRYPTO_set_mem_functions(count_malloc, count_realloc,
+                                                 count_free);
+
+    /* enable trace debugging by dfault in tests */
+    setenv("GSSNTLMSSP_DEBUG", "tests-trace.log", 0);
+
+    fprintf(stderr, "Test errors\n");
+    ret = test_Errors();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    ret = ntlm_init_ctx(&ctx);
+    if (ret) goto done;
+
+    fprintf(stderr, "Test LMOWFv1\n");
+    ret = test_LMOWFv1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test NTOWFv1\n");
+    ret = test_NTOWFv1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test LMResponse v1\n");
+    ret = test_LMResponseV1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test NTResponse v1\n");
+    ret = test_NTResponseV1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test SessionBaseKey v1\n");
+    ret = test_SessionBaseKeyV1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test LM KeyExchangeKey\n");
+    ret = test_LM_KeyExchangeKey(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test EncryptedSessionKey v1 (1)\n");
+    ret = test_EncryptedSessionKey1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test EncryptedSessionKey v1 (2)\n");
+    ret = test_EncryptedSessionKey2(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test EncryptedSessionKey v1 (3)\n");
+    ret = test_EncryptedSessionKey3(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    /* override internal version for V1 test vector */
+    ntlm_internal_set_version(6, 0, 6000, 15);
+
+    fprintf(stderr, "Test decoding ChallengeMessage v1\n");
+    ret = test_DecodeChallengeMessageV1(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test encoding ChallengeMessage v1\n");
     ret = test_EncodeChallengeMessageV1(ctx);
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
     if (ret) gret++;
@@ -2940,6 +5371,11 @@ int main(int argc, const char *argv[])
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
     if (ret) gret++;
 
+    fprintf(stderr, "Test signing and sealing do not allocate memory\n");
+    ret = test_sign_no_alloc(ctx, &T_GSSWRAPEXv2);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
     fprintf(stderr, " *** Test with NTLMv1 auth\n");
     setenv("LM_COMPAT_LEVEL", "0", 1);
 
@@ -3016,11 +5452,86 @@ int main(int argc, const char *argv[])
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
     if (ret) gret++;
 
+    fprintf(stderr, "Test UTF-8/UTF-16LE conversions\n");
+    ret = test_UTF16_codec();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
     fprintf(stderr, "Test NTOWF with UTF16\n");
     ret = test_NTOWF_UTF16(ctx);
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
     if (ret) gret++;
 
+    fprintf(stderr, "Test NetBIOS identity cache\n");
+    ret = test_identity_cache();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test CHALLENGE message templates\n");
+    ret = test_chal_template(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test NTLMv2 key cache\n");
+    ret = test_keycache(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test built-in RC4, MD4, MD5 and DES\n");
+    ret = test_builtin_crypto();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test reuse of digest and MAC contexts\n");
+    ret = test_digest_reuse();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test per-thread random pool\n");
+    ret = test_rand_pool();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test metrics snapshot\n");
+    ret = test_metrics();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test asynchronous debug log\n");
+    ret = test_debug_log();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test exact size message encoding\n");
+    ret = test_encode_exact_size(ctx);
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test shared context table\n");
+    ret = test_ctx_table();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test shared name storage\n");
+    ret = test_shared_names();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test replay cache\n");
+    ret = test_replay_cache();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test RC4 keystream prefetching\n");
+    ret = test_rc4_prefetch();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test arena and object caches\n");
+    ret = test_arena();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
     fprintf(stderr, "Test Acquired cred from with no name\n");
     ret = test_ACQ_NO_NAME();
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
@@ -3031,6 +5542,16 @@ int main(int argc, const char *argv[])
     fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
     if (ret) gret += ret;
 
+    fprintf(stderr, "Test indexed user file lookups\n");
+    ret = test_user_file_index();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
+    fprintf(stderr, "Test compiled user database\n");
+    ret = test_user_db();
+    fprintf(stderr, "Test: %s\n", (ret ? "FAIL":"SUCCESS"));
+    if (ret) gret++;
+
 done:
     ntlm_free_ctx(&ctx);
     return gret;